@@ -0,0 +1,203 @@
+namespace Awelon
+
+// A persistent map keyed by bytes, intended for radix tree children.
+//
+// This is an adaptive node layout, loosely based on adaptive radix
+// trees (ART). Small nodes are a sorted array of keys with values in
+// a parallel array, searched linearly or by binary search. Large nodes
+// use a 256-bit presence bitmap with values in key order, indexed by
+// the population count of lower bits (as in a HAMT). Both layouts
+// permit cheap copy-on-write updates, and neither allocates per entry.
+//
+// Representation is canonical for a given set of keys, so structural
+// equality corresponds to equality of content.
+
+/// An immutable map from bytes to values.
+type ByteMap<'V> =
+    | Sparse of byte[] * 'V[]     // sorted keys, values
+    | Dense of uint64[] * 'V[]    // bitmap (4 words), values in key order
+
+module ByteMap =
+
+    // nodes with more keys than this use the bitmap layout.
+    let private sparseMax = 16
+
+    // small nodes are searched linearly
+    let private linearMax = 8
+
+    [<AbstractClass; Sealed>]
+    type private Empty<'V> private () =
+        static let e : ByteMap<'V> = Sparse (Array.empty, Array.empty)
+        static member Value = e
+
+    /// The empty map.
+    let empty<'V> : ByteMap<'V> = Empty<'V>.Value
+
+    let inline private popCount (x0:uint64) : int =
+        let x1 = x0 - ((x0 >>> 1) &&& 0x5555555555555555UL)
+        let x2 = (x1 &&& 0x3333333333333333UL) + ((x1 >>> 2) &&& 0x3333333333333333UL)
+        let x3 = (x2 + (x2 >>> 4)) &&& 0x0F0F0F0F0F0F0F0FUL
+        int ((x3 * 0x0101010101010101UL) >>> 56)
+
+    let inline private bit (k:byte) : uint64 = (1UL <<< (int k &&& 63))
+    let inline private word (k:byte) : int = (int k >>> 6)
+    let inline private has (bits:uint64[]) (k:byte) : bool =
+        (0UL <> (bits.[word k] &&& bit k))
+
+    // number of keys less than k in a bitmap
+    let private rank (bits:uint64[]) (k:byte) : int =
+        let w = word k
+        let mutable r = popCount (bits.[w] &&& (bit k - 1UL))
+        for ix = 0 to (w - 1) do
+            r <- r + popCount (bits.[ix])
+        r
+
+    // index of key in sorted array, or complement of insertion point
+    let private sparseIndex (ks:byte[]) (k:byte) : int =
+        if (ks.Length > linearMax) then System.Array.BinarySearch(ks, k) else
+        let rec loop ix =
+            if (ix = ks.Length) then ~~~ix else
+            let c = ks.[ix]
+            if (c = k) then ix else
+            if (c > k) then ~~~ix else
+            loop (ix + 1)
+        loop 0
+
+    /// Number of entries in the map.
+    let count (m:ByteMap<'V>) : int =
+        match m with
+        | Sparse (ks,_) -> ks.Length
+        | Dense (_,vs) -> vs.Length
+
+    /// Test whether the map is empty.
+    let inline isEmpty (m:ByteMap<'V>) : bool = (0 = count m)
+
+    /// Find value for a key, if any.
+    let tryFind (k:byte) (m:ByteMap<'V>) : 'V option =
+        match m with
+        | Sparse (ks,vs) ->
+            let ix = sparseIndex ks k
+            if (ix < 0) then None else Some (vs.[ix])
+        | Dense (bits,vs) ->
+            if not (has bits k) then None else
+            Some (vs.[rank bits k])
+
+    /// Test whether map contains a key.
+    let containsKey (k:byte) (m:ByteMap<'V>) : bool =
+        match m with
+        | Sparse (ks,_) -> (sparseIndex ks k >= 0)
+        | Dense (bits,_) -> has bits k
+
+    // construct from sorted keys and values; takes ownership of arrays
+    let private ofSortedArrays (ks:byte[]) (vs:'V[]) : ByteMap<'V> =
+        if (ks.Length <= sparseMax) then Sparse (ks,vs) else
+        let bits = Array.zeroCreate 4
+        for k in ks do
+            bits.[word k] <- (bits.[word k] ||| bit k)
+        Dense (bits,vs)
+
+    let private keysOf (bits:uint64[]) (n:int) : byte[] =
+        let ks = Array.zeroCreate n
+        let mutable ix = 0
+        for k = 0 to 255 do
+            if has bits (byte k) then
+                ks.[ix] <- byte k
+                ix <- (ix + 1)
+        ks
+
+    let inline private arrayInsert (a:'T[]) (ix:int) (v:'T) : 'T[] =
+        let r = Array.zeroCreate (a.Length + 1)
+        Array.blit a 0 r 0 ix
+        r.[ix] <- v
+        Array.blit a ix r (ix + 1) (a.Length - ix)
+        r
+
+    let inline private arrayRemove (a:'T[]) (ix:int) : 'T[] =
+        let r = Array.zeroCreate (a.Length - 1)
+        Array.blit a 0 r 0 ix
+        Array.blit a (ix + 1) r ix (r.Length - ix)
+        r
+
+    let inline private arraySet (a:'T[]) (ix:int) (v:'T) : 'T[] =
+        let r = Array.copy a
+        r.[ix] <- v
+        r
+
+    /// Add or update an entry.
+    let add (k:byte) (v:'V) (m:ByteMap<'V>) : ByteMap<'V> =
+        match m with
+        | Sparse (ks,vs) ->
+            let ix = sparseIndex ks k
+            if (ix >= 0) then Sparse (ks, arraySet vs ix v) else
+            let ins = ~~~ix
+            ofSortedArrays (arrayInsert ks ins k) (arrayInsert vs ins v)
+        | Dense (bits,vs) ->
+            let ix = rank bits k
+            if has bits k then Dense (bits, arraySet vs ix v) else
+            let bits' = Array.copy bits
+            bits'.[word k] <- (bits.[word k] ||| bit k)
+            Dense (bits', arrayInsert vs ix v)
+
+    /// Remove an entry, if present.
+    let remove (k:byte) (m:ByteMap<'V>) : ByteMap<'V> =
+        match m with
+        | Sparse (ks,vs) ->
+            let ix = sparseIndex ks k
+            if (ix < 0) then m else
+            Sparse (arrayRemove ks ix, arrayRemove vs ix)
+        | Dense (bits,vs) ->
+            if not (has bits k) then m else
+            let vs' = arrayRemove vs (rank bits k)
+            let bits' = Array.copy bits
+            bits'.[word k] <- (bits.[word k] &&& ~~~(bit k))
+            if (vs'.Length > sparseMax) then Dense (bits', vs') else
+            Sparse (keysOf bits' vs'.Length, vs')
+
+    /// Singleton map.
+    let singleton (k:byte) (v:'V) : ByteMap<'V> = Sparse ([| k |], [| v |])
+
+    /// Return the only entry in the map, if the map has one entry.
+    let tryFindSingleton (m:ByteMap<'V>) : (byte * 'V) option =
+        match m with
+        | Sparse (ks,vs) when (1 = ks.Length) -> Some (ks.[0], vs.[0])
+        | _ -> None
+
+    /// Fold over entries in ascending key order.
+    let fold (f:'S -> byte -> 'V -> 'S) (s0:'S) (m:ByteMap<'V>) : 'S =
+        match m with
+        | Sparse (ks,vs) ->
+            let mutable s = s0
+            for ix = 0 to (ks.Length - 1) do
+                s <- f s (ks.[ix]) (vs.[ix])
+            s
+        | Dense (bits,vs) ->
+            let mutable s = s0
+            let mutable ix = 0
+            for k = 0 to 255 do
+                if has bits (byte k) then
+                    s <- f s (byte k) (vs.[ix])
+                    ix <- (ix + 1)
+            s
+
+    /// Entries as an array, in ascending key order.
+    let toArray (m:ByteMap<'V>) : (byte * 'V)[] =
+        match m with
+        | Sparse (ks,vs) -> Array.zip ks vs
+        | Dense (bits,vs) -> Array.zip (keysOf bits vs.Length) vs
+
+    /// Entries as a sequence, in ascending key order.
+    let toSeq (m:ByteMap<'V>) : seq<byte * 'V> =
+        Seq.ofArray (toArray m)
+
+    /// Select entries matching a predicate.
+    let filter (f:byte -> 'V -> bool) (m:ByteMap<'V>) : ByteMap<'V> =
+        let ks = new ResizeArray<byte>()
+        let vs = new ResizeArray<'V>()
+        let addIf () k v =
+            if f k v then
+                ks.Add(k)
+                vs.Add(v)
+        fold addIf () m
+        if (ks.Count = count m) then m else
+        ofSortedArrays (ks.ToArray()) (vs.ToArray())
+
@@ -1,6 +1,11 @@
 namespace Awelon
+open System.Threading
+open System.Threading.Tasks
+open System.Collections.Generic
+open Data.ByteString
+open Stowage
 
-// These modules augment an Awelon Dictionary with two primary 
+// These modules augment an Awelon Dictionary with two primary
 // indices:
 //
 //  reverse lookup index: symbol → client words
@@ -9,10 +14,9 @@ namespace Awelon
 // A reverse lookup index can be incrementally computed for each
 // dictionary. A version index may further be computed, but may
 // cascade in some cases (e.g. update initial state of a command
-// pattern or REPL session). It might be worthwhile to simply 
-// compute 
+// pattern or REPL session).
 //
-// These indices can be maintained incrementally with dictionary 
+// These indices can be maintained incrementally with dictionary
 // updates, and have a predictable overhead (in space and time).
 // The reverse lookup is very useful: it can also be applied to
 // find erroneous (undefined, cyclic, unparseable) words, and as
@@ -25,22 +29,343 @@ namespace Awelon
 // be valid across multiple similar dictionaries, and could also
 // be incremental.
 //
-// Incremental indexing could be made asynchronous by seperately
-// tracking a dictionary and its recent (not yet indexed) updates.
-// This would be valuable for ensuring efficient imports and that
-// 
-// 
-//
-//
-// The two indices chosen would be the most useful for common processing
-// of the dictionaries. Computing a unique version for each definition is
-// a useful basis for cached evaluations, for example.
+// Incremental indexing is made asynchronous by separately tracking
+// a dictionary and its recent (not yet indexed) updates. This is
+// valuable for ensuring efficient imports, and that a dictionary
+// commit never waits on index maintenance.
 //
 // A reverse lookup index is not constrained to finding words. We could
 // include annotations, numbers, and even full-text fragments. Erroneous
 // definitions (cycles, undefined symbols, etc.) may also be recorded for
 // easier search and debugging.
-//
-// 
+module DictIndex =
+    type Symbol = Dict.Symbol
+
+    // primitive words `a b c d` are not dependencies.
+    let inline private isPrimWord (w:ByteString) : bool =
+        (1 = BS.length w) && (BS.unsafeHead w <= byte 'd')
+
+    /// Words referenced from the definition of a symbol, sorted and
+    /// without duplicates. Words are qualified for hierarchical
+    /// dictionaries, e.g. `bar` in the definition of `foo/baz` is
+    /// `foo/bar`, and `x/[y]` in the same definition is `foo/x/y`.
+    /// Primitives are excluded. A definition that does not parse
+    /// has no dependencies.
+    ///
+    /// This scans the flat tokens (see Parser.tokenize) without
+    /// building a Program.
+    let defDeps (sym:Symbol) (def:ByteString) : Symbol list =
+        match Parser.tokenize def with
+        | None -> []
+        | Some f ->
+            let struct(pre0,_) = BS.spanEnd (fun c -> (c <> byte '/')) sym
+            let ts = f.toks
+            let ws = new System.Collections.Generic.List<Symbol>()
+            // namespace prefixes, with the token index where each ends
+            let nss = new System.Collections.Generic.Stack<struct(int * ByteString)>()
+            let mutable pre = pre0
+            let nsEnd () = let struct(e,_) = nss.Peek() in e
+            for ix = 0 to (ts.Length - 1) do
+                while (nss.Count > 0) && (ix >= nsEnd ()) do
+                    let struct(_,p) = nss.Pop()
+                    pre <- p
+                match ts.[ix].Type with
+                | Parser.FT.NS ->
+                    nss.Push(struct(ts.[ix].End, pre))
+                    pre <- BS.append pre (BS.snoc (Parser.flatBytes f ix) (byte '/'))
+                | Parser.FT.Word ->
+                    let w = Parser.flatBytes f ix
+                    if not (isPrimWord w) then 
+                        ws.Add(if BS.isEmpty pre then w else BS.append pre w)
+                | _ -> ()
+            let arr = ws.ToArray()
+            Array.sortInPlaceWith (fun a b -> ByteString.Compare a b) arr
+            let rec uniq ix acc =
+                if (ix < 0) then acc else
+                match acc with
+                | (w::_) when ByteString.Eq w (arr.[ix]) -> uniq (ix - 1) acc
+                | _ -> uniq (ix - 1) (arr.[ix] :: acc)
+            uniq (arr.Length - 1) []
+
+    /// Reverse lookup index, with a `word SP client` key for every
+    /// client of each word. Symbols cannot contain SP, so we can find
+    /// clients of a word by prefix. Values are unused (zero).
+    type RLU = LSMTrie<byte>
+
+    /// Version index, mapping each defined word to its deep version.
+    type Versions = LSMTrie<RscHash>
+
+    /// An indexed dictionary.
+    type Index =
+        { dict : Dict       // the indexed dictionary
+          rlu  : RLU        // reverse lookup index
+          vers : Versions   // deep version index
+        }
+
+    /// Index for the empty dictionary.
+    let empty : Index =
+        { dict = Dict.empty
+          rlu = LSMTrie.empty
+          vers = LSMTrie.empty
+        }
+
+    let inline private rluKey (w:Symbol) (client:Symbol) : ByteString =
+        BS.append (BS.snoc w (Dict.cSP)) client
+
+    let private rluClients (w:Symbol) (rlu:RLU) : seq<Symbol> =
+        let p = BS.snoc w (Dict.cSP)
+        LSMTrie.selectPrefix p rlu
+            |> LSMTrie.toSeq
+            |> Seq.map (fst >> BS.drop (BS.length p))
+
+    /// Find direct clients of a word, i.e. words whose definitions
+    /// reference the given word.
+    let clients (w:Symbol) (ix:Index) : seq<Symbol> = rluClients w (ix.rlu)
+
+    /// Find the deep version of a word, if defined.
+    let version (w:Symbol) (ix:Index) : RscHash option =
+        LSMTrie.tryFind w (ix.vers)
+
+    // entries in the reverse lookup index to remove and to add.
+    let private updRLU (rlu:RLU) (struct(sym:Symbol, vd:VDiff<Dict.Def>)) : RLU =
+        let depsOf (def:Dict.Def) = defDeps sym (def.Data)
+        let struct(dOld,dNew) =
+            match vd with
+            | InL a -> struct(depsOf a, [])
+            | InR b -> struct([], depsOf b)
+            | InB (a,b) -> struct(depsOf a, depsOf b)
+        let rem t dep =
+            if List.contains dep dNew then t else
+            LSMTrie.remove (rluKey dep sym) t
+        let add t dep =
+            if List.contains dep dOld then t else
+            LSMTrie.add (rluKey dep sym) 0uy t
+        List.fold add (List.fold rem rlu dOld) dNew
+
+    // Words whose versions may change: changed words and their
+    // transitive clients. Returned in sorted order for determinism.
+    let private affected (rlu:RLU) (changed:seq<Symbol>) : Symbol[] =
+        let visited = new HashSet<Symbol>()
+        let todo = new Stack<Symbol>()
+        for w in changed do
+            if visited.Add(w) then todo.Push(w)
+        while (todo.Count > 0) do
+            for c in rluClients (todo.Pop()) rlu do
+                if visited.Add(c) then todo.Push(c)
+        let arr = Array.ofSeq visited
+        Array.sortInPlace arr
+        arr
+
+    let private cycleAnno = BS.fromString "(cycle)"
+
+    // write a dependency and its version, if defined
+    let private writeDep (verOf:Symbol -> RscHash option) (dst:ByteDst) (dep:Symbol) : unit =
+        ByteStream.writeBytes dep dst
+        match verOf dep with
+        | Some v ->
+            ByteStream.writeByte (Dict.cSP) dst
+            ByteStream.writeBytes v dst
+        | None -> ()
+        ByteStream.writeByte (Dict.cLF) dst
+
+    // deep version for a definition, given versions of dependencies.
+    let private hashDef (def:ByteString) (deps:Symbol[]) (verOf:Symbol -> RscHash option) : RscHash =
+        ByteStream.writeWith (fun dst ->
+            ByteStream.writeBytes def dst
+            ByteStream.writeByte (Dict.cLF) dst
+            Array.iter (writeDep verOf dst) deps) RscHash.hash
+
+    // Cyclic definitions are erroneous in Awelon, but we still give
+    // them versions. The version for a word in a cycle covers the
+    // definitions of the cycle and the versions of its external
+    // dependencies (sorted, as for hashDef).
+    let private hashCycle (w:Symbol) (scc:(struct(Symbol * ByteString))[]) (deps:Symbol[]) (verOf:Symbol -> RscHash option) : RscHash =
+        ByteStream.writeWith (fun dst ->
+            ByteStream.writeBytes cycleAnno dst
+            ByteStream.writeBytes w dst
+            ByteStream.writeByte (Dict.cLF) dst
+            for (struct(m,def)) in scc do
+                ByteStream.writeBytes m dst
+                ByteStream.writeByte (Dict.cSP) dst
+                ByteStream.writeBytes def dst
+                ByteStream.writeByte (Dict.cLF) dst
+            ByteStream.writeByte (Dict.cLF) dst
+            Array.iter (writeDep verOf dst) deps) RscHash.hash
+
+    // DFS frame for Tarjan's strongly connected components algorithm.
+    [<AllowNullLiteral>]
+    type private Frame =
+        val W : Symbol
+        val Def : ByteString
+        val Deps : Symbol[]
+        val mutable Ix : int
+        new(w,def,deps) = { W = w; Def = def; Deps = deps; Ix = 0 }
+
+    // Recompute versions for affected words. Versions for other words
+    // are unchanged. Strongly connected components are computed with
+    // an explicit stack, since dependency chains may be deep. Every
+    // component is completed after the components it depends on.
+    let private updVersions (d:Dict) (vers0:Versions) (aff:Symbol[]) : Versions =
+        let inAff = new HashSet<Symbol>(aff)
+        let vnew = new Dictionary<Symbol,RscHash>()
+        let verOf (w:Symbol) : RscHash option =
+            if not (inAff.Contains w) then LSMTrie.tryFind w vers0 else
+            match vnew.TryGetValue w with
+            | true, v -> Some v
+            | _ -> None
+        let index = new Dictionary<Symbol,int>()
+        let low = new Dictionary<Symbol,int>()
+        let onStack = new HashSet<Symbol>()
+        let scc = new Stack<Frame>()
+        let work = new Stack<Frame>()
+        let visit (w:Symbol) : unit =
+            match Dict.tryFind w d with
+            | None -> () // undefined words have no version
+            | Some def ->
+                let f = new Frame(w, def.Data, Array.ofList (defDeps w def.Data))
+                index.[w] <- index.Count
+                low.[w] <- index.[w]
+                scc.Push(f)
+                onStack.Add(w) |> ignore
+                work.Push(f)
+        let complete (f:Frame) : unit =
+            let members = new List<Frame>()
+            let mutable loop = true
+            while loop do
+                let m = scc.Pop()
+                onStack.Remove(m.W) |> ignore
+                members.Add(m)
+                loop <- not (System.Object.ReferenceEquals(m, f))
+            if (1 = members.Count) && not (Array.contains (f.W) (f.Deps)) then
+                vnew.[f.W] <- hashDef (f.Def) (f.Deps) verOf
+            else
+                let defs = members.ToArray()
+                        |> Array.map (fun m -> struct(m.W, m.Def))
+                        |> Array.sortWith (fun (struct(a,_)) (struct(b,_)) -> compare a b)
+                let inScc = new HashSet<Symbol>(members |> Seq.map (fun m -> m.W))
+                let deps = members |> Seq.collect (fun m -> m.Deps)
+                        |> Seq.filter (fun dep -> not (inScc.Contains dep))
+                        |> Seq.distinct |> Array.ofSeq
+                Array.sortInPlaceWith (fun a b -> ByteString.Compare a b) deps
+                for m in members do
+                    vnew.[m.W] <- hashCycle (m.W) defs deps verOf
+        for w in aff do
+            if not (index.ContainsKey w) then visit w
+            while (work.Count > 0) do
+                let f = work.Peek()
+                if (f.Ix < f.Deps.Length) then
+                    let dep = f.Deps.[f.Ix]
+                    f.Ix <- (f.Ix + 1)
+                    if inAff.Contains dep then
+                        if not (index.ContainsKey dep) then visit dep
+                        else if onStack.Contains dep then
+                            low.[f.W] <- min (low.[f.W]) (index.[dep])
+                else
+                    work.Pop() |> ignore
+                    if (low.[f.W] = index.[f.W]) then complete f
+                    if (work.Count > 0) then
+                        let p = work.Peek()
+                        low.[p.W] <- min (low.[p.W]) (low.[f.W])
+        let updVer t w =
+            match vnew.TryGetValue w with
+            | true, v -> LSMTrie.add w v t
+            | _ -> LSMTrie.checkedRemove w t
+        Array.fold updVer vers0 aff
+
+    /// Update the index for a new version of the dictionary. The cost
+    /// is proportional to the difference between dictionaries, plus
+    /// the transitive clients of changed words.
+    let update (d:Dict) (ix:Index) : Index =
+        let changes = Array.ofSeq (Dict.diff (ix.dict) d)
+                   |> Array.map (fun (sym,vd) -> struct(sym,vd))
+        if (0 = changes.Length) then { ix with dict = d } else
+        let rlu' = Array.fold updRLU (ix.rlu) changes
+        let aff = affected rlu' (changes |> Seq.map (fun (struct(sym,_)) -> sym))
+        let vers' = updVersions d (ix.vers) aff
+        { dict = d; rlu = rlu'; vers = vers' }
+
+    /// Compute the index for a dictionary from scratch.
+    let inline build (d:Dict) : Index = update d empty
+
+    /// Codec for the reverse lookup index.
+    let rluCodec : Codec<RLU> = LSMTrie.codec (EncByte.codec)
+
+    /// Codec for the version index.
+    let versCodec : Codec<Versions> = LSMTrie.codec (EncBytes.codec)
+
+    /// Compact the indices into Stowage. Does not compact the Dict.
+    let compact (db:Stowage) (ix:Index) : Index =
+        { ix with rlu = Codec.compact rluCodec db (ix.rlu)
+                  vers = Codec.compact versCodec db (ix.vers) }
+
+    /// Maintains an index on a background task.
+    ///
+    /// Posting a new version of the dictionary never waits on index
+    /// maintenance. If multiple versions are posted while the indexer
+    /// is busy, intermediate versions are skipped. The current index
+    /// may lag behind the latest posted dictionary.
+    type Indexer =
+        val mutable private ix : Index
+        val mutable private pending : Dict option
+        val mutable private bgtask : bool
+        val mutable private error : exn
+        val private cc : Index -> Index
+        new(ix0,cc) =
+            { ix = ix0
+              pending = None
+              bgtask = false
+              error = null
+              cc = cc
+            }
+        /// Index with compaction into Stowage after every update.
+        new(db:Stowage) = new Indexer(empty, compact db)
+        new() = new Indexer(empty, id)
+
+        /// The most recently completed index.
+        member x.Current with get() : Index = lock x (fun () -> x.ix)
+
+        /// Whether a posted dictionary is not yet indexed.
+        member x.Pending with get() : bool = lock x (fun () -> x.bgtask)
+
+        /// Post a version of the dictionary to index. Returns at once.
+        member x.Post (d:Dict) : unit =
+            lock x (fun () ->
+                x.pending <- Some d
+                if not x.bgtask then
+                    x.bgtask <- true
+                    Task.Run(fun () -> x.BGIndex()) |> ignore<Task>)
+
+        member private x.BGIndex() : unit =
+            assert(not (Monitor.IsEntered(x)))
+            let struct(ix0,d) = lock x (fun () ->
+                let d = Option.get (x.pending)
+                x.pending <- None
+                struct(x.ix, d))
+            let struct(ix',err) =
+                try struct(x.cc (update d ix0), null)
+                with e -> struct(ix0, e)
+            lock x (fun () ->
+                x.ix <- ix'
+                if not (isNull err) then x.error <- err
+                if Option.isSome (x.pending)
+                    then Task.Run(fun () -> x.BGIndex()) |> ignore<Task>
+                    else x.bgtask <- false
+                         Monitor.PulseAll(x))
+
+        /// Wait for all posted dictionaries to be indexed, and return
+        /// the index. Raises an error from indexing, if any.
+        member x.Sync() : Index =
+            lock x (fun () ->
+                while x.bgtask do
+                    Monitor.Wait(x) |> ignore<bool>
+                if not (isNull x.error) then
+                    let e = x.error
+                    x.error <- null
+                    raise (System.AggregateException(e))
+                x.ix)
 
-//module DictX 
+    /// Maintain the index of a dictionary variable as a computed TVar.
+    /// The index is updated incrementally by a Reactor agent whenever
+    /// the dictionary is written via the Reactor, with compaction `cc`.
+    let agent (rx:Reactive.Reactor) (cc:Index -> Index) (dict:TVar<Dict>) : TVar<Index> =
+        Reactive.compute rx empty (fun db ix -> cc (update (db.Read dict) ix))
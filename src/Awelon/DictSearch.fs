@@ -1,28 +1,369 @@
 namespace Awelon
+open System.Collections.Generic
+open Data.ByteString
+open Stowage
 
-
-// The goal for DictSearch is to model an index data structure
-// with the following features:
+// Word search for large dictionaries.
 //
-// - we can index each dictionary node independently
-// - we can efficiently merge indices on Dict nodes
-// - we can store computed values - types, versions
+// A Dict is a tree of nodes. Compacted nodes are stowed, and named
+// by secure hash, while recent updates are held in memory near the
+// root. After an update or fork, most stowed nodes are shared with
+// the prior version. So we index each stowed node independently and
+// cache the index by the node's secure hash: a new version of a
+// dictionary only indexes nodes that changed, plus the in-memory
+// updates at the root.
 //
-// Ideally, we can achieve these features using one index model.
-// This would allow efficient indexing across multiple versions
-// of a dictionary.
+// A node index covers the node's local `:symbol` entries, sorted, and
+// its `/prefix secureHash` child nodes. Symbols within a node have the
+// node's prefix stripped. For search, we track the full prefix while
+// walking the tree, and handle matches that cross the node boundary
+// via prefix lookup on sorted symbols.
 //
-// Computing values is difficult because the value computed at
-// a node may depend on other nodes in its context. 
-// 
-// If we achieve these features together, we can maintain our
-// indices across multiple versions of a dictionary, and produce
-// a new index as needed. 
+// For substring search, the index has a trigram posting list for each
+// 3-byte sequence in local symbols, holding ascending symbol indices
+// as delta-encoded varnats. We intersect the lists for the query's
+// trigrams, then verify candidates. For initialism search, we keep
+// symbol indices sorted by their initials.
 //
-// One viable option is to maintain global index on secure hash
-// resources
-// hash resources to their 
-//   
+// Candidates from stowed nodes may be shadowed, e.g. by a `~symbol`
+// deletion or a longer `/prefix` entry, so we verify them via lookup
+// on the dictionary. Local entries at the root are never shadowed.
 //
-// Besides search, I also want effective caching of Dict 
+// Node indices are cached in memory, and optionally in a durable
+// cache (DCache), keyed by node secure hash. Because a node's hash
+// covers its content, the cached index never needs invalidation.
+module DictSearch =
+    type Symbol = Dict.Symbol
+    type Prefix = Dict.Prefix
+
+    /// Index for the local entries of a dictionary node.
+    type Node =
+        { syms  : Symbol[]                          // local symbols, sorted
+          grams : int[]                             // trigrams, sorted
+          posts : ByteString[]                      // posting list per trigram
+          dirs  : (struct(Prefix * LVRef<Dict>))[]  // stowed child nodes
+          inner : ByteString[]                      // initials after first byte
+          byIni : int[]                             // symbol indices, sorted by inner
+        }
+
+    let inline private gram (s:ByteString) (ix:int) : int =
+        ((int s.[ix]) <<< 16) ||| ((int s.[ix + 1]) <<< 8) ||| (int s.[ix + 2])
+
+    // Word bytes are alphanumeric or non-ASCII. Other bytes, such as
+    // `-` or `/`, separate words. Initials are the first byte of each
+    // word.
+    let inline private isWordByte (c:byte) : bool =
+        ((byte 'a' <= c) && (c <= byte 'z')) ||
+        ((byte 'A' <= c) && (c <= byte 'Z')) ||
+        ((byte '0' <= c) && (c <= byte '9')) ||
+        (c >= 128uy)
+
+    // initials excluding position 0, which depends on context.
+    let private innerInitials (s:ByteString) : ByteString =
+        let acc = new List<byte>()
+        for ix = 1 to (s.Length - 1) do
+            if isWordByte s.[ix] && not (isWordByte s.[ix - 1]) then
+                acc.Add(s.[ix])
+        if (0 = acc.Count) then BS.empty else BS.unsafeCreateA (acc.ToArray())
+
+    /// Initials of a symbol, e.g. `lmf` for `list-map-filter`.
+    let initials (s:ByteString) : ByteString =
+        if BS.isEmpty s then s else
+        let r = innerInitials s
+        if isWordByte (BS.unsafeHead s) then BS.cons (BS.unsafeHead s) r else r
+
+    let private writePosts (ids:List<int>) : ByteString =
+        ByteStream.write (fun dst ->
+            EncVarNat.write (uint64 ids.[0]) dst
+            for ix = 1 to (ids.Count - 1) do
+                EncVarNat.write (uint64 (ids.[ix] - ids.[ix - 1])) dst)
+
+    /// Decode a posting list.
+    let readPosts (p:ByteString) : int[] =
+        let acc = new List<int>()
+        let mutable id = 0
+        let mutable n = 0
+        for ix = 0 to (p.Length - 1) do
+            let b = p.[ix]
+            n <- (n <<< 7) + int (b &&& 0x7Fuy)
+            if (0uy = (b &&& 0x80uy)) then
+                id <- id + n
+                acc.Add(id)
+                n <- 0
+        acc.ToArray()
+
+    let private mkNode (syms:Symbol[]) (dirs:(struct(Prefix * LVRef<Dict>))[]) (grams:int[]) (posts:ByteString[]) : Node =
+        let inner = Array.map innerInitials syms
+        let byIni = Array.init (syms.Length) id
+        let cmp a b =
+            let c = ByteString.Compare (inner.[a]) (inner.[b])
+            if (0 <> c) then c else compare a b
+        Array.sortInPlaceWith cmp byIni
+        { syms = syms; grams = grams; posts = posts; dirs = dirs
+          inner = inner; byIni = byIni }
+
+    /// Index a node from its local entries.
+    let ofEnts (ents:seq<Dict.DictEnt>) : Node =
+        let syms = new List<Symbol>()
+        let dirs = new List<struct(Prefix * LVRef<Dict>)>()
+        for e in ents do
+            match e with
+            | Dict.Define (s, Some _) -> syms.Add(s)
+            | Dict.Direct (p, Some ref) -> dirs.Add(struct(p, ref))
+            | _ -> () // deletions and blank directories
+        let syms = syms.ToArray()
+        Array.sortInPlaceWith (fun a b -> ByteString.Compare a b) syms
+        let tbl = new Dictionary<int, List<int>>()
+        for id = 0 to (syms.Length - 1) do
+            let s = syms.[id]
+            for ix = 0 to (s.Length - 3) do
+                let g = gram s ix
+                match tbl.TryGetValue g with
+                | true, ids -> if (ids.[ids.Count - 1] <> id) then ids.Add(id)
+                | _ ->
+                    let ids = new List<int>()
+                    ids.Add(id)
+                    tbl.Add(g, ids)
+        let grams = Array.ofSeq tbl.Keys
+        Array.sortInPlace grams
+        let posts = grams |> Array.map (fun g -> writePosts (tbl.[g]))
+        mkNode syms (dirs.ToArray()) grams posts
+
+    /// Index the local entries of a dictionary node. Does not load
+    /// stowed child nodes.
+    let inline ofDict (d:Dict) : Node = ofEnts (Dict.toSeqEnt d)
+
+    /// Estimated memory for a node index.
+    let size (n:Node) : SizeEst =
+        let symBytes = n.syms |> Array.sumBy (fun s -> uint64 (16 + s.Length))
+        let postBytes = n.posts |> Array.sumBy (fun p -> uint64 (20 + p.Length))
+        symBytes + postBytes + uint64 (64 * n.dirs.Length)
+
+    /// Codec for node indices. Sorting by initials is recomputed on
+    /// read.
+    let codec =
+        { new Codec<Node> with
+            member __.Write n dst =
+                EncVarNat.write (uint64 n.syms.Length) dst
+                Array.iter (fun s -> EncBytes.write s dst) (n.syms)
+                EncVarNat.write (uint64 n.grams.Length) dst
+                for ix = 0 to (n.grams.Length - 1) do
+                    EncVarNat.write (uint64 n.grams.[ix]) dst
+                    EncBytes.write (n.posts.[ix]) dst
+                EncVarNat.write (uint64 n.dirs.Length) dst
+                for (struct(p,ref)) in n.dirs do
+                    EncBytes.write p dst
+                    EncRscHash.write (ref.ID) dst
+            member __.Read db src =
+                let syms = Array.init (int (EncVarNat.read src)) (fun _ -> EncBytes.read src)
+                let nGrams = int (EncVarNat.read src)
+                let grams = Array.zeroCreate nGrams
+                let posts = Array.zeroCreate nGrams
+                for ix = 0 to (nGrams - 1) do
+                    grams.[ix] <- int (EncVarNat.read src)
+                    posts.[ix] <- EncBytes.read src
+                let readDir _ =
+                    let p = EncBytes.read src
+                    let h = EncRscHash.read src
+                    struct(p, LVRef.wrap (VRef.wrap (Dict.node_codec) db h))
+                let dirs = Array.init (int (EncVarNat.read src)) readDir
+                mkNode syms dirs grams posts
+            member __.Compact db n = struct(n, size n)
+        }
+
+    /// A Searcher caches node indices, and may be shared by many
+    /// versions of a dictionary. With a DB, node indices are also
+    /// kept in a durable cache. The quota limits the durable cache's size.
+    type Searcher =
+        val Mem : MCache<RscHash, Node>
+        val Durable : DCache.C<CVRef<Node>> option
+        new(durable) = { Mem = new MCache<RscHash, Node>(); Durable = durable }
+        new() = new Searcher(None)
+        new(db:DB, key:ByteString, quota:SizeEst) =
+            let cN = EncCVRef.codec (1000UL) codec
+            new Searcher(Some (new DCache.C<CVRef<Node>>(db, key, cN, quota)))
+
+    /// Write buffered durable cache updates to the DB, if any.
+    let sync (s:Searcher) : unit = Option.iter DCache.sync (s.Durable)
+
+    /// Obtain the index for a stowed node, indexing it on a miss.
+    let node (s:Searcher) (ref:LVRef<Dict>) : Node =
+        let h = ref.ID
+        match MCache.tryFind h (s.Mem) with
+        | Some n -> n
+        | None ->
+            let fromDurable =
+                match s.Durable with
+                | Some c -> DCache.tryFind h c |> Option.map CVRef.load
+                | None -> None
+            let n =
+                match fromDurable with
+                | Some n -> n
+                | None ->
+                    let n = ofDict (LVRef.load' ref)
+                    match s.Durable with
+                    | Some c -> DCache.add h (CVRef.stow (1000UL) codec (ref.VRef.DB) n) (size n) c
+                    | None -> ()
+                    n
+            MCache.tryAdd h n (size n) (s.Mem)
+
+    /// A dictionary with an index for the in-memory entries at its
+    /// root. Stowed nodes are indexed on demand by a Searcher.
+    type Index =
+        { dict : Dict
+          root : Node
+        }
+
+    /// Index a version of a dictionary. The cost is proportional to
+    /// the in-memory entries, which are small after compaction.
+    let index (d:Dict) : Index = { dict = d; root = ofDict d }
+
+    /// Index a dictionary variable as a computed TVar, maintained by a
+    /// Reactor agent whenever the dictionary is written.
+    let agent (rx:Reactive.Reactor) (dict:TVar<Dict>) : TVar<Index> =
+        Reactive.compute rx (index Dict.empty) (fun db _ -> index (db.Read dict))
+
+    let inline private hasPrefix (p:ByteString) (s:ByteString) : bool =
+        (p.Length <= s.Length) && ByteString.Eq p (BS.take (p.Length) s)
+
+    let inline private hasSuffix (p:ByteString) (s:ByteString) : bool =
+        (p.Length <= s.Length) && ByteString.Eq p (BS.drop (s.Length - p.Length) s)
+
+    /// Test whether a ByteString contains a substring.
+    let isInfix (q:ByteString) (s:ByteString) : bool =
+        let rec loop ix =
+            if ((ix + q.Length) > s.Length) then false else
+            if ByteString.Eq q (BS.drop ix s |> BS.take (q.Length)) then true else
+            loop (ix + 1)
+        loop 0
+
+    // first index in a sorted array where key(ix) >= p.
+    let private lowerBound (len:int) (key:int -> ByteString) (p:ByteString) : int =
+        let mutable lo = 0
+        let mutable hi = len
+        while (lo < hi) do
+            let mid = lo + ((hi - lo) / 2)
+            if (ByteString.Compare (key mid) p < 0)
+                then lo <- mid + 1
+                else hi <- mid
+        lo
+
+    // visit symbol indices whose key has a given prefix.
+    let private prefixRange (len:int) (key:int -> ByteString) (p:ByteString) (fn:int -> unit) : unit =
+        let mutable ix = lowerBound len key p
+        while (ix < len) && (hasPrefix p (key ix)) do
+            fn ix
+            ix <- ix + 1
+
+    let private intersect (a:int[]) (b:int[]) : int[] =
+        let acc = new List<int>()
+        let mutable i = 0
+        let mutable j = 0
+        while (i < a.Length) && (j < b.Length) do
+            if (a.[i] < b.[j]) then i <- i + 1
+            else if (b.[j] < a.[i]) then j <- j + 1
+            else
+                acc.Add(a.[i])
+                i <- i + 1
+                j <- j + 1
+        acc.ToArray()
+
+    // symbols holding every trigram of a query, i.e. candidates for
+    // a query of three bytes or more.
+    let private gramCandidates (n:Node) (q:ByteString) : int[] =
+        let qgrams = Array.init (q.Length - 2) (gram q) |> Array.distinct
+        let posts = qgrams |> Array.map (fun g ->
+            let ix = System.Array.BinarySearch(n.grams, g)
+            if (ix < 0) then BS.empty else n.posts.[ix])
+        if Array.exists BS.isEmpty posts then Array.empty else
+        Array.sortInPlaceWith (fun a b -> compare (BS.length a) (BS.length b)) posts
+        Array.fold (fun acc p -> intersect acc (readPosts p))
+            (readPosts posts.[0]) (Array.sub posts 1 (posts.Length - 1))
+
+    // Walk the tree of node indices. The visitor receives the full
+    // prefix for each node, and returns whether to visit its children.
+    let private walk (s:Searcher) (ix:Index) (visit:bool -> Prefix -> Node -> bool) : unit =
+        let todo = new Stack<struct(Prefix * LVRef<Dict>)>()
+        let push p (n:Node) =
+            for (struct(dp,ref)) in n.dirs do
+                todo.Push(struct(BS.append p dp, ref))
+        if visit true (BS.empty) (ix.root) then push (BS.empty) (ix.root)
+        while (todo.Count > 0) do
+            let struct(p,ref) = todo.Pop()
+            let n = node s ref
+            if visit false p n then push p n
+
+    // Collect matches as full symbols. Matches from stowed nodes are
+    // verified against the dictionary. Sorted, without duplicates.
+    let private search (s:Searcher) (ix:Index) (matches:Prefix -> Node -> (int -> unit) -> bool) : Symbol[] =
+        let found = new HashSet<Symbol>()
+        let visit isRoot (p:Prefix) (n:Node) =
+            let add id =
+                let sym = BS.append p (n.syms.[id])
+                if isRoot || Dict.contains sym (ix.dict) then
+                    found.Add(sym) |> ignore<bool>
+            matches p n add
+        walk s ix visit
+        let arr = Array.ofSeq found
+        Array.sortInPlaceWith (fun a b -> ByteString.Compare a b) arr
+        arr
+
+    let private addAll (n:Node) (add:int -> unit) : unit =
+        for id = 0 to (n.syms.Length - 1) do add id
+
+    // substring matches within a node with full prefix p
+    let private substringMatches (q:ByteString) (p:Prefix) (n:Node) (add:int -> unit) : bool =
+        if isInfix q p then addAll n add
+        else
+            // matches within the local symbol
+            let ids = if (q.Length >= 3) then gramCandidates n q
+                      else Array.init (n.syms.Length) id
+            for id in ids do
+                if isInfix q (n.syms.[id]) then add id
+            // matches that begin within the prefix
+            for k = 1 to (min (q.Length - 1) (p.Length)) do
+                if hasSuffix (BS.take k q) p then
+                    prefixRange (n.syms.Length) (fun id -> n.syms.[id]) (BS.drop k q) add
+        true
+
+    /// Find defined words containing a substring. For queries of three
+    /// bytes or more, this uses trigram postings. Shorter queries scan
+    /// symbols in each node (but do not load definitions).
+    let substring (s:Searcher) (q:ByteString) (ix:Index) : Symbol[] =
+        search s ix (substringMatches q)
+
+    /// Find defined words with a given suffix.
+    let suffix (s:Searcher) (q:ByteString) (ix:Index) : Symbol[] =
+        substring s q ix |> Array.filter (hasSuffix q)
+
+    // initialism matches within a node with full prefix p. Subtrees
+    // whose prefix initials don't agree with the query are skipped.
+    let private initialismMatches (q:ByteString) (p:Prefix) (n:Node) (add:int -> unit) : bool =
+        let ip = initials p
+        if (q.Length <= ip.Length) then
+            if not (hasPrefix q ip) then false else
+            addAll n add
+            true
+        else if not (hasPrefix ip q) then false else
+        let r = BS.drop (ip.Length) q
+        let boundary = BS.isEmpty p || not (isWordByte (p.[p.Length - 1]))
+        // whether the first byte of a local symbol is an initial
+        let headIni id =
+            let sym = n.syms.[id]
+            boundary && not (BS.isEmpty sym) && isWordByte (BS.unsafeHead sym)
+        let key ix = n.inner.[n.byIni.[ix]]
+        let len = n.byIni.Length
+        prefixRange len key r (fun ix ->
+            let id = n.byIni.[ix]
+            if not (headIni id) then add id)
+        prefixRange len key (BS.unsafeTail r) (fun ix ->
+            let id = n.byIni.[ix]
+            if headIni id && (BS.unsafeHead (n.syms.[id]) = BS.unsafeHead r) then add id)
+        true
+
+    /// Find defined words by initialism, i.e. whose initials begin with
+    /// the query. Words are separated by bytes other than alphanumerics,
+    /// so `lmf` finds `list-map-filter` and `list/map-fold`.
+    let initialism (s:Searcher) (q:ByteString) (ix:Index) : Symbol[] =
+        search s ix (initialismMatches q)
 
@@ -116,7 +116,7 @@ module Dict =
           vu : DefUpd option  // optional empty symbol entry
           cs : Children       // nodes with larger prefixes
         }
-    and Children = Map<byte,struct(Prefix * Dict)>
+    and Children = ByteMap<struct(Prefix * Dict)>
     and Dir = LVRef<Dict> option  // secureHash (Some) or blank (None)
 
         // TODO: consider keeping a size-estimate per Dict node to
@@ -136,7 +136,7 @@ module Dict =
         do Array.blit c.UnsafeArray c.Offset mem (1 + a.Length) c.Length
         BS.unsafeCreateA mem
 
-    let inline private isPrefix p s = (p = (BS.take (BS.length p) s))
+    let inline private isPrefix p s = ByteString.Eq p (BS.take (BS.length p) s)
 
     // compute size of shared prefix for two strings.
     let private bytesShared (a:ByteString) (b:ByteString) : int =
@@ -157,7 +157,7 @@ module Dict =
             | None -> Seq.empty
             | Some du -> Seq.singleton (Define(p,du))
         let sc (ix,struct(p',c)) = toSeqEntP (joinBytes p ix p') c
-        let scs = Seq.concat (Seq.map sc (Map.toSeq (d.cs)))
+        let scs = Seq.concat (Seq.map sc (ByteMap.toSeq (d.cs)))
         Seq.append spd (Seq.append svu scs)
     
     /// Translate a dictionary to a sequence of local entries. This
@@ -166,65 +166,49 @@ module Dict =
 
     let inline mkDict pd vu cs = { pd = pd; vu = vu; cs = cs }
 
-    // TODO: consider developing a mutable DictBuilder variant for efficient
-    // parsing. This could improve read performance by a moderate degree. 
-    // OTOH, the benefits might not be worth the complexity.
-
-    // This operation is inefficient. I've a proposal at fsharp-suggestions 
-    // (#673) to support an efficient accessor for singleton maps to fix the
-    // issue. 
-    let private tryMapSingleton (m:Map<'K,'V>) : ('K * 'V) option =
-        // this is ugly and inefficient
-        let e = (Map.toSeq m).GetEnumerator()
-        if not (e.MoveNext()) then None else
-        let r = e.Current
-        if e.MoveNext() then None else
-        Some r
-
     // Smart add-child function, after the child might have had some
     // entries removed. May remove empty child or merge prefixes if
-    // it's an unnecessary trie node. Moderately expensive, because
-    // we don't have an easy way to access a singleton map.
+    // it's an unnecessary trie node.
     let private updChild (ix:byte) (p:Prefix) (c:Dict) (cs:Children) : Children =
         if Option.isSome (c.pd) || Option.isSome (c.vu) then
-            Map.add ix (struct(p,c)) cs // add non-empty child entry
-        else if Map.isEmpty (c.cs) then
-            Map.remove ix cs // empty child node is removed
+            ByteMap.add ix (struct(p,c)) cs // add non-empty child entry
+        else if ByteMap.isEmpty (c.cs) then
+            ByteMap.remove ix cs // empty child node is removed
         else 
             // check for unnecessary node split point
-            match tryMapSingleton (c.cs) with
-            | None -> Map.add ix (struct(p,c)) cs // child is split point
+            match ByteMap.tryFindSingleton (c.cs) with
+            | None -> ByteMap.add ix (struct(p,c)) cs // child is split point
             | Some (ix',struct(p',c')) -> // merge radix tree prefixes
                 // no recursion; assume c' valid by prior construction
-                Map.add ix (struct((joinBytes p ix' p'), c')) cs
+                ByteMap.add ix (struct((joinBytes p ix' p'), c')) cs
 
     /// Prepend a common prefix to every symbol in a dictionary. 
     /// O(1) via trie structure. 
     let prependPrefix (p:Prefix) (d:Dict) : Dict =
         if BS.isEmpty p then d else
-        let cs' = updChild (BS.unsafeHead p) (BS.unsafeTail p) d (Map.empty)
+        let cs' = updChild (BS.unsafeHead p) (BS.unsafeTail p) d (ByteMap.empty)
         mkDict None None cs'
 
     // prepend prefix specialized for known child nodes
     let inline private prependChildPrefix (p:Prefix) (c:Dict) : Dict =
         if BS.isEmpty p then c else
-        let cs' = Map.add (BS.unsafeHead p) (struct((BS.unsafeTail p), c)) (Map.empty)
+        let cs' = ByteMap.singleton (BS.unsafeHead p) (struct((BS.unsafeTail p), c))
         mkDict None None cs'
 
     /// Empty dictionary. This should only exist at the tree root.
-    let empty : Dict = mkDict None None (Map.empty)
+    let empty : Dict = mkDict None None (ByteMap.empty)
 
     /// Test for obviously empty dictionary - no entries. This does
     /// not recognize whether a dictionary is empty due to pending
     /// deletions. For that, favor isEmpty'.
     let isEmpty (d:Dict) : bool =
-        (Map.isEmpty (d.cs) && Option.isNone (d.vu) && Option.isNone (d.pd))
+        (ByteMap.isEmpty (d.cs) && Option.isNone (d.vu) && Option.isNone (d.pd))
 
     /// Create a dictionary from an initial directory (without loading)
     let fromProto (dir:Dir) : Dict =
         match dir with
         | None -> empty
-        | Some _ -> mkDict (Some dir) None (Map.empty)
+        | Some _ -> mkDict (Some dir) None (ByteMap.empty)
 
     // Split empty prefix entry from given dictionary.
     let private splitProto (d:Dict) : struct(Dir * Dict) =
@@ -249,7 +233,7 @@ module Dict =
     // returns longest matching prefix entry and prefix bytes matched
     let rec private matchDir' (k:Symbol) (d:Dict) : struct(int * Dir option) =
         if BS.isEmpty k then struct(0, d.pd) else
-        match Map.tryFind (BS.unsafeHead k) (d.cs) with
+        match ByteMap.tryFind (BS.unsafeHead k) (d.cs) with
         | Some (struct(p,c)) when isPrefix p (BS.unsafeTail k) ->
             let len = 1 + BS.length p
             let struct(len',pd) = matchDir' (BS.drop len k) c
@@ -269,7 +253,7 @@ module Dict =
     // search for symbol's definition update in local memory
     let rec private tryFindLocal (k:Symbol) (d:Dict) : DefUpd option =
         if BS.isEmpty k then (d.vu) else
-        match Map.tryFind (BS.unsafeHead k) (d.cs) with
+        match ByteMap.tryFind (BS.unsafeHead k) (d.cs) with
         | Some (struct(p,c)) when isPrefix p (BS.unsafeTail k) ->
             tryFindLocal (BS.drop (1 + BS.length p) k) c
         | _ -> None
@@ -296,7 +280,7 @@ module Dict =
         if BS.isEmpty k then rw d else
         let ix = BS.unsafeHead k
         let krem = BS.unsafeTail k
-        match Map.tryFind ix (d.cs) with
+        match ByteMap.tryFind ix (d.cs) with
         | None -> 
             let cs' = updChild ix krem (rw empty) (d.cs)
             mkDict (d.pd) (d.vu) cs'
@@ -347,7 +331,7 @@ module Dict =
         let bFullDel = Option.isNone dir
                     && not (hasRemote (BS.dropLast 1 p) dict)
         let pdu = if bFullDel then None else Some dir
-        let rw _ = mkDict pdu None (Map.empty)
+        let rw _ = mkDict pdu None (ByteMap.empty)
         rewriteAtKey p rw dict
 
     /// Remove all symbols with given prefix from the dictionary.
@@ -367,6 +351,79 @@ module Dict =
     /// Compute dictionary from sequence of entries.
     let inline fromSeqEnt s = applySeqEnt empty s
 
+    let inline private entKey (e:DictEnt) : Symbol =
+        match e with
+        | Direct (p,_) -> p
+        | Define (s,_) -> s
+
+    /// Test whether entries are in the normal order written by
+    /// `toSeqEnt`: ascending keys without duplicates, except that
+    /// `/prefix` may precede the `:symbol` of the same name.
+    let isSortedEnts (ents:DictEnt[]) : bool =
+        let inline rank e = match e with | Direct _ -> 0 | Define _ -> 1
+        let rec loop ix =
+            if (ix >= ents.Length) then true else
+            let a = ents.[ix - 1]
+            let b = ents.[ix]
+            let c = ByteString.Compare (entKey a) (entKey b)
+            let ok = (c < 0) || ((0 = c) && (rank a < rank b))
+            ok && loop (ix + 1)
+        loop 1
+
+    // Build a node bottom-up from sorted entries ents.[lo..hi-1], all
+    // sharing their first `d` key bytes. Here `hr` is the has-remote
+    // context from the parent, as for flushUpdates', and is used to
+    // erase deletions in the same manner as updSym and updPrefix. The
+    // `fin` function is applied to every node as it is completed.
+    let rec private buildSorted (fin:Dict -> Dict) (ents:DictEnt[]) (hr:bool) (d:int) (lo:int) (hi:int) : Dict =
+        let mutable ix = lo
+        let mutable hr' = hr
+        let mutable pd = None
+        match ents.[ix] with
+        | Direct (p,dir) when (d = BS.length p) ->
+            if (hr || Option.isSome dir) then pd <- Some dir
+            hr' <- Option.isSome dir
+            ix <- (ix + 1)
+        | _ -> ()
+        let mutable vu = None
+        if (ix < hi) then
+            match ents.[ix] with
+            | Define (s,du) when (d = BS.length s) ->
+                if (hr' || Option.isSome du) then vu <- Some du
+                ix <- (ix + 1)
+            | _ -> ()
+        let mutable cs = ByteMap.empty
+        while (ix < hi) do
+            let k0 = entKey (ents.[ix])
+            let b = k0.[d]
+            let mutable e = (ix + 1)
+            while ((e < hi) && (b = (entKey (ents.[e])).[d])) do
+                e <- (e + 1)
+            // sorted, so first and last keys have the shortest shared prefix
+            let kN = entKey (ents.[e - 1])
+            let n = bytesShared (BS.drop (d + 1) k0) (BS.drop (d + 1) kN)
+            let c = buildSorted fin ents hr' (d + 1 + n) ix e
+            cs <- updChild b (BS.take n (BS.drop (d + 1) k0)) c cs
+            ix <- e
+        fin (mkDict pd vu cs)
+
+    // build from sorted entries, with a finalizer for each node
+    let private fromSortedEnts' (fin:Dict -> Dict) (ents:DictEnt[]) : Dict =
+        if not (isSortedEnts ents) then invalidArg "ents" "entries are not sorted" else
+        if (0 = ents.Length) then empty else
+        buildSorted fin ents false 0 0 (ents.Length)
+
+    /// Construct a dictionary from sorted entries (see isSortedEnts)
+    /// in one bottom-up pass, without rebuilding a path from the root
+    /// per entry. Equivalent to `fromSeqEnt` on the same entries.
+    let fromSortedEnts (ents:DictEnt[]) : Dict = fromSortedEnts' id ents
+
+    /// Compute dictionary from an array of entries, using the bulk
+    /// builder if the entries are sorted.
+    let fromArrayEnt (ents:DictEnt[]) : Dict =
+        if isSortedEnts ents then fromSortedEnts ents else
+        Array.fold applyEnt empty ents
+
     // here `hr` tracks the `has remote entries` context from the parent.
     // When false, we can often eliminate deletion entries from `b`.
     let rec private flushUpdates' (hr:bool) (a:Dict) (b:Dict) : Dict =
@@ -384,13 +441,13 @@ module Dict =
                 | None -> a.vu
                 | Some du -> if hr' || Option.isSome du then b.vu else None
             let fcu = if hr' then flushChildUpdT else flushChildUpdF
-            let cs' = Map.fold fcu (a.cs) (b.cs)
+            let cs' = ByteMap.fold fcu (a.cs) (b.cs)
             mkDict (a.pd) vu' cs'
         // specializations to resist runtime closure allocation
     and private flushChildUpdT acs ix pc = flushChildUpd true acs ix pc
     and private flushChildUpdF acs ix pc = flushChildUpd false acs ix pc
     and private flushChildUpd hr acs ix (struct(bp,bc)) =
-        match Map.tryFind ix acs with
+        match ByteMap.tryFind ix acs with
         | None -> // may need to erase deletion entries from bc
             let bc' = if hr then bc else flushUpdates' false empty bc
             updChild ix bp bc' acs
@@ -419,9 +476,12 @@ module Dict =
     let rec private extractPrefixLocal (p:Prefix) (d:Dict) : Dict =
         if BS.isEmpty p then d else
         let ix = BS.unsafeHead p
-        match Map.tryFind (BS.unsafeHead p) (d.cs) with
+        match ByteMap.tryFind (BS.unsafeHead p) (d.cs) with
         | Some (struct(p',c)) when isPrefix p' (BS.unsafeTail p) ->
             extractPrefixLocal (BS.drop (1 + BS.length p') p) c
+        | Some (struct(p',c)) when isPrefix (BS.unsafeTail p) p' ->
+            // prefix ends within the child's prefix
+            prependChildPrefix (BS.drop (BS.length p - 1) p') c
         | _ -> empty
 
     /// Extract dictionary at specified prefix, erasing the prefix.
@@ -446,13 +506,49 @@ module Dict =
             | Some (Some def) -> Seq.singleton (p,def)
             | _ -> Seq.empty
         let seqChild (ix,struct(p',c)) = toSeqP (joinBytes p ix p') c
-        let scs = Seq.concat (Seq.map seqChild (Map.toSeq (d.cs)))
+        let scs = Seq.concat (Seq.map seqChild (ByteMap.toSeq (d.cs)))
         Seq.append sv scs
         
     /// Compute a sequence of defined symbols. This will perform
     /// erasures and updates incrementally, as needed.
     let toSeq (d:Dict) : seq<Symbol * Def> = toSeqP (BS.empty) d
 
+    // remote directory of a child node, if not cached
+    let private coldDir (c:Dict) : LVRef<Dict> option =
+        match c.pd with
+        | Some (Some ref) when not (LVRef.isCached ref) -> Some ref
+        | _ -> None
+
+    // Sequence over children in a window, prefetching directories for
+    // `ahead` siblings beyond the child being sequenced.
+    let private seqAhead (ahead:int) (cs:'C[]) (dirOf:'C -> LVRef<Dict> option) (fn:'C -> seq<'X>) : seq<'X> =
+        let fetch lo hi = 
+            let refs = Array.choose dirOf (cs.[lo .. (min hi (cs.Length - 1))])
+            LVRef.prefetchAsync refs
+        Seq.delay (fun () ->
+            if (ahead > 0) then fetch 0 (ahead - 1)
+            let child ix =
+                if (ahead > 0) then fetch (ix + ahead) (ix + ahead)
+                fn (cs.[ix])
+            Seq.collect child (seq { 0 .. (cs.Length - 1) }))
+
+    let rec private toSeqAheadP (ahead:int) (p:Prefix) (d0:Dict) : seq<Symbol * Def> =
+        let d = mergeProto d0 
+        let sv =
+            match (d.vu) with
+            | Some (Some def) -> Seq.singleton (p,def)
+            | _ -> Seq.empty
+        let cs = ByteMap.toArray (d.cs)
+        let dirOf (_,struct(_,c)) = coldDir c
+        let seqChild (ix,struct(p',c)) = toSeqAheadP ahead (joinBytes p ix p') c
+        Seq.append sv (seqAhead ahead cs dirOf seqChild)
+
+    /// toSeq, but prefetches stowed nodes for up to `ahead` siblings
+    /// of the node being sequenced, in the background and as a batch.
+    /// This mitigates load latency for cold traversals, e.g. export.
+    let toSeqAhead (ahead:int) (d:Dict) : seq<Symbol * Def> = 
+        toSeqAheadP ahead (BS.empty) d
+
     /// Partition the dictionary on a symbol, such that all symbols
     /// smaller are to the left and symbols equal or greater are to
     /// the right. Use with toSeq for indexed browsing.
@@ -460,10 +556,10 @@ module Dict =
         if BS.isEmpty k then struct(empty,d0) else
         let d = mergeProto d0 // merge prefixes in path of key
         let ix = BS.unsafeHead k
-        let lcs = Map.filter (fun k _ -> (k < ix)) (d.cs)
-        let rcs = Map.filter (fun k _ -> (ix < k)) (d.cs)
+        let lcs = ByteMap.filter (fun k _ -> (k < ix)) (d.cs)
+        let rcs = ByteMap.filter (fun k _ -> (ix < k)) (d.cs)
         let struct(lcs',rcs') = // split and include ix
-            match Map.tryFind ix (d.cs) with
+            match ByteMap.tryFind ix (d.cs) with
             | None -> struct(lcs,rcs)
             | Some (struct(p,c)) ->
                 let krem = BS.unsafeTail k
@@ -472,8 +568,8 @@ module Dict =
                     let struct(lc,rc) = splitAtKey (BS.drop n krem) c
                     struct(updChild ix p lc lcs, updChild ix p rc rcs)
                 else if ((n < BS.length krem) && (p.[n] < krem.[n])) 
-                    then struct(Map.add ix (struct(p,c)) lcs, rcs)
-                    else struct(lcs, Map.add ix (struct(p,c)) rcs)
+                    then struct(ByteMap.add ix (struct(p,c)) lcs, rcs)
+                    else struct(lcs, ByteMap.add ix (struct(p,c)) rcs)
         struct(mkDict None (d.vu) lcs', mkDict None None rcs')
 
 
@@ -504,7 +600,10 @@ module Dict =
     /// read nodes beyond those we iterate to look up old definitions.
     /// This implementation assumes short `/ secureHash` chains, and 
     /// does not check for a latest common ancestor. 
-    let diff (a0:Dict) (b0:Dict) : seq<Symbol * VDiff<Def>> =
+    ///
+    /// The `ahead` parameter will prefetch stowed nodes for up to that
+    /// many differing siblings, in the background. Use zero to disable.
+    let diffAhead (ahead:int) (a0:Dict) (b0:Dict) : seq<Symbol * VDiff<Def>> =
         let rec diffP p a b =
             if System.Object.ReferenceEquals(a,b) then Seq.empty else
             if (a.pd = b.pd) then diffV p a b else
@@ -521,9 +620,22 @@ module Dict =
             Seq.append sv (diffCS p a b)
         and diffCS p a b = // diff all possible indexes 
             // this is the only lazy part of our sequence...
-            Seq.concat (Seq.map (diffIX p (a.cs) (b.cs)) seqBytes)
+            if (ahead < 1) then Seq.concat (Seq.map (diffIX p (a.cs) (b.cs)) seqBytes) else
+            let present ix = ByteMap.containsKey ix (a.cs) || ByteMap.containsKey ix (b.cs)
+            let ixs = Array.filter present [| 0uy .. 255uy |]
+            let cold cs ix = 
+                match ByteMap.tryFind ix cs with
+                | Some (struct(_,c)) -> coldDir c
+                | None -> None
+            let dirOf ix = // cold refs are stowed, so comparing IDs is cheap
+                match cold (a.cs) ix, cold (b.cs) ix with
+                | Some ra, Some rb when (ra.ID = rb.ID) -> None
+                | Some ra, Some rb -> LVRef.prefetchAsync [| rb |]; Some ra
+                | Some ra, None -> Some ra
+                | None, rb -> rb
+            seqAhead ahead ixs dirOf (diffIX p (a.cs) (b.cs))
         and diffIX p acs bcs ix = // diff specific index
-            match Map.tryFind ix acs, Map.tryFind ix bcs with
+            match ByteMap.tryFind ix acs, ByteMap.tryFind ix bcs with
             | None,None -> Seq.empty // no differences
             | None,Some(struct(bp,bc)) -> diffP (joinBytes p ix bp) empty bc
             | Some(struct(ap,ac)),None -> diffP (joinBytes p ix ap) ac empty
@@ -534,6 +646,34 @@ module Dict =
                 diffP (joinBytes p ix (BS.take n ap)) ac' bc' 
         diffP (BS.empty) a0 b0
 
+    /// Compute an efficient difference of two dictionaries. See diffAhead.
+    let diff (a0:Dict) (b0:Dict) : seq<Symbol * VDiff<Def>> = diffAhead 0 a0 b0
+
+    /// Three-way merge at the granularity of symbols. Given a common
+    /// origin `o`, our update `a`, and a concurrent update `b`, this
+    /// applies our changes onto `b`. Returns None on conflict, where
+    /// `b` has a different definition than both `o` and `a` for some
+    /// symbol we changed.
+    ///
+    /// Cost depends on the size of our changes, not of `b`. This is
+    /// useful as a merge function for a Dict TVar (see DB.writeMerge).
+    let merge3 (o:Dict) (a:Dict) (b:Dict) : Dict option =
+        let ours = Seq.toArray (diff o a)
+        let conflict (k, vd) =
+            let struct(vo,va) =
+                match vd with
+                | InL x -> struct(Some x, None)
+                | InR y -> struct(None, Some y)
+                | InB (x,y) -> struct(Some x, Some y)
+            let vb = tryFind k b
+            (vb <> vo) && (vb <> va)
+        if Array.exists conflict ours then None else
+        let upd d (k, vd) =
+            match vd with
+            | InL _ -> remove' k d
+            | InR y | InB (_,y) -> add k y d
+        Some (Array.fold upd b ours)
+
 
     // TODO: efficient unions and intersections.
 
@@ -567,7 +707,7 @@ module Dict =
         let struct(lnv,szv) = sizeVU (d.vu)
         let struct(lncs,szcs) = sizeCS (d.cs)
         struct((lnp+lnv+lncs),(szp+szv+szcs))
-    and private sizeCS cs = Map.fold sizeChild (struct(0UL,0UL)) (cs)
+    and private sizeCS cs = ByteMap.fold sizeChild (struct(0UL,0UL)) (cs)
     and private sizeChild (struct(ln,sz)) ix (struct(p,c)) =
         let struct(lnc,szc) = size c
         let szp = uint64 (1 + BS.length p) 
@@ -629,17 +769,51 @@ module Dict =
         if ((c0 = cDir) && (RscHash.isValidHash h)) then Direct (sym, Some (mkDir h)) else
         raise ByteStream.ReadError
 
-    let private parseLineStep onLine s =
-        if BS.isEmpty s then None else
-        let struct(ln,more) = BS.span ((<>) cLF) s
-        Some (onLine ln, BS.drop 1 more)
+    // Offset of the next LF in s at or after ix, or s.Length if none.
+    // Array.IndexOf for bytes is vectorized by the .Net Core runtime,
+    // which is much faster than a byte-by-byte span for long inputs.
+    let inline private lineEnd (s:ByteString) (ix:int) : int =
+        let r = System.Array.IndexOf<byte>(s.UnsafeArray, cLF, s.Offset + ix, s.Length - ix)
+        if (r < 0) then s.Length else (r - s.Offset)
+
+    // Parse lines into an array of entries, in order.
+    let private parseDictEntArray mkDef mkDir (s:ByteString) : DictEnt[] =
+        let acc = new ResizeArray<DictEnt>()
+        let mutable ix = 0
+        while (ix < s.Length) do
+            let e = lineEnd s ix
+            let ln = BS.unsafeCreate (s.UnsafeArray) (s.Offset + ix) (e - ix)
+            acc.Add(parseDictEnt mkDef mkDir ln)
+            ix <- (e + 1)
+        acc.ToArray()
+
+    // Large inputs, such as a dictionary import, are divided into
+    // chunks at line boundaries then parsed in parallel. Compacted
+    // nodes are much smaller than a chunk, so are parsed directly.
+    let private parseChunkSize = (256 * 1024)
+
+    let private chunkLines (s:ByteString) : ByteString[] =
+        let acc = new ResizeArray<ByteString>()
+        let mutable ix = 0
+        while (ix < s.Length) do
+            let e =
+                if ((s.Length - ix) <= parseChunkSize) then s.Length else
+                min (s.Length) (1 + lineEnd s (ix + parseChunkSize))
+            acc.Add(BS.unsafeCreate (s.UnsafeArray) (s.Offset + ix) (e - ix))
+            ix <- e
+        acc.ToArray()
 
     /// Parse entries in a dictionary string. May raise ByteStream.ReadError.
-    let private parseDictEnts mkDef mkDir (s:ByteString) : seq<DictEnt> =
-        Seq.unfold (parseLineStep (parseDictEnt mkDef mkDir)) s
+    let private parseDictEnts mkDef mkDir (s:ByteString) : DictEnt[] =
+        if (s.Length <= (4 * parseChunkSize)) then parseDictEntArray mkDef mkDir s else
+        try chunkLines s
+                |> Array.Parallel.map (parseDictEntArray mkDef mkDir)
+                |> Array.concat
+        with
+        | :? System.AggregateException as e -> raise (e.Flatten().InnerExceptions.[0])
 
     let inline private parseDict mkDef mkDir s : Dict =
-        fromSeqEnt (parseDictEnts mkDef mkDir s)
+        fromArrayEnt (parseDictEnts mkDef mkDir s)
 
     // divide huge prefixes into manageable fragments. Mostly, this is
     // to handle the worst-case behavior for super-long symbols. In the
@@ -647,15 +821,17 @@ module Dict =
     let inline private limitPrefix lim struct(p,c) =
         struct(BS.take lim p, prependChildPrefix (BS.drop lim p) c)
 
+    // heuristic constants for compaction
+    let private compactThresh = 25UL * uint64 (RscHash.size)
+    let private flushThresh = 9UL * compactThresh
+
     // Heuristic compaction algorithm. Upon compaction, updates propagate
     // down the tree and large nodes are rewritten to `/ secureHash`. The
     // log-structured merge tree aspect is from buffering updates near to
     // the root node until sufficient updates are available. 
     let rec private nodeCompact (cD:Codec<Dict>) (db:Stowage) (d0:Dict) =
-        // heuristic constants
-        let thresh = 25UL * uint64 (RscHash.size)
-        let flushThresh = 9UL * thresh
-        if Map.isEmpty (d0.cs) && Option.isNone (d0.vu) then
+        let thresh = compactThresh
+        if ByteMap.isEmpty (d0.cs) && Option.isNone (d0.vu) then
             // trivial case, no updates buffered at this node
             match (d0.pd) with
             | Some (Some _) -> struct(d0,1UL,protoRefSize)
@@ -666,27 +842,25 @@ module Dict =
             let dM = mergeProto d0
             let struct(ctM,szM) = size dM
             let struct(dF,ctF,szF) =
-                let skipFlush = (szM < flushThresh) || (Map.isEmpty (dM.cs))
+                let skipFlush = (szM < flushThresh) || (ByteMap.isEmpty (dM.cs))
                 if skipFlush then struct(dM,ctM,szM) else
-                let compactChild (struct(cs,ct,sz)) ix pc0 =
+                // children are independent, so may compact in parallel
+                let compactChild ((ix,pc0)) =
                     let struct(p,c) = limitPrefix (int (thresh >>> 1)) pc0 
                     let struct(c',ctC,szC) = nodeCompact cD db c
                     let szP = uint64 (1 + BS.length p)
                     let szPS = ctC * szP
                     if (szPS < thresh) then
                         // acceptable worst-case prefix redundancy
-                        let cs' = updChild ix p c' cs
-                        let ct' = ct + ctC
-                        let sz' = sz + szC + szPS
-                        struct(cs',ct',sz')
+                        struct(ix,p,c',ctC,szC + szPS)
                     else // create Stowage node for prefix sharing
                         let ref = LVRef.stow cD db c' (szC <<< 2)
-                        let cs' = Map.add ix (struct(p,fromProto (Some ref))) cs
-                        let ct' = ct + 1UL // /prefix secureHash
-                        let sz' = sz + protoRefSize + szP
-                        struct(cs',ct',sz')
+                        struct(ix,p,fromProto (Some ref),1UL,protoRefSize + szP)
+                let addChild (struct(cs,ct,sz)) (struct(ix,p,c,ctC,szC)) =
+                    struct(updChild ix p c cs, ct + ctC, sz + szC)
                 let struct(cs',ctCS,szCS) = // compact and compute sizes
-                    Map.fold compactChild (struct(Map.empty,0UL,0UL)) (dM.cs)
+                    Codec.forkMap compactChild (ByteMap.toArray (dM.cs))
+                        |> Array.fold addChild (struct(ByteMap.empty,0UL,0UL))
                 let vu' = dM.vu // empty prefix cannot be flushed to child node 
                 let struct(ctVU,szVU) = sizeVU vu'
                 let dF = mkDict None vu' cs'
@@ -725,13 +899,24 @@ module Dict =
     let inline compact (db:Stowage) (d:Dict) : Dict =
         Codec.compact node_codec db d
 
+    /// Build and compact a dictionary from sorted entries (see
+    /// isSortedEnts). Large subtrees are compacted into Stowage as
+    /// they are completed, so the full dictionary is never held in
+    /// memory as a trie. Useful for bulk imports.
+    let compactSortedEnts (db:Stowage) (ents:DictEnt[]) : Dict =
+        let fin d =
+            if (sizeBytes d < flushThresh) then d else
+            let struct(d',_,_) = nodeCompact node_codec db d
+            d'
+        compact db (fromSortedEnts' fin ents)
+
     /// Obtain a Directory representation for a Dictionary. This will
     /// just use the existing `/ secureHash` directory if it's a single
     /// entry, otherwise will allocate a directory in Stowage. Does not
     /// compact the dictionary, and can result in very small nodes. It 
     /// is usually better to compact a dictionary, than to stow it.
     let stow (db:Stowage) (d:Dict) : Dir =
-        if Map.isEmpty (d.cs) && Option.isNone (d.vu) then
+        if ByteMap.isEmpty (d.cs) && Option.isNone (d.vu) then
             match d.pd with
             | Some dir -> dir
             | None -> None
@@ -743,6 +928,22 @@ module Dict =
     /// structures. Adds a size prefix to the root node!
     let codec = Stowage.EncSized.codec node_codec
 
+    /// Export a dictionary, with every stowed node and resource it
+    /// references, as an archive with a single root `dict`. See
+    /// Stowage.Archive.
+    let export (db:Stowage) (d:Dict) (dst:System.IO.Stream) : Archive.Stats =
+        Archive.write db [("dict", Codec.writeBytes node_codec d)] dst
+
+    /// Import a dictionary archive, and write the dictionary into a
+    /// durable variable. Resources are flushed in batches of at least
+    /// `batch` bytes.
+    let import (db:DB) (batch:int) (tv:TVar<Dict option>) (src:System.IO.Stream) : Archive.Stats =
+        let bind roots =
+            match List.tryFind (fst >> ((=) "dict")) roots with
+            | Some (_,b) -> db.Write tv (Some (Codec.readBytes node_codec (db :> Stowage) b))
+            | None -> raise (Archive.CorruptArchive "no dictionary root")
+        Archive.read db batch bind src
+
     // PERFORMANCE NOTES
     //
     // The performance I'm getting from this Dict/codec is comparable
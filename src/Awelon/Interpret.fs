@@ -1,4 +1,5 @@
 namespace Awelon
+open System.Collections.Generic
 open Data.ByteString
 
 // This interpreter module provides a simplistic evaluation for Awelon
@@ -7,11 +8,34 @@ open Data.ByteString
 // For example, we'll make relatively little effort to integrate with
 // durable cache results, or support reactive update.
 //
+// Lists of natural numbers may be packed into an unboxed NatArray
+// via the `(nats)` annotation, for accelerated numeric kernels such
+// as `nats-sum` or `nats-matmul`. Packed lists are expanded on demand
+// like texts, so there is no observable difference.
+//
+// Programs are compiled to a flat bytecode array per block, then run
+// on a simple stack machine. Words are linked lazily, on first call,
+// and `[code](accel)` definitions are recognized and replaced by a
+// native implementation from an accelerator registry.
+//
+// Evaluation is strict, left to right, and without evaluation under
+// blocks. When a computation cannot progress, e.g. due to an undefined
+// word or an `(error)` annotation, or when our effort quota is spent,
+// we halt and produce the residual program: the data stack followed by
+// the pending continuation. This is an equivalent program, so it is a
+// valid (if partial) evaluation.
+//
+// A `[A](par)` annotation is passed to the Env's Par hook. By default
+// this is the identity, but a parallel mode (see KPN) may evaluate A
+// in the background and leave a Future value in its place. Futures are
+// moved, copied and dropped without waiting, and are forced only when
+// an operation must inspect the value.
+//
 // Note: The interpreter does not perform 'execution' of an application
 // model. Another layer would be required for that role!
 module Interpret =
 
-    /// Src is a generic, key-value database for source code. The 
+    /// Src is a generic, key-value database for source code. The
     /// argument is a fully qualified word (e.g. `foo/bar`). The
     /// result should be its unprocessed definition, if one exists.
     /// Src is assumed to be pure, i.e. definitions are constant.
@@ -23,24 +47,943 @@ module Interpret =
         | Some def -> Some (def.Data)
         | None -> None
 
-    /// Our Interpreter will process programs as follows:
-    /// 
-    /// - Nouns and Verbs are distinct.
-    /// - Evaluated data is distinct from un-evaluated.
-    /// - 
+    type Word = Parser.Word
+
+    /// Bytecode operations. The `arg` field of an instruction is
+    /// interpreted per operation, usually as an index into the
+    /// literal or link tables of the enclosing Code.
+    type Op =
+        | Apply = 0uy   // [B][A]a == A[B]
+        | Bind  = 1uy   // [B][A]b == [[B]A]
+        | Copy  = 2uy   // [A]c == [A][A]
+        | Drop  = 3uy   // [A]d ==
+        | Push  = 4uy   // push literal (arg indexes lits)
+        | Call  = 5uy   // call a word (arg indexes links)
+        | Arity = 6uy   // (a2) .. (a9) (arg is arity)
+        | Anno  = 7uy   // other annotations (arg is an Anno)
+        | Stuck = 8uy   // cannot evaluate further
+
+    /// Annotations with interpreter-recognized behavior. Other
+    /// annotations are compiled as Ignore (identity behavior).
+    type Anno =
+        | Ignore = 0
+        | Error = 1     // (error) - prevent progress
+        | Nat = 2       // (nat) - assert natural number
+        | Par = 3       // (par) - evaluate block in parallel
+        | Nats = 4      // (nats) - pack a list of natural numbers
+
+    [<Struct>]
+    type Instr =
+        { op  : Op
+          arg : int
+        }
+    let inline private instr op arg = { op = op; arg = arg }
+
+    // split a namespace prefix such as `d/e/` into its words
+    let rec private nsWords (pre:ByteString) : Word list =
+        if BS.isEmpty pre then [] else
+        let struct(w,rem) = BS.span (fun c -> (c <> byte '/')) pre
+        (w :: nsWords (BS.drop 1 rem))
+
+    // Interpreter metrics, recorded per Machine.Run rather than per
+    // step. Steps per second is steps over the time spent running.
+    let private runTimer = Stowage.Metrics.timer "awelon_interpret_run_seconds" "Machine runs, until done, stuck, or out of quota."
+    let private stepCount = Stowage.Metrics.counter "awelon_interpret_steps_total" "Instructions executed by the interpreter."
+    do Stowage.Metrics.gauge "awelon_interpret_steps_per_second" "Instructions executed per second of running." (fun () ->
+        let t = runTimer.TotalSeconds
+        if (t > 0.0) then float stepCount.Value / t else 0.0)
+
+    /// Interpreter-layer values. Natural numbers and texts have
+    /// an accelerated representation, and are expanded to their
+    /// `[41 succ]` or `[104 "ello" cons]` block forms on demand.
+    ///
+    /// A Future is a placeholder for a block computed in parallel.
+    /// A packed list of naturals is expanded like a text.
+    [<CustomEquality; NoComparison>]
+    type Value =
+        | Nat of uint64
+        | Text of ByteString
+        | Block of Block
+        | Future of Future
+        | Nats of NatArray
+        override x.Equals(yobj) = System.Object.ReferenceEquals(x,yobj)
+        override x.GetHashCode() =
+            System.Runtime.CompilerServices.RuntimeHelpers.GetHashCode(x)
+
+    /// A single-assignment placeholder for a value, computed by a
+    /// thunk at most once. Whoever first claims the future runs the
+    /// thunk: a worker thread, or the first thread to await it. So a
+    /// thread never waits upon work that hasn't started.
+    ///
+    /// A Future may hold a Reservation of steps from the quota of its
+    /// Owner, which set the quota of its computation. The unused steps
+    /// are refunded when the owner forces the Future (see Machine.Force)
+    /// or settles its reservations, so the owner pays for the work.
+    and Future =
+        val mutable private State : int     // 0 pending, 1 running, 2 done
+        val mutable private Thunk : unit -> Value
+        val mutable private Result : Value
+        val mutable private Error : exn
+        val mutable Owner : Machine
+        val mutable Reservation : Reservation
+        new(thunk) = 
+            { State = 0
+              Thunk = thunk
+              Result = Unchecked.defaultof<Value>
+              Error = null 
+              Owner = Unchecked.defaultof<Machine>
+              Reservation = null
+            }
+
+        /// Steps reserved from the owner.
+        member f.Reserved with get() : int64 =
+            if isNull f.Reservation then 0L else f.Reservation.Steps
+
+        /// Steps used, once the reservation is refunded.
+        member f.Used with get() : int64 =
+            if isNull f.Reservation then 0L else f.Reservation.Used
+
+        /// Run the thunk, unless it was already claimed.
+        member f.TryRun () : unit =
+            if (0 <> System.Threading.Interlocked.CompareExchange(&f.State, 1, 0)) then () else
+            let struct(v,e) =
+                try struct(f.Thunk (), null)
+                with e -> struct(Unchecked.defaultof<Value>, e)
+            lock f (fun () ->
+                f.Result <- v
+                f.Error <- e
+                f.Thunk <- Unchecked.defaultof<unit -> Value>
+                f.State <- 2
+                System.Threading.Monitor.PulseAll f)
+
+        /// Test whether the value is available.
+        member f.IsDone with get() = (2 = System.Threading.Volatile.Read(&f.State))
+
+        /// Wait for the value, running the thunk if it is pending.
+        member f.Await () : Value =
+            f.TryRun()
+            lock f (fun () ->
+                while (2 <> f.State) do
+                    System.Threading.Monitor.Wait f |> ignore
+                if not (isNull f.Error) then raise (System.AggregateException(f.Error))
+                f.Result)
+
+    /// Steps a machine reserved for work that runs elsewhere (see KPN).
+    /// The refund is claimed once: Finish completes the work, if still
+    /// running, and returns the steps it used.
+    and [<AllowNullLiteral>] Reservation =
+        val Steps : int64
+        val private Finish : unit -> int64
+        val mutable private Claimed : int
+        val mutable Used : int64
+        new(steps, finish) = { Steps = steps; Finish = finish; Claimed = 0; Used = 0L }
+
+        /// Whether the refund was claimed.
+        member r.IsClaimed with get() : bool = (0 <> System.Threading.Volatile.Read(&r.Claimed))
+
+        /// Finish the work and return the unused steps. Returns zero
+        /// if already claimed.
+        member r.Refund () : int64 =
+            if (0 <> System.Threading.Interlocked.Exchange(&r.Claimed, 1)) then 0L else
+            r.Used <- r.Finish ()
+            (r.Steps - r.Used)
+
+    /// A block is compiled code with a list of bound values, which
+    /// are pushed in list order before the code runs. Value words
+    /// such as `true = [a d]` keep their name for residual output.
+    and Block =
+        { bound : Value list
+          code  : Code
+          name  : Word      // empty for anonymous blocks
+        }
+
+    /// Compiled code for a program. The `src` array has one action
+    /// per operation for rendering residual programs.
+    and Code =
+        { ops   : Instr[]
+          src   : Parser.Action[]
+          lits  : Value[]
+          links : Link[]
+        }
+
+    /// How a word has been linked.
+    and LinkKind =
+        | Unlinked = 0
+        | Undefined = 1     // no definition; cannot progress
+        | Value = 2         // definition is a block value
+        | Inline = 3        // definition runs inline
+        | Accel = 4         // accelerated, with inline fallback
+        | Native = 5        // compiled by a higher tier (see Jit)
+
+    /// A Link is shared by all calls to a word within an Env, and
+    /// is resolved when first called. Calls to inline words are
+    /// counted, so hot words can be compiled by a higher tier.
+    and [<AllowNullLiteral>] Link =
+        val Word : Word
+        val mutable Def : ByteString
+        val mutable Kind : LinkKind
+        val mutable Code : Code
+        val mutable Value : Value
+        val mutable Accel : Machine -> bool
+        val mutable Native : Machine -> unit
+        val mutable Calls : int
+        new(w) =
+            { Word = w
+              Def = BS.empty
+              Kind = LinkKind.Unlinked
+              Code = Unchecked.defaultof<Code>
+              Value = Unchecked.defaultof<Value>
+              Accel = Unchecked.defaultof<Machine -> bool>
+              Native = Unchecked.defaultof<Machine -> unit>
+              Calls = 0
+            }
+
+    /// An Env links words from a source to compiled code, and may
+    /// be shared by many machines. Accelerators are keyed by word,
+    /// but are used only when the word's definition carries the
+    /// `(accel)` annotation at its top level.
+    ///
+    /// When an inline word has been called TierThreshold times, we
+    /// pass its link to Tier, which may upgrade it asynchronously.
+    ///
+    /// Memo may rewrite the compiled code of an inline word upon
+    /// linking, e.g. to a cached partial evaluation of the definition.
+    /// It receives the machine that is linking the word, which should
+    /// be charged for any evaluation.
+    ///
+    /// Par receives the block argument of a `(par)` annotation, and
+    /// returns an equivalent value, e.g. a Future. Machines sharing
+    /// an Env may run concurrently when Par is used.
+    and Env =
+        val Src : Src
+        val Accel : CritbitTree<Machine -> bool>
+        val mutable Tier : Link -> unit
+        val mutable TierThreshold : int
+        val mutable Memo : Machine -> Link -> Code -> Code
+        val mutable Par : Machine -> Block -> Value
+        val private Links : Dictionary<Word,Link>
+        val mutable internal ZeroCode : Code
+        val mutable internal SuccCode : Code
+        val mutable internal NullCode : Code
+        val mutable internal ConsCode : Code
+        val mutable internal FixCode : Code
+        val internal EmptyCode : Code
+        new(src,accel) as env =
+            { Src = src
+              Accel = accel
+              Tier = ignore
+              TierThreshold = 1000
+              Memo = (fun _ _ c -> c)
+              Par = (fun _ b -> Block b)
+              Links = new Dictionary<Word,Link>()
+              ZeroCode = Unchecked.defaultof<Code>
+              SuccCode = Unchecked.defaultof<Code>
+              NullCode = Unchecked.defaultof<Code>
+              ConsCode = Unchecked.defaultof<Code>
+              FixCode = Unchecked.defaultof<Code>
+              EmptyCode = { ops = Array.empty; src = Array.empty; lits = Array.empty; links = Array.empty }
+            } then
+            let inline wordCode w = env.Compile [Parser.Atom (Parser.tokWord (BS.fromString w))]
+            env.ZeroCode <- wordCode "zero"
+            env.SuccCode <- wordCode "succ"
+            env.NullCode <- wordCode "null"
+            env.ConsCode <- wordCode "cons"
+            env.FixCode <- wordCode "z"
+
+        /// Obtain the shared link object for a word.
+        member env.Link (w:Word) : Link =
+            lock (env.Links) (fun () ->
+                match env.Links.TryGetValue w with
+                | true, lnk -> lnk
+                | _ ->
+                    let lnk = new Link(w)
+                    env.Links.Add(w,lnk)
+                    lnk)
+
+        /// Compile a program to bytecode.
+        member env.Compile (p:Parser.Program) : Code = env.CompileNS [] (BS.empty) p
+
+        // compile under a hierarchical namespace, e.g. `d/[41 succ]`,
+        // where `ns` is reverse-ordered and `pre` is the word prefix 
+        member private env.CompileNS (ns:Word list) (pre:ByteString) (p:Parser.Program) : Code =
+            let ops = new List<Instr>()
+            let src = new List<Parser.Action>()
+            let lits = new List<Value>()
+            let links = new List<Link>()
+            let emit op arg s = ops.Add(instr op arg); src.Add(s)
+            let addLit v = lits.Add(v); (lits.Count - 1)
+            let addLink w =
+                let ix = links.FindIndex(fun l -> (w = l.Word))
+                if (ix >= 0) then ix else
+                links.Add(env.Link w)
+                (links.Count - 1)
+            let rec wrapNS ns op =
+                match ns with
+                | (w::ns') -> wrapNS ns' (Parser.NS(struct(w,op)))
+                | [] -> op
+            let compileWord pre w s =
+                let isPrim = (1 = BS.length w) && (BS.unsafeHead w <= byte 'd')
+                if not isPrim then emit Op.Call (addLink (BS.append pre w)) s else
+                match char (BS.unsafeHead w) with
+                | 'a' -> emit Op.Apply 0 s
+                | 'b' -> emit Op.Bind 0 s
+                | 'c' -> emit Op.Copy 0 s
+                | _ -> emit Op.Drop 0 s
+            let compileAnno (w:Word) s =
+                let isArity = (2 = BS.length w) && (byte 'a' = w.[0]) 
+                           && (byte '1' < w.[1]) && (byte '9' >= w.[1])
+                if isArity then emit Op.Arity (int (w.[1] - byte '0')) s else
+                match BS.toString w with
+                | "error" -> emit Op.Anno (int Anno.Error) s
+                | "nat" -> emit Op.Anno (int Anno.Nat) s
+                | "par" -> emit Op.Anno (int Anno.Par) s
+                | "nats" -> emit Op.Anno (int Anno.Nats) s
+                | _ -> emit Op.Anno (int Anno.Ignore) s
+            let rec compileAction ns pre op =
+                let s = wrapNS ns op
+                match op with
+                | Parser.Atom (struct(tt,tok)) ->
+                    match tt with
+                    | Parser.TT.Word -> compileWord pre tok s
+                    | Parser.TT.Anno -> compileAnno tok s
+                    | Parser.TT.Nat ->
+                        // localization: assume nats have the same meaning
+                        // in every hierarchical dictionary.
+                        match System.UInt64.TryParse(BS.toString tok) with
+                        | true, n -> emit Op.Push (addLit (Nat n)) s
+                        | _ -> emit Op.Stuck 0 s // too large for now
+                    | Parser.TT.Text -> emit Op.Push (addLit (Text tok)) s
+                    | _ -> emit Op.Stuck 0 s // resources not supported yet
+                | Parser.Block b ->
+                    let c = env.CompileNS ns pre b
+                    emit Op.Push (addLit (Block { bound = []; code = c; name = BS.empty })) s
+                | Parser.NS (struct(w,op')) ->
+                    let pre' = BS.append pre (BS.snoc w (byte '/'))
+                    compileAction (w::ns) pre' op'
+            List.iter (compileAction ns pre) p
+            { ops = ops.ToArray()
+              src = src.ToArray()
+              lits = lits.ToArray()
+              links = links.ToArray()
+            }
+
+        /// Resolve a link on first use, for a calling machine. Linking
+        /// is idempotent, so a race between machines sharing an Env is
+        /// benign.
+        member env.Resolve (m:Machine) (lnk:Link) : unit =
+            if (LinkKind.Unlinked <> lnk.Kind) then () else
+            match env.Src (lnk.Word) with
+            | None -> lnk.Kind <- LinkKind.Undefined
+            | Some def ->
+                lnk.Def <- def
+                // a word `d/foo` is defined within dictionary `d/`
+                let struct(pre,_) = BS.spanEnd (fun c -> (c <> byte '/')) (lnk.Word)
+                let ns = List.rev (nsWords pre)
+                let compile p = env.CompileNS ns pre p
+                match Parser.parse def with
+                | Parser.ParseFail _ -> lnk.Kind <- LinkKind.Undefined
+                | Parser.ParseOK p ->
+                    let isAccelAnno op =
+                        match op with
+                        | Parser.Atom (struct(Parser.TT.Anno, w)) -> (w = BS.fromString "accel")
+                        | _ -> false
+                    let accel =
+                        if not (List.exists isAccelAnno p) then None else
+                        CritbitTree.tryFind (lnk.Word) (env.Accel)
+                    match p, accel with
+                    | _, Some fn ->
+                        lnk.Code <- compile p
+                        lnk.Accel <- fn
+                        lnk.Kind <- LinkKind.Accel
+                    | [Parser.Block b], None ->
+                        let blk = { bound = []; code = compile b; name = lnk.Word }
+                        lnk.Value <- Block blk
+                        lnk.Kind <- LinkKind.Value
+                    | _ ->
+                        lnk.Code <- env.Memo m lnk (compile p)
+                        lnk.Kind <- LinkKind.Inline
+
+    /// Continuation frames. A frame with null Code is a hold frame,
+    /// which pushes its Hold value on return. If Count is non-zero,
+    /// it instead runs Hold (a block) up to Count more times.
+    and [<Struct>] Frame =
+        val Code  : Code
+        val PC    : int
+        val Hold  : Value
+        val Count : uint64
+        new(c,pc,h,n) = { Code = c; PC = pc; Hold = h; Count = n }
+
+    /// Why a machine stopped.
+    and Halt =
+        | Running = 0
+        | Done = 1      // evaluation completed
+        | Stuck = 2     // cannot progress
+        | Quota = 3     // effort quota exhausted
+
+    /// The stack machine. A machine is single-threaded. Accelerators
+    /// may manipulate the data stack and enter blocks directly, but
+    /// must return false without side-effects if they cannot handle
+    /// their arguments (then the reference definition is used).
+    and Machine =
+        val Env : Env
+        val mutable Data : Value[]
+        val mutable SP : int
+        val mutable Frames : Frame[]
+        val mutable FP : int
+        val mutable Code : Code
+        val mutable PC : int
+        val mutable Steps : int64
+        val mutable Quota : int64
+        /// Total effort for this machine. Usually equal to Quota, but a
+        /// machine run in segments (see KPN) has a lower Quota for each
+        /// segment. Work spawned by the machine is bounded by Budget, so
+        /// results don't depend on how the machine was segmented.
+        val mutable Budget : int64
+        val mutable Halt : Halt
+        val mutable internal NativeCall : Link
+        val mutable private Reservations : List<Reservation>
+        new(env,quota) =
+            { Env = env
+              Data = Array.zeroCreate 64
+              SP = 0
+              Frames = Array.zeroCreate 32
+              FP = 0
+              Code = env.EmptyCode
+              PC = 0
+              Steps = 0L
+              Quota = quota
+              Budget = quota
+              Halt = Halt.Running
+              NativeCall = null
+              Reservations = null
+            }
+
+
+        member inline m.Push (v:Value) : unit =
+            if (m.SP = m.Data.Length)
+                then System.Array.Resize(&m.Data, 2 * m.SP)
+            m.Data.[m.SP] <- v
+            m.SP <- m.SP + 1
+
+        member inline m.Pop () : Value =
+            m.SP <- m.SP - 1
+            let v = m.Data.[m.SP]
+            m.Data.[m.SP] <- Unchecked.defaultof<Value>
+            v
+
+        /// Peek at a value, where 0 is the top of the stack. This
+        /// forces a Future, replacing it by its value on the stack.
+        member inline m.Peek (ix:int) : Value = 
+            match m.Data.[m.SP - 1 - ix] with
+            | Future f -> 
+                let v = m.Force f
+                m.Data.[m.SP - 1 - ix] <- v
+                v
+            | v -> v
+
+        /// Wait for a Future. If this machine owns the Future, steps it
+        /// reserved but didn't use are refunded, once.
+        member m.Force (f:Future) : Value =
+            let v = f.Await()
+            if obj.ReferenceEquals(f.Owner, m) then
+                f.Owner <- Unchecked.defaultof<Machine>
+                if not (isNull f.Reservation) then
+                    m.Steps <- m.Steps - f.Reservation.Refund()
+            v
+
+        /// Charge steps reserved for a Future. They are refunded when
+        /// the future is forced, or when the machine settles.
+        member m.Reserve (r:Reservation) : unit =
+            m.Steps <- m.Steps + r.Steps
+            if isNull m.Reservations then m.Reservations <- new List<Reservation>()
+            // drop claimed reservations before the list grows
+            if (m.Reservations.Count = m.Reservations.Capacity) then
+                m.Reservations.RemoveAll(fun r -> r.IsClaimed) |> ignore<int>
+            m.Reservations.Add(r)
+
+        /// Claim the refunds for every reservation, waiting for spawned
+        /// work to finish. Returns whether any steps were refunded.
+        ///
+        /// Run settles when the machine would otherwise halt on its
+        /// Budget. Waiting makes the refund independent of scheduling,
+        /// so results remain deterministic.
+        member m.Settle () : bool =
+            if isNull m.Reservations then false else
+            let rs = m.Reservations
+            m.Reservations <- null
+            let refund = rs |> Seq.sumBy (fun r -> r.Refund())
+            m.Steps <- m.Steps - refund
+            (refund > 0L)
+
+        member private m.PushFrame (f:Frame) : unit =
+            if (m.FP = m.Frames.Length)
+                then System.Array.Resize(&m.Frames, 2 * m.FP)
+            m.Frames.[m.FP] <- f
+            m.FP <- m.FP + 1
+
+        // save the current continuation unless it's empty (TCO)
+        member inline private m.SaveCont () : unit =
+            if (m.PC < m.Code.ops.Length)
+                then m.PushFrame(Frame(m.Code, m.PC, Unchecked.defaultof<Value>, 0UL))
+
+        /// View a value as a block, expanding nats and texts.
+        member m.AsBlock (v:Value) : Block =
+            match v with
+            | Block b -> b
+            | Nat 0UL -> { bound = []; code = m.Env.ZeroCode; name = BS.empty }
+            | Nat n -> { bound = [Nat (n - 1UL)]; code = m.Env.SuccCode; name = BS.empty }
+            | Text t when BS.isEmpty t -> { bound = []; code = m.Env.NullCode; name = BS.empty }
+            | Text t ->
+                let hd = Nat (uint64 (BS.unsafeHead t))
+                { bound = [hd; Text (BS.unsafeTail t)]; code = m.Env.ConsCode; name = BS.empty }
+            | Future f -> m.AsBlock (m.Force f)
+            | Nats a when NatArray.isEmpty a -> { bound = []; code = m.Env.NullCode; name = BS.empty }
+            | Nats a ->
+                let hd = Nat (a.[0])
+                { bound = [hd; Nats (NatArray.sub a 1 (a.Length - 1))]; code = m.Env.ConsCode; name = BS.empty }
+
+        /// Pack a list of natural numbers, if the value is evidently
+        /// such a list: texts, packed lists, and blocks of form `[N T
+        /// cons]` or `[null]`, where the tail T is also a list. The
+        /// `cons` and `null` words must be from the root namespace.
+        member m.PackNats (v0:Value) : NatArray option =
+            let acc = new List<uint64>()
+            let mutable v = v0
+            let mutable result = None
+            let mutable halt = false
+            let isWord (s:string) (i:Instr) (c:Code) =
+                (Op.Call = i.op) && (BS.fromString s = c.links.[i.arg].Word)
+            while not halt do
+                halt <- true
+                match v with
+                | Future f -> v <- m.Force f; halt <- false
+                | Nats a ->
+                    for ix = 0 to (a.Length - 1) do acc.Add(a.[ix])
+                    result <- Some (NatArray(acc.ToArray()))
+                | Text t ->
+                    for ix = 0 to (t.Length - 1) do acc.Add(uint64 t.[ix])
+                    result <- Some (NatArray(acc.ToArray()))
+                | Block b ->
+                    // values bound or pushed by literals, then one call
+                    let c = b.code
+                    let nLits = c.ops.Length - 1
+                    let lit ix = (Op.Push = c.ops.[ix].op)
+                    let ok = (nLits >= 0) && Seq.forall lit (seq { 0 .. (nLits - 1) })
+                    if not ok then () else
+                    let vals = List.append (b.bound) [ for ix in 0 .. (nLits - 1) -> c.lits.[c.ops.[ix].arg] ]
+                    let last = c.ops.[nLits]
+                    match vals with
+                    | [] when isWord "null" last c ->
+                        result <- Some (NatArray(acc.ToArray()))
+                    | [Nat n; tl] when isWord "cons" last c ->
+                        acc.Add(n)
+                        v <- tl
+                        halt <- false
+                    | _ -> ()
+                | Nat _ -> ()
+            result
+
+        /// Enter code, i.e. run it inline.
+        member m.EnterCode (c:Code) : unit =
+            m.SaveCont()
+            m.Code <- c
+            m.PC <- 0
+
+        /// Enter a block, i.e. run it inline.
+        member m.Enter (b:Block) : unit =
+            m.SaveCont()
+            let mutable vs = b.bound
+            while not (List.isEmpty vs) do
+                m.Push (List.head vs)
+                vs <- List.tail vs
+            m.Code <- b.code
+            m.PC <- 0
+
+        /// Enter a block, then push `hold` when it returns.
+        member m.EnterHold (b:Block) (hold:Value) : unit =
+            m.SaveCont()
+            m.PushFrame(Frame(Unchecked.defaultof<Code>, 0, hold, 0UL))
+            m.Code <- m.Env.EmptyCode
+            m.Enter b
+
+        /// Enter a block value `n` times (n > 0) in sequence.
+        member m.EnterRepeat (v:Value) (n:uint64) : unit =
+            assert(n > 0UL)
+            m.SaveCont()
+            if (n > 1UL)
+                then m.PushFrame(Frame(Unchecked.defaultof<Code>, 0, v, (n - 1UL)))
+            m.Code <- m.Env.EmptyCode
+            m.Enter (m.AsBlock v)
+
+        // return from code; false if the machine is done
+        member private m.Return () : bool =
+            if (0 = m.FP) then false else
+            let f = m.Frames.[m.FP - 1]
+            if not (obj.ReferenceEquals(f.Code, null)) then
+                m.FP <- m.FP - 1
+                m.Frames.[m.FP] <- Unchecked.defaultof<Frame>
+                m.Code <- f.Code
+                m.PC <- f.PC
+            elif (0UL = f.Count) then
+                m.FP <- m.FP - 1
+                m.Frames.[m.FP] <- Unchecked.defaultof<Frame>
+                m.Code <- m.Env.EmptyCode
+                m.PC <- 0
+                m.Push (f.Hold)
+            else
+                // repeat frame, updated in place
+                if (1UL = f.Count) then 
+                    m.FP <- m.FP - 1
+                    m.Frames.[m.FP] <- Unchecked.defaultof<Frame>
+                else
+                    m.Frames.[m.FP - 1] <- Frame(f.Code, 0, f.Hold, (f.Count - 1UL))
+                m.Code <- m.Env.EmptyCode
+                m.PC <- 0
+                m.Enter (m.AsBlock f.Hold)
+            true
+
+        /// Call a word. Return false if the word is undefined.
+        member m.Call (lnk:Link) : bool =
+            if (LinkKind.Unlinked = lnk.Kind) then m.Env.Resolve m lnk
+            match lnk.Kind with
+            | LinkKind.Accel ->
+                if not (lnk.Accel m) then m.EnterCode (lnk.Code)
+                true
+            | LinkKind.Inline ->
+                lnk.Calls <- lnk.Calls + 1
+                if (lnk.Calls = m.Env.TierThreshold) then m.Env.Tier lnk
+                m.EnterCode (lnk.Code)
+                true
+            | LinkKind.Native ->
+                // compiled code is run from the Run loop rather than nested
+                // in this step, so calls between compiled words don't grow
+                // the CLR stack.
+                m.EnterCode (lnk.Code)
+                let room = (m.Quota - m.Steps) > int64 (lnk.Code.ops.Length)
+                if room then m.NativeCall <- lnk
+                true
+            | LinkKind.Value -> m.Push (lnk.Value); true
+            | _ -> false
+
+        /// Primitive `a`, i.e. `[B][A]a == A[B]`. Enters A. These
+        /// primitives return false if stuck, leaving the machine
+        /// unmodified.
+        member m.Apply () : bool =
+            if (m.SP < 2) then false else
+            let a = m.AsBlock (m.Pop())
+            let b = m.Pop()
+            m.EnterHold a b
+            true
+
+        /// Primitive `b`, i.e. `[B][A]b == [[B]A]`.
+        member m.Bind () : bool =
+            if (m.SP < 2) then false else
+            let a = m.AsBlock (m.Pop())
+            let b = m.Pop()
+            m.Push (Block { bound = (b :: a.bound); code = a.code; name = BS.empty })
+            true
+
+        /// Primitive `c`, i.e. `[A]c == [A][A]`.
+        member m.Copy () : bool =
+            if (m.SP < 1) then false else
+            m.Push (m.Data.[m.SP - 1]) // copy without forcing
+            true
+
+        /// Primitive `d`, i.e. `[A]d ==`.
+        member m.Drop () : bool =
+            if (m.SP < 1) then false else
+            m.Pop() |> ignore
+            true
+
+        /// Perform one step. Return false if stuck, leaving the
+        /// machine unmodified. Does not update PC or Steps.
+        member m.Step (i:Instr) : bool =
+            match i.op with
+            | Op.Push -> m.Push (m.Code.lits.[i.arg]); true
+            | Op.Call -> m.Call (m.Code.links.[i.arg])
+            | Op.Apply -> m.Apply()
+            | Op.Bind -> m.Bind()
+            | Op.Copy -> m.Copy()
+            | Op.Drop -> m.Drop()
+            | Op.Arity -> (m.SP >= i.arg)
+            | Op.Anno ->
+                match enum<Anno> i.arg with
+                | Anno.Error -> false
+                | Anno.Nat ->
+                    if (m.SP < 1) then false else
+                    match m.Peek 0 with
+                    | Nat _ -> true
+                    | _ -> false
+                | Anno.Nats ->
+                    if (m.SP < 1) then false else
+                    match m.PackNats (m.Peek 0) with
+                    | Some a -> m.Data.[m.SP - 1] <- Nats a; true
+                    | None -> false
+                | Anno.Par ->
+                    if (m.SP < 1) then false else
+                    // don't force a Future, which is already in parallel
+                    match m.Data.[m.SP - 1] with
+                    | Block b -> m.Data.[m.SP - 1] <- m.Env.Par m b
+                    | _ -> () // nats and texts are already values
+                    true
+                | _ -> true
+            | _ -> false
+
+        /// Run until done, stuck, or out of quota.
+        member m.Run () : unit =
+            let t0 = System.Diagnostics.Stopwatch.GetTimestamp()
+            let s0 = m.Steps
+            m.Halt <- Halt.Running
+            while (Halt.Running = m.Halt) do
+                if (m.PC < m.Code.ops.Length) then
+                    if (m.Steps >= m.Quota) then
+                        if not ((m.Quota >= m.Budget) && m.Settle())
+                            then m.Halt <- Halt.Quota
+                    else
+                    let i = m.Code.ops.[m.PC]
+                    m.PC <- m.PC + 1
+                    m.Steps <- m.Steps + 1L
+                    if not (m.Step i) then
+                        m.PC <- m.PC - 1
+                        m.Halt <- Halt.Stuck
+                    else
+                        while not (isNull m.NativeCall) do
+                            let lnk = m.NativeCall
+                            m.NativeCall <- null
+                            lnk.Native m
+                elif not (m.Return()) then
+                    m.Halt <- Halt.Done
+            stepCount.Add (m.Steps - s0)
+            runTimer.Since t0
+
+    /// Native implementations for `[code](accel)` words.
+    type Accelerator = Machine -> bool
+
+    /// Registry of accelerators, keyed by word.
+    type Registry = CritbitTree<Accelerator>
+
+    /// Convert a value back to an Awelon action.
+    let rec valueAction (v:Value) : Parser.Action =
+        match v with
+        | Nat n -> Parser.Atom (Parser.tokNat (BS.fromString (string n)))
+        | Text t -> Parser.Atom (Parser.tokText t)
+        | Block b ->
+            if (List.isEmpty b.bound) && not (BS.isEmpty b.name)
+                then Parser.Atom (Parser.tokWord (b.name))
+                else Parser.Block (blockProgram b)
+        | Future f -> valueAction (f.Await())
+        | Nats a ->
+            // nested `[N T cons]` lists, built from the end
+            let word s = Parser.Atom (Parser.tokWord (BS.fromString s))
+            let cons = word "cons"
+            let mutable p = Parser.Block [word "null"]
+            for ix = (a.Length - 1) downto 0 do
+                let n = Parser.Atom (Parser.tokNat (BS.fromString (string a.[ix])))
+                p <- Parser.Block [n; p; cons]
+            p
+    and blockProgram (b:Block) : Parser.Program =
+        let body = List.ofArray (b.code.src)
+        List.foldBack (fun v p -> (valueAction v :: p)) (b.bound) body
+
+    let private codeFrom (c:Code) (pc:int) : Parser.Program =
+        if (pc >= c.src.Length) then [] else
+        List.ofArray (Array.sub (c.src) pc (c.src.Length - pc))
+
+    /// Compute the residual program for a halted machine. This is
+    /// the data stack followed by the pending continuation.
+    let residual (m:Machine) : Parser.Program =
+        let repeatWord = BS.fromString "repeat"
+        let frameProg (f:Frame) : Parser.Program =
+            if not (obj.ReferenceEquals(f.Code, null)) then codeFrom (f.Code) (f.PC)
+            elif (0UL = f.Count) then [valueAction (f.Hold)]
+            else [ valueAction (f.Hold)
+                   valueAction (Nat (f.Count))
+                   Parser.Atom (Parser.tokWord repeatWord) ]
+        let mutable p = []
+        for ix = 0 to (m.FP - 1) do
+            p <- List.append (frameProg (m.Frames.[ix])) p
+        p <- List.append (codeFrom (m.Code) (m.PC)) p
+        for ix = (m.SP - 1) downto 0 do
+            p <- (valueAction (m.Data.[ix]) :: p)
+        p
+
+    /// Standard accelerators.
+    module Accel =
+
+        let inline private word s = BS.fromString s
+
+        let inline private blockAt (m:Machine) ix =
+            match m.Peek ix with
+            | Block _ -> true
+            | _ -> false
+
+        // [A]i == A
+        let inline_ (m:Machine) : bool =
+            if (m.SP < 1) then false else
+            m.Enter (m.AsBlock (m.Pop()))
+            true
+
+        // [B][A]w == [A][B]
+        let swap (m:Machine) : bool =
+            if (m.SP < 2) then false else
+            let a = m.Pop()
+            let b = m.Pop()
+            m.Push a
+            m.Push b
+            true
+
+        // [X][F]z == [X][[F]z]F
+        let fixpoint (m:Machine) : bool =
+            if (m.SP < 2) || not (blockAt m 0) then false else
+            let f = m.AsBlock (m.Pop())
+            m.Push (Block { bound = [Block f]; code = m.Env.FixCode; name = BS.empty })
+            m.Enter f
+            true
+
+        // [X][F]N repeat == [X] F F .. F (N times)
+        let repeat (m:Machine) : bool =
+            if (m.SP < 3) then false else
+            match m.Peek 0 with
+            | Nat n ->
+                m.Pop() |> ignore
+                let f = m.Pop()
+                if (n > 0UL) then m.EnterRepeat f n
+                true
+            | _ -> false
+
+        let succ (m:Machine) : bool =
+            if (m.SP < 1) then false else
+            match m.Peek 0 with
+            | Nat n when (n < System.UInt64.MaxValue) ->
+                m.Pop() |> ignore
+                m.Push (Nat (n + 1UL))
+                true
+            | _ -> false
+
+        // pop two nats, if available, for a binary operation
+        let inline private natArgs2 (m:Machine) : bool =
+            if (m.SP < 2) then false else
+            match (m.Peek 1), (m.Peek 0) with
+            | Nat _, Nat _ -> true
+            | _ -> false
+
+        let inline private natAt (m:Machine) ix =
+            match m.Peek ix with
+            | Nat n -> n
+            | _ -> invalidOp "not a natural number"
+
+        let add (m:Machine) : bool =
+            if not (natArgs2 m) then false else
+            let a = natAt m 1
+            let r = a + natAt m 0
+            if (r < a) then false else // overflow
+            m.Pop() |> ignore
+            m.Data.[m.SP - 1] <- Nat r
+            true
+
+        let mul (m:Machine) : bool =
+            if not (natArgs2 m) then false else
+            let a = natAt m 1
+            let b = natAt m 0
+            let r = a * b
+            if (0UL <> a) && ((r / a) <> b) then false else // overflow
+            m.Pop() |> ignore
+            m.Data.[m.SP - 1] <- Nat r
+            true
+
+        // Kernels for packed lists of naturals (see NatArray) raise an
+        // exception on overflow, then we use the reference definition.
+        let inline private kernel (fn:unit -> 'R) : 'R option =
+            try Some (fn ())
+            with | :? System.OverflowException -> None
+
+        // [L] nats-sum == N
+        let natsSum (m:Machine) : bool =
+            if (m.SP < 1) then false else
+            match m.Peek 0 with
+            | Nats a ->
+                match kernel (fun () -> NatArray.sum a) with
+                | Some n -> m.Data.[m.SP - 1] <- Nat n; true
+                | None -> false
+            | _ -> false
+
+        // [A] [B] nats-dot == N, for lists of equal length
+        let natsDot (m:Machine) : bool =
+            if (m.SP < 2) then false else
+            match (m.Peek 1), (m.Peek 0) with
+            | Nats a, Nats b when (a.Length = b.Length) ->
+                match kernel (fun () -> NatArray.dot a b) with
+                | Some n ->
+                    m.Pop() |> ignore
+                    m.Data.[m.SP - 1] <- Nat n
+                    true
+                | None -> false
+            | _ -> false
+
+        // elementwise operations with a scalar, e.g. [L] N nats-add
+        let inline private natsScalar (fn:uint64 -> NatArray -> NatArray) (m:Machine) : bool =
+            if (m.SP < 2) then false else
+            match (m.Peek 1), (m.Peek 0) with
+            | Nats a, Nat k ->
+                match kernel (fun () -> fn k a) with
+                | Some r ->
+                    m.Pop() |> ignore
+                    m.Data.[m.SP - 1] <- Nats r
+                    true
+                | None -> false
+            | _ -> false
 
+        let natsAdd (m:Machine) : bool = natsScalar NatArray.addScalar m
+        let natsMul (m:Machine) : bool = natsScalar NatArray.mulScalar m
 
-    /// Interpreter-layer values should be optimized towards runtime
-    /// interpretations. Relevantl
-    /// 
-    
+        // [A] [B] N nats-matmul == [C], for row-major matrices with
+        // inner dimension N (see NatArray.matmul)
+        let natsMatMul (m:Machine) : bool =
+            if (m.SP < 3) then false else
+            match (m.Peek 2), (m.Peek 1), (m.Peek 0) with
+            | Nats a, Nats b, Nat n when (n > 0UL) && (n <= uint64 System.Int32.MaxValue) 
+                                      && (0 = (a.Length % int n)) && (0 = (b.Length % int n)) ->
+                match kernel (fun () -> NatArray.matmul (int n) a b) with
+                | Some c ->
+                    m.Pop() |> ignore
+                    m.Pop() |> ignore
+                    m.Data.[m.SP - 1] <- Nats c
+                    true
+                | None -> false
+            | _ -> false
 
+        let inline register (w:string) (fn:Accelerator) (r:Registry) : Registry =
+            CritbitTree.add (word w) fn r
 
-    /// I assume `[code](accel)` will be used within source to 
-    /// indicate accelerated implementations. Wh
+        /// The default registry.
+        let standard : Registry =
+            CritbitTree.empty
+                |> register "i" inline_
+                |> register "w" swap
+                |> register "z" fixpoint
+                |> register "repeat" repeat
+                |> register "succ" succ
+                |> register "nat-add" add
+                |> register "nat-mul" mul
+                |> register "nats-sum" natsSum
+                |> register "nats-dot" natsDot
+                |> register "nats-add" natsAdd
+                |> register "nats-mul" natsMul
+                |> register "nats-matmul" natsMatMul
 
+    /// Construct an Env with the standard accelerators.
+    let env (src:Src) : Env = new Env(src, Accel.standard)
 
+    /// Evaluate a program with an effort quota, measured in steps.
+    /// Returns the residual program and the halting condition.
+    let eval' (e:Env) (quota:int64) (p:Parser.Program) : struct(Parser.Program * Halt) =
+        let m = new Machine(e, quota)
+        m.Code <- e.Compile p
+        m.Run()
+        struct(residual m, m.Halt)
 
-    
-    
+    /// Evaluate a program without a quota.
+    let eval (e:Env) (p:Parser.Program) : Parser.Program =
+        let struct(p',_) = eval' e System.Int64.MaxValue p
+        p'
 
@@ -0,0 +1,176 @@
+namespace Awelon
+open System
+open System.Linq.Expressions
+open System.Threading.Tasks
+open Data.ByteString
+open Stowage
+open Awelon.Interpret
+
+// A second, compiled tier for hot Awelon words.
+//
+// The interpreter counts calls to inline words. When a word becomes
+// hot, this tier generates IL for the word's bytecode (via expression
+// trees, which use DynamicMethod internally). The generated code runs
+// straight-line operations without the interpreter's dispatch loop:
+// literals, primitives `a b c d` and arity checks are compiled to
+// direct calls or tests, and a call pushes a block value or invokes
+// an accelerator (e.g. `succ` or `nat-add`) without going through the
+// interpreter. Only rare operations, such as `(nat)` or `(par)`, use
+// Machine.Step. The code returns to the interpreter when control is
+// transferred (e.g. to apply a block or call another inline word) or
+// when an operation is stuck. In the latter case, the interpreter retries the operation to
+// produce a residual program, so there is no observable difference.
+// Calls between compiled words also return to the interpreter, which
+// runs the callee from its loop, so recursion doesn't use CLR stack.
+//
+// Generated code refers to literals and links by index through its
+// Code argument, so it depends only on the word's bytecode. This
+// permits sharing compiled code between Envs, keyed by a version hash
+// of the program the bytecode was compiled from.
+module Jit =
+
+    /// Compiled code for a word. The Code argument must be compiled
+    /// from the same program.
+    type Compiled = Action<Machine, Code>
+
+    /// Version of a word's code for our compiled code cache.
+    ///
+    /// Compiled code does not depend on the definitions of linked
+    /// words, so a shallow version is sufficient. We hash the source
+    /// program of the Code rather than the word's definition, since
+    /// the code may be rewritten upon linking (see Env.Memo).
+    let version (c:Code) : RscHash = 
+        RscHash.hash (Parser.write (List.ofArray (c.src)))
+
+    let private tMachine = typeof<Machine>
+    let private mStep = tMachine.GetMethod("Step")
+    let private mPush = tMachine.GetMethod("Push")
+    let private mEnterCode = tMachine.GetMethod("EnterCode")
+    let private mCall = tMachine.GetMethod("Call")
+    let private mAccel = typeof<Machine -> bool>.GetMethod("Invoke")
+
+    /// Generate IL for a Code object.
+    ///
+    /// The compiled code assumes the machine has already entered the
+    /// code and starts from PC zero. Steps are counted as usual, but
+    /// the caller is responsible for a quota check up front.
+    let compile (c:Code) : Compiled =
+        let m = Expression.Parameter(tMachine, "m")
+        let code = Expression.Parameter(typeof<Code>, "code")
+        let ret = Expression.Label("ret")
+        let pc = Expression.PropertyOrField(m, "PC")
+        let sp = Expression.PropertyOrField(m, "SP")
+        let steps = Expression.PropertyOrField(m, "Steps")
+        let mcode = Expression.PropertyOrField(m, "Code")
+        let lits = Expression.PropertyOrField(code, "lits")
+        let links = Expression.PropertyOrField(code, "links")
+        let setPC (k:int) = Expression.Assign(pc, Expression.Constant(k)) :> Expression
+        let stmts = new ResizeArray<Expression>()
+        for k = 0 to (c.ops.Length - 1) do
+            let i = c.ops.[k]
+            stmts.Add(setPC (k + 1))
+            stmts.Add(Expression.AddAssign(steps, Expression.Constant(1L)))
+            // if stuck, rewind and return to the interpreter
+            let stuck =
+                Expression.Block(setPC k,
+                    Expression.SubtractAssign(steps, Expression.Constant(1L)),
+                    Expression.Return(ret))
+            let unless (ok:Expression) = Expression.IfThen(Expression.Not(ok), stuck) :> Expression
+            // control moved if the code or PC changed, including
+            // reentry of this code by a recursive call
+            let moved = Expression.OrElse(Expression.ReferenceNotEqual(mcode, code),
+                                          Expression.NotEqual(pc, Expression.Constant(k + 1)))
+            let retIfMoved = Expression.IfThen(moved, Expression.Return(ret)) :> Expression
+            match i.op with
+            | Op.Push ->
+                let lit = Expression.ArrayIndex(lits, Expression.Constant(i.arg))
+                stmts.Add(Expression.Call(m, mPush, lit))
+            | Op.Apply ->
+                stmts.Add(unless (Expression.Call(m, tMachine.GetMethod("Apply"))))
+                stmts.Add(Expression.Return(ret))
+            | Op.Bind | Op.Copy | Op.Drop ->
+                stmts.Add(unless (Expression.Call(m, tMachine.GetMethod(string i.op))))
+            | Op.Arity ->
+                stmts.Add(Expression.IfThen(Expression.LessThan(sp, Expression.Constant(i.arg)), stuck))
+            | Op.Call ->
+                // the link kind may change at runtime, e.g. when the
+                // word is resolved or upgraded, so we test it here
+                let lnk = Expression.Variable(typeof<Link>, "lnk")
+                let kind = Expression.Convert(Expression.PropertyOrField(lnk, "Kind"), typeof<int>)
+                let isKind (lk:LinkKind) = Expression.Equal(kind, Expression.Constant(int lk))
+                let accel =
+                    Expression.Call(Expression.PropertyOrField(lnk, "Accel"), mAccel, m)
+                let onAccel =
+                    Expression.IfThenElse(accel, retIfMoved,
+                        Expression.Block(
+                            Expression.Call(m, mEnterCode, Expression.PropertyOrField(lnk, "Code")),
+                            Expression.Return(ret)))
+                let onOther = Expression.Block(unless (Expression.Call(m, mCall, lnk)), retIfMoved)
+                stmts.Add(Expression.Block([| lnk |],
+                            Expression.Assign(lnk, Expression.ArrayIndex(links, Expression.Constant(i.arg))),
+                            Expression.IfThenElse(isKind LinkKind.Value,
+                                Expression.Call(m, mPush, Expression.PropertyOrField(lnk, "Value")),
+                                Expression.IfThenElse(isKind LinkKind.Accel, onAccel, onOther))))
+            | Op.Anno when (int Anno.Ignore = i.arg) -> ()
+            | _ ->
+                // rare annotations don't transfer control
+                let step = Expression.Call(m, mStep, Expression.Constant(box i, typeof<Instr>))
+                stmts.Add(unless step)
+        stmts.Add(Expression.Label(ret))
+        let body = Expression.Block(stmts)
+        Expression.Lambda<Compiled>(body, [| m; code |]).Compile()
+
+    // Compiled code is cached in memory, shared between Envs.
+    let private cache : MCache<RscHash, Compiled> = new MCache<RscHash, Compiled>()
+
+    // rough size estimate for compiled code
+    let inline private compiledSize (c:Code) : SizeEst =
+        1000UL + (200UL * uint64 c.ops.Length)
+
+    /// Compile an inline link synchronously, upgrading it to the
+    /// Native tier. Compiled code is cached under the version hash.
+    /// The machine enters the link's code before running it.
+    let upgrade (lnk:Link) : unit =
+        if (LinkKind.Inline <> lnk.Kind) then () else
+        let code = lnk.Code
+        let v = version code
+        let fn =
+            match MCache.tryFind v cache with
+            | Some fn -> fn
+            | None -> MCache.tryAdd v (compile code) (compiledSize code) cache
+        lnk.Native <- (fun m -> fn.Invoke(m, code))
+        System.Threading.Thread.MemoryBarrier()
+        lnk.Kind <- LinkKind.Native
+
+    // words left in the interpreter because code generation failed
+    let private failed = new System.Collections.Concurrent.ConcurrentDictionary<Word, exn>()
+    let private fallbacks =
+        Metrics.counter "awelon_jit_fallbacks_total" "Hot words left in the interpreter because code generation failed."
+
+    /// Words that remain in the interpreter because code generation
+    /// failed, with the error. Shared by every Env.
+    let failures () : (Word * exn) list =
+        failed |> Seq.map (fun kv -> (kv.Key, kv.Value)) |> List.ofSeq
+
+    /// Upgrade a link in the background. The interpreter continues
+    /// to run the word until the compiled code is available. If code
+    /// generation fails, the word remains in the interpreter, and is
+    /// reported by `failures` and the fallbacks counter.
+    let tier (lnk:Link) : unit =
+        let task = Task.Run(fun () ->
+            try upgrade lnk
+            with e ->
+                failed.[lnk.Word] <- e
+                fallbacks.Incr())
+        ignore<Task> task
+
+    /// Enable the compiled tier for an Env.
+    let enable (e:Env) : unit =
+        e.Tier <- tier
+
+    /// Construct an Env with standard accelerators and compiled tier.
+    let env (src:Src) : Env =
+        let e = Interpret.env src
+        enable e
+        e
+
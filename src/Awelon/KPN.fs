@@ -0,0 +1,139 @@
+namespace Awelon
+open System.Threading
+open System.Threading.Tasks
+open Data.ByteString
+open Awelon.Interpret
+
+// Parallel evaluation of `[A](par)` subprograms.
+//
+// Each `(par)` block becomes a process, evaluated by a fresh machine
+// on the thread pool. In place of the block, the spawning machine gets
+// a Future - a single-assignment placeholder per AwelonKPN.md - which
+// it may route through data plumbing (copy, drop, bind, apply as an
+// argument) without waiting. A process that receives a Future forces
+// it only upon inspection, so a chain of `(par)` stages is pipelined,
+// and independent stages run concurrently.
+//
+// Results are deterministic. A process evaluates its block with a
+// quota fixed at the moment of spawn, so its result doesn't depend on
+// scheduling. A completed process yields a block of its result values.
+// A process that halts early yields its residual program as a block,
+// just as evaluation would.
+//
+// Work remains bounded by the quota. A process reserves half of its
+// parent's remaining quota, which is charged to the parent. The steps
+// the process didn't use are refunded when the parent forces the
+// Future, or when the parent runs out of quota: then it waits for its
+// processes to finish, and continues with the refunds (see
+// Machine.Settle). So N processes together never exceed the parent's
+// quota, and a parent doesn't halt early for processes it dropped.
+//
+// The .Net thread pool runs tasks spawned by workers from local queues
+// with work stealing. The number of queued processes is bounded: past
+// the bound, a new process isn't queued, and instead runs on demand by
+// the first machine to force it. Forcing a pending Future always runs
+// it inline, so waits only occur on processes that are already running.
+//
+// In the background, a process runs at most BackgroundQuota steps, then
+// waits to be forced, and then resumes where it paused. This bounds the
+// work wasted on futures that are never used. A process whose Future
+// was garbage collected before it was scheduled doesn't run at all.
+module KPN =
+
+    /// Default for Scheduler.BackgroundQuota. Ten million steps is
+    /// enough for most processes to finish in the background, while
+    /// the work wasted on a Future that is never used stays small
+    /// compared to a typical evaluation quota.
+    let defaultBackgroundQuota : int64 = 10_000_000L
+
+    /// A Scheduler bounds the number of processes queued or running
+    /// in the background, to limit memory for pending work, and the
+    /// steps a process runs in the background before it's forced
+    /// (BackgroundQuota). A process that reaches this limit resumes
+    /// when forced, or when its parent settles its reservations.
+    type Scheduler =
+        val MaxPending : int
+        val BackgroundQuota : int64
+        val mutable internal Pending : int
+        new(maxPending, bgQuota) = { MaxPending = maxPending; BackgroundQuota = bgQuota; Pending = 0 }
+        new(maxPending) = new Scheduler(maxPending, defaultBackgroundQuota)
+        new() = new Scheduler(4 * System.Environment.ProcessorCount)
+
+    // the block denoted by a halted machine
+    let private result (m:Machine) : Block =
+        if (Halt.Done = m.Halt)
+            then { bound = List.init (m.SP) (fun ix -> m.Data.[ix]); code = m.Env.EmptyCode; name = BS.empty }
+            else { bound = []; code = m.Env.Compile (residual m); name = BS.empty }
+
+    /// Evaluate a block's program with a given quota. Returns a block
+    /// equivalent to the argument.
+    let evalBlock (e:Env) (quota:int64) (b:Block) : Block =
+        let m = new Machine(e, quota)
+        m.Enter b
+        m.Run()
+        result m
+
+    // A process is a machine that may run in segments, up to a limit
+    // within its quota, then resume. Segments are serialized by a lock.
+    type private Process =
+        val M : Machine
+        val Quota : int64
+        val mutable Started : bool
+        new(e:Env, quota:int64, b:Block) as p =
+            { M = new Machine(e, quota); Quota = quota; Started = false } then
+            p.M.Enter b
+
+        member p.Finished with get() : bool =
+            p.Started && ((Halt.Quota <> p.M.Halt) || (p.M.Steps >= p.Quota))
+
+        // run up to a step limit (capped by the quota)
+        member p.Advance (limit:int64) : unit =
+            lock p (fun () ->
+                if not p.Finished then
+                    p.Started <- true
+                    p.M.Quota <- min (p.Quota) limit
+                    p.M.Run())
+
+    let private queue (s:Scheduler) (p:Process) (f:Future) : unit =
+        if (Interlocked.Increment(&s.Pending) > s.MaxPending)
+            then Interlocked.Decrement(&s.Pending) |> ignore // run on demand
+            else
+                // the task doesn't keep the Future alive while queued
+                let wf = new System.WeakReference<Future>(f)
+                let run () =
+                    try match wf.TryGetTarget() with
+                        | true, f ->
+                            p.Advance (p.M.Steps + s.BackgroundQuota)
+                            if p.Finished then f.TryRun()
+                        | _ -> ()
+                    finally Interlocked.Decrement(&s.Pending) |> ignore
+                ignore<Task> (Task.Run(run))
+
+    /// Spawn a process for a block, returning a Future. The process
+    /// reserves half the machine's remaining Budget.
+    let spawn (s:Scheduler) (m:Machine) (b:Block) : Value =
+        // keep named value words, e.g. `true`, for readable output
+        if (List.isEmpty b.bound) && not (BS.isEmpty b.name) then Block b else
+        let quota = max 0L ((m.Budget - m.Steps) / 2L)
+        let p = new Process(m.Env, quota, b)
+        // the reservation refers to the process, not the Future, so
+        // an unused Future may still be collected
+        let r = new Reservation(quota, fun () -> p.Advance quota; p.M.Steps)
+        m.Reserve r
+        let f = new Future(fun () ->
+                    p.Advance quota
+                    Block (result p.M))
+        f.Owner <- m
+        f.Reservation <- r
+        queue s p f
+        Value.Future f
+
+    /// Enable parallel evaluation of `(par)` blocks for an Env.
+    let enable (s:Scheduler) (e:Env) : unit =
+        e.Par <- spawn s
+
+    /// Construct an Env with standard accelerators and a KPN scheduler.
+    let env (src:Src) : Env =
+        let e = Interpret.env src
+        enable (new Scheduler()) e
+        e
@@ -0,0 +1,89 @@
+namespace Awelon
+open Data.ByteString
+open Stowage
+open Awelon.Interpret
+
+// Durable memoization of word evaluations.
+//
+// Awelon evaluation is confluent, so we may evaluate a definition
+// ahead of time and link words to the residual program instead of the
+// raw definition. We cache these residuals durably, keyed by a deep
+// version hash of the word (see DictIndex), such that an Env for a
+// new version of a dictionary can reuse evaluations for every word
+// whose transitive definition is unchanged.
+//
+// Residuals are written as Awelon programs. Large residuals are held
+// by reference via CVRef, so the cache tree itself remains small.
+module Memo =
+
+    // residuals larger than this are stowed
+    let private stowThresh = 1000UL
+
+    /// A memo table, shared by many Envs. Quota limits the effort
+    /// to evaluate each definition, measured in steps. The cache
+    /// quota limits the total size of cached residuals.
+    type Table =
+        val Cache : DCache.C<CVRef<ByteString>>
+        val mutable Quota : int64
+        new(cache) = { Cache = cache; Quota = 100000L }
+        new(db:DB, key:ByteString, quota:SizeEst) =
+            let cV = EncCVRef.codec stowThresh (EncBytes.codec)
+            new Table(new DCache.C<CVRef<ByteString>>(db, key, cV, quota))
+
+    /// Cache statistics for a memo table.
+    let stats (t:Table) : DCache.Stats = DCache.stats (t.Cache)
+
+    /// Write buffered cache updates to the DB.
+    let sync (t:Table) : unit = DCache.sync (t.Cache)
+
+    let private store (t:Table) (k:RscHash) (s:ByteString) : unit =
+        let sz = uint64 (BS.length s)
+        let ref = CVRef.stow stowThresh (EncBytes.codec) (t.Cache.Stowage) s
+        DCache.add k ref sz (t.Cache)
+
+    let private load (t:Table) (k:RscHash) : Parser.Program option =
+        match DCache.tryFind k (t.Cache) with
+        | None -> None
+        | Some ref ->
+            match Parser.parse (CVRef.load ref) with
+            | Parser.ParseOK p -> Some p
+            | Parser.ParseFail _ -> None // treat as a miss
+
+    /// Memoizing compiler for inline words. The version function
+    /// should return a deep version hash for a word, if known. On a
+    /// miss, we evaluate the definition within the Table's quota, or
+    /// what remains of the caller's quota if less, and charge the
+    /// steps to the caller. If evaluation halts within the quota, the
+    /// residual program is stored and used as the word's code.
+    /// Otherwise, we use the definition as is.
+    let memo (t:Table) (version:Word -> RscHash option) (e:Env) (caller:Machine) (lnk:Link) (code:Code) : Code =
+        match version (lnk.Word) with
+        | None -> code
+        | Some v ->
+            match load t v with
+            | Some p -> e.Compile p
+            | None ->
+                // link the raw definition while evaluating, so a call
+                // to a recursive word doesn't attempt to memoize again
+                lnk.Code <- code
+                lnk.Kind <- LinkKind.Inline
+                let quota = min (t.Quota) (max 0L (caller.Quota - caller.Steps))
+                let m = new Machine(e, quota)
+                m.Code <- code
+                m.Run()
+                caller.Steps <- caller.Steps + m.Steps
+                if (Halt.Quota = m.Halt) then code else
+                let p = residual m
+                store t v (Parser.write p)
+                e.Compile p
+
+    /// Enable memoization for an Env.
+    let enable (t:Table) (version:Word -> RscHash option) (e:Env) : unit =
+        e.Memo <- memo t version e
+
+    /// Construct an Env for an indexed dictionary, with memoization
+    /// under the index's deep versions.
+    let env (t:Table) (ix:DictIndex.Index) : Env =
+        let e = Interpret.env (dictSrc (ix.dict))
+        enable t (fun w -> DictIndex.version w ix) e
+        e
@@ -0,0 +1,156 @@
+namespace Awelon
+open Data.ByteString
+open Stowage
+
+/// An unboxed array of natural numbers, or a slice thereof.
+///
+/// This is the accelerated representation for an Awelon list of
+/// natural numbers, such as `[1 [2 [null] cons] cons]`, in the same
+/// sense that Text accelerates a list of bytes. Arrays are immutable
+/// once shared. Numeric kernels operate over the whole slice without
+/// allocating per element.
+[<Struct>]
+type NatArray =
+    val Data : uint64[]
+    val Offset : int
+    val Length : int
+    new(data, off, len) = { Data = data; Offset = off; Length = len }
+    new(data:uint64[]) = { Data = data; Offset = 0; Length = data.Length }
+    member inline a.Item with get(ix:int) : uint64 = a.Data.[a.Offset + ix]
+
+// Kernels use checked arithmetic. On overflow, they raise an exception
+// such that an accelerator may fall back to its reference definition.
+// Loops are unrolled four ways, with independent accumulators, so
+// the overflow checks don't serialize.
+module NatArray =
+    open Microsoft.FSharp.Core.Operators.Checked
+
+    let empty : NatArray = NatArray(Array.empty)
+    let inline length (a:NatArray) : int = a.Length
+    let inline isEmpty (a:NatArray) : bool = (0 = a.Length)
+
+    /// Slice of an array.
+    let sub (a:NatArray) (off:int) (len:int) : NatArray =
+        if (off < 0) || (len < 0) || ((off + len) > a.Length)
+            then invalidArg "len" "slice out of range"
+        NatArray(a.Data, a.Offset + off, len)
+
+    let inline ofArray (arr:uint64[]) : NatArray = NatArray(Array.copy arr)
+    let toArray (a:NatArray) : uint64[] = Array.sub (a.Data) (a.Offset) (a.Length)
+
+    /// Sum of elements.
+    let sum (a:NatArray) : uint64 =
+        let d = a.Data
+        let mutable s0 = 0UL
+        let mutable s1 = 0UL
+        let mutable s2 = 0UL
+        let mutable s3 = 0UL
+        let mutable ix = a.Offset
+        let stop = a.Offset + a.Length
+        while ((ix + 4) <= stop) do
+            s0 <- s0 + d.[ix]
+            s1 <- s1 + d.[ix + 1]
+            s2 <- s2 + d.[ix + 2]
+            s3 <- s3 + d.[ix + 3]
+            ix <- ix + 4
+        while (ix < stop) do
+            s0 <- s0 + d.[ix]
+            ix <- ix + 1
+        (s0 + s1) + (s2 + s3)
+
+    /// Dot product of two arrays of equal length.
+    let dot (a:NatArray) (b:NatArray) : uint64 =
+        if (a.Length <> b.Length) then invalidArg "b" "length mismatch" else
+        let da = a.Data
+        let db = b.Data
+        let off = b.Offset - a.Offset
+        let mutable s0 = 0UL
+        let mutable s1 = 0UL
+        let mutable s2 = 0UL
+        let mutable s3 = 0UL
+        let mutable ix = a.Offset
+        let stop = a.Offset + a.Length
+        while ((ix + 4) <= stop) do
+            s0 <- s0 + (da.[ix] * db.[ix + off])
+            s1 <- s1 + (da.[ix + 1] * db.[ix + off + 1])
+            s2 <- s2 + (da.[ix + 2] * db.[ix + off + 2])
+            s3 <- s3 + (da.[ix + 3] * db.[ix + off + 3])
+            ix <- ix + 4
+        while (ix < stop) do
+            s0 <- s0 + (da.[ix] * db.[ix + off])
+            ix <- ix + 1
+        (s0 + s1) + (s2 + s3)
+
+    // elementwise map into a fresh array
+    let inline private mapInto (fn:uint64 -> uint64) (a:NatArray) : NatArray =
+        let r = Array.zeroCreate (a.Length)
+        let d = a.Data
+        let off = a.Offset
+        for ix = 0 to (r.Length - 1) do
+            r.[ix] <- fn d.[off + ix]
+        NatArray(r)
+
+    /// Add a constant to every element.
+    let addScalar (k:uint64) (a:NatArray) : NatArray = mapInto (fun x -> x + k) a
+
+    /// Multiply every element by a constant.
+    let mulScalar (k:uint64) (a:NatArray) : NatArray = mapInto (fun x -> x * k) a
+
+    /// Matrix multiply for row-major matrices. Given inner dimension
+    /// `n`, `a` is `m * n` and `b` is `n * p`, and the result is `m * p`.
+    /// We iterate `i k j` so the inner loop scans rows of `b` and `c`.
+    let matmul (n:int) (a:NatArray) (b:NatArray) : NatArray =
+        if (n < 1) || (0 <> (a.Length % n)) || (0 <> (b.Length % n))
+            then invalidArg "n" "dimensions mismatch"
+        let m = a.Length / n
+        let p = b.Length / n
+        let c = Array.zeroCreate (m * p)
+        let da = a.Data
+        let db = b.Data
+        for i = 0 to (m - 1) do
+            let ci = i * p
+            for k = 0 to (n - 1) do
+                let x = da.[a.Offset + (i * n) + k]
+                if (0UL <> x) then
+                    let bk = b.Offset + (k * p)
+                    for j = 0 to (p - 1) do
+                        c.[ci + j] <- c.[ci + j] + (x * db.[bk + j])
+        NatArray(c)
+
+    /// Raw binary encoding, as 8 byte little-endian elements. This is
+    /// the stowed form for large arrays, e.g. via VRef.stow codec.
+    let toBytes (a:NatArray) : ByteString =
+        let bytes = Array.zeroCreate (8 * a.Length)
+        if System.BitConverter.IsLittleEndian
+            then System.Buffer.BlockCopy(a.Data, 8 * a.Offset, bytes, 0, bytes.Length)
+            else
+                for ix = 0 to (a.Length - 1) do
+                    let x = a.[ix]
+                    for b = 0 to 7 do
+                        bytes.[(8 * ix) + b] <- byte ((x >>> (8 * b)) &&& 0xFFUL)
+        BS.unsafeCreateA bytes
+
+    /// Parse the raw binary encoding.
+    let ofBytes (s:ByteString) : NatArray =
+        if (0 <> (s.Length % 8)) then invalidArg "s" "not an array of naturals" else
+        let arr = Array.zeroCreate (s.Length / 8)
+        if System.BitConverter.IsLittleEndian
+            then System.Buffer.BlockCopy(s.UnsafeArray, s.Offset, arr, 0, s.Length)
+            else
+                for ix = 0 to (arr.Length - 1) do
+                    let mutable x = 0UL
+                    for b = 7 downto 0 do
+                        x <- (x <<< 8) ||| uint64 (s.[(8 * ix) + b])
+                    arr.[ix] <- x
+        NatArray(arr)
+
+    /// Codec for a whole binary, e.g. a stowed array resource.
+    let codec =
+        { new Codec<NatArray> with
+            member __.Write a dst = ByteStream.writeBytes (toBytes a) dst
+            member __.Read db src = ofBytes (ByteStream.readRem src)
+            member __.Compact db a = struct(a, uint64 (8 * a.Length))
+        }
+
+    /// Stow an array as a raw binary resource.
+    let inline stow (db:Stowage) (a:NatArray) : VRef<NatArray> = VRef.stow codec db a
@@ -160,7 +160,7 @@ module Parser =
         }
     let inline makeParseState cx ns p = 
         { cx = cx; ns = ns; p = p }
-    let inline parsedOp st op =
+    let parsedOp st op =
         let ns_op = wrapNS (st.ns) op // add pending ns to operation
         makeParseState (st.cx) [] (ns_op::(st.p))
     let inline parsedTok st tok = parsedOp st (Atom tok)
@@ -233,7 +233,7 @@ module Parser =
             match st.cx with
             | Some bcx ->
                 let op = Block (List.rev (st.p))
-                parse' (parsedOp op bcx) (BS.unsafeTail s)
+                parse' (parsedOp bcx op) (BS.unsafeTail s)
             | None -> finiParse st s
         else if isWordStart c0 then
             let struct(w,s') = BS.span isWordChar s
@@ -245,6 +245,200 @@ module Parser =
             | Some (struct(tok,s')) -> parse' (parsedTok st tok) s'
             | None -> finiParse st s
 
+    /// Entry types for a flat parse. Atoms use the same codes as TT.
+    /// A Block entry is followed by its content, and an NS entry is
+    /// followed by the action in its namespace.
+    type FT =
+        | Word=0
+        | Anno=1
+        | Nat=2
+        | Text=3
+        | BinRef=4
+        | CodeRef=5
+        | Block=6
+        | NS=7
+
+    /// An entry in a flat parse. Off and Len locate the token within
+    /// the source, excluding punctuation, or the content of a block
+    /// between brackets. End is the index after this entry and every
+    /// entry it contains, so blocks and namespaces are index ranges.
+    [<Struct>]
+    type FTok =
+        val Type : FT
+        val Off : int
+        val mutable Len : int
+        val mutable End : int
+        new(tt,off,len,e) = { Type = tt; Off = off; Len = len; End = e }
+
+    /// A program parsed into a flat array of entries in program order,
+    /// referring back to the source without copying.
+    type Flat =
+        { src  : ByteString
+          toks : FTok[]
+        }
+
+    /// The token or block content bytes for an entry.
+    let inline flatBytes (f:Flat) (ix:int) : ByteString =
+        let t = f.toks.[ix]
+        BS.unsafeCreate (f.src.UnsafeArray) (f.src.Offset + t.Off) (t.Len)
+
+    // byte classes for the tokenizer
+    type private CC =
+        | None=0uy
+        | Word=1uy      // [a-z]
+        | Num=2uy       // [0-9]
+        | Dash=3uy      // '-'
+        | SP=4uy
+        | Open=5uy      // '['
+        | Close=6uy     // ']'
+        | Text=7uy      // '"'
+        | Anno=8uy      // '('
+        | BinRef=9uy    // '%'
+        | CodeRef=10uy  // '$'
+
+    let private byteClass : CC[] =
+        let cc (c:byte) =
+            if isWordStart c then CC.Word
+            elif isNumChar c then CC.Num
+            else
+                match char c with
+                | '-' -> CC.Dash
+                | ' ' -> CC.SP
+                | '[' -> CC.Open
+                | ']' -> CC.Close
+                | '"' -> CC.Text
+                | '(' -> CC.Anno
+                | '%' -> CC.BinRef
+                | '$' -> CC.CodeRef
+                | _ -> CC.None
+        Array.init 256 (fun ix -> cc (byte ix))
+
+    let inline private isWordByte (c:byte) : bool =
+        let k = byteClass.[int c]
+        (CC.Word = k) || (CC.Num = k) || (CC.Dash = k)
+
+    /// Tokenize a program in one pass, into a flat array of entries.
+    /// This accepts the same language as `parse`, and returns None if
+    /// the program does not parse.
+    let tokenize (s:ByteString) : Flat option =
+        let arr = s.UnsafeArray
+        let o = s.Offset
+        let stop = o + s.Length
+        let mutable toks : FTok[] = Array.zeroCreate (max 8 (s.Length / 3))
+        let mutable cnt = 0
+        let blocks = new Stack<struct(int * int)>() // open block, nsBase
+        let ns = new List<int>() // pending NS entries
+        let mutable nsBase = 0   // pending NS entries of outer blocks
+        let mutable ok = true
+        let mutable ix = o
+        let inline emit tt off len =
+            if (cnt = toks.Length) then System.Array.Resize(&toks, 2 * cnt)
+            toks.[cnt] <- FTok(tt, off - o, len, cnt + 1)
+            cnt <- cnt + 1
+        let inline complete () = // an action ended, closing its namespaces
+            while (ns.Count > nsBase) do
+                toks.[ns.[ns.Count - 1]].End <- cnt
+                ns.RemoveAt(ns.Count - 1)
+        let inline scanWord ix =
+            let mutable e = ix
+            while (e < stop) && (isWordByte arr.[e]) do e <- e + 1
+            e
+        let inline sep e = (e = stop) || not (isWordByte arr.[e])
+        while ok && (ix < stop) do
+            let c = arr.[ix]
+            match byteClass.[int c] with
+            | CC.SP ->
+                // permitted between actions, not after a namespace
+                if (ns.Count > nsBase) then ok <- false else
+                ix <- ix + 1
+            | CC.Open ->
+                emit FT.Block (ix + 1) 0
+                blocks.Push(struct(cnt - 1, nsBase))
+                nsBase <- ns.Count
+                ix <- ix + 1
+            | CC.Close ->
+                if (0 = blocks.Count) || (ns.Count > nsBase) then ok <- false else
+                let struct(b,nsb) = blocks.Pop()
+                toks.[b].Len <- (ix - o) - toks.[b].Off
+                toks.[b].End <- cnt
+                nsBase <- nsb
+                complete ()
+                ix <- ix + 1
+            | CC.Word ->
+                let e = scanWord ix
+                if (e < stop) && (byte '/' = arr.[e]) then
+                    emit FT.NS ix (e - ix)
+                    ns.Add(cnt - 1)
+                    ix <- e + 1
+                else
+                    emit FT.Word ix (e - ix)
+                    complete ()
+                    ix <- e
+            | CC.Num ->
+                let mutable e = ix
+                while (e < stop) && (isNumChar arr.[e]) do e <- e + 1
+                if ((e - ix) > 1) && (byte '0' = c) || not (sep e) then ok <- false else
+                emit FT.Nat ix (e - ix)
+                complete ()
+                ix <- e
+            | CC.Text ->
+                let mutable e = ix + 1
+                while (e < stop) && (isTextChar arr.[e]) do e <- e + 1
+                if (e = stop) || (byte '"' <> arr.[e]) then ok <- false else
+                emit FT.Text (ix + 1) (e - ix - 1)
+                complete ()
+                ix <- e + 1
+            | CC.Anno ->
+                let e = scanWord (ix + 1)
+                let valid = (e > (ix + 1)) && (isWordStart arr.[ix + 1])
+                         && (e < stop) && (byte ')' = arr.[e])
+                if not valid then ok <- false else
+                emit FT.Anno (ix + 1) (e - ix - 1)
+                complete ()
+                ix <- e + 1
+            | CC.BinRef | CC.CodeRef ->
+                let mutable e = ix + 1
+                while (e < stop) && (RscHash.isHashByte arr.[e]) do e <- e + 1
+                if (RscHash.size <> (e - ix - 1)) || not (sep e) then ok <- false else
+                let tt = if (CC.BinRef = byteClass.[int c]) then FT.BinRef else FT.CodeRef
+                emit tt (ix + 1) (e - ix - 1)
+                complete ()
+                ix <- e
+            | _ -> ok <- false
+        if not ok || (blocks.Count > 0) || (ns.Count > 0) then None else
+        if (cnt < toks.Length) then System.Array.Resize(&toks, cnt)
+        Some { src = s; toks = toks }
+
+    /// Build a Program from a flat parse. This uses an explicit stack
+    /// for blocks, so deep nesting does not consume the .Net stack.
+    let toProgram (f:Flat) : Program =
+        let ts = f.toks
+        let stack = new Stack<struct(Action list * Word list * int)>()
+        let mutable p = []      // reverse-ordered actions in block
+        let mutable ns = []     // pending namespace words
+        let mutable blockEnd = ts.Length
+        let closeBlocks ix =
+            while (ix = blockEnd) && (stack.Count > 0) do
+                let struct(pp,pns,pe) = stack.Pop()
+                p <- (wrapNS pns (Block (List.rev p)) :: pp)
+                ns <- []
+                blockEnd <- pe
+        for ix = 0 to (ts.Length - 1) do
+            closeBlocks ix
+            let t = ts.[ix]
+            match t.Type with
+            | FT.Block ->
+                stack.Push(struct(p, ns, blockEnd))
+                p <- []
+                ns <- []
+                blockEnd <- t.End
+            | FT.NS -> ns <- (flatBytes f ix :: ns)
+            | tt ->
+                p <- (wrapNS ns (Atom (tok (enum<TT> (int tt)) (flatBytes f ix))) :: p)
+                ns <- []
+        closeBlocks (ts.Length)
+        List.rev p
+
     /// Parse from a ByteString.
     ///
     /// I assume Awelon programs are relatively small, up to a few dozen
@@ -252,9 +446,13 @@ module Parser =
     /// code, do so at the dictionary layer to simplify caching, forking,
     /// versioning, review, undo, and editing of the stream. Individual
     /// definitions should still be small.
-    let inline parse (s:ByteString) : ParseResult =
-        let st0 = makeParseState None [] []
-        parse' st0 s
+    ///
+    /// Programs are tokenized first. Only on failure do we run `parse'`
+    /// to report the parser state at the error.
+    let parse (s:ByteString) : ParseResult =
+        match tokenize s with
+        | Some f -> ParseOK (toProgram f)
+        | None -> parse' (makeParseState None [] []) s
 
     /// Write a single token. The token bytestring excludes the
     /// surrounding punctuation, so we'll add that back in. This
@@ -319,7 +517,7 @@ module Parser =
 
     /// Write to byte string. (Trivially wraps write'.)
     let inline write (p:Program) : ByteString = 
-        ByteStream.write (write' p) 
+        ByteStream.writeCopy (write' p) 
 
 
     /// A cursor represents a location within an "open" program. This
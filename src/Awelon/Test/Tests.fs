@@ -13,7 +13,7 @@ open Data.ByteString
 let ps s =
     match Parser.parse (BS.fromString s) with
     | Parser.ParseOK p -> BS.toString (Parser.write p)
-    | Parser.ParseFail st -> BS.toString (BS.cons (byte '?') (st.s))
+    | Parser.ParseFail (_,rem) -> BS.toString (BS.cons (byte '?') rem)
 
 // Shuffle an array for various tests.
 let shuffle (rng:System.Random) (a : 'T[]) : unit =
@@ -58,9 +58,337 @@ let ``basic parser tests`` () =
     Assert.Equal(asBin, ps asBin)
     Assert.Equal(asRsc, ps asRsc)
 
-// TODO: test interpreters
+[<Fact>]
+let ``flat tokenizer`` () =
+    // the tokenizer accepts the same programs as the reference parser
+    let slow s = 
+        match Parser.parse' (Parser.makeParseState None [] []) s with
+        | Parser.ParseOK p -> Some (Parser.write p)
+        | Parser.ParseFail _ -> None
+    let fast s = Option.map (Parser.toProgram >> Parser.write) (Parser.tokenize s)
+    let h = BS.toString (RscHash.hash (BS.fromString "test"))
+    let frags = [| "a"; "b1"; "x-y"; "0"; "12"; "03"; " "; "  "; "["; "]"; "/"; "(";
+                   ")"; "\""; "(nat)"; "\"txt\""; "%" + h; "$" + h; "$abc"; "@"; "d/" |]
+    let rng = new System.Random(9)
+    for _ in 1 .. 20000 do
+        let s = String.concat "" [ for _ in 1 .. rng.Next(12) -> frags.[rng.Next(frags.Length)] ]
+        Assert.Equal(slow (BS.fromString s), fast (BS.fromString s))
+
+    // blocks and namespaces are index ranges
+    match Parser.tokenize (BS.fromString "a/b/[x [y]] 42 (z)") with
+    | None -> failwith "parse failure"
+    | Some f ->
+        let types = f.toks |> Array.map (fun t -> t.Type) |> List.ofArray
+        Assert.Equal<Parser.FT list>([Parser.FT.NS; Parser.FT.NS; Parser.FT.Block; Parser.FT.Word;
+                                      Parser.FT.Block; Parser.FT.Word; Parser.FT.Nat; Parser.FT.Anno], types)
+        Assert.Equal<int list>([6; 6; 6; 4; 6; 6; 7; 8], f.toks |> Array.map (fun t -> t.End) |> List.ofArray)
+        Assert.Equal("x [y]", BS.toString (Parser.flatBytes f 2))
+        Assert.Equal("z", BS.toString (Parser.flatBytes f 7))
+
+    // deep nesting does not use the .Net stack
+    let deep = String.replicate 100000 "[" + String.replicate 100000 "]"
+    Assert.Equal(deep, ps deep)
+
+// a minimal prelude for interpreter tests
+let testPrelude =
+    [ "w", "(a2) [] b a (accel)"
+      "i", "[] w a d (accel)"
+      "z", "[[(a3) c i] b (eq-z) [c] a b w i](a3) c i (accel)"
+      "repeat", "(accel) (error)"
+      "succ", "(accel) (error)"
+      "nat-add", "(accel) (error)"
+      "nat-mul", "(accel) (error)"
+      "true", "[a d]"
+      "false", "[d i]"
+      "swap-twice", "w w"
+    ]
+
+let testEnv (defs : (string * string) list) : Interpret.Env =
+    let m = defs |> List.map (fun (w,d) -> (BS.fromString w, BS.fromString d))
+                 |> Map.ofList
+    Interpret.env (fun w -> Map.tryFind w m)
+
+// evaluate then print, with an effort quota
+let evalq (env:Interpret.Env) (quota:int64) (s:string) : string =
+    match Parser.parse (BS.fromString s) with
+    | Parser.ParseOK p -> 
+        let struct(p',_) = Interpret.eval' env quota p
+        BS.toString (Parser.write p')
+    | Parser.ParseFail _ -> invalidArg "s" "parse failure"
+
+let eval env s = evalq env System.Int64.MaxValue s
+
+[<Fact>]
+let ``interpreter primitives`` () =
+    let e = testEnv testPrelude
+    Assert.Equal("", eval e "")
+    Assert.Equal("b1 [a1]", eval e "[a1] [b1] a")
+    Assert.Equal("[[a1] b1]", eval e "[a1] [b1] b")
+    Assert.Equal("[a1] [a1]", eval e "[a1] c")
+    Assert.Equal("[a1]", eval e "[a1] [b1] d")
+    Assert.Equal("[b1] [a1]", eval e "[a1] [b1] w")
+    Assert.Equal("[a1] [b1]", eval e "[a1] [b1] swap-twice")
+    Assert.Equal("x y", eval e "[x y] i")
+    Assert.Equal("[true]", eval e "true [] b")
+    Assert.Equal("[b1]", eval e "[[a1]] [[b1]] true i")
+    Assert.Equal("[a1]", eval e "[[a1]] [[b1]] false i")
+    Assert.Equal("1 (error) 2", eval e "1 (error) 2")
+    Assert.Equal("[a1] (a2) [b1]", eval e "[a1] (a2) [b1]")
+    Assert.Equal("d/x [1]", eval e "[1] d/[x] a")
+    Assert.Equal("[[x] 2 succ]", eval e "[x] 3 b")
+    Assert.Equal("[[x] 104 \"ello\" cons]", eval e "[x] \"hello\" b")
+
+[<Fact>]
+let ``interpreter accelerators`` () =
+    let e = testEnv testPrelude
+    Assert.Equal("5", eval e "2 3 nat-add")
+    Assert.Equal("42", eval e "6 7 nat-mul")
+    Assert.Equal("43", eval e "42 succ")
+    Assert.Equal("4000", eval e "0 [4 nat-add] 1000 repeat")
+    Assert.Equal("[x]", eval e "[x] [f] 0 repeat")
+    Assert.Equal("[x] f [f] 2 repeat", eval e "[x] [f] 3 repeat")
+    Assert.Equal("[a1]", eval e "[a1] [d] z")
+    Assert.Equal("[a1] [[] z]", eval e "[a1] [] z")
+    // accelerators fall back to the reference definition 
+    Assert.Equal("[x] 1 (error)", eval e "[x] 1 nat-add")
+    Assert.Equal("18446744073709551615 1 (error)", eval e "18446744073709551615 1 nat-add")
+    // accelerators require the (accel) annotation
+    let e' = testEnv (("nat-add", "[a d]") :: testPrelude)
+    Assert.Equal("2 3 [a d]", eval e' "2 3 [a d]")
+
+[<Fact>]
+let ``interpreter quota`` () =
+    let e = testEnv testPrelude
+    let omega = "[c i] c i"
+    Assert.Equal(omega, evalq e 0L omega)
+    let p = BS.fromString omega |> Parser.parse
+    match p with 
+    | Parser.ParseOK prog ->
+        let struct(p', halt) = Interpret.eval' e 10000L prog
+        Assert.Equal(Interpret.Halt.Quota, halt)
+        let struct(_, halt') = Interpret.eval' e 10000L p'
+        Assert.Equal(Interpret.Halt.Quota, halt')
+    | _ -> Assert.True(false)
+
+[<Fact>]
+let ``interpreter repeat10M`` () =
+    let e = testEnv testPrelude
+    let sw = System.Diagnostics.Stopwatch.StartNew()
+    let r = eval e "0 [4 nat-add] 10000000 repeat"
+    sw.Stop()
+    printfn "bench.repeat10M: %A ms" (sw.Elapsed.TotalMilliseconds)
+    Assert.Equal("40000000", r)
+
+[<Fact>]
+let ``interpreter jit tier`` () =
+    let defs =
+        [ "add4", "4 nat-add"
+          "stuck", "1 2 nat-add undef 3"
+          "twice", "c [i] b i"
+          "d/foo", "bar 1"
+          "d/bar", "2"
+          "prims", "(a2) [x] b c d w"
+          "pick", "[1] [2] true i 41 succ"
+        ] @ testPrelude
+    let e = testEnv defs
+    // upgrade synchronously, on first call
+    e.TierThreshold <- 1
+    e.Tier <- Jit.upgrade
+    let progs =
+        [ "0 [add4] 1000 repeat"
+          "stuck stuck"
+          "[x] twice"
+          "[add4] twice"
+          "5 [add4] twice"
+          "d/foo d/foo"
+          "[x] 1 add4"
+          "5 6 prims"
+          "6 prims"
+          "pick"
+          "[y] pick b"
+        ]
+    let ref = testEnv defs
+    for p in progs do
+        let expect = eval ref p
+        Assert.Equal(expect, eval e p) // compiles
+        Assert.Equal(expect, eval e p) // runs compiled
+    Assert.Equal("4000", eval e "0 [add4] 1000 repeat")
+    Assert.Equal("3 undef 3", eval e "stuck")
+    Assert.Equal("2 1", eval e "d/foo")
+    Assert.Equal("[6 x] 5", eval e "5 6 prims")
+    Assert.Equal("6 (a2) [x] b c d w", eval e "6 prims")
+    Assert.Equal("2 42", eval e "pick")
+
+[<Fact>]
+let ``interpreter jit deep recursion`` () =
+    // a chain of non-tail calls, far deeper than the CLR stack
+    let n = 100000
+    let defs =
+        [ for i in 0 .. (n - 1) -> (sprintf "w%d" i, sprintf "w%d 1 d" (i + 1)) ]
+            @ [ (sprintf "w%d" n, "7") ] @ testPrelude
+    let e = testEnv defs
+    e.TierThreshold <- 1
+    e.Tier <- Jit.upgrade
+    let ref = testEnv defs
+    Assert.Equal("7", eval ref "w0")
+    Assert.Equal("7", eval e "w0") // compiles
+    Assert.Equal("7", eval e "w0") // runs compiled
+    Assert.Equal("7", eval e "[w0] i")
+    Assert.True(List.isEmpty (Jit.failures ()))
+
+[<Fact>]
+let ``interpreter kpn`` () =
+    let defs = ("count", "[1 nat-add] 100000 repeat") :: testPrelude
+    let e = testEnv defs
+    KPN.enable (new KPN.Scheduler()) e
+    let ref = testEnv defs
+    Assert.Equal("[1 2 nat-add]", eval ref "[1 2 nat-add](par)")
+    Assert.Equal("[3]", eval e "[1 2 nat-add](par)")
+    Assert.Equal("[6] [6]", eval e "[2 3 nat-mul](par) c")
+    Assert.Equal("[[x] 3]", eval e "[x] [1 2 nat-add](par) b")
+    Assert.Equal("5", eval e "[2 3 nat-add](par) i (nat)")
+    Assert.Equal("true", eval e "true (par)")
+    Assert.Equal("[3 x]", eval e "[1 2 nat-add x](par)")
+    Assert.Equal("[3]", eval e "[1 2 nat-add](par) (par)")
+
+    // a repeated (par) leaves a pending Future alone
+    let eLazy = testEnv defs
+    KPN.enable (new KPN.Scheduler(0)) eLazy
+    let m = new Interpret.Machine(eLazy, System.Int64.MaxValue)
+    let run (s:string) =
+        match Parser.parse (BS.fromString s) with
+        | Parser.ParseOK p -> m.Code <- eLazy.Compile p; m.PC <- 0; m.Run()
+        | _ -> invalidArg "s" "parse failure"
+    run "[1 2 nat-add](par)"
+    let f0 = m.Data.[0]
+    run "(par)"
+    Assert.True(obj.ReferenceEquals(f0, m.Data.[0]))
+    match f0 with
+    | Interpret.Future f -> Assert.False(f.IsDone)
+    | _ -> Assert.True(false)
+
+    // independent and pipelined processes agree with the reference
+    let progs =
+        [ "[0 count](par) [1 count](par) i w i nat-add"
+          "[0 count](par) [i count](par) b [i count](par) b i"
+          "0 [[0 count](par) i nat-add] 20 repeat"
+          "[0 count](par) [x] w d"
+        ]
+    for p in progs do
+        let expect = eval ref p
+        for _ in 1 .. 10 do
+            Assert.Equal(expect, eval e p)
+
+    // a quota applies to each process, deterministically
+    let omega = "[[c i] c i](par) [x] b"
+    let r = evalq e 1000L omega
+    for _ in 1 .. 10 do
+        Assert.Equal(r, evalq e 1000L omega)
+
+    // processes share the parent's quota, and the parent is charged
+    // only for the steps that a forced process used
+    let spawnRun (env:Interpret.Env) (quota:int64) (s:string) =
+        match Parser.parse (BS.fromString s) with
+        | Parser.ParseOK p ->
+            let m = new Interpret.Machine(env, quota)
+            m.Code <- env.Compile p
+            m.Run()
+            m
+        | _ -> invalidArg "s" "parse failure"
+    let futures (m:Interpret.Machine) =
+        [ for ix in 0 .. (m.SP - 1) do
+            match m.Data.[ix] with
+            | Interpret.Future f -> yield f
+            | _ -> () ]
+    let mw = spawnRun e 10000L "[[c i] c i](par) [[c i] c i](par) [[c i] c i](par) [[c i] c i](par)"
+    Assert.Equal(4, List.length (futures mw))
+    for f in futures mw do mw.Force f |> ignore
+    Assert.True(mw.Steps <= 10000L)
+    Assert.True(futures mw |> List.sumBy (fun f -> f.Used) < 10000L)
+    let ms = spawnRun e 10000L "[1 2 nat-add](par)"
+    Assert.True(ms.Steps >= 5000L) // reserved
+    futures ms |> List.iter (ms.Force >> ignore)
+    Assert.True(ms.Steps < 100L) // refunded
+
+    // a parent that runs out of quota reclaims the steps its processes
+    // didn't use, even for a dropped Future that is never forced
+    let dropped = "[1 2 nat-add](par) d [1 2 nat-add](par) d 0 [1 nat-add] 2000 repeat"
+    let mq = spawnRun e 10000L dropped
+    Assert.Equal(Interpret.Halt.Done, mq.Halt)
+    Assert.True(mq.Steps < 10000L)
+    for _ in 1 .. 10 do
+        Assert.Equal("2000", evalq e 10000L dropped)
+
+    // background work on a process is capped, and a forced process
+    // resumes where it paused
+    let eCap = testEnv defs
+    KPN.enable (new KPN.Scheduler(4, 100L)) eCap
+    let mc = spawnRun eCap System.Int64.MaxValue "[0 [1 nat-add] 5000 repeat](par) [[c i] c i](par)"
+    System.Threading.Thread.Sleep(100)
+    match futures mc with
+    | [f; omega] ->
+        Assert.False(omega.IsDone)
+        Assert.Equal("[5000]", BS.toString (Parser.write [Interpret.valueAction (mc.Force f)]))
+    | _ -> Assert.True(false)
+
+    // with no capacity, processes run on demand
+    let e0 = testEnv defs
+    KPN.enable (new KPN.Scheduler(0)) e0
+    for p in progs do
+        Assert.Equal(eval ref p, eval e0 p)
+
+// nested `[1 [2 [null] cons] cons]` list of nats
+let natList (ns:uint64 list) : string =
+    List.foldBack (fun n t -> sprintf "[%d %s cons]" n t) ns "[null]"
+
+[<Fact>]
+let ``interpreter nat arrays`` () =
+    let defs = 
+        [ "nats-sum", "(accel) (error)"
+          "nats-dot", "(accel) (error)"
+          "nats-add", "(accel) (error)"
+          "nats-mul", "(accel) (error)"
+          "nats-matmul", "(accel) (error)"
+        ] @ testPrelude
+    let e = testEnv defs
+    let l = natList [1UL; 2UL; 3UL]
+    Assert.Equal(l, eval e (l + " (nats)"))
+    Assert.Equal("6", eval e (l + " (nats) nats-sum"))
+    Assert.Equal("294", eval e "\"abc\" (nats) nats-sum")
+    Assert.Equal("5", eval e "[null] 3 w [cons] b b 2 w [cons] b b (nats) nats-sum")
+    Assert.Equal("[x] (nats)", eval e "[x] (nats)")
+    Assert.Equal("1 " + natList [2UL; 3UL] + " cons", eval e (l + " (nats) i"))
+    Assert.Equal("19403", eval e "\"ab\" (nats) \"cd\" (nats) nats-dot")
+    Assert.Equal(natList [11UL; 12UL; 13UL], eval e (l + " (nats) 10 nats-add"))
+    Assert.Equal(natList [2UL; 4UL; 6UL], eval e (l + " (nats) 2 nats-mul"))
+    let a = natList [1UL; 2UL; 3UL; 4UL]
+    let b = natList [5UL; 6UL; 7UL; 8UL]
+    Assert.Equal(natList [19UL; 22UL; 43UL; 50UL], 
+                 eval e (a + " (nats) " + b + " (nats) 2 nats-matmul"))
 
-let testDefStr n = 
+    // reference definitions on overflow or unpacked arguments
+    let big = natList [System.UInt64.MaxValue; 1UL]
+    Assert.Equal(big + " (error)", eval e (big + " (nats) nats-sum"))
+    Assert.Equal(l + " (error)", eval e (l + " nats-sum"))
+
+    // kernels agree with naive computations
+    let rng = new System.Random(7)
+    let arr n = NatArray(Array.init n (fun _ -> uint64 (rng.Next(1000))))
+    let x = arr 1001
+    let y = arr 1001
+    Assert.Equal(Array.sum (NatArray.toArray x), NatArray.sum x)
+    Assert.Equal(Array.map2 (*) (NatArray.toArray x) (NatArray.toArray y) |> Array.sum, NatArray.dot x y)
+    let ma = arr (3 * 5)
+    let mb = arr (5 * 4)
+    let naive = Array.init (3 * 4) (fun ix ->
+        let i = ix / 4
+        let j = ix % 4
+        List.sum [ for k in 0 .. 4 -> ma.[i * 5 + k] * mb.[k * 4 + j] ])
+    Assert.Equal<uint64[]>(naive, NatArray.toArray (NatArray.matmul 5 ma mb))
+    let xs = NatArray.sub x 3 500
+    Assert.Equal<uint64[]>(NatArray.toArray xs, NatArray.toArray (NatArray.ofBytes (NatArray.toBytes xs)))
+
+let testDefStr n =
     let s = if (0 = n) then "[zero]" else
             "[" + string (n - 1) + " succ] (nat)"
     BS.fromString s
@@ -102,6 +430,175 @@ let ``simple dict tests`` () =
     Assert.False(has 200 d30)
     Assert.Equal(11, Seq.length (Dict.toSeq d30)) // 30,300,301,302,..309
 
+[<Fact>]
+let ``bytemap vs map`` () =
+    let rng = new System.Random(1)
+    let mutable m = Map.empty
+    let mutable bm = ByteMap.empty
+    for i = 1 to 20000 do
+        let k = byte (rng.Next(256))
+        // bias towards removal for some periods, to shrink nodes
+        if (rng.Next(100) < (if (0 = ((i / 1000) % 2)) then 30 else 70)) then
+            m <- Map.remove k m
+            bm <- ByteMap.remove k bm
+        else
+            m <- Map.add k i m
+            bm <- ByteMap.add k i bm
+        Assert.Equal(Map.count m, ByteMap.count bm)
+        Assert.Equal(Map.tryFind k m, ByteMap.tryFind k bm)
+        if (0 = (i % 100)) then
+            Assert.Equal<(byte * int) list>(Map.toList m, List.ofSeq (ByteMap.toSeq bm))
+            let odd = ByteMap.filter (fun k _ -> (0uy <> (k &&& 1uy))) bm
+            Assert.Equal(Map.count (Map.filter (fun k _ -> (0uy <> (k &&& 1uy))) m), ByteMap.count odd)
+    // representation is canonical
+    let bm' = Map.fold (fun s k v -> ByteMap.add k v s) ByteMap.empty m
+    Assert.Equal(bm, bm')
+
+[<Fact>]
+let ``sorted dict build`` () =
+    let rng = new System.Random(1)
+    let a = [| 1 .. 5000 |]
+    shuffle rng a
+    let d = Array.fold (flip addN) Dict.empty a
+            |> Dict.dropPrefix (bs 12)
+            |> Array.foldBack remN (Array.sub a 0 1000)
+    let ents = Array.ofSeq (Dict.toSeqEnt d)
+    Assert.True(Dict.isSortedEnts ents)
+    Assert.False(Dict.isSortedEnts (Array.rev ents))
+    Assert.Equal<ByteString>(Dict.write d, Dict.write (Dict.fromSortedEnts ents))
+    Assert.Equal<ByteString>(Dict.write d, Dict.write (Dict.fromArrayEnt (Array.rev ents)))
+
+    // unnecessary deletions are erased as for fromSeqEnt
+    let def s = Some (Dict.Def(BS.fromString s))
+    let ents' =
+        [| Dict.Define (bs "a", None)
+           Dict.Define (bs "b", def "x")
+           Dict.Direct (bs "c", None)
+           Dict.Define (bs "c", def "y")
+           Dict.Define (bs "cd", None)
+           Dict.Direct (bs "e", None)
+        |]
+    Assert.True(Dict.isSortedEnts ents')
+    let dS = Dict.fromSortedEnts ents'
+    Assert.Equal<ByteString>(Dict.write (Dict.fromSeqEnt ents'), Dict.write dS)
+    Assert.Equal("2", string (Dict.sizeEnts dS))
+
+let dictOf (defs : (string * string) list) : Dict =
+    let addDef d (w,s) = Dict.add (BS.fromString w) (Dict.Def(BS.fromString s)) d
+    List.fold addDef Dict.empty defs
+
+[<Fact>]
+let ``dict index`` () =
+    let defs =
+        [ "foo", "bar baz"
+          "bar", "1 [c] a"
+          "baz", "bar (nat) undef"
+          "qux", "42"
+          "d/x", "y e/[z]"
+          "d/y", "2"
+          "p", "q"
+          "q", "p qux"
+        ]
+    let d = dictOf defs
+    let ix = DictIndex.build d
+    let clients w = DictIndex.clients (bs w) ix |> Seq.map BS.toString |> List.ofSeq
+    let ver w = DictIndex.version (bs w) ix
+    Assert.Equal<string list>(["baz"; "foo"], clients "bar")
+    Assert.Equal<string list>(["baz"], clients "undef")
+    Assert.Equal<string list>(["d/x"], clients "d/y")
+    Assert.Equal<string list>(["d/x"], clients "d/e/z")
+    Assert.Equal<string list>([], clients "c")
+    Assert.True(Option.isNone (ver "undef"))
+    for (w,_) in defs do
+        Assert.True(Option.isSome (ver w))
+    Assert.NotEqual(ver "p", ver "q")
+
+    // incremental update matches a full rebuild
+    let d' = d |> Dict.add (bs "bar") (Dict.Def(BS.fromString "2"))
+               |> Dict.remove (bs "baz")
+               |> Dict.add (bs "undef") (Dict.Def(BS.fromString "3"))
+    let ix' = DictIndex.update d' ix
+    let ixR = DictIndex.build d'
+    let ver' w = DictIndex.version (bs w) ix'
+    for w in ["foo"; "bar"; "baz"; "qux"; "d/x"; "d/y"; "p"; "q"; "undef"] do
+        Assert.Equal(DictIndex.version (bs w) ixR, ver' w)
+    Assert.NotEqual(ver "foo", ver' "foo")
+    Assert.NotEqual(ver "bar", ver' "bar")
+    Assert.Equal(ver "qux", ver' "qux")
+    Assert.Equal(ver "d/x", ver' "d/x")
+    Assert.True(Option.isNone (ver' "baz"))
+    Assert.Equal<string list>(["foo"], DictIndex.clients (bs "bar") ix' |> Seq.map BS.toString |> List.ofSeq)
+
+    // versions within a cycle cover its external dependencies
+    let d'' = d' |> Dict.add (bs "qux") (Dict.Def(BS.fromString "43"))
+    let ix'' = DictIndex.update d'' ix'
+    let ixR' = DictIndex.build d''
+    for w in ["p"; "q"] do
+        Assert.NotEqual(ver' w, DictIndex.version (bs w) ix'')
+        Assert.Equal(DictIndex.version (bs w) ixR', DictIndex.version (bs w) ix'')
+
+    // background indexing
+    let indexer = new DictIndex.Indexer()
+    indexer.Post d
+    indexer.Post d'
+    let ixB = indexer.Sync()
+    Assert.False(indexer.Pending)
+    Assert.Equal(ver' "foo", DictIndex.version (bs "foo") ixB)
+
+[<Fact>]
+let ``dict merge3`` () =
+    let o = dictOf [ "a", "1"; "b", "2"; "c", "3"; "d/x", "4" ]
+    let def w = Dict.tryFind (bs w) >> Option.map (fun (d:Dict.Def) -> BS.toString d.Data)
+    let ours = o |> Dict.add (bs "a") (Dict.Def(bs "10")) |> Dict.remove (bs "d/x")
+    let theirs = o |> Dict.add (bs "b") (Dict.Def(bs "20")) |> Dict.add (bs "e") (Dict.Def(bs "5"))
+    match Dict.merge3 o ours theirs with
+    | None -> failwith "disjoint changes should merge"
+    | Some m ->
+        Assert.Equal(Some "10", def "a" m)
+        Assert.Equal(Some "20", def "b" m)
+        Assert.Equal(Some "3", def "c" m)
+        Assert.Equal(None, def "d/x" m)
+        Assert.Equal(Some "5", def "e" m)
+
+    // identical changes are not conflicts, but different changes are
+    let same = o |> Dict.add (bs "a") (Dict.Def(bs "10"))
+    Assert.True(Option.isSome (Dict.merge3 o ours same))
+    let diff = o |> Dict.add (bs "a") (Dict.Def(bs "11"))
+    Assert.True(Option.isNone (Dict.merge3 o ours diff))
+    let del = o |> Dict.remove (bs "a")
+    Assert.True(Option.isNone (Dict.merge3 o ours del))
+
+[<Fact>]
+let ``wikilon tx read validation`` () =
+    let root = dictOf [ "a", "1"; "p/x", "2" ]
+    let tx0 = Wikilon.DB.TX.empty
+    let struct(va, tx1) = Wikilon.DB.TX.read (bs "a") root tx0
+    let struct(vb, tx2) = Wikilon.DB.TX.read (bs "b") root tx1
+    let struct(dp, tx) = Wikilon.DB.TX.readPrefix (bs "p/") root tx2
+    Assert.True(Option.isSome va)
+    Assert.True(Option.isNone vb)
+    Assert.Equal(1, Seq.length (Dict.toSeq dp))
+    let tx = Wikilon.DB.TX.addWrite (bs "c") (Dict.Def(bs "3")) tx
+    Assert.True(Wikilon.DB.TX.valid root tx)
+
+    // concurrent updates to other symbols do not conflict
+    let other = Dict.add (bs "d") (Dict.Def(bs "4")) root
+    match Wikilon.DB.TX.apply other tx with
+    | None -> failwith "unrelated update should not conflict"
+    | Some r -> Assert.True(Dict.contains (bs "c") r)
+
+    // defining a symbol we read as absent is a conflict
+    let defB = Dict.add (bs "b") (Dict.Def(bs "5")) root
+    Assert.True(Option.isNone (Wikilon.DB.TX.apply defB tx))
+
+    // as is any change under a prefix we read
+    let defP = Dict.add (bs "p/y") (Dict.Def(bs "6")) root
+    Assert.True(Option.isNone (Wikilon.DB.TX.apply defP tx))
+    let delP = Dict.remove (bs "p/x") root
+    Assert.False(Wikilon.DB.TX.valid delP tx)
+    let updA = Dict.add (bs "a") (Dict.Def(bs "7")) root
+    Assert.False(Wikilon.DB.TX.valid updA tx)
+
 // a fixture is needed to load the database
 type TestDB =
     val s : LMDB.Storage
@@ -218,8 +715,344 @@ type DBTests =
 
         // following test takes about 30 seconds on my machine 
         //printfn "size 700k, 100 compactions"
-        //tf.CompactionTest 700000 7000 rng 
-        
+        //tf.CompactionTest 700000 7000 rng
+
+    [<Fact>]
+    member tf.``parallel dict compaction`` () =
+        let rng = new System.Random(15)
+        let a = [| 1 .. 50000 |]
+        shuffle rng a
+        let d0 = Array.fold (flip addN) Dict.empty a
+        let sq = Codec.compact (Dict.node_codec) (tf.Stowage) d0
+        let pr = Codec.compactPar (Dict.node_codec) (tf.Stowage) d0
+        let bytes d = Codec.writeBytes (Dict.node_codec) d
+        Assert.Equal<ByteString>(bytes sq, bytes pr)
+        let d1 = Array.fold (flip remN) pr (Array.sub a 0 5000)
+        Assert.Equal<ByteString>(bytes (Codec.compact (Dict.node_codec) (tf.Stowage) d1),
+                                 bytes (Codec.compactPar (Dict.node_codec) (tf.Stowage) d1))
+
+    [<Fact>]
+    member tf.``prefetching dict traversals`` () =
+        let d0 = seq { for i = 1 to 30000 do yield i } |> Seq.fold (flip addN) Dict.empty
+        let d1 = seq { 1 .. 7 .. 30000 } |> Seq.fold (flip remN) d0
+        let cold d = // reload, so the stowed nodes are not cached
+            let c = Codec.compact (Dict.node_codec) (tf.Stowage) d
+            Codec.readBytes (Dict.node_codec) (tf.Stowage) (Codec.writeBytes (Dict.node_codec) c)
+        let defs s = s |> Seq.map (fun (w,(d:Dict.Def)) -> (w, d.Data)) |> List.ofSeq
+        Assert.Equal<(ByteString * ByteString) list>(defs (Dict.toSeq d0), defs (Dict.toSeqAhead 8 (cold d0)))
+        let vdiffs s = s |> Seq.map fst |> List.ofSeq
+        Assert.Equal<ByteString list>(vdiffs (Dict.diff d0 d1), vdiffs (Dict.diffAhead 8 (cold d0) (cold d1)))
+        Assert.Equal(4286, List.length (vdiffs (Dict.diffAhead 8 (cold d0) (cold d1))))
+
+    [<Fact>]
+    member tf.``test dict index stowage`` () =
+        let d = seq { for i = 1 to 20000 do yield i }
+                |> Seq.fold (flip addN) Dict.empty
+                |> Dict.add (bs "succ") (Dict.Def(BS.fromString "[(succ)]"))
+        let indexer = new DictIndex.Indexer(tf.Stowage)
+        indexer.Post d
+        let ix = indexer.Sync()
+        Assert.Equal(20000, Seq.length (DictIndex.clients (bs "succ") ix))
+        let v = DictIndex.version (bs 12345) ix
+        Assert.True(Option.isSome v)
+        // a change to `succ` changes every version
+        let sw = System.Diagnostics.Stopwatch.StartNew()
+        indexer.Post (Dict.add (bs "succ") (Dict.Def(BS.fromString "[(succ2)]")) d)
+        let ix' = indexer.Sync()
+        printfn "reindex after succ update: %A ms" (sw.Elapsed.TotalMilliseconds)
+        Assert.NotEqual(v, DictIndex.version (bs 12345) ix')
+        // a leaf change affects just that word
+        indexer.Post (Dict.add (bs 12345) (Dict.Def(BS.fromString "0")) (ix'.dict))
+        let ix'' = indexer.Sync()
+        Assert.NotEqual(DictIndex.version (bs 12345) ix', DictIndex.version (bs 12345) ix'')
+        Assert.Equal(DictIndex.version (bs 12346) ix', DictIndex.version (bs 12346) ix'')
+
+    [<Fact>]
+    member tf.``test dict parse large node`` () =
+        // large enough to be parsed in parallel chunks
+        let d = seq { for i = 1 to 100000 do yield i }
+                |> Seq.fold (flip addN) Dict.empty
+                |> remN 777
+        let s = Dict.write d
+        Assert.True(BS.length s > (4 * 256 * 1024))
+        let sw = System.Diagnostics.Stopwatch.StartNew()
+        let d' = Codec.readBytes (Dict.node_codec) (tf.Stowage) s
+        sw.Stop()
+        printfn "parse %A bytes: %A ms" (BS.length s) (sw.Elapsed.TotalMilliseconds)
+        Assert.Equal<ByteString>(s, Dict.write d')
+        Assert.True(Dict.contains (bs 99999) d')
+        Assert.False(Dict.contains (bs 777) d')
+        // bulk build into stowage
+        let ents = Array.ofSeq (Dict.toSeqEnt d)
+        let dC = Dict.compactSortedEnts (tf.Stowage) ents
+        Assert.True(Dict.sizeBytes dC < (BS.length s |> uint64))
+        Assert.True(Seq.forall2 (=) (Dict.toSeq d) (Dict.toSeq dC))
+        Assert.True(Dict.contains (bs 99999) dC)
+        Assert.False(Dict.contains (bs 777) dC)
+        // parse errors are reported as usual
+        let bad = BS.append s (BS.fromString "?oops\n")
+        Assert.Throws<ByteStream.ReadError>(fun () ->
+            Codec.readBytes (Dict.node_codec) (tf.Stowage) bad |> ignore) |> ignore
+
+    [<Fact>]
+    member tf.``test dict search`` () =
+        let rng = new System.Random(3)
+        let parts = [| "list"; "map"; "filter"; "fold"; "nat"; "text"; "zip" |]
+        let word i =
+            let ns = if (0 = (i % 5)) then "lib/" else ""
+            let ps = Array.init (1 + rng.Next(3)) (fun _ -> parts.[rng.Next(parts.Length)])
+            sprintf "%s%s-%d" ns (String.concat "-" ps) i
+        let ws = Array.init 20000 word
+        let cc d = Codec.compact (Dict.node_codec) (tf.Stowage) d
+        let d0 = ws |> Array.fold (fun d w -> Dict.add (bs w) (Dict.Def(bs "0")) d) Dict.empty |> cc
+        let d1 = d0 |> Dict.remove (bs ws.[10]) |> Dict.remove (bs ws.[15])
+                    |> Dict.add (bs "zip-zap-new") (Dict.Def(bs "1"))
+        let expect (fn:string -> bool) (d:Dict) =
+            Dict.toSeq d |> Seq.map fst |> Seq.filter (BS.toString >> fn) |> Array.ofSeq
+        let s = new DictSearch.Searcher()
+        for d in [d0; d1; cc d1] do
+            let ix = DictSearch.index d
+            for q in [ "map-f"; "ip-z"; "st-1"; "b/t"; "zz"; "9"; "-nat-"; "lib/fold-" ] do
+                Assert.Equal<ByteString[]>(expect (fun w -> w.Contains(q)) d, DictSearch.substring s (bs q) ix)
+            for q in [ "-123"; "fold-77"; "9" ] do
+                Assert.Equal<ByteString[]>(expect (fun w -> w.EndsWith(q)) d, DictSearch.suffix s (bs q) ix)
+            for q in [ "lmf"; "zzn"; "lt"; "l"; "f1" ] do
+                let ini w = BS.toString (DictSearch.initials (bs w))
+                Assert.Equal<ByteString[]>(expect (fun w -> (ini w).StartsWith(q)) d, DictSearch.initialism s (bs q) ix)
+        Assert.Equal<ByteString>(bs "lmf1", DictSearch.initials (bs "list-map/filter-12"))
+        Assert.Equal<ByteString[]>([| bs "zip-zap-new" |], DictSearch.substring s (bs "zap") (DictSearch.index d1))
+
+        // node indices are durable, and shared between versions
+        let sD = new DictSearch.Searcher(tf.DB, bs "test-search", 64UL * 1024UL * 1024UL)
+        let q = bs "fold-fold"
+        let r0 = DictSearch.substring sD q (DictSearch.index d0)
+        let sw = System.Diagnostics.Stopwatch.StartNew()
+        let r1 = DictSearch.substring sD q (DictSearch.index d1)
+        printfn "search after fork: %A ms" (sw.Elapsed.TotalMilliseconds)
+        Assert.Equal<ByteString[]>(expect (fun w -> w.Contains("fold-fold")) d1, r1)
+        DictSearch.sync sD
+        let sD' = new DictSearch.Searcher(tf.DB, bs "test-search", 64UL * 1024UL * 1024UL)
+        Assert.Equal<ByteString[]>(r0, DictSearch.substring sD' q (DictSearch.index d0))
+        Assert.True((DCache.stats (Option.get sD'.Durable)).hits > 0UL)
+
+    [<Fact>]
+    member tf.``test dict archive`` () =
+        // stowed nodes, an external definition, and in-memory updates
+        let big = BS.fromString (String.replicate 2000 "big ")
+        let d0 = Seq.init 20000 (fun i -> (sprintf "word-%d" i, sprintf "%d word-%d" i (i / 2)))
+                    |> Seq.fold (fun d (w,s) -> Dict.add (bs w) (Dict.Def(bs s)) d) Dict.empty
+                    |> Dict.add (bs "big") (Dict.externDef (tf.Stowage) (Dict.Def(big)))
+                    |> Dict.compact (tf.Stowage)
+        let d1 = d0 |> Dict.add (bs "new") (Dict.Def(bs "0")) |> Dict.remove (bs "word-7")
+        let mem = new MemoryStream()
+        let ex = Dict.export (tf.Stowage) d1 mem
+        Assert.True(ex.resources > 10L)
+
+        let path = "testDB-archive"
+        clearTestDir path
+        use s2 = new LMDB.Storage(path, 100)
+        let db2 = DB.fromStorage (s2 :> DB.Storage)
+        let tv = db2.Register (bs "dict") (Dict.node_codec)
+        let im = Dict.import db2 (64 * 1024) tv (new MemoryStream(mem.ToArray()))
+        Assert.Equal(ex.resources, im.resources)
+        System.GC.Collect()
+        s2.GC()
+        let d2 = Option.get (db2.Read tv)
+        Assert.Equal<(ByteString * ByteString) list>(
+            Dict.toSeq d1 |> Seq.map (fun (w,d) -> (w, d.Data)) |> List.ofSeq,
+            Dict.toSeq d2 |> Seq.map (fun (w,d) -> (w, d.Data)) |> List.ofSeq)
+        match Dict.tryFind (bs "big") d2 with
+        | Some def -> Assert.Equal<ByteString>(big, (s2 :> Stowage).Load (BS.drop 1 def.Data))
+        | None -> Assert.True(false)
+
+    [<Fact>]
+    member tf.``test type check`` () =
+        let defs =
+            testPrelude @
+            [ "three", "1 succ succ"
+              "add3", "three nat-add"
+              "rot", "[] b b w i"
+              "apply-nat", "1 a"
+              "self-apply", "[c i] c i"
+              "uses-z", "[] [] z"
+              "bad-nat", "\"x\" (nat)"
+              "uses-bad", "bad-nat"
+              "three-i", "3 i"
+              "text-i", "\"hello\" i"
+              "undef", "foo"
+              "d/x", "1"
+              "d/y", "x [x] a"
+              "loop1", "loop2"
+              "loop2", "loop1"
+              "uses-loop", "loop1"
+            ]
+        let d = defs |> List.fold (fun d (w,s) -> Dict.add (bs w) (Dict.Def(bs s)) d) Dict.empty
+        let ix = DictIndex.build d
+        let cache = new TypeCheck.Cache(tf.DB, bs "test-types", 64UL * 1024UL * 1024UL)
+        let ty w = TypeCheck.show (Option.get (TypeCheck.check cache ix (bs w)))
+        Assert.Equal("S a b -- S b a", ty "w")
+        Assert.Equal("S [S -- T] -- T", ty "i")
+        Assert.Equal("S a b -- S a b", ty "swap-twice")
+        Assert.Equal("S -- S [T a [T -- U] -- U]", ty "true")
+        Assert.Equal("S -- S nat", ty "three")
+        Assert.Equal("S nat -- S nat", ty "add3")
+        Assert.Equal("S -- S nat nat", ty "d/y")
+        Assert.Equal("error: expected a number, found a text", ty "bad-nat")
+        // numbers and texts are blocks, typed via undefined `zero` etc.
+        Assert.Equal("untyped: a number as a block", ty "apply-nat")
+        Assert.Equal("untyped: a number as a block", ty "three-i")
+        Assert.Equal("untyped: a text as a block", ty "text-i")
+        Assert.Equal("error: recursive type", ty "self-apply")
+        Assert.Equal("error: undefined word foo", ty "undef")
+        Assert.Equal("untyped: fixpoint", ty "z")
+        Assert.Equal("untyped: depends on z", ty "uses-z")
+        Assert.Equal("error: ill-typed dependency bad-nat", ty "uses-bad")
+        Assert.Equal("error: cyclic definition", ty "loop2")
+        Assert.Equal("error: cyclic definition", ty "loop1")
+        Assert.Equal("untyped: depends on loop1", ty "uses-loop")
+        Assert.True(Option.isNone (TypeCheck.check cache ix (bs "foo")))
+        Assert.Equal("S a b -- S a b", TypeCheck.show (Option.get (TypeCheck.tryFind cache ix (bs "swap-twice"))))
+
+        // `[zero]` and `[2 succ]` have the same type, so `3 i` does too.
+        // Likewise, `[null]` and `[104 "ello" cons]` for a text.
+        let lits = [ "zero", "0 (error)"; "null", "0 \"\" (error)"; "cons", "(a2)" ]
+        let dl = lits |> List.fold (fun d (w,s) -> Dict.add (bs w) (Dict.Def(bs s)) d) d
+        let ixl = DictIndex.update dl ix
+        let tyl w = TypeCheck.show (Option.get (TypeCheck.check cache ixl (bs w)))
+        Assert.Equal("S -- S nat", tyl "three-i")
+        Assert.Equal("S a -- S nat a", tyl "apply-nat")
+        Assert.Equal("S -- S nat text", tyl "text-i")
+        Assert.Equal("error: ill-typed dependency bad-nat", tyl "uses-bad")
+        // a change to `null` affects the type of texts, without a
+        // change to the deep version of `text-i`
+        let ixn = DictIndex.update (Dict.add (bs "null") (Dict.Def(bs "\"\" 0 (error)")) dl) ixl
+        Assert.Equal(DictIndex.version (bs "text-i") ixl, DictIndex.version (bs "text-i") ixn)
+        Assert.Equal("untyped: a text as a block", TypeCheck.show (Option.get (TypeCheck.check cache ixn (bs "text-i"))))
+        Assert.Equal("S -- S nat", TypeCheck.show (Option.get (TypeCheck.check cache ixn (bs "three-i"))))
+
+        // a background checker only checks words with new versions
+        let chain n = seq { for i = 1 to n do yield (sprintf "c%d" i, sprintf "c%d w" (i - 1)) }
+        let d0 = Seq.append (Seq.ofList defs) (Seq.append [("c0", "w")] (chain 5000))
+                |> Seq.fold (fun d (w,s) -> Dict.add (bs w) (Dict.Def(bs s)) d) Dict.empty
+        let ix0 = DictIndex.build d0
+        let checker = new TypeCheck.Checker(new TypeCheck.Cache(tf.DB, bs "test-types-bg", 64UL * 1024UL * 1024UL), 2)
+        checker.Post ix0
+        checker.Sync() |> ignore
+        let n0 = checker.Cache.Checked
+        Assert.True(n0 >= 5000L)
+        Assert.Equal("S a b -- S b a", TypeCheck.show (Option.get (checker.TryFind (bs "c5000"))))
+        let ix1 = DictIndex.update (Dict.add (bs "c4990") (Dict.Def(bs "c4989 1")) d0) ix0
+        checker.Post ix1
+        checker.Sync() |> ignore
+        // 11 words changed, c4990 to c5000. Parallel workers might
+        // check a shared dependency twice, but not much more.
+        let n1 = checker.Cache.Checked - n0
+        Assert.True((11L <= n1) && (n1 < 100L))
+        Assert.Equal("S a b -- S a nat b", TypeCheck.show (Option.get (checker.TryFind (bs "c4995"))))
+        Assert.Equal("S a b -- S b a", TypeCheck.show (Option.get (checker.TryFind (bs "c100"))))
+
+    [<Fact>]
+    member tf.``test index agents`` () =
+        let rx = new Reactive.Reactor(tf.DB)
+        let dv = rx.DB.Allocate (dictOf (testPrelude @ [ "rot", "[w] a w" ]))
+        let ixv = DictIndex.agent rx (DictIndex.compact (tf.Stowage)) dv
+        let sv = DictSearch.agent rx dv
+        let cache = new TypeCheck.Cache(tf.DB, bs "test-types-rx", 64UL * 1024UL * 1024UL)
+        let tv = TypeCheck.agent rx cache 2 ixv
+        let ty w = TypeCheck.tryFind cache (rx.DB.Read tv) (bs w) |> Option.map TypeCheck.show
+        let clients w = DictIndex.clients (bs w) (rx.DB.Read ixv) |> Seq.map BS.toString |> List.ofSeq
+        let search q = DictSearch.substring (new DictSearch.Searcher()) (bs q) (rx.DB.Read sv)
+        rx.Sync()
+        Assert.Equal<string list>(["i"; "rot"; "swap-twice"; "z"], clients "w")
+        Assert.Equal(Some "S a b -- S a b", ty "swap-twice")
+        Assert.Equal<ByteString[]>([| bs "swap-twice" |], search "twice")
+
+        // every index follows a write to the dictionary
+        let n0 = cache.Checked
+        rx.DB.Write dv (Dict.add (bs "once-twice") (Dict.Def(bs "swap-twice w")) (rx.DB.Read dv))
+        rx.Sync()
+        Assert.Equal<string list>(["i"; "once-twice"; "rot"; "swap-twice"; "z"], clients "w")
+        Assert.Equal(Some "S a b -- S b a", ty "once-twice")
+        Assert.Equal<ByteString[]>([| bs "once-twice"; bs "swap-twice" |], search "twice")
+        Assert.Equal(1L, cache.Checked - n0)
+
+    [<Fact>]
+    member tf.``test memo cache`` () =
+        let defs = 
+            testPrelude @
+            [ "three", "1 succ succ"
+              "six", "three three nat-add"
+              "sixsq", "six c nat-mul"
+              "sq", "c nat-mul"
+              "loop", "[c a] c a"
+            ]
+        let tbl = new Memo.Table(tf.DB, BS.fromString "test-memo", 64UL * 1024UL * 1024UL)
+        let plain = testEnv defs
+        let progs = [ "sixsq"; "7 sq"; "[three] six" ]
+        let check (ix:DictIndex.Index) =
+            let e = Memo.env tbl ix
+            for p in progs do
+                Assert.Equal(eval plain p, eval e p)
+            Assert.Equal(evalq plain 1000L "loop", evalq e 1000L "loop")
+        let ix = DictIndex.build (dictOf defs)
+        check ix
+        let s1 = Memo.stats tbl
+        Assert.True(s1.misses > 0UL)
+        Assert.True(s1.count > 0UL)
+        Assert.True(s1.size > 0UL)
+        // a new Env for the same dictionary reuses every evaluation
+        check ix
+        let s2 = Memo.stats tbl
+        Assert.Equal(s1.misses, s2.misses)
+        Assert.True(s2.hits > s1.hits)
+        // an update affects only the transitive clients 
+        let ix' = DictIndex.update (Dict.add (bs "three") (Dict.Def(BS.fromString "3 succ")) (ix.dict)) ix
+        let e' = Memo.env tbl ix'
+        Assert.Equal("64", eval e' "sixsq")
+        Assert.Equal("[three] 8", eval e' "[three] six")
+        let s3 = Memo.stats tbl
+        Assert.Equal(s2.misses + 3UL, s3.misses) // sixsq, six, three
+        // the cache is durable
+        Memo.sync tbl
+        tf.DB.Flush()
+        let tbl' = new Memo.Table(tf.DB, BS.fromString "test-memo", 64UL * 1024UL * 1024UL)
+        Assert.Equal(s3.count, (Memo.stats tbl').count)
+
+        // memo evaluation is charged to the caller, within its quota
+        let run (e:Interpret.Env) (quota:int64) (s:string) : Interpret.Machine =
+            let m = new Interpret.Machine(e, quota)
+            match Parser.parse (BS.fromString s) with
+            | Parser.ParseOK p -> m.Code <- e.Compile p
+            | Parser.ParseFail _ -> invalidArg "s" "parse failure"
+            m.Run()
+            m
+        let tblQ = new Memo.Table(tf.DB, BS.fromString "test-memo-quota", 64UL * 1024UL * 1024UL)
+        let mq = run (Memo.env tblQ ix) 3L "sixsq"
+        Assert.Equal(Interpret.Halt.Quota, mq.Halt)
+        Assert.Equal(0UL, (Memo.stats tblQ).count)
+        let m1 = run (Memo.env tblQ ix) 1000000L "sixsq"
+        let m2 = run (Memo.env tblQ ix) 1000000L "sixsq"
+        Assert.Equal(Interpret.Halt.Done, m1.Halt)
+        Assert.Equal(Interpret.Halt.Done, m2.Halt)
+        Assert.True(m1.Steps > m2.Steps)
+
+        // large residuals are stowed, and the cache root is compacted
+        let big = String.replicate 2000 "x"
+        let defsB = [ "big", sprintf "\"%s\" c d" big ]
+        let ixB = DictIndex.build (dictOf defsB)
+        let keyB = "test-memo-big"
+        let tblB = new Memo.Table(tf.DB, bs keyB, 64UL * 1024UL * 1024UL)
+        let eB = Memo.env tblB ixB
+        Assert.Equal(sprintf "\"%s\"" big, eval eB "big")
+        match DCache.tryFind (Option.get (DictIndex.version (bs "big") ixB)) (tblB.Cache) with
+        | Some ref -> Assert.True(CVRef.isRemote ref)
+        | None -> failwith "expecting a memoized residual"
+        Memo.sync tblB
+        tf.DB.Flush()
+        match tf.Storage.Read (BS.trimBytes (tf.Storage.Mangle (bs keyB))) with
+        | Some root -> Assert.True(BS.length root < 500)
+        | None -> failwith "expecting a durable cache"
+
     // TODO: test splitAtKey, etc.        
         
 
@@ -1,4 +1,9 @@
 namespace Awelon
+open System.Collections.Generic
+open System.Threading
+open System.Threading.Tasks
+open Data.ByteString
+open Stowage
 
 // Awelon language can support static typing based on arities
 // and annotations. However, Awelon does not specify any type
@@ -14,8 +19,629 @@ namespace Awelon
 //
 // - static analysis of arities
 // - accelerated data types
-// - simple type annotations 
+// - simple type annotations
 // - dynamic types for macros
-//  
+//
+// The current model infers a stack effect for each word, with row
+// polymorphism for the rest of the stack. E.g. `w` has type `S a b --
+// S b a`, and `i` has `S [S -- R] -- R`. Numbers and texts are data,
+// but also blocks: `3` is `[2 succ]` and `"hello"` is `[104 "ello"
+// cons]`. Where a number is used as a block, we require `[zero]` and
+// `[N succ]` have the same type, and similarly for texts with `[null]`
+// and `[N T cons]`; otherwise the word is untyped. The `(nat)` and
+// arity annotations add constraints. This is sufficient to find arity errors and simple misuse of data. Some
+// useful words, such as the fixpoint `z` or words that use it, have no
+// type in this model and are reported as untyped rather than wrong.
+//
+// Checking a word requires the types of its transitive dependencies.
+// We cache each result in a DCache, keyed by the word and its deep
+// version (see DictIndex), so a result remains valid for any dictionary
+// with the same transitive definition. After an edit, only words whose
+// version changed are checked again.
+module TypeCheck =
+    type Word = Parser.Word
+
+    /// A value type. Variables are numbered.
+    type Ty =
+        | TVar of int
+        | TNat
+        | TText
+        | TBlock of Row * Row   // a block's stack effect
+    /// A stack type, as a list of types (top first) above a variable
+    /// for the rest of the stack.
+    and Row =
+        | RVar of int
+        | RCons of Ty * Row
+
+    /// A stack effect. Variables are universally quantified.
+    type Effect = { inp : Row; out : Row }
+
+    /// Outcome of type checking a word.
+    type Result =
+        | Typed of Effect       // inferred stack effect
+        | Untyped of string     // unknown, for the given reason
+        | IllTyped of string    // a type error, with a message
+
+    exception private TypeFail of string
+    exception private Unknown of string
+
+    // Substitution state for type inference.
+    type private St =
+        val TS : Dictionary<int,Ty>
+        val RS : Dictionary<int,Row>
+        val mutable Next : int
+        val TypeOf : Word -> Effect     // for zero, succ, null, cons
+        val mutable Expanding : bool    // typing a number or text as a block
+        new(typeOf) =
+            { TS = new Dictionary<int,Ty>(); RS = new Dictionary<int,Row>(); Next = 0
+              TypeOf = typeOf; Expanding = false }
+        member st.Fresh() : int =
+            st.Next <- (st.Next + 1)
+            st.Next
+
+    let rec private resolveT (st:St) (t:Ty) : Ty =
+        match t with
+        | TVar v ->
+            match st.TS.TryGetValue v with
+            | true, t' -> resolveT st t'
+            | _ -> t
+        | _ -> t
+
+    let rec private resolveR (st:St) (r:Row) : Row =
+        match r with
+        | RVar v ->
+            match st.RS.TryGetValue v with
+            | true, r' -> resolveR st r'
+            | _ -> r
+        | _ -> r
+
+    let rec private occursT (st:St) (v:int) (t:Ty) : bool =
+        match resolveT st t with
+        | TVar u -> (u = v)
+        | TBlock (i,o) -> occursR st v i || occursR st v o
+        | _ -> false
+    and private occursR (st:St) (v:int) (r:Row) : bool =
+        match resolveR st r with
+        | RVar u -> (u = v)
+        | RCons (t,r') -> occursT st v t || occursR st v r'
+
+    let private tyName (t:Ty) : string =
+        match t with
+        | TVar _ -> "a value"
+        | TNat -> "a number"
+        | TText -> "a text"
+        | TBlock _ -> "a block"
+
+    // copy a term, renaming variables via a function
+    let rec private renameT (fn:int -> int) (t:Ty) : Ty =
+        match t with
+        | TVar v -> TVar (fn v)
+        | TBlock (i,o) -> TBlock (renameR fn i, renameR fn o)
+        | _ -> t
+    and private renameR (fn:int -> int) (r:Row) : Row =
+        match r with
+        | RVar v -> RVar (fn v)
+        | RCons (t,r') -> RCons (renameT fn t, renameR fn r')
+
+    // rename variables by order of appearance, from zero
+    let private normalize (e:Effect) : Effect =
+        let names = new Dictionary<int,int>()
+        let fn v =
+            match names.TryGetValue v with
+            | true, n -> n
+            | _ ->
+                let n = names.Count
+                names.Add(v, n)
+                n
+        let inp = renameR fn (e.inp)
+        { inp = inp; out = renameR fn (e.out) }
+
+    let private instantiate (st:St) (e:Effect) : Effect =
+        let names = new Dictionary<int,int>()
+        let fn v =
+            match names.TryGetValue v with
+            | true, n -> n
+            | _ ->
+                let n = st.Fresh()
+                names.Add(v, n)
+                n
+        let inp = renameR fn (e.inp)
+        { inp = inp; out = renameR fn (e.out) }
+
+    let private cons (ts:Ty list) (r:Row) : Row = List.foldBack (fun t r -> RCons (t,r)) ts r
+
+    // unify an actual type `a` with an expected type `b`
+    let rec private unifyT (st:St) (a:Ty) (b:Ty) : unit =
+        match (resolveT st a), (resolveT st b) with
+        | TVar x, TVar y when (x = y) -> ()
+        | TVar x, t | t, TVar x ->
+            if occursT st x t then raise (TypeFail "recursive type") else
+            st.TS.[x] <- t
+        | TNat, TNat | TText, TText -> ()
+        | TBlock (i1,o1), TBlock (i2,o2) ->
+            unifyR st i1 i2
+            unifyR st o1 o2
+        | (TNat | TText) as x, (TBlock _ as y) -> unifyT st (asBlock st x) y
+        | (TBlock _ as x), ((TNat | TText) as y) -> unifyT st x (asBlock st y)
+        | x, y -> raise (TypeFail (sprintf "expected %s, found %s" (tyName y) (tyName x)))
+    and private unifyR (st:St) (a:Row) (b:Row) : unit =
+        match (resolveR st a), (resolveR st b) with
+        | RVar x, RVar y when (x = y) -> ()
+        | RVar x, r | r, RVar x ->
+            if occursR st x r then raise (TypeFail "recursive type") else
+            st.RS.[x] <- r
+        | RCons (t1,r1), RCons (t2,r2) ->
+            unifyT st t1 t2
+            unifyR st r1 r2
+    // the block type of a number or text, unifying both expansions
+    and private asBlock (st:St) (t:Ty) : Ty =
+        let fail () = raise (Unknown (sprintf "%s as a block" (tyName t)))
+        if st.Expanding then fail () else
+        let struct(w0, w1, args) =
+            match t with
+            | TNat -> struct("zero", "succ", [TNat])
+            | _ -> struct("null", "cons", [TText; TNat])
+        st.Expanding <- true
+        try try let b0 = blockOf st w0 []
+                unifyT st (blockOf st w1 args) b0
+                b0
+            with TypeFail _ -> fail ()
+        finally st.Expanding <- false
+    // the block type of `[args word]`
+    and private blockOf (st:St) (w:string) (args:Ty list) : Ty =
+        let e = instantiate st (st.TypeOf (BS.fromString w))
+        let s = RVar (st.Fresh())
+        unifyR st (cons args s) (e.inp)
+        TBlock (s, e.out)
+
+    // fully apply the substitution
+    let rec private zonkT (st:St) (t:Ty) : Ty =
+        match resolveT st t with
+        | TBlock (i,o) -> TBlock (zonkR st i, zonkR st o)
+        | t' -> t'
+    and private zonkR (st:St) (r:Row) : Row =
+        match resolveR st r with
+        | RCons (t,r') -> RCons (zonkT st t, zonkR st r')
+        | r' -> r'
+
+    // pop n fresh types from a row, returning types (top first) and the rest
+    let private pop (st:St) (n:int) (row:Row) : struct(Ty list * Row) =
+        let ts = List.init n (fun _ -> TVar (st.Fresh()))
+        let rest = RVar (st.Fresh())
+        unifyR st row (cons ts rest)
+        struct(ts, rest)
+
+    let private isArityAnno (w:Word) : bool =
+        (2 = BS.length w) && (byte 'a' = w.[0]) && (byte '1' < w.[1]) && (byte '9' >= w.[1])
+
+    // The type of a program, given its input row. Words are qualified
+    // by prefix `pre`, and typed by `typeOf`.
+    let rec private inferP (st:St) (typeOf:Word -> Effect) (pre:ByteString) (row:Row) (p:Parser.Program) : Row =
+        List.fold (inferA st typeOf pre) row p
+    and private inferA (st:St) (typeOf:Word -> Effect) (pre:ByteString) (row:Row) (op:Parser.Action) : Row =
+        match op with
+        | Parser.Atom (struct(tt,tok)) ->
+            match tt with
+            | Parser.TT.Word when (1 = BS.length tok) && (BS.unsafeHead tok <= byte 'd') ->
+                match char (BS.unsafeHead tok) with
+                | 'a' -> // [B][A]a == A[B]
+                    let struct(ts,s) = pop st 2 row
+                    let s' = RVar (st.Fresh())
+                    unifyT st (List.head ts) (TBlock (s, s'))
+                    RCons (List.item 1 ts, s')
+                | 'b' -> // [B][A]b == [[B]A]
+                    let struct(ts,s) = pop st 2 row
+                    let r = RVar (st.Fresh())
+                    let r' = RVar (st.Fresh())
+                    let tB = List.item 1 ts
+                    unifyT st (List.head ts) (TBlock (RCons (tB, r), r'))
+                    RCons (TBlock (r, r'), s)
+                | 'c' ->
+                    let struct(ts,s) = pop st 1 row
+                    cons (ts @ ts) s
+                | _ ->
+                    let struct(_,s) = pop st 1 row
+                    s
+            | Parser.TT.Word ->
+                let e = instantiate st (typeOf (BS.append pre tok))
+                unifyR st row (e.inp)
+                e.out
+            | Parser.TT.Anno when isArityAnno tok ->
+                let struct(ts,s) = pop st (int (tok.[1] - byte '0')) row
+                cons ts s
+            | Parser.TT.Anno when (BS.fromString "nat" = tok) ->
+                let struct(ts,s) = pop st 1 row
+                unifyT st (List.head ts) TNat
+                cons ts s
+            | Parser.TT.Anno -> row
+            | Parser.TT.Nat -> RCons (TNat, row)
+            | Parser.TT.Text -> RCons (TText, row)
+            | _ -> raise (Unknown "resources are not typed")
+        | Parser.Block b ->
+            let s = RVar (st.Fresh())
+            RCons (TBlock (s, inferP st typeOf pre s b), row)
+        | Parser.NS (struct(w,op')) ->
+            inferA st typeOf (BS.append pre (BS.snoc w (byte '/'))) row op'
+
+    let private parseEffect (s:string) : Effect =
+        // builtin types are written with single-letter variables
+        let toks = s.Split([|' '|], System.StringSplitOptions.RemoveEmptyEntries)
+        let var (c:string) = int c.[0]
+        let rec effect (ts:string list) : struct(Effect * string list) =
+            let struct(i, ts') = rowOf ts
+            match ts' with
+            | ("--" :: ts'') ->
+                let struct(o, rest) = rowOf ts''
+                struct({ inp = i; out = o }, rest)
+            | _ -> invalidArg "s" "-- expected"
+        and rowOf (ts:string list) : struct(Row * string list) =
+            match ts with
+            | (v :: rest) when System.Char.IsUpper(v.[0]) -> elems rest [] (RVar (var v))
+            | _ -> invalidArg "s" "row variable expected"
+        and elems (ts:string list) (acc:Ty list) (r0:Row) : struct(Row * string list) =
+            match ts with
+            | ("[" :: rest) ->
+                let struct(e, rest') = effect rest
+                match rest' with
+                | ("]" :: rest'') -> elems rest'' (TBlock (e.inp, e.out) :: acc) r0
+                | _ -> invalidArg "s" "] expected"
+            | ("nat" :: rest) -> elems rest (TNat :: acc) r0
+            | ("text" :: rest) -> elems rest (TText :: acc) r0
+            | (v :: rest) when System.Char.IsLower(v.[0]) && (1 = v.Length) -> elems rest (TVar (var v) :: acc) r0
+            | _ -> struct(cons acc r0, ts)
+        let struct(e, rest) = effect (List.ofArray toks)
+        if not (List.isEmpty rest) then invalidArg "s" "unexpected tokens" else
+        normalize e
+
+    // Standard accelerators have types that we cannot infer from their
+    // reference definitions. Accelerators without a type in our model
+    // (e.g. `z`, `repeat`, or those operating on lists) are untyped.
+    let private accelTypes : Map<string, Result> =
+        [ "i", Typed (parseEffect "S [ S -- R ] -- R")
+          "w", Typed (parseEffect "S a b -- S b a")
+          "succ", Typed (parseEffect "S nat -- S nat")
+          "nat-add", Typed (parseEffect "S nat nat -- S nat")
+          "nat-mul", Typed (parseEffect "S nat nat -- S nat")
+          "z", Untyped "fixpoint"
+          "repeat", Untyped "accelerated loop"
+          "nats-sum", Untyped "accelerated list"
+          "nats-dot", Untyped "accelerated list"
+          "nats-add", Untyped "accelerated list"
+          "nats-mul", Untyped "accelerated list"
+          "nats-matmul", Untyped "accelerated list"
+        ] |> Map.ofList
+
+    let private isAccel (p:Parser.Program) : bool =
+        let accel = BS.fromString "accel"
+        let isAccelAnno op =
+            match op with
+            | Parser.Atom (struct(Parser.TT.Anno, w)) -> (w = accel)
+            | _ -> false
+        List.exists isAccelAnno p
+
+    // the result for words within a cycle
+    let private cyclicMsg = "cyclic definition"
+
+    /// Type a definition, given the results for its dependencies.
+    /// The lookup returns None for undefined words. Definitions that
+    /// use ill-typed words are ill-typed, while those that use an
+    /// untyped or cyclic word are untyped.
+    let checkDef (typeOf:Word -> Result option) (w:Word) (def:ByteString) : Result =
+        match Parser.parse def with
+        | Parser.ParseFail _ -> IllTyped "definition does not parse"
+        | Parser.ParseOK p ->
+            let accel = isAccel p
+            match Map.tryFind (BS.toString w) accelTypes with
+            | Some r when accel -> r
+            | _ ->
+            let depType (dep:Word) : Effect =
+                match typeOf dep with
+                | Some (Typed e) -> e
+                | Some (IllTyped msg) when (msg <> cyclicMsg) ->
+                    raise (TypeFail (sprintf "ill-typed dependency %s" (BS.toString dep)))
+                | Some _ -> raise (Unknown (sprintf "depends on %s" (BS.toString dep)))
+                | None -> raise (TypeFail (sprintf "undefined word %s" (BS.toString dep)))
+            let struct(pre,_) = BS.spanEnd (fun c -> (c <> byte '/')) w
+            let st = new St(depType)
+            let inp = RVar (st.Fresh())
+            try let out = inferP st depType pre inp p
+                Typed (normalize { inp = zonkR st inp; out = zonkR st out })
+            with
+            | TypeFail msg -> if accel then Untyped msg else IllTyped msg
+            | Unknown msg -> Untyped msg
+
+    /// Print a stack effect, e.g. `S a b -- S b a`. Rows are named by
+    /// upper case letters, values by lower case.
+    let showEffect (e:Effect) : string =
+        let rows = new Dictionary<int,string>()
+        let vals = new Dictionary<int,string>()
+        let name (names:Dictionary<int,string>) (c0:char) (v:int) =
+            match names.TryGetValue v with
+            | true, n -> n
+            | _ ->
+                let ix = names.Count
+                let c = char ((int c0) + (ix % 8))
+                let n = if (ix < 8) then string c else sprintf "%c%d" c (ix / 8)
+                names.Add(v, n)
+                n
+        let rec showT (t:Ty) : string =
+            match t with
+            | TVar v -> name vals 'a' v
+            | TNat -> "nat"
+            | TText -> "text"
+            | TBlock (i,o) -> sprintf "[%s -- %s]" (showR i) (showR o)
+        and showR (r:Row) : string =
+            // bottom of the stack first, and name variables in order
+            let rec loop r acc =
+                match r with
+                | RVar v -> struct(v, acc)
+                | RCons (t,r') -> loop r' (t :: acc)
+            let struct(v,ts) = loop r []
+            let s = name rows 'S' v
+            String.concat " " (s :: List.map showT ts)
+        let i = showR (e.inp)
+        sprintf "%s -- %s" i (showR (e.out))
+
+    /// Print a result for developers.
+    let show (r:Result) : string =
+        match r with
+        | Typed e -> showEffect e
+        | Untyped msg -> sprintf "untyped: %s" msg
+        | IllTyped msg -> sprintf "error: %s" msg
+
+    let rec private writeT (t:Ty) (dst:ByteDst) : unit =
+        match t with
+        | TVar v -> EncByte.write 0uy dst; EncVarNat.write (uint64 v) dst
+        | TNat -> EncByte.write 1uy dst
+        | TText -> EncByte.write 2uy dst
+        | TBlock (i,o) -> EncByte.write 3uy dst; writeR i dst; writeR o dst
+    and private writeR (r:Row) (dst:ByteDst) : unit =
+        let rec loop r acc =
+            match r with
+            | RVar v -> struct(v, List.rev acc)
+            | RCons (t,r') -> loop r' (t :: acc)
+        let struct(v,ts) = loop r []
+        EncVarNat.write (uint64 (List.length ts)) dst
+        List.iter (fun t -> writeT t dst) ts
+        EncVarNat.write (uint64 v) dst
+
+    let rec private readT (src:ByteSrc) : Ty =
+        match EncByte.read src with
+        | 0uy -> TVar (int (EncVarNat.read src))
+        | 1uy -> TNat
+        | 2uy -> TText
+        | 3uy ->
+            let i = readR src
+            TBlock (i, readR src)
+        | _ -> raise ByteStream.ReadError
+    and private readR (src:ByteSrc) : Row =
+        let ts = List.init (int (EncVarNat.read src)) (fun _ -> readT src)
+        cons ts (RVar (int (EncVarNat.read src)))
+
+    let private writeResult (r:Result) (dst:ByteDst) : unit =
+        match r with
+        | Typed e -> EncByte.write (byte 'T') dst; writeR (e.inp) dst; writeR (e.out) dst
+        | Untyped msg -> EncByte.write (byte 'U') dst; EncBytes.write (BS.fromString msg) dst
+        | IllTyped msg -> EncByte.write (byte 'E') dst; EncBytes.write (BS.fromString msg) dst
+
+    /// Codec for results, e.g. for a durable cache.
+    let codec =
+        { new Codec<Result> with
+            member __.Write r dst = writeResult r dst
+            member __.Read db src =
+                match char (EncByte.read src) with
+                | 'T' ->
+                    let i = readR src
+                    Typed { inp = i; out = readR src }
+                | 'U' -> Untyped (BS.toString (EncBytes.read src))
+                | 'E' -> IllTyped (BS.toString (EncBytes.read src))
+                | _ -> raise ByteStream.ReadError
+            member __.Compact db r =
+                struct(r, uint64 (BS.length (ByteStream.write (writeResult r))))
+        }
+
+    /// A type cache, keyed by deep version. Checked counts the words
+    /// we have type checked (i.e. cache misses) in this process. The
+    /// quota limits the total size of cached results.
+    type Cache =
+        val C : DCache.C<Result>
+        val mutable Checked : int64
+        new(c) = { C = c; Checked = 0L }
+        new(db:DB, key:ByteString, quota:SizeEst) =
+            new Cache(new DCache.C<Result>(db, key, codec, quota))
+
+    /// Write buffered cache updates to the DB.
+    let sync (c:Cache) : unit = DCache.sync (c.C)
+
+    // Numbers and texts are typed as blocks via these words, which are
+    // not dependencies in the DictIndex. So every result also depends
+    // on their versions.
+    let private litWords = [ "cons"; "null"; "succ"; "zero" ] |> List.map BS.fromString
+    let private litVersion (ix:DictIndex.Index) : ByteString =
+        litWords |> Seq.map (fun w -> defaultArg (DictIndex.version w ix) BS.empty) |> BS.concat
+
+    // Cache keys include the word, not just its deep version, because
+    // accelerators are typed by name. E.g. `succ` and `nat-add` may
+    // have the same definition.
+    let private cacheKey (lv:ByteString) (v:RscHash) (w:Word) : DCache.Key =
+        let v' = if BS.isEmpty lv then v else RscHash.hash (BS.append v lv)
+        BS.append (BS.snoc v' (Dict.cSP)) w
+
+    /// Cached result for a word, if available.
+    let tryFind (c:Cache) (ix:DictIndex.Index) (w:Word) : Result option =
+        match DictIndex.version w ix with
+        | None -> None
+        | Some v -> DCache.tryFind (cacheKey (litVersion ix) v w) (c.C)
+
+    // DFS frame for checking dependencies before clients.
+    [<AllowNullLiteral>]
+    type private Frame =
+        val W : Word
+        val K : DCache.Key
+        val Def : ByteString
+        val Deps : Word[]
+        val mutable Ix : int
+        new(w,k,def,deps) = { W = w; K = k; Def = def; Deps = deps; Ix = 0 }
+
+    /// Type check a word, using and updating the cache. Dependencies
+    /// are checked first, with an explicit stack, since dependency
+    /// chains may be deep. Words within a cycle are ill-typed. We check
+    /// `zero succ null cons` first, to type numbers and texts as blocks.
+    let check (c:Cache) (ix:DictIndex.Index) (w:Word) : Result option =
+        let lv = litVersion ix
+        let local = new Dictionary<Word,Result>()
+        let onStack = new HashSet<Word>()
+        let cyclic = new HashSet<Word>()
+        let work = new Stack<Frame>()
+        // the result for a word if known, or a frame to check it
+        let lookup (w:Word) : struct(Result option * Frame) =
+            match local.TryGetValue w with
+            | true, r -> struct(Some r, null)
+            | _ ->
+            match Dict.tryFind w (ix.dict), DictIndex.version w ix with
+            | Some def, Some v ->
+                let k = cacheKey lv v w
+                match DCache.tryFind k (c.C) with
+                | Some r ->
+                    local.[w] <- r
+                    struct(Some r, null)
+                | None ->
+                    let deps = Array.ofList (DictIndex.defDeps w (def.Data))
+                    struct(None, new Frame(w, k, def.Data, deps))
+            | _ -> struct(None, null) // undefined
+        let push (f:Frame) =
+            onStack.Add(f.W) |> ignore<bool>
+            work.Push(f)
+        let run (w:Word) =
+            let struct(_, f0) = lookup w
+            if not (isNull f0) then push f0
+            while (work.Count > 0) do
+                let f = work.Peek()
+                if (f.Ix < f.Deps.Length) then
+                    let dep = f.Deps.[f.Ix]
+                    f.Ix <- (f.Ix + 1)
+                    if onStack.Contains dep then
+                        // every word on the stack above dep is in a cycle
+                        let mutable loop = true
+                        for g in work do
+                            if loop then
+                                cyclic.Add(g.W) |> ignore<bool>
+                                loop <- (g.W <> dep)
+                    else
+                        let struct(_, fd) = lookup dep
+                        if not (isNull fd) then push fd
+                else
+                    work.Pop() |> ignore
+                    onStack.Remove(f.W) |> ignore<bool>
+                    let typeOf (dep:Word) : Result option =
+                        match local.TryGetValue dep with
+                        | true, r -> Some r
+                        | _ -> let struct(r,_) = lookup dep in r
+                    let r =
+                        if cyclic.Contains (f.W)
+                            then IllTyped cyclicMsg
+                            else checkDef typeOf (f.W) (f.Def)
+                    Interlocked.Increment(&c.Checked) |> ignore<int64>
+                    local.[f.W] <- r
+                    DCache.add (f.K) r (uint64 (BS.length (Codec.writeBytes codec r))) (c.C)
+        List.iter run litWords
+        run w
+        match local.TryGetValue w with
+        | true, r -> Some r
+        | _ -> None
+
+    /// Words whose deep versions differ between two indices, i.e.
+    /// words that need checking after an edit.
+    let changed (a:DictIndex.Index) (b:DictIndex.Index) : Word[] =
+        LSMTrie.diff (a.vers) (b.vers)
+            |> Seq.choose (fun (w,vd) ->
+                match vd with
+                | InL _ -> None
+                | InR _ | InB _ -> Some w)
+            |> Array.ofSeq
+
+    // check words whose deep version changed, with limited parallelism
+    let private checkChanged (c:Cache) (maxParallel:int) (ix0:DictIndex.Index) (ix:DictIndex.Index) : unit =
+        let opts = new ParallelOptions(MaxDegreeOfParallelism = maxParallel)
+        // a change to `zero succ null cons` may affect any word
+        let ixPrior = if (litVersion ix0 = litVersion ix) then ix0 else DictIndex.empty
+        Parallel.ForEach(changed ixPrior ix, opts, fun w -> check c ix w |> ignore) |> ignore
+
+    /// Checks types on a background task, as new versions of a
+    /// dictionary are posted.
+    ///
+    /// Posting never waits on type checking, and if multiple versions
+    /// are posted while the checker is busy, intermediate versions are
+    /// skipped. Each version checks only words whose deep version has
+    /// changed since the last checked index, with limited parallelism.
+    type Checker =
+        val Cache : Cache
+        val MaxParallel : int
+        val mutable private ix : DictIndex.Index
+        val mutable private pending : DictIndex.Index option
+        val mutable private bgtask : bool
+        val mutable private error : exn
+        new(cache, maxParallel) =
+            { Cache = cache
+              MaxParallel = maxParallel
+              ix = DictIndex.empty
+              pending = None
+              bgtask = false
+              error = null
+            }
+        new(cache) = new Checker(cache, max 1 (System.Environment.ProcessorCount / 2))
+
+        /// The most recently checked index.
+        member x.Current with get() : DictIndex.Index = lock x (fun () -> x.ix)
+
+        /// Whether a posted index is not yet checked.
+        member x.Pending with get() : bool = lock x (fun () -> x.bgtask)
+
+        /// Post an index to check. Returns at once.
+        member x.Post (ix:DictIndex.Index) : unit =
+            lock x (fun () ->
+                x.pending <- Some ix
+                if not x.bgtask then
+                    x.bgtask <- true
+                    Task.Run(fun () -> x.BGCheck()) |> ignore<Task>)
+
+        member private x.BGCheck() : unit =
+            assert(not (Monitor.IsEntered(x)))
+            let struct(ix0,ix) = lock x (fun () ->
+                let ix = Option.get (x.pending)
+                x.pending <- None
+                struct(x.ix, ix))
+            let err =
+                try checkChanged (x.Cache) (x.MaxParallel) ix0 ix
+                    null
+                with e -> e
+            lock x (fun () ->
+                if isNull err then x.ix <- ix else x.error <- err
+                if Option.isSome (x.pending)
+                    then Task.Run(fun () -> x.BGCheck()) |> ignore<Task>
+                    else x.bgtask <- false
+                         Monitor.PulseAll(x))
+
+        /// Wait for all posted indices to be checked, and return the
+        /// last. Raises an error from checking, if any.
+        member x.Sync() : DictIndex.Index =
+            lock x (fun () ->
+                while x.bgtask do
+                    Monitor.Wait(x) |> ignore<bool>
+                if not (isNull x.error) then
+                    let e = x.error
+                    x.error <- null
+                    raise (System.AggregateException(e))
+                x.ix)
 
+        /// Cached result for a word in the most recently checked index.
+        member x.TryFind (w:Word) : Result option = tryFind (x.Cache) (x.Current) w
 
+    /// Check types as a computed TVar, holding the most recently checked
+    /// index. A Reactor agent checks the words changed whenever the index
+    /// variable is written, e.g. by a DictIndex agent.
+    let agent (rx:Reactive.Reactor) (c:Cache) (maxParallel:int) (ixv:TVar<DictIndex.Index>) : TVar<DictIndex.Index> =
+        Reactive.compute rx DictIndex.empty (fun db ix0 ->
+            let ix = db.Read ixv
+            checkChanged c maxParallel ix0 ix
+            ix)
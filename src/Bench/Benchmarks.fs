@@ -0,0 +1,394 @@
+module Benchmarks
+
+open System
+open System.IO
+open System.Threading
+open BenchmarkDotNet.Attributes
+open Stowage
+open Awelon
+open Data.ByteString
+
+// Benchmarks are deterministic: inputs are generated from fixed seeds,
+// so results are comparable between commits.
+
+let clearDir path =
+    if Directory.Exists(path)
+        then Directory.Delete(path,true)
+
+// pseudo-random keys of moderate size (e.g. 8 to 24 bytes)
+let randomKeys (seed:int) (n:int) : ByteString[] =
+    let rng = new Random(seed)
+    let key _ =
+        let len = 8 + rng.Next(17)
+        BS.unsafeCreateA (Array.init len (fun _ -> byte (97 + rng.Next(26))))
+    Array.init n key
+
+// An LMDB storage for a benchmark, in a clean directory.
+type BenchDB =
+    val path : string
+    val s : LMDB.Storage
+    val db : DB
+    new(name:string) =
+        let path = Path.Combine("bench-db", name)
+        clearDir path
+        let s = new LMDB.Storage(path, 4000)
+        { path = path; s = s; db = DB.fromStorage (s :> DB.Storage) }
+    member inline t.Stowage with get() = (t.s :> Stowage)
+    member inline t.Storage with get() = (t.s :> DB.Storage)
+    member t.Flush() = DB.flushStorage (t.Storage)
+    interface IDisposable with
+        member t.Dispose() =
+            (t.s :> IDisposable).Dispose()
+            clearDir (t.path)
+
+[<MemoryDiagnoser>]
+type CritbitBench() =
+    let mutable keys : ByteString[] = Array.empty
+    let mutable tree : CritbitTree<int> = CritbitTree.empty
+
+    [<Params(10000, 1000000)>]
+    member val N = 0 with get, set
+
+    [<GlobalSetup>]
+    member b.Setup() =
+        keys <- randomKeys 1 (b.N)
+        tree <- b.Insert()
+
+    [<Benchmark>]
+    member b.Insert() : CritbitTree<int> =
+        let mutable t = CritbitTree.empty
+        for ix = 0 to (keys.Length - 1) do
+            t <- CritbitTree.add (keys.[ix]) ix t
+        t
+
+    [<Benchmark>]
+    member b.Lookup() : int =
+        let mutable n = 0
+        for k in keys do
+            if CritbitTree.containsKey k tree then n <- (n + 1)
+        n
+
+[<MemoryDiagnoser>]
+type TrieBench() =
+    let mutable keys : ByteString[] = Array.empty
+    let mutable ikeys : uint64[] = Array.empty
+    let mutable imap : IntMap<uint64> = IntMap.empty
+    let mutable lsm : LSMTrie<ByteString> = LSMTrie.empty
+    let mutable bdb : BenchDB = Unchecked.defaultof<BenchDB>
+
+    [<Params(100000)>]
+    member val N = 0 with get, set
+
+    [<GlobalSetup>]
+    member b.Setup() =
+        keys <- randomKeys 2 (b.N)
+        let rng = new Random(3)
+        ikeys <- Array.init (b.N) (fun _ -> uint64 (rng.Next()) * uint64 (rng.Next()))
+        imap <- b.IntMapInsert()
+        lsm <- b.LSMTrieInsert()
+        bdb <- new BenchDB("trie")
+
+    [<GlobalCleanup>]
+    member b.Cleanup() = (bdb :> IDisposable).Dispose()
+
+    [<Benchmark>]
+    member b.IntMapInsert() : IntMap<uint64> =
+        Array.fold (fun m k -> IntMap.add k k m) IntMap.empty ikeys
+
+    [<Benchmark>]
+    member b.IntMapLookup() : int =
+        Array.sumBy (fun k -> if IntMap.containsKey k imap then 1 else 0) ikeys
+
+    [<Benchmark>]
+    member b.IntMapCompact() : IntMap<uint64> =
+        Codec.compact (IntMap.codec EncVarNat.codec) (bdb.Stowage) imap
+
+    [<Benchmark>]
+    member b.LSMTrieInsert() : LSMTrie<ByteString> =
+        Array.fold (fun t k -> LSMTrie.add k k t) LSMTrie.empty keys
+
+    [<Benchmark>]
+    member b.LSMTrieLookup() : int =
+        Array.sumBy (fun k -> if LSMTrie.containsKey k lsm then 1 else 0) keys
+
+    [<Benchmark>]
+    member b.LSMTrieCompact() : LSMTrie<ByteString> =
+        Codec.compact (LSMTrie.codec EncBytes.codec) (bdb.Stowage) lsm
+
+    [<Benchmark>]
+    member b.LSMTrieCompactPar() : LSMTrie<ByteString> =
+        Codec.compactPar (LSMTrie.codec EncBytes.codec) (bdb.Stowage) lsm
+
+    // incremental updates on a compacted tree, then compact again
+    [<Benchmark>]
+    member b.LSMTrieUpdateCompact() : LSMTrie<ByteString> =
+        let cT = LSMTrie.codec EncBytes.codec
+        let t0 = Codec.compact cT (bdb.Stowage) lsm
+        let upd t ix = LSMTrie.add (keys.[ix]) (BS.empty) t
+        let t1 = Seq.fold upd t0 (seq { 0 .. 97 .. (keys.Length - 1) })
+        Codec.compact cT (bdb.Stowage) t1
+
+// Write cost of LSMTrie compaction policies: incremental inserts with
+// periodic compaction. Bytes rewritten and write amplification are
+// printed per policy on cleanup, alongside the timings.
+[<MemoryDiagnoser>]
+type LSMTriePolicyBench() =
+    let mutable keys : ByteString[] = Array.empty
+    let mutable bdb : BenchDB = Unchecked.defaultof<BenchDB>
+    let mutable stats : LSMTrie.WriteStats = new LSMTrie.WriteStats()
+
+    [<Params("leveled", "tiered")>]
+    member val Policy = "" with get, set
+
+    [<GlobalSetup>]
+    member b.Setup() =
+        keys <- randomKeys 16 20000
+        bdb <- new BenchDB("lsm-policy")
+
+    [<GlobalCleanup>]
+    member b.Cleanup() =
+        printfn "LSMTrie %s policy: %s" (b.Policy) (stats.ToString())
+        (bdb :> IDisposable).Dispose()
+
+    [<Benchmark>]
+    member b.IncrementalCompact() : LSMTrie<ByteString> =
+        let policy =
+            if (b.Policy = "tiered") then LSMTrie.Policy.tiered 800UL 4 2
+            else LSMTrie.Policy.leveled 800UL
+        stats <- new LSMTrie.WriteStats()
+        let cT = LSMTrie.codecWith policy stats EncBytes.codec
+        let step t (ix:int) =
+            let k = keys.[ix]
+            stats.RecordUpdate (uint64 (2 * BS.length k))
+            let t' = LSMTrie.add k k t
+            if (0 <> (ix % 500)) then t' else Codec.compact cT (bdb.Stowage) t'
+        Array.fold step LSMTrie.empty [| 0 .. (keys.Length - 1) |]
+            |> Codec.compact cT (bdb.Stowage)
+
+// Stowage throughput, with a concurrent workload that keeps the GC
+// busy: another thread continuously stows then drops resources.
+[<MemoryDiagnoser>]
+type StorageBench() =
+    let mutable bdb : BenchDB = Unchecked.defaultof<BenchDB>
+    let mutable refs : RscHash[] = Array.empty
+    let mutable halt = false
+    let mutable churn : Thread = null
+    let rscBytes =
+        let rng = new Random(4)
+        BS.unsafeCreateA (Array.init 100000 (fun _ -> byte (rng.Next(256))))
+    let rsc (i:int) = BS.take (100 + (i % 4000)) (BS.drop (i % 90000) rscBytes)
+
+    [<Params(10000)>]
+    member val N = 0 with get, set
+
+    [<GlobalSetup>]
+    member b.Setup() =
+        bdb <- new BenchDB("storage")
+        refs <- Array.init (b.N) (fun i -> bdb.Stowage.Stow (rsc i))
+        bdb.Flush()
+        halt <- false
+        let churnLoop () =
+            let mutable i = 0
+            while not halt do
+                let r = bdb.Stowage.Stow (BS.append (BS.fromString "churn") (rsc i))
+                bdb.Stowage.Decref r
+                i <- (i + 1)
+                if (0 = (i % 1000)) then bdb.Flush()
+        churn <- new Thread(churnLoop)
+        churn.Start()
+
+    [<GlobalCleanup>]
+    member b.Cleanup() =
+        halt <- true
+        churn.Join()
+        Array.iter (bdb.Stowage.Decref) refs
+        (bdb :> IDisposable).Dispose()
+
+    [<Benchmark>]
+    member b.StowAndFlush() : unit =
+        let rs = Array.init 1000 (fun i -> bdb.Stowage.Stow (BS.append (BS.fromString "stow") (rsc i)))
+        bdb.Flush()
+        Array.iter (bdb.Stowage.Decref) rs
+
+    [<Benchmark>]
+    member b.Load() : int =
+        Array.sumBy (fun r -> BS.length (bdb.Stowage.Load r)) refs
+
+    [<Benchmark>]
+    member b.LoadView() : int =
+        Array.sumBy (fun r -> bdb.s.LoadView r (fun v -> int (v.[0]))) refs
+
+// Hashing many small nodes, as in compaction of large trees.
+[<MemoryDiagnoser>]
+type HashBench() =
+    let nodes =
+        let rng = new Random(6)
+        Array.init 10000 (fun _ -> 
+            BS.unsafeCreateA (Array.init (50 + rng.Next(400)) (fun _ -> byte (rng.Next(256)))))
+    let hashes = RscHash.hashMany nodes
+
+    [<Benchmark>]
+    member b.Hash() : RscHash[] = Array.map RscHash.hash nodes
+
+    [<Benchmark>]
+    member b.HashMany() : RscHash[] = RscHash.hashMany nodes
+
+    [<Benchmark>]
+    member b.Decode() : int = Array.sumBy (fun h -> int (RscHash.decode h).[0]) hashes
+
+// Numeric kernels over unboxed arrays of naturals.
+[<MemoryDiagnoser>]
+type NatArrayBench() =
+    let rng = new Random(8)
+    let arr n = NatArray(Array.init n (fun _ -> uint64 (rng.Next(1000))))
+    let xs = arr 1000000
+    let ys = arr 1000000
+    let ma = arr (128 * 128)
+    let mb = arr (128 * 128)
+
+    [<Benchmark>]
+    member b.Sum() : uint64 = NatArray.sum xs
+
+    [<Benchmark>]
+    member b.Dot() : uint64 = NatArray.dot xs ys
+
+    [<Benchmark>]
+    member b.MatMul128() : NatArray = NatArray.matmul 128 ma mb
+
+// A synthetic dictionary of about a million words, e.g. `w123456 =
+// w3 w17 1 nat-add`, with a few thousand changes for diff benchmarks.
+[<MemoryDiagnoser>]
+type DictBench() =
+    let mutable d0 : Dict = Dict.empty
+    let mutable d1 : Dict = Dict.empty
+    let mutable words : ByteString[] = Array.empty
+    let mutable bdb : BenchDB = Unchecked.defaultof<BenchDB>
+    let searcher = new DictSearch.Searcher()
+    let word (i:int) = BS.fromString (sprintf "w%d" i)
+
+    [<Params(1000000)>]
+    member val N = 0 with get, set
+
+    [<GlobalSetup>]
+    member b.Setup() =
+        bdb <- new BenchDB("dict")
+        let rng = new Random(5)
+        let def i =
+            let s = sprintf "w%d w%d %d nat-add" (rng.Next(i+1)) (rng.Next(i+1)) i
+            Dict.Def(BS.fromString s)
+        let ents = Array.init (b.N) (fun i -> (word i, def i))
+        d0 <- Array.fold (fun d (w,v) -> Dict.add w v d) Dict.empty ents
+        d0 <- Codec.compact (Dict.node_codec) (bdb.Stowage) d0
+        let upd d _ = Dict.add (word (rng.Next(b.N))) (Dict.Def(BS.fromString "0")) d
+        d1 <- Seq.fold upd d0 (seq { 1 .. 5000 })
+        words <- Array.init 100000 (fun _ -> word (rng.Next(b.N)))
+
+    [<GlobalCleanup>]
+    member b.Cleanup() = (bdb :> IDisposable).Dispose()
+
+    [<Benchmark>]
+    member b.TryFind() : int =
+        Array.sumBy (fun w -> if Option.isSome (Dict.tryFind w d0) then 1 else 0) words
+
+    [<Benchmark>]
+    member b.Diff() : int = Seq.length (Dict.diff d0 d1)
+
+    // full traversal of a dictionary reloaded from its root, so nodes
+    // are not cached, with and without prefetch
+    member private b.Cold() : Dict =
+        let c = Dict.node_codec
+        Codec.readBytes c (bdb.Stowage) (Codec.writeBytes c d0)
+
+    [<Benchmark>]
+    member b.ColdToSeq() : int = Seq.length (Dict.toSeq (b.Cold()))
+
+    [<Benchmark>]
+    member b.ColdToSeqAhead() : int = Seq.length (Dict.toSeqAhead 16 (b.Cold()))
+
+    // substring search for `w12345`, via a full scan and via indices
+    // shared between versions (warm after the first query)
+    [<Benchmark>]
+    member b.SearchScan() : int =
+        let q = "w12345"
+        Dict.toSeq d1 |> Seq.filter (fun (w,_) -> (BS.toString w).Contains(q)) |> Seq.length
+
+    [<Benchmark>]
+    member b.SearchIndex() : int =
+        let ix = DictSearch.index d1
+        Array.length (DictSearch.substring searcher (BS.fromString "w12345") ix)
+
+    [<Benchmark>]
+    member b.Compact() : Dict =
+        Codec.compact (Dict.node_codec) (bdb.Stowage) d1
+
+    [<Benchmark>]
+    member b.CompactPar() : Dict =
+        Codec.compactPar (Dict.node_codec) (bdb.Stowage) d1
+
+[<MemoryDiagnoser>]
+type InterpBench() =
+    let prelude =
+        [ "w", "(a2) [] b a (accel)"
+          "i", "[] w a d (accel)"
+          "z", "[[(a3) c i] b (eq-z) [c] a b w i](a3) c i (accel)"
+          "repeat", "(accel) (error)"
+          "succ", "(accel) (error)"
+          "nat-add", "(accel) (error)"
+          "nat-mul", "(accel) (error)"
+          "add4", "4 nat-add"
+          "add8", "add4 add4"
+          "swap-twice", "w w"
+        ]
+    let src =
+        let m = prelude |> List.map (fun (w,d) -> (BS.fromString w, BS.fromString d))
+                        |> Map.ofList
+        fun w -> Map.tryFind w m
+    let eval (e:Interpret.Env) (s:string) : ByteString =
+        match Parser.parse (BS.fromString s) with
+        | Parser.ParseOK p -> Parser.write (Interpret.eval e p)
+        | Parser.ParseFail _ -> invalidArg "s" "parse failure"
+    let wordCalls = "0 [add8 1 2 swap-twice nat-add nat-add] 1000000 repeat"
+    // eight independent (par) stages, then a sum of their results
+    let parStages =
+        let stage i = sprintf "[%d [1 nat-add] 1000000 repeat](par) " i
+        String.concat "" (List.map stage [1 .. 8]) + "i" + String.replicate 7 " w i nat-add"
+
+    [<Benchmark>]
+    member b.Repeat10M() : ByteString =
+        eval (Interpret.env src) "0 [4 nat-add] 10000000 repeat"
+
+    [<Benchmark>]
+    member b.WordCalls1M() : ByteString =
+        eval (Interpret.env src) wordCalls
+
+    [<Benchmark>]
+    member b.WordCalls1MJit() : ByteString =
+        let e = Interpret.env src
+        e.TierThreshold <- 100
+        e.Tier <- Jit.upgrade
+        eval e wordCalls
+
+    [<Benchmark>]
+    member b.ParStages() : ByteString = eval (Interpret.env src) parStages
+
+    [<Benchmark>]
+    member b.ParStagesKPN() : ByteString = eval (KPN.env src) parStages
+
+    [<Benchmark>]
+    member b.Parse() : int =
+        let s = BS.fromString (String.replicate 10000 "[1 2 \"text\" foo/bar (anno)] ")
+        match Parser.parse s with
+        | Parser.ParseOK p -> List.length p
+        | Parser.ParseFail _ -> 0
+
+    [<Benchmark>]
+    member b.Tokenize() : int =
+        let s = BS.fromString (String.replicate 10000 "[1 2 \"text\" foo/bar (anno)] ")
+        match Parser.tokenize s with
+        | Some f -> f.toks.Length
+        | None -> 0
+
+    [<Benchmark>]
+    member b.DefDeps() : int =
+        let s = BS.fromString (String.replicate 10000 "[1 2 \"text\" foo/bar (anno)] ")
+        List.length (DictIndex.defDeps (BS.fromString "d/x") s)
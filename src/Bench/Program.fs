@@ -0,0 +1,55 @@
+module Program
+
+open System
+open System.IO
+open System.Diagnostics
+open BenchmarkDotNet.Configs
+open BenchmarkDotNet.Exporters
+open BenchmarkDotNet.Exporters.Json
+open BenchmarkDotNet.Running
+
+// Results are labeled by git revision (or BENCH_LABEL), then copied
+// to `bench-results/<label>/` so we can compare runs between commits.
+let label () : string =
+    let env = Environment.GetEnvironmentVariable("BENCH_LABEL")
+    if not (String.IsNullOrEmpty env) then env else
+    try let psi = new ProcessStartInfo("git", "rev-parse --short HEAD")
+        psi.RedirectStandardOutput <- true
+        psi.UseShellExecute <- false
+        use p = Process.Start(psi)
+        let rev = p.StandardOutput.ReadToEnd().Trim()
+        p.WaitForExit()
+        if (0 = p.ExitCode) && not (String.IsNullOrEmpty rev) then rev else "local"
+    with _ -> "local"
+
+// The default config already exports CSV, GitHub markdown, and HTML
+// reports, and each benchmark type carries [<MemoryDiagnoser>]. We
+// only add a JSON export, for tools that compare runs.
+let config : IConfig =
+    let c = ManualConfig.Create(DefaultConfig.Instance)
+    c.Add(JsonExporter.Full)
+    c :> IConfig
+
+let export (dirs:seq<string>) : unit =
+    let dst = Path.Combine("bench-results", label ())
+    Directory.CreateDirectory(dst) |> ignore
+    for dir in Seq.distinct dirs do
+        for f in Directory.GetFiles(dir) do
+            File.Copy(f, Path.Combine(dst, Path.GetFileName(f)), true)
+    printfn "benchmark results exported to %s" dst
+
+[<EntryPoint>]
+let main argv =
+    let benchmarks =
+        [| typeof<Benchmarks.CritbitBench>
+           typeof<Benchmarks.TrieBench>
+           typeof<Benchmarks.LSMTriePolicyBench>
+           typeof<Benchmarks.StorageBench>
+           typeof<Benchmarks.HashBench>
+           typeof<Benchmarks.NatArrayBench>
+           typeof<Benchmarks.DictBench>
+           typeof<Benchmarks.InterpBench>
+        |]
+    let summaries = BenchmarkSwitcher(benchmarks).Run(argv, config)
+    export (summaries |> Seq.map (fun s -> s.ResultsDirectoryPath))
+    0
@@ -17,10 +17,36 @@ module ByteStream =
     type Dst =
         val mutable internal Data : byte[]  // resizable bytes array
         val mutable internal Pos : int      // current writer head
-        internal new() = { Data = Array.empty; Pos = 0 }
-
-    let inline private resize (sz:int) (d:Dst) : unit =
-        assert(sz >= d.Pos)
+        val internal Pooled : bool          // Data is scratch from Pool
+        internal new() = { Data = Array.empty; Pos = 0; Pooled = false }
+        internal new(scratch:byte[]) = { Data = scratch; Pos = 0; Pooled = true }
+
+    // Scratch buffers for pooled writes, per thread. Nested writes, e.g.
+    // a codec that stows children while writing its parent, will each
+    // take a buffer. We retain only a few buffers of moderate size.
+    module private Pool =
+        let maxCount = 4
+        let maxSize = (1 <<< 20)
+        let minSize = 4096
+        let private free = 
+            new System.Threading.ThreadLocal<System.Collections.Generic.Stack<byte[]>>(
+                fun () -> new System.Collections.Generic.Stack<byte[]>())
+
+        let rec private fit (sz:int) (amt:int) : int =
+            if (sz >= amt) || (sz >= (System.Int32.MaxValue / 2)) then max sz amt else 
+            fit (2 * sz) amt
+
+        // a buffer of at least amt bytes. Too small buffers are dropped,
+        // so the pool converges to buffers large enough for the thread.
+        let rent (amt:int) : byte[] =
+            let s = free.Value
+            if (s.Count > 0) && (s.Peek().Length >= amt) then s.Pop() else
+            if (s.Count > 0) then s.Pop() |> ignore<byte[]>
+            Array.zeroCreate (fit minSize amt)
+
+        let release (mem:byte[]) : unit =
+            let s = free.Value
+            if (mem.Length <= maxSize) && (s.Count < maxCount) then s.Push(mem)
 
     // reallocate array with sufficient space relative to Pos
     let private alloc (amt:int) (d:Dst) : unit =
@@ -29,8 +55,9 @@ module ByteStream =
             then raise (new System.OutOfMemoryException("ByteStream reserve"))
         // adjust for geometric growth
         let newSize = d.Pos + max amt (min maxAmt (max 200 d.Pos))
-        let mem = Array.zeroCreate newSize
+        let mem = if d.Pooled then Pool.rent newSize else Array.zeroCreate newSize
         Array.blit (d.Data) 0 mem 0 (d.Pos)
+        if d.Pooled then Pool.release (d.Data)
         d.Data <- mem
 
     let inline private requireSpace (amt:int) (dst:Dst) : unit =
@@ -45,7 +72,7 @@ module ByteStream =
     /// further reallocation.
     let reserve (amt:int) (dst:Dst) : unit =
         assert(amt > 0)
-        if (Array.isEmpty dst.Data) 
+        if (Array.isEmpty dst.Data) && not dst.Pooled
             then dst.Data <- Array.zeroCreate amt
             else requireSpace amt dst
 
@@ -92,6 +119,23 @@ module ByteStream =
     let write' (writer: Dst -> 'X) : (ByteString * 'X) = 
         capture' (new Dst()) writer  
 
+    /// Write to a pooled scratch buffer, then process the result.
+    ///
+    /// The ByteString passed to `consume` is valid only until consume
+    /// returns, after which the buffer is reused. The consumer must copy
+    /// any bytes it retains, e.g. to hash or to copy into a database. 
+    /// This avoids allocations for intermediate buffers.
+    let writeWith (writer:Dst -> unit) (consume:ByteString -> 'R) : 'R =
+        let dst = new Dst(Pool.rent Pool.minSize)
+        try consume (capture dst writer)
+        finally Pool.release (dst.Data)
+
+    /// Write to a pooled scratch buffer, then copy to an exact-sized
+    /// ByteString. Unlike `write`, this allocates only the result, and
+    /// the result doesn't retain slack space from geometric growth.
+    let writeCopy (writer:Dst -> unit) : ByteString =
+        writeWith writer (fun s -> BS.unsafeCreateA (BS.toArray s))
+
     /// A ByteString Reader. 
     ///
     /// This is similar to System.IO.MemoryStream in read-only mode, albeit
@@ -130,6 +130,27 @@ let ``trivial byte writer`` () =
                 ByteStream.writeBytes x.[1..] dst)
     Assert.Equal<ByteString>(x,x')
 
+[<Fact>]
+let ``pooled byte writer`` () =
+    let rng = new System.Random(18)
+    let bins = Array.init 50 (fun i -> 
+        BS.unsafeCreateA (Array.init (rng.Next(20000)) (fun _ -> byte (rng.Next(256)))))
+    let wr (b:ByteString) (dst:ByteDst) = 
+        ByteStream.writeByte 1uy dst
+        ByteStream.writeBytes b dst
+    for b in bins do
+        let expect = ByteStream.write (wr b)
+        let copy = ByteStream.writeCopy (wr b)
+        Assert.Equal<ByteString>(expect, copy)
+        Assert.Equal(copy.Length, copy.UnsafeArray.Length) // exact size
+        // nested pooled writes use distinct buffers
+        let nest dst =
+            let inner = ByteStream.writeCopy (wr b) 
+            ByteStream.writeBytes inner dst
+        Assert.Equal<ByteString>(BS.append expect expect, 
+            ByteStream.writeWith (fun dst -> nest dst; nest dst) BS.toArray |> BS.unsafeCreateA)
+        Assert.Equal(expect.Length, ByteStream.writeWith (wr b) BS.length)
+
 [<Fact>]
 let ``trivial byte reader`` () =
     let x = (BS.fromString "==test==").[2..5]
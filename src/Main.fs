@@ -19,6 +19,8 @@ starts a local web server, which is mostly configured online. Arguments:
     [-size GB] maximum database size (default 100)
     [-cache MB] space-speed tradeoff (default 100)
     [-admin]  print a temporary admin password
+    [-export File] write the dictionary to an archive, then halt
+    [-import File] replace the dictionary from an archive, then halt
 
 Configuration of Wikilon is managed online. Requesting an `-admin` password
 makes the admin account available until process reset. The admin can create
@@ -36,6 +38,8 @@ type Args = {
   size : int;
   cache : int;
   admin : bool;
+  export : string option;
+  import : string option;
   bad : string list;
 }
 
@@ -47,6 +51,8 @@ let defaultArgs : Args = {
   size = 100
   cache = 100
   admin = false;
+  export = None;
+  import = None;
   bad = [];
 }
 
@@ -66,6 +72,8 @@ let rec procArgs xs (a : Args) : Args =
     | "-size"::(Nat n)::xs' -> procArgs xs' { a with size = n }
     | "-cache"::(Nat n)::xs' -> procArgs xs' { a with cache = n }
     | "-admin"::xs' -> procArgs xs' { a with admin = true }
+    | "-export"::fp::xs' -> procArgs xs' { a with export = Some fp }
+    | "-import"::fp::xs' -> procArgs xs' { a with import = Some fp }
     | x::xs' -> procArgs xs' {a with bad = x :: a.bad }
 
 let getEntropy (n : int) : ByteString = 
@@ -89,6 +97,10 @@ let main argv =
     if args.help then printfn "%s" helpMsg; 0 else 
     let bad = not (List.isEmpty args.bad)
     if bad then printfn "Unrecognized args (try -help): %A" args.bad; (-1) else
+    let both = Option.isSome args.export && Option.isSome args.import
+    if both then printfn "Use one of -export or -import (try -help)"; (-1) else
+    let fullPath = Option.map Path.GetFullPath
+    let args = { args with export = fullPath args.export; import = fullPath args.import }
     do setAppWorkingDir args.home
     let adminPass =
         if not args.admin then None else
@@ -99,21 +111,36 @@ let main argv =
     use dbStore = new Stowage.LMDB.Storage("data", (1024 * args.size))
     let dbRoot = Stowage.DB.fromStorage dbStore
     let dbWiki = DB.withPrefix (BS.fromString "wiki/") dbRoot
-    let wsParams : WS.Params = { db = dbWiki; admin = adminPass }
-    let app = WS.mkApp wsParams
-    let cts = new CancellationTokenSource()
-    let svc = 
-        { defaultConfig with 
-            hideHeader = true
-            bindings = [ HttpBinding.createSimple HTTP args.ip args.port
-                       ]
-            cancellationToken = cts.Token
-        }
-    let (_,serve) = startWebServerAsync svc app
-    Async.Start(serve, cts.Token) 
-    printfn "Press any key to halt."
-    Console.ReadKey true |> ignore<ConsoleKeyInfo>
-    cts.Cancel()
-    0 // return an integer exit code
+    let dictRoot = dbWiki.Register (WS.rootKey) (Awelon.Dict.node_codec)
+    match args.export, args.import with
+    | Some fp, _ ->
+        use dst = new BufferedStream(File.Create(fp), (1 <<< 20))
+        let d = defaultArg (dbWiki.Read dictRoot) (Awelon.Dict.empty)
+        let st = Awelon.Dict.export (dbWiki :> Stowage) d dst
+        printfn "exported %d resources (%d bytes); %d missing" st.resources st.bytes st.missing
+        0
+    | None, Some fp ->
+        use src = new BufferedStream(File.OpenRead(fp), (1 <<< 20))
+        let st = Awelon.Dict.import dbWiki (64 <<< 20) dictRoot src
+        printfn "imported %d resources (%d bytes)" st.resources st.bytes
+        0
+    | None, None ->
+        do dbStore.RegisterMetrics()
+        let wsParams : WS.Params = { db = dbWiki; admin = adminPass }
+        let app = WS.mkApp wsParams
+        let cts = new CancellationTokenSource()
+        let svc = 
+            { defaultConfig with 
+                hideHeader = true
+                bindings = [ HttpBinding.createSimple HTTP args.ip args.port
+                           ]
+                cancellationToken = cts.Token
+            }
+        let (_,serve) = startWebServerAsync svc app
+        Async.Start(serve, cts.Token) 
+        printfn "Press any key to halt."
+        Console.ReadKey true |> ignore<ConsoleKeyInfo>
+        cts.Cancel()
+        0 // return an integer exit code
 
 
@@ -0,0 +1,214 @@
+namespace Stowage
+open System.IO
+open System.Collections.Generic
+open Data.ByteString
+
+/// Streaming import and export of Stowage resources as a tar archive.
+///
+/// An archive holds a few named roots, and every resource reachable
+/// from them. Each resource is written once, as `rsc/secureHash`, and
+/// after every resource it references, such that an importer may stow
+/// resources as they arrive. Roots are written last, as `root/name`.
+/// References are recognized conservatively, see RscHash.foldHashDeps.
+///
+/// Use of tar permits inspection and extraction by standard tools.
+module Archive =
+
+    let private blockSize = 512
+    let private rscPrefix = "rsc/"
+    let private rootPrefix = "root/"
+
+    /// Raised for a malformed archive or a resource that doesn't match
+    /// its secure hash.
+    exception CorruptArchive of string
+
+    // ustar header for a regular file
+    let private header (name:string) (size:int64) : byte[] =
+        let h = Array.zeroCreate blockSize
+        let put (off:int) (s:string) =
+            let bs = System.Text.Encoding.ASCII.GetBytes(s)
+            System.Buffer.BlockCopy(bs, 0, h, off, bs.Length)
+        let octal (width:int) (n:int64) = System.Convert.ToString(n, 8).PadLeft(width - 1, '0')
+        if (name.Length > 99) then invalidArg "name" "archive name too long"
+        put 0 name
+        put 100 (octal 8 0o644L)
+        put 108 (octal 8 0L)
+        put 116 (octal 8 0L)
+        put 124 (octal 12 size)
+        put 136 (octal 12 0L)
+        put 148 "        "
+        h.[156] <- byte '0'
+        put 257 "ustar"
+        put 263 "00"
+        let chk = Array.fold (fun s (b:byte) -> s + int64 b) 0L h
+        put 148 ((octal 7 chk) + "\000 ")
+        h
+
+    let private padding (size:int64) : int =
+        int ((int64 blockSize - (size % int64 blockSize)) % int64 blockSize)
+
+    let private writeEntry (dst:Stream) (name:string) (data:ByteString) : unit =
+        dst.Write(header name (int64 data.Length), 0, blockSize)
+        dst.Write(data.UnsafeArray, data.Offset, data.Length)
+        dst.Write(Array.zeroCreate (padding (int64 data.Length)), 0, padding (int64 data.Length))
+
+    // Resources are tracked by a hash prefix. Collisions of 120 bits
+    // are not a concern, and this halves the memory for big exports.
+    let inline private trackKey (h:RscHash) : ByteString = BS.trimBytes (BS.take 24 h)
+
+    /// Summary of an export or import.
+    type Stats =
+        { resources : int64     // resources written or stowed
+          bytes     : int64     // total bytes of resources
+          missing   : int64     // unavailable references on export, e.g. false positives
+        }
+
+    // a resource in the export walk, with its dependencies loaded as
+    // a batch when first visited
+    type private Frame =
+        val Name : string
+        val Hash : RscHash      // empty for roots
+        val Data : ByteString
+        val Deps : RscHash[]
+        val mutable Loaded : ByteString option[]
+        val mutable Next : int
+        new(name,h,data) =
+            let deps = RscHash.foldHashDeps (fun l h -> (BS.trimBytes h)::l) [] data
+                        |> List.rev |> Array.ofList |> Array.distinct
+            { Name = name; Hash = h; Data = data; Deps = deps; Loaded = null; Next = 0 }
+
+    /// Write an archive of named roots and every resource reachable
+    /// from them. Resources are loaded in parallel batches, as each
+    /// node is visited, and are written in dependency order. Memory is
+    /// proportional to the depth of the walk times the branching factor
+    /// (and a small entry per resource written).
+    let write (db:Stowage) (roots:(string * ByteString) list) (dst:Stream) : Stats =
+        let written = new HashSet<ByteString>()
+        let mutable nRsc = 0L
+        let mutable nBytes = 0L
+        let mutable nMissing = 0L
+        let load (hs:RscHash[]) : ByteString option[] =
+            if (hs.Length <= 8) then Stowage.loadMany db hs else
+            hs |> Array.chunkBySize 8 |> Array.Parallel.map (Stowage.loadMany db) |> Array.concat
+        for (name,data) in roots do
+            let stack = new Stack<Frame>()
+            stack.Push(new Frame(rootPrefix + name, BS.empty, data))
+            while (stack.Count > 0) do
+                let f = stack.Peek()
+                if isNull f.Loaded then
+                    let todo = [| for ix in 0 .. (f.Deps.Length - 1) do
+                                    if not (written.Contains(trackKey f.Deps.[ix])) then yield ix |]
+                    let vs = load (Array.map (fun ix -> f.Deps.[ix]) todo)
+                    f.Loaded <- Array.zeroCreate (f.Deps.Length)
+                    Array.iteri (fun j ix -> f.Loaded.[ix] <- vs.[j]) todo
+                if (f.Next < f.Deps.Length) then
+                    let ix = f.Next
+                    f.Next <- ix + 1
+                    let h = f.Deps.[ix]
+                    let k = trackKey h
+                    if not (written.Contains k) then
+                        match f.Loaded.[ix] with
+                        | Some v -> stack.Push(new Frame(rscPrefix + BS.toString h, h, v))
+                        | None ->
+                            // unavailable, e.g. a false positive; not retried
+                            written.Add(k) |> ignore<bool>
+                            nMissing <- nMissing + 1L
+                        f.Loaded.[ix] <- None // release memory
+                else
+                    stack.Pop() |> ignore<Frame>
+                    writeEntry dst (f.Name) (f.Data)
+                    if not (BS.isEmpty f.Hash) then
+                        written.Add(trackKey f.Hash) |> ignore<bool>
+                        nRsc <- nRsc + 1L
+                        nBytes <- nBytes + int64 (f.Data.Length)
+        let fin = Array.zeroCreate (2 * blockSize)
+        dst.Write(fin, 0, fin.Length)
+        dst.Flush()
+        { resources = nRsc; bytes = nBytes; missing = nMissing }
+
+    let rec private readFully (src:Stream) (buf:byte[]) (off:int) (len:int) : unit =
+        if (0 = len) then () else
+        let n = src.Read(buf, off, len)
+        if (0 = n) then raise (CorruptArchive "unexpected end of archive")
+        readFully src buf (off + n) (len - n)
+
+    // read an entry header, or None at the end of the archive
+    let private readHeader (src:Stream) : struct(string * int) option =
+        let h = Array.zeroCreate blockSize
+        readFully src h 0 blockSize
+        if Array.forall ((=) 0uy) h then None else
+        let field (off:int) (len:int) =
+            let s = System.Text.Encoding.ASCII.GetString(h, off, len)
+            let nul = s.IndexOf('\000')
+            (if (nul < 0) then s else s.Substring(0, nul)).Trim()
+        let chk = field 148 8
+        for ix = 148 to 155 do h.[ix] <- byte ' '
+        let sum = Array.fold (fun s (b:byte) -> s + int64 b) 0L h
+        if (chk = "") || (System.Convert.ToInt64(chk, 8) <> sum)
+            then raise (CorruptArchive "bad header checksum")
+        let size = System.Convert.ToInt64(field 124 12, 8)
+        if (size > int64 (64 * 1024 * 1024)) then raise (CorruptArchive "oversized entry")
+        Some (struct(field 0 100, int size))
+
+    /// Read an archive into a DB. Resources are stowed as they arrive,
+    /// and the DB is flushed whenever `batch` bytes have been stowed,
+    /// so memory remains bounded by the batch rather than the archive.
+    ///
+    /// After every resource is stowed, `bind` receives the roots, and
+    /// should keep them, e.g. by writing to durable variables. The DB
+    /// is flushed once more before releasing the imported resources,
+    /// which are held against GC until then. Referencing resources
+    /// hold their dependencies, so only resources without a parent in
+    /// the archive are held for long.
+    let read (db:DB) (batch:int) (bind:(string * ByteString) list -> unit) (src:Stream) : Stats =
+        let held = new HashSet<RscHash>()
+        let release = new List<RscHash>()
+        let mutable roots = []
+        let mutable pending = 0
+        let mutable nRsc = 0L
+        let mutable nBytes = 0L
+        let flush () =
+            db.Flush()
+            for h in release do db.Decref h
+            release.Clear()
+        try
+            let mutable fin = false
+            while not fin do
+                match readHeader src with
+                | None -> fin <- true
+                | Some (struct(name,size)) ->
+                    let buf = Array.zeroCreate size
+                    readFully src buf 0 size
+                    let pad = padding (int64 size)
+                    if (pad > 0) then readFully src (Array.zeroCreate pad) 0 pad
+                    let data = BS.unsafeCreateA buf
+                    // resources referenced by this one are held by it after flush
+                    let adopt (h:RscHash) = if held.Remove(h) then release.Add(h)
+                    if name.StartsWith(rscPrefix) then
+                        let h = BS.fromString (name.Substring(rscPrefix.Length))
+                        if not (held.Contains(h)) then
+                            RscHash.iterHashDeps (BS.trimBytes >> adopt) data
+                            let h' = db.Stow data
+                            if not (ByteString.Eq h h') then
+                                db.Decref h'
+                                raise (CorruptArchive ("resource does not match hash " + BS.toString h))
+                            held.Add(h) |> ignore<bool>
+                            nRsc <- nRsc + 1L
+                            nBytes <- nBytes + int64 size
+                            pending <- pending + size
+                            if (pending >= batch) then
+                                flush ()
+                                pending <- 0
+                    elif name.StartsWith(rootPrefix) then
+                        roots <- (name.Substring(rootPrefix.Length), data) :: roots
+                    else raise (CorruptArchive ("unrecognized entry " + name))
+            bind (List.rev roots)
+            release.AddRange(held)
+            held.Clear()
+            flush ()
+        finally
+            // upon error, release everything we still hold
+            for h in held do db.Decref h
+            for h in release do db.Decref h
+        { resources = nRsc; bytes = nBytes; missing = 0L }
+
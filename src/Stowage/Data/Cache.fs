@@ -1,6 +1,7 @@
 namespace Stowage
 open System.Threading
 open System.Threading.Tasks
+open System.Runtime.InteropServices
 
 /// Abstract cached resource. 
 ///
@@ -11,6 +12,15 @@ type Cached =
     abstract member Usage : int with get
     abstract member Clear : unit -> unit
 
+/// Optional interface for a Cached resource to report its cost.
+///
+/// Cost is the estimated time to reload or recompute the resource
+/// after it's cleared, in microseconds. A cost of zero or less is
+/// treated as unknown. The cache manager prefers to evict resources
+/// that are cheap to reload relative to their size.
+type Costly =
+    abstract member Cost : int64 with get
+
 /// Stowage Cache
 ///
 /// Use of Stowage resources can operate a lot like virtual memory,
@@ -21,31 +31,143 @@ type Cached =
 /// The current implementation uses a concrete heuristic strategy that 
 /// combines aspects of least-recently-used with exponential-decay. It 
 /// should be effective for most use cases. Resources are cleared from
-/// the .Net task thread pool.
+/// the .Net task thread pool. Resources that report a reload cost are
+/// prioritized GreedyDual-Size style.
 ///
 /// This module only provides a manager, not lookup. For cached lookups,
 /// consider MCache or DCache.  
 module Cache =
 
-    type private Rsc = (struct(SizeEst * int * System.WeakReference))
+    // Cached items are held by weak GC handles. Unlike WeakReference,
+    // a GCHandle doesn't allocate a finalizable object per item. Each
+    // handle is freed when its item is scrubbed.
+    //
+    // Each item has a size, a logical touch count, and a priority.
+    type private Rsc = (struct(SizeEst * int * GCHandle * float))
     type private Frame = ResizeArray<Rsc>
 
-    // Our simple algorithm for releasing memory.
-    let private scrubFrame (rng:System.Random) (pdecay:int) (f:Frame) : struct(Frame * SizeEst) =
+    /// Cache manager statistics. Hits and misses are reported by the
+    /// clients of a manager, such as LVRef and MCache.
+    type Stats =
+        { hits      : uint64    // lookups served from the cache
+          misses    : uint64    // lookups that had to load
+          evictions : uint64    // items cleared to meet the quota
+          evicted   : SizeEst   // total size of evicted items
+          size      : SizeEst   // estimated size of managed items
+          quota     : SizeEst   // soft limit for managed items
+        }
+
+    // Items are prioritized GreedyDual-Size style. The priority of an
+    // item is H = L + cost/size, where L is an inflation value that is
+    // raised to the priority of each evicted item, and H is refreshed
+    // when an item is touched. Thus, items that are cheap to reload per
+    // byte, or haven't been used for a while, are evicted first.
+
+    // reload cost per byte (in microseconds) for items without a cost,
+    // i.e. assuming we reload and parse at about 100MB/s.
+    let private defaultCostPerByte = 0.01
+
+    let private costPerByte (c:Cached) (sz:SizeEst) : float =
+        match c with
+        | :? Costly as k when (k.Cost > 0L) -> float (k.Cost) / float sz
+        | _ -> defaultCostPerByte
+
+    type private Candidate = (struct(float * int * Rsc * Cached))
+
+    let private candidateOrder = 
+        System.Comparison<Candidate>(fun (struct(ha,ra,_,_)) (struct(hb,rb,_,_)) ->
+            let c = compare ha hb
+            if (0 <> c) then c else compare ra rb)
+
+    // Our algorithm for releasing memory. Items touched since the last
+    // scrub are retained with a refreshed priority. Of the remaining 
+    // items, we evict those of lowest priority, up to `pdecay` percent
+    // of their total size. Ties are broken randomly, so for items of
+    // equal cost-per-byte this is the same as random exponential decay.
+    //
+    // Returns the new frame, the size erased, the count and size of
+    // evicted items, and the new inflation value.
+    let private scrubFrame (rng:System.Random) (pdecay:int) (inflation:float) (f:Frame) 
+                         : struct(Frame * SizeEst * int * SizeEst * float) =
         let mutable erased = 0UL
+        let mutable candBytes = 0UL
         let newFrame = new Frame()
-        for (struct(sz,tc,wref)) in f do
-            match wref.Target with
+        let cands = new ResizeArray<Candidate>()
+        for (struct(sz,tc,h,pri) as r) in f do
+            match h.Target with
             | null -> 
+                h.Free()
                 erased <- (erased + sz)
             | :? Cached as c ->
                 let tc' = c.Usage
-                let doScrub = (tc = tc') && (rng.Next(100) < pdecay)
-                if doScrub 
-                    then c.Clear(); erased <- (erased + sz)
-                    else newFrame.Add(struct(sz,tc',wref))
+                if (tc <> tc') 
+                    then newFrame.Add(struct(sz,tc',h,inflation + costPerByte c sz))
+                    else cands.Add(struct(pri, rng.Next(), r, c))
+                         candBytes <- (candBytes + sz)
             | _ -> failwith "invalid state"
-        struct(newFrame,erased)
+        cands.Sort(candidateOrder)
+        let evictQuota = (candBytes / 100UL) * uint64 pdecay
+        let mutable evicted = 0
+        let mutable evictedBytes = 0UL
+        let mutable inflation' = inflation
+        for (struct(pri,_,(struct(sz,_,h,_) as r),c)) in cands do
+            if (evictedBytes < evictQuota) then
+                c.Clear()
+                h.Free()
+                erased <- (erased + sz)
+                evicted <- (evicted + 1)
+                evictedBytes <- (evictedBytes + sz)
+                inflation' <- max inflation' pri
+            else newFrame.Add(r)
+        struct(newFrame, erased, evicted, evictedBytes, inflation')
+
+    // A shard holds a ring of frames. Receive adds items to the head
+    // frame under the shard lock, and scrubbing (under a separate lock)
+    // processes the oldest frame. 
+    //
+    // Counters are also sharded, to avoid contention.
+    type private Shard =
+        val mutable ixHd : int
+        val frames : Frame[]
+        val rngSrc : System.Random
+        val scrub : obj
+        val mutable inflation : float
+        val mutable hits : int64
+        val mutable misses : int64
+        val mutable evictions : int64
+        val mutable evicted : int64
+        new(framect,seed) =
+            { ixHd = 0
+              frames = Array.init (max framect 2) (fun _ -> new Frame())
+              rngSrc = new System.Random(seed)
+              scrub = new obj()
+              inflation = 0.0
+              hits = 0L
+              misses = 0L
+              evictions = 0L
+              evicted = 0L
+            }
+        member inline sh.NextFrameIx() = ((sh.ixHd + 1) % (sh.frames.Length))
+
+    // Registrations are buffered per thread, then added to a shard in
+    // batches. A thread is associated with one shard, so shards are
+    // mostly uncontended. If a thread exits, its buffered handles are
+    // freed by the finalizer, and their sizes released to the manager.
+    [<AllowNullLiteral>]
+    type private Buffer =
+        val items : Rsc[]
+        val mutable count : int
+        val shard : int
+        val release : SizeEst -> unit
+        new(shard,release) = 
+            { items = Array.zeroCreate 16; count = 0; shard = shard; release = release }
+        override b.Finalize() =
+            let mutable sz = 0UL
+            for ix = 0 to (b.count - 1) do
+                let struct(szItem,_,h,_) = b.items.[ix]
+                h.Free()
+                sz <- (sz + szItem)
+            if (0UL <> sz) then b.release sz
 
     /// Concrete cache manager.
     ///
@@ -59,71 +181,143 @@ module Cache =
     /// Cached items are only referenced weakly, such that GC can
     /// remove items independently from the cache manager clearing
     /// them. Due to GC, there is no guarantee Clear is called.
+    ///
+    /// The manager is sharded to reduce contention. Each thread
+    /// buffers a few items before adding them to its shard, and
+    /// shards are scrubbed in parallel, one frame per shard per
+    /// step. Size accounting is lock-free.
     type Manager =
-        val mutable private szMax : SizeEst
-        val mutable private szCur : SizeEst
-        val mutable private ixHd  : int
-        val private frames : Frame[]
-        val private rngSrc : System.Random
+        val mutable private szMax : int64
+        val mutable private szCur : int64
+        val private shards : Shard[]
+        val mutable private buffers : ThreadLocal<Buffer>
         val private pdecay : int
-        val mutable private bgtask : bool
-        new(framect,pdecay,quota) =
-            { szMax  = quota
-              szCur  = 0UL
-              ixHd   = 0
-              frames = Array.init (max framect 2) (fun _ -> new Frame()) 
-              rngSrc = new System.Random(0)
+        val mutable private bgtask : int
+        new(framect,pdecay,quota,shardct) as m =
+            { szMax  = int64 (min quota (uint64 System.Int64.MaxValue))
+              szCur  = 0L
+              shards = Array.init (max shardct 1) (fun ix -> new Shard(framect, ix))
+              buffers = null
               pdecay = (max pdecay 1)
-              bgtask = false
-            }
+              bgtask = 0
+            } then
+            m.buffers <- new ThreadLocal<Buffer>(fun () -> m.NewBuffer())
+        new(framect,pdecay,quota) = 
+            new Manager(framect, pdecay, quota, System.Environment.ProcessorCount)
         new(quota) = new Manager(12,60,quota)
 
+        member private m.NewBuffer() : Buffer =
+            let tid = Thread.CurrentThread.ManagedThreadId
+            new Buffer(tid % (m.shards.Length), fun sz -> m.Release sz)
+
+        member private m.Release (sz:SizeEst) : unit =
+            Interlocked.Add(&m.szCur, - (int64 sz)) |> ignore<int64>
+
+        member inline private m.OverQuota with get() : bool =
+            (Volatile.Read(&m.szMax) < Volatile.Read(&m.szCur))
+
         /// Adjust the managed quota.
         member m.Resize (quota:SizeEst) : unit =
-            lock m (fun () ->
-                m.szMax <- quota
-                m.ConsiderBGScrub())
+            Volatile.Write(&m.szMax, int64 (min quota (uint64 System.Int64.MaxValue)))
+            if m.OverQuota then 
+                let b = m.buffers.Value
+                if (b.count > 0) then m.Flush b
+                m.ConsiderBGScrub()
 
         /// Add object for management. When added, a size estimate must
         /// also be provided to count against the quota. 
         member m.Receive (c:Cached) (sz0:SizeEst) : unit =
-            lock m (fun () ->
-                let f = m.frames.[m.ixHd]
-                let sz = 80UL + sz0 // add per-item overhead
-                let tc = c.Usage + System.Int32.MinValue // logical touch
-                f.Add(struct(sz,tc,System.WeakReference(c)))
-                m.szCur <- (m.szCur + sz)
-                m.ConsiderBGScrub())
+            let sz = 80UL + sz0 // add per-item overhead
+            let tc = c.Usage + System.Int32.MinValue // logical touch
+            let b = m.buffers.Value
+            let pri = m.shards.[b.shard].inflation + costPerByte c sz
+            b.items.[b.count] <- struct(sz, tc, GCHandle.Alloc(c, GCHandleType.Weak), pri)
+            b.count <- (b.count + 1)
+            Interlocked.Add(&m.szCur, int64 sz) |> ignore<int64>
+            // when over quota, flush so our items are visible to scrubbing
+            let over = m.OverQuota
+            if over || (b.count = b.items.Length) then m.Flush b
+            if over then m.ConsiderBGScrub()
+
+        member private m.Flush (b:Buffer) : unit =
+            let sh = m.shards.[b.shard]
+            lock sh (fun () ->
+                let f = sh.frames.[sh.ixHd]
+                for ix = 0 to (b.count - 1) do
+                    f.Add(b.items.[ix]))
+            System.Array.Clear(b.items, 0, b.count)
+            b.count <- 0
+
+        /// Report a lookup served from the cache.
+        member m.Hit() : unit =
+            let sh = m.shards.[m.buffers.Value.shard]
+            Interlocked.Increment(&sh.hits) |> ignore<int64>
+
+        /// Report a lookup that had to load or recompute a resource.
+        member m.Miss() : unit =
+            let sh = m.shards.[m.buffers.Value.shard]
+            Interlocked.Increment(&sh.misses) |> ignore<int64>
+
+        /// Hit, miss, and eviction counts, and the current size.
+        member m.Stats() : Stats =
+            let inline sum fn = m.shards |> Array.sumBy (fun sh -> uint64 (fn sh))
+            { hits = sum (fun sh -> Volatile.Read(&sh.hits))
+              misses = sum (fun sh -> Volatile.Read(&sh.misses))
+              evictions = sum (fun sh -> Volatile.Read(&sh.evictions))
+              evicted = sum (fun sh -> Volatile.Read(&sh.evicted))
+              size = uint64 (max 0L (Volatile.Read(&m.szCur)))
+              quota = uint64 (Volatile.Read(&m.szMax))
+            }
 
         member private m.ConsiderBGScrub() : unit =
-            if (m.bgtask || (m.szMax >= m.szCur)) then () else
-            assert(Monitor.IsEntered(m))
-            m.bgtask <- true
+            if not m.OverQuota then () else
+            if (0 <> Interlocked.CompareExchange(&m.bgtask, 1, 0)) then () else
             Task.Run(fun () -> m.BGScrub()) |> ignore<Task>
 
-        member inline private m.NextFrameIx() =
-            ((m.ixHd + 1) % (m.frames.Length))
+        // scrub the oldest frame of a shard, returning how many items
+        // remain in the shard
+        member private m.ScrubShard (sh:Shard) : int =
+            lock (sh.scrub) (fun () ->
+                let ixScrub = lock sh (fun () -> 
+                    sh.ixHd <- sh.NextFrameIx()
+                    sh.NextFrameIx())
+                // Receive only writes to the head frame, so we don't need
+                // the shard lock to process this frame.
+                let f = sh.frames.[ixScrub]
+                let struct(f',erased,ct,sz,inflation') = 
+                    scrubFrame (sh.rngSrc) (m.pdecay) (sh.inflation) f
+                sh.frames.[ixScrub] <- f'
+                sh.inflation <- inflation'
+                Interlocked.Add(&sh.evictions, int64 ct) |> ignore<int64>
+                Interlocked.Add(&sh.evicted, int64 sz) |> ignore<int64>
+                Interlocked.Add(&m.szCur, - (int64 erased)) |> ignore<int64>
+                lock sh (fun () -> Array.sumBy (fun (f:Frame) -> f.Count) (sh.frames)))
 
         member private m.BGScrub() : unit =
-            assert(not (Monitor.IsEntered(m)))
-            lock (m.frames) (fun () ->
-                assert(m.bgtask)
-                lock m (fun () -> m.ixHd <- m.NextFrameIx())
-                let ixScrub = m.NextFrameIx()
-                let f = m.frames.[ixScrub]
-                let struct(f',erased) = scrubFrame (m.rngSrc) (m.pdecay) (f)
-                m.frames.[ixScrub] <- f'
-                lock m (fun () ->
-                    assert(m.szCur >= erased)
-                    m.szCur <- (m.szCur - erased)
-                    m.bgtask <- false
-                    m.ConsiderBGScrub()))
+            let scrubbed = Array.zeroCreate (m.shards.Length)
+            let scrub ix = scrubbed.[ix] <- m.ScrubShard (m.shards.[ix])
+            if (1 = m.shards.Length) 
+                then scrub 0
+                else Parallel.For(0, m.shards.Length, scrub) |> ignore<ParallelLoopResult>
+            Volatile.Write(&m.bgtask, 0)
+            // if every shard is empty (e.g. recent items are still
+            // buffered by threads), wait for the next Receive to retry.
+            if (Array.sum scrubbed > 0) then m.ConsiderBGScrub()
 
     /// Although there are some use-cases for multiple cache managers,
     /// it's usually best to just use a global cache manager to match
     /// our global heap and OS-provided virtual memory system.
     let defaultManager = new Manager(80_000_000UL)
 
+    // metrics for the global manager, sampled from Stats on report
+    do  let stat fn () = float (fn (defaultManager.Stats()))
+        Metrics.counterFn "stowage_cache_hits_total" "Lookups served from the cache." (stat (fun s -> s.hits))
+        Metrics.counterFn "stowage_cache_misses_total" "Lookups that had to load." (stat (fun s -> s.misses))
+        Metrics.counterFn "stowage_cache_evictions_total" "Items cleared to meet the quota." (stat (fun s -> s.evictions))
+        Metrics.counterFn "stowage_cache_evicted_bytes_total" "Estimated size of evicted items." (stat (fun s -> s.evicted))
+        Metrics.gauge "stowage_cache_resident_bytes" "Estimated size of managed items." (stat (fun s -> s.size))
+        Metrics.gauge "stowage_cache_quota_bytes" "Soft limit for managed items." (stat (fun s -> s.quota))
+
     /// Configure the global Stowage cache size. Default is eighty
     /// megabytes. Sizes aren't exact, but are used to estimate when
     /// an overflow occurs to drive background expiration of data.
@@ -145,3 +339,12 @@ module Cache =
     /// our quotas by too much. Better to err towards high estimates.
     let inline receive c sz = defaultManager.Receive c sz
 
+    /// Report a cache hit to the global manager.
+    let inline hit () = defaultManager.Hit()
+
+    /// Report a cache miss to the global manager.
+    let inline miss () = defaultManager.Miss()
+
+    /// Statistics for the global manager.
+    let inline stats () = defaultManager.Stats()
+
@@ -27,6 +27,27 @@ type Codec<'T> =
     abstract member Read : Stowage -> ByteSrc -> 'T
     abstract member Compact : Stowage -> 'T -> struct('T * SizeEst)
 
+// Fork-join state for parallel compaction. A thread is active while
+// running within compactPar, including forked tasks. Forks are limited
+// to a small multiple of processors, beyond which we run sequentially.
+[<Sealed>]
+type internal ParScope private () =
+    [<System.ThreadStatic; DefaultValue>] 
+    static val mutable private active : bool
+    static let forks : int[] = [| 0 |]
+    static member Active 
+        with get() = ParScope.active 
+        and set v = ParScope.active <- v
+    static member MaxForks : int = (2 * System.Environment.ProcessorCount)
+    static member TryFork () : bool =
+        if not ParScope.active then false else
+        let n = System.Threading.Interlocked.Increment(&forks.[0])
+        if (n <= ParScope.MaxForks) then true else
+        System.Threading.Interlocked.Decrement(&forks.[0]) |> ignore
+        false
+    static member Joined () : unit =
+        System.Threading.Interlocked.Decrement(&forks.[0]) |> ignore
+
 module Codec =
 
     let inline write (c:Codec<'T>) (v:'T) (dst:ByteDst) : unit = c.Write v dst
@@ -39,8 +60,58 @@ module Codec =
         let struct(v',_) = compactSz c db v
         v'
 
+    /// Fork-join for compaction of independent subtrees. Within a
+    /// parallel compaction, `b` may run on the thread pool while `a`
+    /// runs on the current thread. Otherwise, or if the pool is busy
+    /// with other forks, this simply computes `a` then `b`. 
+    let forkJoin (a:unit -> 'A) (b:unit -> 'B) : struct('A * 'B) =
+        if not (ParScope.TryFork()) then
+            let ra = a ()
+            struct(ra, b ())
+        else
+            let runB () =
+                let prior = ParScope.Active
+                ParScope.Active <- true
+                try b () 
+                finally 
+                    ParScope.Active <- prior
+                    ParScope.Joined()
+            let tb = System.Threading.Tasks.Task.Run(runB)
+            let ra = a ()
+            struct(ra, tb.GetAwaiter().GetResult())
+
+    /// Map over an array via forkJoin. Results are in order.
+    let forkMap (fn:'A -> 'B) (arr:'A[]) : 'B[] =
+        let out = Array.zeroCreate (arr.Length)
+        let rec mapRange lo hi =
+            if ((hi - lo) < 2) then
+                if (lo < hi) then out.[lo] <- fn (arr.[lo])
+            else
+                let mid = lo + ((hi - lo) / 2)
+                forkJoin (fun () -> mapRange lo mid) (fun () -> mapRange mid hi) 
+                    |> ignore
+        mapRange 0 (arr.Length)
+        out
+
+    /// Parallel compaction. Codecs may compact independent subtrees 
+    /// in parallel via forkJoin. The result is the same as compactSz, 
+    /// independent of scheduling, so structure sharing is preserved.
+    /// The Stowage must support concurrent Stow.
+    let compactSzPar (c:Codec<'T>) (db:Stowage) (v:'T) : struct('T * SizeEst) =
+        let prior = ParScope.Active
+        ParScope.Active <- true
+        try compactSz c db v 
+        finally ParScope.Active <- prior
+
+    /// Parallel compaction. See compactSzPar.
+    let compactPar (c:Codec<'T>) (db:Stowage) (v:'T) : 'T =
+        let struct(v',_) = compactSzPar c db v
+        v'
+
+    /// Write value to an exact-sized bytestring. This uses a pooled
+    /// scratch buffer, so the only allocation is for the result.
     let inline writeBytes (c:Codec<'T>) (v:'T) : ByteString =
-        ByteStream.write (write c v)
+        ByteStream.writeCopy (write c v)
 
     /// Read full bytestring as value, or raise ByteStream.ReadError
     let inline readBytes (c:Codec<'T>) (db:Stowage) (b:ByteString) : 'T =
@@ -74,22 +74,13 @@ type DB =
     /// should cleanly abort the transaction. (See DB.Retry)
     /// 
     /// For high-contention variables, clients should use external
-    /// synchronization to improve chances of transaction success.
+    /// synchronization to improve chances of transaction success, or
+    /// write with a merge function (see DB.writeMerge).
     abstract member Transact : (DB -> 'X) -> struct('X * bool)
 
-// TODO: Reactive Extensions for DB??
-//
-// I'd like the ability to wait upon a set of dependencies, such
-// that we can intelligently react to changes, to replay or retry
-// a transaction or simply to maintain cached computations.
-//
-// One possible approach is to install "automatic" transactions
-// that play once when installed and again whenever a dependency
-// changes, before final commit. However, insisting everything
-// be atomic might be a bad idea.
-//
-// Since I don't have a nice API or clear requirements, for now
-// I leave reactive extensions to ad-hoc DB wrappers.
+// Reactive extensions, i.e. automatic transactions that replay when
+// their dependencies change and computed TVars, are modeled by a DB
+// wrapper. See Stowage.Reactive.
 
 module DB =
 
@@ -118,6 +109,8 @@ module DB =
             member pdb.Stow v = pdb.Stowage.Stow v
             member pdb.Incref h = pdb.Stowage.Incref h
             member pdb.Decref h = pdb.Stowage.Decref h
+        interface StowageBatch with
+            member pdb.LoadMany hs = Stowage.loadMany (pdb.Stowage) hs
 
     /// Wrap DB to add a prefix upon registering durable TVars. This
     /// is useful to isolate subprograms to subdirectories within a
@@ -264,6 +257,9 @@ module DB =
         type Writes = Reads
         type Env = Reads
 
+        // merge a write into a concurrently committed value
+        type Merges = Map<DBVar, Data -> Data option>
+
         // compute serializable writes (excludes ephemerals)
         let serializeWrites (ws:Writes) : KVMap =
             let add wb (dbv:DBVar) v =
@@ -342,29 +338,56 @@ module DB =
                 member db.Stow v = db.Stowage.Stow v
                 member db.Incref h = db.Stowage.Incref h
                 member db.Decref h = db.Stowage.Decref h
+            interface StowageBatch with
+                member db.LoadMany hs = Stowage.loadMany (db.Stowage) hs
 
             member inline db.Read (dbv:DBVar<'V>) : 'V = unbox<'V>(dbv.Data)
             member inline db.Write (dbv:DBVar<'V>) (v:'V) : unit =
                 let ws = Map.add (dbv :> DBVar) (box<'V>(v)) (Map.empty)
-                let b = db.Commit (Map.empty) ws
+                let b = db.Commit (Map.empty) ws (Map.empty)
                 assert(b)
 
-            member private db.Commit (rs:Reads) (ws:Writes) : bool =
+            // Optimistic commit. If every conflicting read is on a var
+            // written with a merge function, we compute the merges outside
+            // of the critical section then retry with the merged writes.
+            // This permits concurrent commits on a shared variable (such 
+            // as a dictionary root) without retrying the transaction.
+            member private db.Commit (rs:Reads) (ws:Writes) (ms:Merges) : bool =
                 // snapshot consistency implies read-only transactions succeed,
                 // logically occurring before any change in the data.
                 if Map.isEmpty ws then true else
-                lock (db.mutex) (fun () ->
-                    let check (dbv:DBVar) v = 
-                        System.Object.ReferenceEquals((dbv.Data), v)
-                    let okReads = Map.forall check rs
-                    if not okReads then false else
-                    db.Precommit ws
-                    let commit (dbv:DBVar) v = 
-                        dbv.Data <- v
-                        if isDurable dbv // buffer the durable writes
-                           then db.buffer <- Map.add dbv v (db.buffer)
-                    Map.iter commit ws
-                    true)
+                let conflicts = lock (db.mutex) (fun () ->
+                    let conflict (dbv:DBVar) v = 
+                        not (System.Object.ReferenceEquals((dbv.Data), v))
+                    let cs = Map.filter conflict rs
+                    if not (Map.isEmpty cs) then
+                        let mergeable (dbv:DBVar) _ = Map.containsKey dbv ms
+                        if Map.forall mergeable cs 
+                            then Some (Map.map (fun (dbv:DBVar) _ -> dbv.Data) cs)
+                            else None
+                    else
+                        db.Precommit ws
+                        let commit (dbv:DBVar) v = 
+                            dbv.Data <- v
+                            if isDurable dbv // buffer the durable writes
+                               then db.buffer <- Map.add dbv v (db.buffer)
+                        Map.iter commit ws
+                        Some (Map.empty))
+                match conflicts with
+                | None -> false
+                | Some cs when Map.isEmpty cs -> true
+                | Some cs ->
+                    // rebase writes onto the concurrently committed values
+                    let merge rws (dbv:DBVar) cur =
+                        match rws with
+                        | None -> None
+                        | Some (struct(rs',ws')) ->
+                            match (Map.find dbv ms) cur with
+                            | None -> None
+                            | Some v -> Some (struct(Map.add dbv cur rs', Map.add dbv v ws'))
+                    match Map.fold merge (Some (struct(rs,ws))) cs with
+                    | Some (struct(rs',ws')) -> db.Commit rs' ws' ms
+                    | None -> false
             
             // precommit assumes we're holding lock
             member private db.Precommit (ws:Writes) : unit =
@@ -464,13 +487,13 @@ module DB =
                         then ss.memory <- Map.empty)
 
             member db.Transact (fn : DB -> 'X) : struct('X * bool) =
-                let (result,rs,ws,flush) = 
+                let (result,rs,ws,ms,flush) = 
                     let ss = db.AcquireSnapshot()
                     try let tx = new TX(db,ss,Map.empty)
                         let result = fn (tx :> DB)
-                        (result, tx.rs, tx.ws, tx.flush)
+                        (result, tx.rs, tx.ws, tx.ms, tx.flush)
                     finally db.ReleaseSnapshot ss
-                let ok = db.Commit rs ws
+                let ok = db.Commit rs ws ms
                 if (ok && flush) then db.Flush()
                 struct(result,ok)
        
@@ -481,6 +504,7 @@ module DB =
             val private mutex : System.Object 
             val mutable rs : Reads
             val mutable ws : Writes
+            val mutable ms : Merges
             val mutable flush : bool
 
             new(db,ss,env) =
@@ -489,6 +513,7 @@ module DB =
                   env = env
                   rs = Map.empty
                   ws = Map.empty
+                  ms = Map.empty
                   flush = false
                   mutex = new System.Object()
                 }
@@ -499,6 +524,8 @@ module DB =
                 member tx.Stow v = tx.Stowage.Stow v
                 member tx.Incref h = tx.Stowage.Incref h
                 member tx.Decref h = tx.Stowage.Decref h
+            interface StowageBatch with
+                member tx.LoadMany hs = Stowage.loadMany (tx.Stowage) hs
 
 
             // reads in a transaction will look in several locations:
@@ -535,7 +562,14 @@ module DB =
                 
             member tx.Write (dbv:DBVar<'V>) (v:'V) : unit =
                 lock (tx.mutex) (fun () ->
-                    tx.ws <- Map.add (dbv :> DBVar) (box<'V>(v)) (tx.ws))
+                    tx.ws <- Map.add (dbv :> DBVar) (box<'V>(v)) (tx.ws)
+                    tx.ms <- Map.remove (dbv :> DBVar) (tx.ms))
+
+            member tx.WriteMerge (dbv:DBVar<'V>) (v:'V) (merge:'V -> 'V option) : unit =
+                let m (cur:Data) = Option.map box<'V> (merge (unbox<'V>(cur)))
+                lock (tx.mutex) (fun () ->
+                    tx.ws <- Map.add (dbv :> DBVar) (box<'V>(v)) (tx.ws)
+                    tx.ms <- Map.add (dbv :> DBVar) m (tx.ms))
 
             member inline tx.Flush() = tx.flush <- true
 
@@ -552,7 +586,7 @@ module DB =
                 let env = leftBiasedUnion (tx.ws) (tx.env)
                 let ctx = new TX(tx.db, tx.ss, env)
                 let result = fn (ctx :> DB)
-                let ok = tx.Commit (ctx.rs) (ctx.ws)
+                let ok = tx.Commit (ctx.rs) (ctx.ws) (ctx.ms)
                 if (ok && ctx.flush) then tx.Flush()
                 struct(result,ok)
 
@@ -562,8 +596,9 @@ module DB =
             // updated in a manner that invalidates a read by the child.
             // If the transaction succeeds, we filter the read-set based
             // on the parent's write set (hence we logically read from 
-            // the moment of commit).
-            member private tx.Commit (rs:Reads) (ws:Writes) : bool =
+            // the moment of commit). Merge functions are not applied
+            // here, but are passed to the parent for its own commit.
+            member private tx.Commit (rs:Reads) (ws:Writes) (ms:Merges) : bool =
                 // snapshot consistency implies read-only transactions succeed
                 if Map.isEmpty ws then true else
                 lock (tx.mutex) (fun () ->
@@ -578,6 +613,11 @@ module DB =
                         Map.add dbv v m
                     tx.rs <- Map.foldBack addReadDep rs (tx.rs)
                     tx.ws <- leftBiasedUnion ws (tx.ws)
+                    let updMerge ms' dbv _ =
+                        match Map.tryFind dbv ms with
+                        | Some m -> Map.add dbv m ms'
+                        | None -> Map.remove dbv ms'
+                    tx.ms <- Map.fold updMerge (tx.ms) ws
                     true)
 
 
@@ -587,4 +627,25 @@ module DB =
     /// a relatively convenient way to create a full Stowage DB.
     let fromStorage s = (new StorageDB.RootDB(s :> Storage)) :> DB
 
+    /// A DB wrapper that forwards merged writes, see writeMerge.
+    type MergeWriter =
+        abstract member WriteMerge : TVar<'V> -> 'V -> ('V -> 'V option) -> unit
 
+    /// Write a TVar with a merge function, for optimistic concurrency.
+    ///
+    /// Normally, a transaction fails if a variable it read was updated
+    /// concurrently. If every such variable was written via writeMerge,
+    /// commit will instead apply each merge function to the current
+    /// value, and commit the merged values. A merge function returns
+    /// None to report a conflict, in which case commit fails as usual.
+    ///
+    /// Merge functions may run concurrently and more than once, after
+    /// the transaction has returned. They should be pure, and should
+    /// not access the DB. For a DB without transactional context, this
+    /// is the same as a plain write.
+    let rec writeMerge (db:DB) (tv:TVar<'V>) (v:'V) (merge:'V -> 'V option) : unit =
+        match db with
+        | :? StorageDB.TX as tx -> tx.WriteMerge (StorageDB.castTVar tv) v merge
+        | :? PDB as pdb -> writeMerge (pdb.DB) tv v merge
+        | :? MergeWriter as mw -> mw.WriteMerge tv v merge
+        | _ -> db.Write tv v
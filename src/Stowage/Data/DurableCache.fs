@@ -24,7 +24,7 @@ module DCache =
     // Each element will remember its given "memory" size estimate, 
     // which may be different from encoded size. Clients should use
     // use CVRef or other reference type explicitly for larger values.
-    type private E<'V> = (struct(SizeEst * 'V))
+    type internal E<'V> = (struct(SizeEst * 'V))
 
     // How should we represent the cache?
     //
@@ -38,13 +38,13 @@ module DCache =
 
     // Our basic storage representation - a sized tree. We need the
     // sizes to help drive GC for quota management. 
-    type private StowageRep<'V> =
+    type internal StowageRep<'V> =
         { data  : LSMTrie<E<'V>>
           size  : uint64            // how much data (total of SizeEst)
           count : uint64            // how many keys
         }
 
-    let private cRep cV =
+    let internal cRep cV =
         let cT = LSMTrie.codec (EncPair.codec' (EncVarNat.codec) cV)
         { new Codec<StowageRep<'V>> with
             member cR.Write r dst =
@@ -66,20 +66,174 @@ module DCache =
         }
 
 
-    // thoughts: should I favor an LSM trie or a plain trie? A plain
-    // trie has advantages of more precise size estimates, but for a
-    // cache the update performance and working sets from LSM may be
-    // more valuable.  
-    // 
-    // If I don't secure-hash keys, an IntMap based hashmap may be wise.
-    //
-    // I don't want to use a DB TVar directly because I don't want to
-    // sync every update with other durable DB updates. Instead, I might
-    // want to write after some threshold is buffered in memory, or after
-    // several seconds delay. Or some other heuristic. Loss is acceptable.
-    //
-    // An interesting point: if Codec changes, I can presumably handle
-    // this by simply erasing the keys that raised ByteStream.ReadError.
-    // So cache is highly resilient to changes in type or codec. Similar
-    // for missing a hash resource.
+    let private emptyRep : StowageRep<'V> = 
+        { data = LSMTrie.empty; size = 0UL; count = 0UL }
+
+    /// Cache statistics. Hits and misses are counted per process,
+    /// while count and size describe the whole (durable) cache.
+    type Stats =
+        { hits    : uint64      // successful lookups
+          misses  : uint64      // failed lookups
+          added   : SizeEst     // total size of values added
+          decayed : SizeEst     // total size of values erased for quota
+          count   : uint64      // keys in cache
+          size    : SizeEst     // total size of cached values
+        }
+
+    // Caches are monitored for metrics by weak reference. Each entry
+    // has the cache key and a function to read the cache's stats.
+    let private monitored = new ResizeArray<struct(string * System.WeakReference * (obj -> Stats))>()
+
+    let private monitor (key:ByteString) (c:obj) (read:obj -> Stats) : unit =
+        lock monitored (fun () ->
+            monitored.Add(struct(BS.toString key, new System.WeakReference(c), read)))
+
+    /// A durable cache, persisted in a DB TVar.
+    ///
+    /// Updates are accumulated in memory, then written to the TVar
+    /// after a threshold is buffered or upon explicit `sync`. Like any
+    /// TVar write, it is durable only after the DB is flushed. Loss of
+    /// recent updates is acceptable for a cache, so we don't flush.
+    ///
+    /// When the cache exceeds its Quota, we erase a random fraction
+    /// of the keys. Because keys are mangled by secure hash, erasing
+    /// everything under a random key prefix is a fair random sample.
+    /// Repeated over time, this gives a simple exponential decay.
+    type C<'V> =
+        val internal DB : DB
+        val internal Var : TVar<StowageRep<'V> option>
+        val internal Codec : Codec<StowageRep<'V>>
+        val mutable internal Rep : StowageRep<'V>
+        val mutable internal Buffered : SizeEst
+        val mutable internal Hits : int64
+        val mutable internal Misses : int64
+        val mutable internal Added : SizeEst
+        val mutable internal Decayed : SizeEst
+        val internal Rand : System.Random
+        /// Total size of cached values before we decay entries.
+        val mutable Quota : SizeEst
+        /// Buffered update size before we write to the DB TVar.
+        val mutable SyncThresh : SizeEst
+        new(db:DB, key:ByteString, cV:Codec<'V>, quota:SizeEst) as c =
+            let cR = cRep cV
+            let var = db.Register key cR
+            let rep = 
+                // a cache that fails to parse (e.g. due to a codec
+                // change) is simply discarded.
+                try defaultArg (db.Read var) emptyRep
+                with 
+                | ByteStream.ReadError -> emptyRep
+                | MissingRsc _ -> emptyRep
+            { DB = db; Var = var; Codec = cR; Rep = rep; Buffered = 0UL
+              Hits = 0L; Misses = 0L; Added = 0UL; Decayed = 0UL
+              Rand = new System.Random()
+              Quota = quota
+              SyncThresh = (4UL * 1024UL * 1024UL)
+            } then
+            monitor key c (fun o ->
+                let c = o :?> C<'V>
+                lock c (fun () ->
+                    { hits = uint64 c.Hits; misses = uint64 c.Misses
+                      added = c.Added; decayed = c.Decayed
+                      count = c.Rep.count; size = c.Rep.size
+                    }))
+
+        /// The Stowage for this cache, e.g. to stow large values.
+        member c.Stowage with get() : Stowage = (c.DB :> Stowage)
+
+    // erase a random fraction (about 1/32) of the keys.
+    let private decay (c:C<'V>) : unit =
+        let r = c.Rep
+        let p = mangleKey (BS.fromString (string (c.Rand.Next()))) |> BS.take 1
+        let erase struct(t,sz,n) k (struct(szE,_):E<'V>) =
+            struct(LSMTrie.remove k t, (sz + szE), (n + 1UL))
+        let struct(data',sz,n) = 
+            LSMTrie.fold erase (struct(r.data, 0UL, 0UL)) (LSMTrie.selectPrefix p r.data)
+        c.Decayed <- (c.Decayed + sz)
+        c.Rep <- { data = data'; size = (r.size - sz); count = (r.count - n) }
+
+    // write the cache to its TVar. Assumes lock held. We compact the
+    // tree first, so the TVar holds a small root node and each write
+    // stows only the nodes updated since the last.
+    let private write (c:C<'V>) : unit =
+        let mutable fuel = 64 // guard against tiny quotas
+        while (c.Rep.size > c.Quota) && (fuel > 0) do
+            decay c
+            fuel <- (fuel - 1)
+        c.Rep <- Codec.compact (c.Codec) (c.DB :> Stowage) (c.Rep)
+        c.Buffered <- 0UL
+        c.DB.Write (c.Var) (Some (c.Rep))
+
+    /// Write buffered updates to the DB TVar. The caller must flush
+    /// the DB if updates should be durable.
+    let sync (c:C<'V>) : unit = lock c (fun () -> write c)
+
+    /// Lookup a value in the cache. Thread-safe. Lookups search a
+    /// snapshot of the cache without holding its lock, so concurrent
+    /// lookups don't serialize on loading stowed nodes.
+    let tryFind (k:Key) (c:C<'V>) : 'V option =
+        let mk = mangleKey k
+        let r = System.Threading.Volatile.Read(&c.Rep)
+        match LSMTrie.tryFind mk (r.data) with
+        | Some (struct(_,v)) ->
+            System.Threading.Interlocked.Increment(&c.Hits) |> ignore<int64>
+            Some v
+        | None ->
+            System.Threading.Interlocked.Increment(&c.Misses) |> ignore<int64>
+            None
+
+    /// Add a value to the cache with a size estimate. Thread-safe.
+    ///
+    /// The size estimate guides quota management, so it should count
+    /// the value's full memory or storage cost. Larger values should
+    /// use CVRef or a similar reference type.
+    let add (k:Key) (v:'V) (sz:SizeEst) (c:C<'V>) : unit =
+        let mk = mangleKey k
+        lock c (fun () ->
+            let r = c.Rep
+            let struct(size,count) =
+                match LSMTrie.tryFind mk (r.data) with
+                | Some (struct(szOld,_)) -> struct(r.size - szOld, r.count)
+                | None -> struct(r.size, r.count + 1UL)
+            let data' = LSMTrie.add mk (struct(sz,v)) (r.data)
+            c.Rep <- { data = data'; size = (size + sz); count = count }
+            c.Added <- (c.Added + sz)
+            c.Buffered <- (c.Buffered + sz)
+            if (c.Buffered > c.SyncThresh) then write c)
+
+    /// Remove a value from the cache. Thread-safe.
+    let remove (k:Key) (c:C<'V>) : unit =
+        let mk = mangleKey k
+        lock c (fun () ->
+            let r = c.Rep
+            match LSMTrie.tryFind mk (r.data) with
+            | None -> ()
+            | Some (struct(sz,_)) ->
+                let data' = LSMTrie.remove mk (r.data)
+                c.Rep <- { data = data'; size = (r.size - sz); count = (r.count - 1UL) })
+
+    /// Current cache statistics.
+    let stats (c:C<'V>) : Stats =
+        lock c (fun () ->
+            { hits = uint64 c.Hits; misses = uint64 c.Misses
+              added = c.Added; decayed = c.Decayed
+              count = c.Rep.count; size = c.Rep.size
+            })
+
+    // sample live caches, labeled by key, dropping collected caches
+    let private sample (fn:Stats -> uint64) () : (string * float) list =
+        lock monitored (fun () ->
+            monitored.RemoveAll(fun (struct(_,w,_)) -> not w.IsAlive) |> ignore<int>
+            [ for struct(k,w,read) in monitored do
+                match w.Target with
+                | null -> ()
+                | c -> yield (k, float (fn (read c))) ])
+
+    do  let family name help kind fn = Metrics.family name help kind "cache" (sample fn)
+        family "stowage_dcache_hits_total" "Successful lookups." "counter" (fun s -> s.hits)
+        family "stowage_dcache_misses_total" "Failed lookups." "counter" (fun s -> s.misses)
+        family "stowage_dcache_added_bytes_total" "Total size of values added." "counter" (fun s -> s.added)
+        family "stowage_dcache_decayed_bytes_total" "Total size of values erased for quota." "counter" (fun s -> s.decayed)
+        family "stowage_dcache_keys" "Keys in cache." "gauge" (fun s -> s.count)
+        family "stowage_dcache_bytes" "Total size of cached values." "gauge" (fun s -> s.size)
 
@@ -273,6 +273,22 @@ module IntMap =
                 if Option.isSome pickL then pickL else
                 tryPick fn kr r
 
+        // fold over leaves in memory, skipping remote nodes
+        let rec foldLocal fn s kp node =
+            match node with
+            | Leaf (k,v) -> fn s (kp ||| k) v
+            | Inner (p, b, Local (struct(l,r),_)) ->
+                let struct(kl,kr) = keyPrefixes kp p b
+                foldLocal fn (foldLocal fn s kl l) kr r
+            | Inner (_, _, Remote _) -> s
+
+        // test whether any node is remote
+        let rec hasRemote node =
+            match node with
+            | Leaf _ -> false
+            | Inner (_, _, Local (struct(l,r),_)) -> (hasRemote l) || (hasRemote r)
+            | Inner (_, _, Remote _) -> true
+
         let rec toSeq kp node =
             seq {
                 match node with
@@ -284,6 +300,47 @@ module IntMap =
                     yield! toSeq kr r
             }
 
+        // collect up to `n` remote refs that aren't cached, in key order.
+        // We search through local and cached nodes.
+        let rec private scanRemotes n (acc:ResizeArray<_>) node =
+            if (acc.Count >= n) then () else
+            match node with
+            | Leaf _ -> ()
+            | Inner (_, _, Local (struct(l,r),_)) ->
+                scanRemotes n acc l
+                scanRemotes n acc r
+            | Inner (_, _, Remote ref) ->
+                match ref.cache with
+                | Some (struct(l,r)) ->
+                    scanRemotes n acc l
+                    scanRemotes n acc r
+                | None -> acc.Add(ref)
+
+        // toSeq with a stack of pending nodes. Upon a cache miss, we'll
+        // prefetch the next few remote nodes from the stack while we load
+        // the current node.
+        let toSeqAhead (ahead:int) kp node =
+            let prefetch stack =
+                let acc = new ResizeArray<_>()
+                for (struct(_,n)) in stack do scanRemotes ahead acc n
+                LVRef.prefetchAsync (acc.ToArray())
+            let rec loop stack =
+                seq {
+                    match stack with
+                    | [] -> ()
+                    | (struct(kp,Leaf (k,v)) :: rest) ->
+                        yield ((kp ||| k), v)
+                        yield! loop rest
+                    | (struct(kp,Inner (p, b, np)) :: rest) ->
+                        match np with
+                        | Remote ref when not (LVRef.isCached ref) -> prefetch rest
+                        | _ -> ()
+                        let struct(kl,kr) = keyPrefixes kp p b
+                        let struct(l,r) = load' np
+                        yield! loop (struct(kl,l) :: struct(kr,r) :: rest)
+                }
+            loop [struct(kp,node)]
+
         let rec toSeqR kp node = 
             seq {
                 match node with
@@ -428,6 +485,19 @@ module IntMap =
         | Some v -> v
         | None -> raise (System.Collections.Generic.KeyNotFoundException())
 
+    /// Fold over key-value pairs in memory, in key order, skipping any
+    /// that are held remotely in Stowage. Doesn't touch Stowage.
+    let foldLocal (fn:'S -> Key -> 'V -> 'S) (s:'S) (t:Tree<'V>) : 'S =
+        match t with
+        | Some n -> Node.foldLocal fn s 0UL n
+        | None -> s
+
+    /// Test whether any part of a tree is remote. Doesn't touch Stowage.
+    let hasRemote (t:Tree<'V>) : bool =
+        match t with
+        | Some n -> Node.hasRemote n
+        | None -> false
+
     /// Return tree with data at the given key loaded, or enough data
     /// to verify presence of the key without Stowage loads.
     let touch (k:Key) (t:Tree<'V>) : Tree<'V> =
@@ -521,6 +591,15 @@ module IntMap =
         | Some n -> Node.toSeq 0UL n
         | None -> Seq.empty
 
+    /// Sequence of key-value pairs, prefetching stowed nodes ahead of
+    /// the traversal. Upon loading a node from Stowage, we'll prefetch
+    /// up to `ahead` pending nodes in the background, as a batch. This
+    /// mitigates load latency for scans over large, cold trees.
+    let toSeqAhead (ahead:int) (t:Tree<'V>) : seq<(Key * 'V)> =
+        match t with
+        | Some n -> Node.toSeqAhead ahead 0UL n
+        | None -> Seq.empty
+
     /// Sequence of key-value pairs (reverse-ordered by key)
     let toSeqR (t:Tree<'V>) : seq<(Key * 'V)> =
         match t with
@@ -574,12 +653,38 @@ module IntMap =
         let cLeaf = byte 'L'
         let cInner = byte 'N'
 
+        // Inner nodes with a local pair of children are the bulk of
+        // a tree, so they have a denser encoding: the critbit is held
+        // in the tag byte, and a zero prefix (the common case) is left
+        // implicit. The `local` CVRef marker is also omitted. 
+        //
+        //   0b11bbbbbb (pair)             - local, zero prefix
+        //   0b10bbbbbb (prefix) (pair)    - local, prefix as varnat
+        //
+        // The original `N` encoding is still used for remote children,
+        // and is readable for local children.
+        let cLocal0 = 0xC0uy
+        let cLocalP = 0x80uy
+        let private critbitMask = 0x3Fuy
+        do assert((cLeaf < cLocalP) && (cInner < cLocalP))
+
+        // size of a local inner node, excepting the pair
+        let inline private localSize (p:Key) : SizeEst =
+            if (0UL = p) then 1UL else (1UL + EncVarNat.size p)
+
         let write cV cNP node dst =
             match node with
             | Leaf (k,v) ->
                 EncByte.write cLeaf dst
                 EncVarNat.write k dst
                 Codec.write cV v dst
+            | Inner (p,b,Local (lr,_)) ->
+                if (0UL = p) then 
+                    EncByte.write (cLocal0 ||| b) dst 
+                else
+                    EncByte.write (cLocalP ||| b) dst
+                    EncVarNat.write p dst
+                Codec.write cNP lr dst
             | Inner (p,b,np) ->
                 EncByte.write cInner dst
                 EncVarNat.write p dst
@@ -592,6 +697,13 @@ module IntMap =
                 let k = EncVarNat.read src
                 let v = Codec.read cV db src
                 Leaf (k,v)
+            else if (cLocalP = (b0 &&& cLocalP)) then
+                let b = (b0 &&& critbitMask)
+                let p = if (cLocal0 = (b0 &&& cLocal0)) then 0UL else EncVarNat.read src
+                let s0 = ByteStream.bytesRem src
+                let lr = Codec.read cNP db src
+                let sz = uint64 (s0 - ByteStream.bytesRem src)
+                Inner (p, b, Local (lr, sz))
             else if (cInner <> b0) then
                 raise (ByteStream.ReadError)
             else 
@@ -606,12 +718,23 @@ module IntMap =
                 let struct(v',szV) = Codec.compactSz cV db v
                 struct(Leaf(k,v'), 1UL + EncVarNat.size k + szV)
             | Inner (p,b,np) ->
-                let szPrefix = 2UL + EncVarNat.size p // cInner, b, p
                 let struct(np',szNP) = EncCVRef.compact thresh cNP db np
-                struct(Inner(p,b,np'), szPrefix + szNP)
+                match np' with
+                | Local (_,szLR) -> struct(Inner(p,b,np'), localSize p + szLR)
+                | Remote _ -> 
+                    let szPrefix = 2UL + EncVarNat.size p // cInner, b, p
+                    struct(Inner(p,b,np'), szPrefix + szNP)
+
+        // whether compaction must walk a node's children, i.e. it is a
+        // local node that is new or larger than the threshold.
+        let private needsWalk thresh node =
+            match node with
+            | Inner (_,_,Local (_,szEst)) -> (szEst >= thresh)
+            | _ -> false
 
         // codec for pair of nodes is primary recursion point,
         // given we only compact at split points (pair of nodes).
+        // If both nodes need a walk, we fork (see Codec.forkJoin).
         let codecNP (thresh:SizeEst) (cV:Codec<'V>) = 
             { new Codec<struct(Node<'V> * Node<'V>)> with
                 member cNP.Write (struct(l,r)) dst = 
@@ -622,6 +745,12 @@ module IntMap =
                     let r = read cV cNP db src
                     struct(l,r)
                 member cNP.Compact db (struct(l,r)) =
+                    if (needsWalk thresh l) && (needsWalk thresh r) then
+                        let struct(struct(l',szL),struct(r',szR)) =
+                            Codec.forkJoin (fun () -> compact thresh cV cNP db l)
+                                           (fun () -> compact thresh cV cNP db r)
+                        struct(struct(l',r'), szL + szR)
+                    else
                     let struct(l',szL) = compact thresh cV cNP db l
                     let struct(r',szR) = compact thresh cV cNP db r
                     struct(struct(l',r'), szL + szR)
@@ -21,11 +21,17 @@ module LSMTrie =
     ///
     /// Updates to remote tree nodes are buffered locally until compaction.
     /// A compaction operation will heuristically flush updates to children.
+    ///
+    /// The summary is a 256-bit map of child indices, computed upon
+    /// compaction. It is a superset of the children held remotely,
+    /// so lookups for absent keys may skip loading remote nodes. An
+    /// empty summary is unknown, and is used for local nodes.
     type Tree<'V> =
         { prefix    : ByteString
           value     : 'V option         // value, if any.
           children  : IntMap<Tree<'V>>  // tree child array (uses stowage)
           updates   : IntMap<Trie<'V option>> // updates buffered in memory
+          summary   : ByteString        // remote child indices, or empty
         }
         // note: compaction for updates should be performed with large
         // thresholds, which allows us to cache size estimates and avoid
@@ -36,6 +42,7 @@ module LSMTrie =
           value = None
           children = IntMap.empty
           updates = IntMap.empty
+          summary = BS.empty
         }
 
     let singleton (k:Key) (v:'V) : Tree<'V> =
@@ -43,6 +50,7 @@ module LSMTrie =
           value = Some v
           children = IntMap.empty
           updates = IntMap.empty
+          summary = BS.empty
         }
 
     /// Test whether LSMTrie is empty. (Assuming valid structure.)
@@ -75,6 +83,12 @@ module LSMTrie =
             loop (ix + 1)
         loop 0
 
+    // test whether a remote child index may be present. 
+    let inline private mayHaveChild (ix:uint64) (t:Tree<_>) : bool =
+        (32 <> t.summary.Length) 
+            || (0uy <> (t.summary.[int (ix >>> 3)] &&& (1uy <<< int (ix &&& 7UL))))
+            || not (IntMap.isKeyRemote ix (t.children))
+
     let rec tryFind (k:Key) (t:Tree<'V>) : 'V option =
         let n = bytesShared k (t.prefix)
         if (n <> t.prefix.Length) then None else
@@ -89,6 +103,7 @@ module LSMTrie =
         match keyUpdate with
         | Some vUpd -> vUpd // is `None` if removed.
         | None -> // search children recursively.
+            if not (mayHaveChild ix t) then None else
             match IntMap.tryFind ix (t.children) with
             | Some c -> tryFind k' c
             | None -> None
@@ -115,13 +130,13 @@ module LSMTrie =
     // assumes remote update-set is valid relative to child-set.
     let private mkNode p v cs us =
         if (Option.isSome v) || not (IntMap.isEmpty us) then 
-            { prefix = p; value = v; children = cs; updates = us }
+            { prefix = p; value = v; children = cs; updates = us; summary = BS.empty }
         else 
             match cs with
             | None -> empty
             | Some (IntMap.Leaf(b,c)) ->
                 { c with prefix = joinBytes p (byte b) (c.prefix) }
-            | _ -> { prefix = p; value = None; children = cs; updates = IntMap.empty }
+            | _ -> { prefix = p; value = None; children = cs; updates = IntMap.empty; summary = BS.empty }
 
  
     let inline private setChildAt ix c' cs =
@@ -178,6 +193,7 @@ module LSMTrie =
                   value = Some v
                   children = IntMap.singleton ix c
                   updates = IntMap.empty
+                  summary = BS.empty
                 }
         else if (n = t.prefix.Length) then
             // key is deeper; add or buffer the write
@@ -211,6 +227,7 @@ module LSMTrie =
               value = None
               children = cs' 
               updates = IntMap.empty
+              summary = BS.empty
             }
 
     /// Return copy of tree with key-value pair added or updated.
@@ -408,6 +425,7 @@ module LSMTrie =
           value = None
           children = IntMap.singleton ix c
           updates = IntMap.empty
+          summary = BS.empty
         }
 
 
@@ -517,48 +535,154 @@ module LSMTrie =
     //
     // Priority: low, until a use case arises.
                         
+    /// Compaction policy. Stowage nodes are written when a subtree
+    /// exceeds the page size. An update buffer is flushed to children
+    /// when it exceeds the buffer threshold for the node's depth, as
+    /// the number of trie nodes from the root.
+    ///
+    /// Uniform buffers are similar to leveling in an LSM tree. Larger
+    /// buffers near the root are similar to tiering: each update is
+    /// rewritten fewer times, but nodes near the root are larger.
+    type Policy =
+        { page    : SizeEst
+          buffer  : int -> SizeEst
+        }
+
+    module Policy =
+        /// Depths beyond this use the same buffer as this depth.
+        let maxDepth : int = 15
+
+        /// Uniform buffer threshold, half the page size.
+        let leveled (page:SizeEst) : Policy =
+            { page = page; buffer = (fun _ -> (page / 2UL)) }
+
+        /// Buffer thresholds grow by `ratio` per depth for the first
+        /// `levels` depths, e.g. with ratio 4 and two levels, the root
+        /// buffers 8 pages, depth 1 buffers 2 pages, then half a page.
+        let tiered (page:SizeEst) (ratio:int) (levels:int) : Policy =
+            if (ratio < 1) then invalidArg "ratio" "expecting ratio >= 1"
+            let buffer d = 
+                let n = max 0 (levels - d)
+                (page / 2UL) * (pown (uint64 ratio) n)
+            { page = page; buffer = buffer }
+
+    /// Write amplification counters, by depth, for compactions with a
+    /// given codec. Written counts bytes of trie nodes rewritten upon 
+    /// compaction (excluding children). Flushed counts bytes of update
+    /// buffers flushed to children. Updated counts bytes logically
+    /// updated, as reported by the application via RecordUpdate. 
+    type WriteStats =
+        val Written : int64[]
+        val Flushed : int64[]
+        val mutable Updated : int64
+        new() = 
+            { Written = Array.zeroCreate (1 + Policy.maxDepth)
+              Flushed = Array.zeroCreate (1 + Policy.maxDepth)
+              Updated = 0L
+            }
+
+        /// Record logical bytes updated, e.g. key and value sizes.
+        member s.RecordUpdate (bytes:SizeEst) : unit =
+            System.Threading.Interlocked.Add(&s.Updated, int64 bytes) |> ignore
+
+        member internal s.RecordWrite (depth:int) (written:SizeEst) (flushed:SizeEst) : unit =
+            System.Threading.Interlocked.Add(&s.Written.[depth], int64 written) |> ignore
+            if (0UL <> flushed) then
+                System.Threading.Interlocked.Add(&s.Flushed.[depth], int64 flushed) |> ignore
+
+        member s.TotalWritten with get() : int64 = Array.sum (s.Written)
+        member s.TotalFlushed with get() : int64 = Array.sum (s.Flushed)
+
+        /// Bytes written per byte logically updated (NaN if unknown).
+        member s.Amplification with get() : float = 
+            if (0L = s.Updated) then nan else
+            (float (s.TotalWritten)) / (float (s.Updated))
+
+        override s.ToString() =
+            sprintf "written %A flushed %A updated %d (amplification %.2f)"
+                (s.Written) (s.Flushed) (s.Updated) (s.Amplification)
+
+    // Compute the summary upon compaction. The prior summary covers
+    // remote children of `cs`, if known, and we add local children.
+    let private summarize (prior:ByteString) (cs:IntMap<Tree<'V>>) (cs':IntMap<Tree<'V>>) : ByteString =
+        if not (IntMap.hasRemote cs') then BS.empty else
+        let remote = IntMap.hasRemote cs
+        if remote && (32 <> prior.Length) then BS.empty else
+        let bits = if remote then BS.toArray prior else Array.zeroCreate 32
+        let setBit () (ix:uint64) _ =
+            bits.[int (ix >>> 3)] <- bits.[int (ix >>> 3)] ||| (1uy <<< int (ix &&& 7UL))
+        IntMap.foldLocal setBit () cs
+        BS.unsafeCreateA bits
+                        
     module Enc =
 
-        // Encoding is concatenation of key, value, updates, and children.
-        // Compaction will flush updates based on a given `buffer` size. 
+        let private tagSummary = 0x80uy
+
+        // Encoding is concatenation of key, value, updates, children and
+        // summary. Compaction will flush updates based on a `buffer` size.
+        // A codec is constructed per depth, up to Policy.maxDepth.
+        //
+        // Nodes with a summary begin with a tag byte, 0x80. This can't
+        // begin the VarNat size of the key, so nodes written before we
+        // had summaries are read as-is, with the empty (unknown) summary.
         type TreeCodec<'V> =
             val value    : Codec<'V>                  // value encoder
             val updates  : Codec<IntMap<Trie<'V option>>>  // for updates
             val buffer   : SizeEst                    // update buffer threshold
+            val depth    : int                        // trie depth of node
+            val stats    : WriteStats                 // write amplification
             val mutable children : Codec<IntMap<Tree<'V>>>    // for recursion
             interface Codec<Tree<'V>> with
                 member c.Write t dst =
+                    if not (BS.isEmpty t.summary) then ByteStream.writeByte tagSummary dst
                     EncBytes.write (t.prefix) dst
                     EncOpt.write (c.value) (t.value) dst
                     Codec.write (c.children) (t.children) dst
                     Codec.write (c.updates) (t.updates) dst
+                    if not (BS.isEmpty t.summary) then EncBytes.write (t.summary) dst
                 member c.Read db src =
+                    let tagged = (tagSummary = ByteStream.peekByte src)
+                    if tagged then ByteStream.readByte src |> ignore<byte>
                     let p = EncBytes.read src
                     let v = EncOpt.read (c.value) db src
                     let cs = Codec.read (c.children) db src
                     let us = Codec.read (c.updates) db src
-                    { prefix = p; value = v; children = cs; updates = us }
+                    let sm = if tagged then EncBytes.read src else BS.empty
+                    { prefix = p; value = v; children = cs; updates = us; summary = sm }
                 member c.Compact db t =
                     let szP = EncBytes.size (t.prefix)
                     let struct(v',szV) = EncOpt.compact (c.value) db (t.value)
                     let struct(us',szUpd) = Codec.compactSz (c.updates) db (t.updates)
-                    if (szUpd > c.buffer) then
-                        // flush the update buffer during compaction
-                        let struct(cs',szCS) = Codec.compactSz (c.children) db (flush us' (t.children))
-                        let t' = { prefix = t.prefix; value = v'; children = cs'; updates = IntMap.empty }
-                        struct(t',szP + szV + szCS + 1UL)
-                    else 
-                        // reuse children then write update buffer
-                        let struct(cs',szCS) = Codec.compactSz (c.children) db (t.children)
-                        let t' = { prefix = t.prefix; value = v'; children = cs'; updates = us' }
-                        struct(t',szP + szV + szCS + szUpd)
-            new(cv,page,buffer) 
+                    // flush the update buffer during compaction, or reuse
+                    // children then write update buffer
+                    let flushing = (szUpd > c.buffer)
+                    let cs = if flushing then flush us' (t.children) else (t.children)
+                    let struct(us'',szU) = if flushing then struct(IntMap.empty, 1UL) 
+                                                     else struct(us', szUpd)
+                    let struct(cs',szCS) = Codec.compactSz (c.children) db cs
+                    let sm = summarize (t.summary) cs cs'
+                    let szS = if BS.isEmpty sm then 0UL else 1UL + EncBytes.size sm
+                    let t' = { prefix = t.prefix; value = v'; children = cs'; updates = us''; summary = sm }
+                    c.stats.RecordWrite (c.depth) (szP + szV + szU + szS) 
+                                        (if flushing then szUpd else 0UL)
+                    struct(t',szP + szV + szCS + szU + szS)
+            private new(cv,us,policy:Policy,stats,depth) 
                 as tc = { value = cv 
-                          updates = Trie.Enc.TreeCodec(EncOpt.codec cv, System.UInt64.MaxValue).children
-                          buffer = buffer
+                          updates = us
+                          buffer = policy.buffer depth
+                          depth = depth
+                          stats = stats
                           children = Codec.invalid
                         } then
-                tc.children <- IntMap.codec' page (tc :> Codec<Tree<'V>>)
+                let next = 
+                    if (depth >= Policy.maxDepth) then tc else
+                    new TreeCodec<'V>(cv,us,policy,stats,depth + 1)
+                tc.children <- IntMap.codec' (policy.page) (next :> Codec<Tree<'V>>)
+            new(cv,policy:Policy,stats:WriteStats) = 
+                let us = Trie.Enc.TreeCodec(EncOpt.codec cv, System.UInt64.MaxValue).children
+                new TreeCodec<'V>(cv,us,policy,stats,0)
+            new(cv,page,buffer) = 
+                new TreeCodec<'V>(cv, { page = page; buffer = (fun _ -> buffer) }, new WriteStats())
             new(cv,thresh) = new TreeCodec<'V>(cv,thresh,thresh/2UL) 
 
     /// Codec with specified heuristic compaction threshold.
@@ -578,6 +702,10 @@ module LSMTrie =
     let inline codec' (thresh:SizeEst) (cV:Codec<'V>) =
         Enc.TreeCodec<'V>(cV,thresh) :> Codec<Tree<'V>>
 
+    /// Codec with a compaction policy, recording write amplification.
+    let inline codecWith (policy:Policy) (stats:WriteStats) (cV:Codec<'V>) =
+        Enc.TreeCodec<'V>(cV,policy,stats) :> Codec<Tree<'V>>
+
     /// Codec with default compaction threshold. 
     let inline codec cV = codec' (IntMap.EncNode.defaultThreshold) cV
 
@@ -24,6 +24,8 @@ type LVRef<'V> =
     val internal lvref : Lazy<VRef<'V>>
     val mutable internal cache : 'V option
     val mutable internal tc : int
+    val mutable internal cost : int64 // load and parse time, microseconds
+    val mutable internal fetching : int // 1 while a prefetch is pending
     member r.VRef with get() = r.lvref.Force()
     member inline r.ID with get() = r.VRef.ID
     override r.ToString() = r.VRef.ToString()
@@ -44,7 +46,10 @@ type LVRef<'V> =
         member r.Clear() = 
             r.lvref.Force() |> ignore<VRef<'V>>
             r.cache <- None
-    internal new (lvref,cache) = { lvref = lvref; cache = cache; tc = 0 }
+    interface Costly with
+        member r.Cost with get() = r.cost
+    internal new (lvref,cache) = 
+        { lvref = lvref; cache = cache; tc = 0; cost = 0L; fetching = 0 }
 
 module LVRef =
 
@@ -84,20 +89,77 @@ module LVRef =
         Cache.receive (ref :> Cached) sz
         ref
 
+    let private loadTimer =
+        Metrics.timer "stowage_lvref_load_seconds" "LVRef loads upon cache miss, including parse."
+
+    // parse and cache loaded bytes. Caller should hold the lock. Timestamp
+    // t0 is for the start of the load, for cost estimates.
+    let private cacheBytes (ref:LVRef<'V>) (t0:int64) (bytes:ByteString) : 'V =
+        let vref = ref.VRef
+        let v = Codec.readBytes (vref.Codec) (vref.DB) bytes
+        let dt = System.Diagnostics.Stopwatch.GetTimestamp() - t0
+        loadTimer.Record dt
+        ref.cost <- max 1L ((dt * 1000000L) / System.Diagnostics.Stopwatch.Frequency)
+        ref.cache <- Some v
+        Cache.receive (ref :> Cached) (80UL + uint64 (BS.length bytes)) 
+        v
+
     let private loadAndCache (ref:LVRef<'V>) : 'V =
         let vref = ref.VRef
         lock ref (fun () ->
             match ref.cache with
             | None ->
-                let bytes = vref.DB.Load (vref.ID)
-                let v = Codec.readBytes (vref.Codec) (vref.DB) bytes
-                ref.cache <- Some v
-                let szEst = 80UL + uint64 (BS.length bytes)
-                Cache.receive (ref :> Cached) (80UL + uint64 (BS.length bytes)) 
-                v
+                Cache.miss ()
+                let t0 = System.Diagnostics.Stopwatch.GetTimestamp()
+                cacheBytes ref t0 (vref.DB.Load (vref.ID))
             | Some v -> v
         )
 
+    /// Test whether a value is currently held in memory.
+    let isCached (ref:LVRef<'V>) : bool = Option.isSome (ref.cache)
+
+    // claim refs for prefetch: stowed, not cached, not already pending.
+    let private claimFetch (ref:LVRef<'V>) : bool =
+        ref.lvref.IsValueCreated && Option.isNone (ref.cache) &&
+            (0 = System.Threading.Interlocked.CompareExchange(&ref.fetching, 1, 0))
+
+    let private fetchClaimed (refs:LVRef<'V>[]) : unit =
+        try for grp in Array.groupBy (fun (r:LVRef<'V>) -> r.VRef.DB) refs do
+                let (db,rs) = grp
+                let t0 = System.Diagnostics.Stopwatch.GetTimestamp()
+                let bytes = Stowage.loadMany db (Array.map (fun (r:LVRef<'V>) -> r.ID) rs)
+                // share the load time between refs in the batch
+                let dtLoad = (System.Diagnostics.Stopwatch.GetTimestamp() - t0) / int64 rs.Length
+                for ix = 0 to (rs.Length - 1) do
+                    let r = rs.[ix]
+                    match bytes.[ix] with
+                    | Some b -> 
+                        lock r (fun () -> 
+                            if Option.isNone (r.cache) then
+                                Cache.miss ()
+                                let tr = System.Diagnostics.Stopwatch.GetTimestamp() - dtLoad
+                                cacheBytes r tr b |> ignore<'V>)
+                    | None -> () // report MissingRsc on load
+                System.GC.KeepAlive(rs)
+        finally
+            for r in refs do r.fetching <- 0
+
+    /// Load values into the cache, as a batch (see Stowage.loadMany).
+    /// Refs that are cached or not yet stowed are skipped. This is
+    /// useful when a traversal is about to load many refs.
+    let prefetch (refs:LVRef<'V>[]) : unit =
+        let todo = Array.filter claimFetch refs
+        if (todo.Length > 0) then fetchClaimed todo
+
+    /// Prefetch in the background. Errors are ignored here, and will
+    /// surface upon load instead.
+    let prefetchAsync (refs:LVRef<'V>[]) : unit =
+        let todo = Array.filter claimFetch refs
+        if (todo.Length > 0) then
+            let work (_:obj) = try fetchClaimed todo with | _ -> ()
+            System.Threading.ThreadPool.QueueUserWorkItem(
+                new System.Threading.WaitCallback(work)) |> ignore<bool>
+
     let inline private touch (ref:LVRef<_>) : unit =
         // race conditions are possible for updating touch counter, but
         // are irrelevant due to the heuristic nature of caching.
@@ -111,7 +173,7 @@ module LVRef =
     let load (ref:LVRef<'V>) : 'V =
         touch ref
         match ref.cache with
-        | Some v -> v
+        | Some v -> Cache.hit (); v
         | None -> loadAndCache ref
 
 
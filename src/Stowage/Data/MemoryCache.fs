@@ -45,8 +45,8 @@ module MCache =
     let tryFind (k:'K) (c:C<'K,'V>) : 'V option = 
         lock (c.D) (fun () ->
             match c.D.TryGetValue(k) with
-            | true,e -> e.Touch(); Some (e.V)
-            | _ -> None)
+            | true,e -> e.Touch(); c.M.Hit(); Some (e.V)
+            | _ -> c.M.Miss(); None)
 
     /// Add and return data if key is new, otherwise return existing
     /// data. Atomic. Thread-safe. Consider use of Lazy<'V> type to
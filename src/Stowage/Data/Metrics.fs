@@ -0,0 +1,220 @@
+namespace Stowage
+open System.Threading
+open System.Diagnostics
+
+/// Lightweight runtime metrics.
+///
+/// Counters and timers are plain Interlocked updates on preallocated
+/// objects, cheap enough for hot paths such as a cache lookup. Gauges
+/// are sampled only when a report is produced. Every metric registers
+/// in a process-wide registry, so a report covers all of Stowage and
+/// its clients. Rates are left to the reader of a report: sample it
+/// twice, and divide the change in a counter by the time between.
+///
+/// Timers may also trace slow spans. A span that runs longer than its
+/// timer's threshold is kept in a small ring of recent slow spans, for
+/// diagnosing latency spikes that averages hide.
+///
+/// Metrics are registered as their modules are initialized, so a
+/// metric appears in reports after first use of its module.
+///
+/// Reports use the Prometheus text exposition format.
+module Metrics =
+
+    /// A metric in the registry. Samples are (suffix, value) pairs.
+    [<AbstractClass>]
+    type Metric(name:string, help:string, kind:string) =
+        member __.Name = name
+        member __.Help = help
+        member __.Kind = kind
+        abstract member Samples : unit -> (string * float) list
+
+    /// A monotonic counter.
+    type Counter(name, help) =
+        inherit Metric(name, help, "counter")
+        [<DefaultValue>] val mutable private value : int64
+        member c.Add (n:int64) : unit = Interlocked.Add(&c.value, n) |> ignore<int64>
+        member c.Incr () : unit = Interlocked.Increment(&c.value) |> ignore<int64>
+        member c.Value with get() : int64 = Volatile.Read(&c.value)
+        override c.Samples () = [("", float c.Value)]
+
+    /// A value sampled upon report.
+    type Gauge(name, help, kind, read:unit -> float) =
+        inherit Metric(name, help, kind)
+        override __.Samples () = [("", read ())]
+
+    /// A family of values distinguished by one label, sampled upon
+    /// report. Each sample is a label value and a metric value.
+    type Family(name, help, kind, label:string, read:unit -> (string * float) list) =
+        inherit Metric(name, help, kind)
+        let escape (s:string) = s.Replace("\\", "\\\\").Replace("\"", "\\\"").Replace("\n", "\\n")
+        override __.Samples () =
+            read () |> List.map (fun (l,v) -> (sprintf "{%s=\"%s\"}" label (escape l), v))
+
+    /// A recently traced slow span.
+    type Span =
+        { name     : string
+          start    : System.DateTime    // UTC
+          duration : System.TimeSpan
+        }
+
+    // The ring of slow spans. Writes are rare, so a lock is fine.
+    let private traceRing : Span[] = Array.zeroCreate 256
+    let mutable private traceCount = 0L
+
+    let private trace (s:Span) : unit =
+        lock traceRing (fun () ->
+            traceRing.[int (traceCount % int64 traceRing.Length)] <- s
+            traceCount <- traceCount + 1L)
+
+    /// Recent slow spans, oldest first.
+    let slowSpans () : Span list =
+        lock traceRing (fun () ->
+            let n = int (min traceCount (int64 traceRing.Length))
+            List.init n (fun ix -> traceRing.[int ((traceCount - int64 n + int64 ix) % int64 traceRing.Length)]))
+
+    let private num (v:float) : string = v.ToString("R", System.Globalization.CultureInfo.InvariantCulture)
+
+    let inline private ticksToSeconds (t:int64) : float = float t / float Stopwatch.Frequency
+
+    // Timer buckets are powers of four microseconds, from 1us to about
+    // a minute, plus a final bucket for anything longer.
+    let private bucketCount = 14
+    let private bucketBound (ix:int) : float = (float (1L <<< (2 * ix))) / 1.0e6
+
+    let private bucketOf (ticks:int64) : int =
+        let us = (ticks * 1000000L) / Stopwatch.Frequency
+        let rec loop ix bound =
+            if (ix >= bucketCount) || (us <= bound) then ix else
+            loop (ix + 1) (bound <<< 2)
+        loop 0 1L
+
+    /// A latency distribution, reported as a histogram in seconds. The
+    /// maximum latency observed is reported as a separate gauge (see
+    /// timer). Spans longer than `Slow` are also traced (see slowSpans).
+    /// Slow is initially one second.
+    type Timer(name, help) =
+        inherit Metric(name, help, "histogram")
+        let buckets : int64[] = Array.zeroCreate (bucketCount + 1)
+        [<DefaultValue>] val mutable private count : int64
+        [<DefaultValue>] val mutable private total : int64
+        [<DefaultValue>] val mutable private max : int64
+        [<DefaultValue>] val mutable private slowTicks : int64
+
+        /// Threshold for tracing a span.
+        member t.Slow
+            with get() : System.TimeSpan =
+                let s = Volatile.Read(&t.slowTicks)
+                System.TimeSpan.FromSeconds(ticksToSeconds (if (0L = s) then Stopwatch.Frequency else s))
+            and set (v:System.TimeSpan) =
+                Volatile.Write(&t.slowTicks, max 1L (int64 (v.TotalSeconds * float Stopwatch.Frequency)))
+
+        /// Record a duration in Stopwatch ticks.
+        member t.Record (ticks:int64) : unit =
+            Interlocked.Increment(&t.count) |> ignore<int64>
+            Interlocked.Add(&t.total, ticks) |> ignore<int64>
+            Interlocked.Increment(&buckets.[bucketOf ticks]) |> ignore<int64>
+            let rec setMax () =
+                let m = Volatile.Read(&t.max)
+                if (ticks > m) && (m <> Interlocked.CompareExchange(&t.max, ticks, m)) then setMax ()
+            setMax ()
+            let s = Volatile.Read(&t.slowTicks)
+            if (ticks >= (if (0L = s) then Stopwatch.Frequency else s)) then
+                let d = System.TimeSpan.FromSeconds(ticksToSeconds ticks)
+                trace { name = t.Name; start = System.DateTime.UtcNow - d; duration = d }
+
+        /// Record time since a Stopwatch timestamp.
+        member t.Since (t0:int64) : unit = t.Record (Stopwatch.GetTimestamp() - t0)
+
+        /// Time an operation, including when it raises an exception.
+        member t.Time (op:unit -> 'X) : 'X =
+            let t0 = Stopwatch.GetTimestamp()
+            try op () finally t.Since t0
+
+        member t.Count with get() : int64 = Volatile.Read(&t.count)
+        member t.TotalSeconds with get() : float = ticksToSeconds (Volatile.Read(&t.total))
+        member t.MaxSeconds with get() : float = ticksToSeconds (Volatile.Read(&t.max))
+
+        override t.Samples () =
+            let cumulative = Array.scan (+) 0L (Array.init bucketCount (fun ix -> Volatile.Read(&buckets.[ix])))
+            let bs = List.init bucketCount (fun ix ->
+                        ("_bucket{le=\"" + num (bucketBound ix) + "\"}", float cumulative.[ix + 1]))
+            bs @ [ ("_bucket{le=\"+Inf\"}", float t.Count)
+                   ("_sum", t.TotalSeconds)
+                   ("_count", float t.Count) ]
+
+    // The registry. Metrics are few and registered at startup, so we
+    // simply copy the list on write.
+    let mutable private registry : Metric list = []
+    let private registryLock = new obj()
+
+    /// Add a metric to the registry, or return the registered metric of
+    /// the same name. Raises an exception if that metric is of a different
+    /// type, i.e. names must be unique per process.
+    let register (m:'M when 'M :> Metric) : 'M =
+        lock registryLock (fun () ->
+            match List.tryFind (fun (r:Metric) -> (r.Name = m.Name)) registry with
+            | None ->
+                registry <- (m :> Metric) :: registry
+                m
+            | Some (:? 'M as r) -> r
+            | Some _ -> invalidArg "m" ("metric name in use: " + m.Name))
+
+    /// Register a counter.
+    let counter (name:string) (help:string) : Counter = register (new Counter(name, help))
+
+    /// Register a gauge, sampled upon report.
+    let gauge (name:string) (help:string) (read:unit -> float) : unit =
+        register (new Gauge(name, help, "gauge", read)) |> ignore<Gauge>
+
+    // Name of the gauge for a timer's maximum, e.g. `foo_max_seconds`
+    // for `foo_seconds`. A histogram has no samples besides buckets,
+    // sum, and count, so we cannot report a `foo_seconds_max` sample.
+    let private maxName (name:string) : string =
+        let sfx = "_seconds"
+        if name.EndsWith(sfx) 
+            then name.Substring(0, name.Length - sfx.Length) + "_max" + sfx
+            else name + "_max"
+
+    /// Register a timer, and a gauge for its maximum latency.
+    let timer (name:string) (help:string) : Timer = 
+        let t = register (new Timer(name, help))
+        gauge (maxName name) ("Maximum of " + name + ".") (fun () -> t.MaxSeconds)
+        t
+
+    /// Register a counter that is maintained elsewhere, sampled upon
+    /// report, e.g. from a Stats record.
+    let counterFn (name:string) (help:string) (read:unit -> float) : unit =
+        register (new Gauge(name, help, "counter", read)) |> ignore<Gauge>
+
+    /// Register a family of gauges or counters, of the given kind,
+    /// distinguished by a label. E.g. one sample per cache instance.
+    let family (name:string) (help:string) (kind:string) (label:string) (read:unit -> (string * float) list) : unit =
+        register (new Family(name, help, kind, label, read)) |> ignore<Family>
+
+    /// All registered metrics, ordered by name.
+    let metrics () : Metric list =
+        List.sortBy (fun (m:Metric) -> m.Name) registry
+
+    /// A report of every metric in the Prometheus text format. A metric
+    /// that fails to sample is reported as a comment.
+    let report () : string =
+        let sb = new System.Text.StringBuilder()
+        for m in metrics () do
+            sb.Append("# HELP ").Append(m.Name).Append(' ').Append(m.Help).Append('\n')
+              .Append("# TYPE ").Append(m.Name).Append(' ').Append(m.Kind).Append('\n') |> ignore
+            try for (sfx,v) in m.Samples() do
+                    sb.Append(m.Name).Append(sfx).Append(' ').Append(num v).Append('\n') |> ignore
+            with e -> sb.Append("# error: ").Append(e.Message.Replace('\n',' ')).Append('\n') |> ignore
+        sb.ToString()
+
+    /// A report of recent slow spans, one per line: start time (ISO 8601),
+    /// duration in seconds, and timer name.
+    let traceReport () : string =
+        let sb = new System.Text.StringBuilder()
+        for s in slowSpans () do
+            sb.Append(s.start.ToString("o")).Append(' ')
+              .Append(s.duration.TotalSeconds.ToString("F6", System.Globalization.CultureInfo.InvariantCulture))
+              .Append(' ').Append(s.name).Append('\n') |> ignore
+        sb.ToString()
+
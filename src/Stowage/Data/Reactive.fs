@@ -0,0 +1,323 @@
+namespace Stowage
+open System.Threading
+open System.Threading.Tasks
+open System.Collections.Generic
+
+/// Reactive extensions for a DB: automatic transactions and computed
+/// TVars.
+///
+/// A Reactor wraps a DB and observes writes committed through it. An
+/// agent is an automatic transaction: it runs once when installed,
+/// remembers the variables it read, and runs again after any of them
+/// is written. A computed TVar is an agent that writes its result to
+/// an ephemeral variable, so other agents may in turn depend on it.
+///
+/// Agents run on a background task, in topological order by rank. An
+/// agent ranks above every agent whose writes have dirtied it. Writes
+/// arriving while agents are busy are batched, such that a dirty agent
+/// runs once no matter how many of its inputs were written. Before
+/// running, an agent compares the current values of its read set with
+/// those it last observed, and skips if nothing has changed. Computed
+/// results equal to the prior result are not written, so they don't
+/// propagate further.
+///
+/// Only writes via the Reactor DB, including transactions on it and
+/// writes by agents, are observed. Writes directly to the underlying
+/// DB are invisible to agents until something else dirties them.
+module Reactive =
+
+    // Value comparison for change detection. Committed data is boxed
+    // once by the DB, so reference equality serves for most values.
+    // Value types are boxed again upon each read, so compare those by
+    // value.
+    let private same (a:obj) (b:obj) : bool =
+        if obj.ReferenceEquals(a,b) then true else
+        if isNull a then false else
+        a.GetType().IsValueType && a.Equals(b)
+
+    // a read dependency: the observed value, and a way to read it again
+    type internal Dep = (struct(obj * (DB -> obj)))
+
+    /// An installed automatic transaction.
+    [<AllowNullLiteral>]
+    type Agent =
+        val ID : uint64
+        val internal Run : DB -> unit
+        val mutable internal reads : Dictionary<obj,Dep>
+        val mutable internal rank : int
+        val mutable internal dirty : bool
+        val mutable internal removed : bool
+        val mutable internal runs : int
+        val mutable internal skips : int
+        val mutable internal error : exn
+        internal new(id,run) =
+            { ID = id
+              Run = run
+              reads = null
+              rank = 0
+              dirty = false
+              removed = false
+              runs = 0
+              skips = 0
+              error = null
+            }
+
+        /// Topological rank, i.e. how many agents are upstream.
+        member a.Rank with get() = a.rank
+
+        /// How many times this agent has run to completion or error.
+        member a.Runs with get() = a.runs
+
+        /// How many times this agent was dirtied but skipped because
+        /// its inputs were unchanged.
+        member a.Skips with get() = a.skips
+
+        /// The error from the most recent run, or null.
+        member a.Error with get() = a.error
+
+    // order dirty agents by rank, then by installation
+    let private byRank =
+        { new IComparer<Agent> with
+            member __.Compare(x,y) =
+                let c = compare (x.rank) (y.rank)
+                if (0 <> c) then c else compare (x.ID) (y.ID)
+        }
+
+    // DB wrapper that records reads for an agent, and reports writes
+    // to the Reactor upon commit of the outermost transaction.
+    type private TDB =
+        val Reactor : Reactor
+        val Base : DB
+        val Source : Agent              // writing agent, or null
+        val Reads : Dictionary<obj,Dep> // for source agent, or null
+        val InTX : bool
+        val mutable Writes : obj list
+        new(rx,db,src,rs,intx) =
+            { Reactor = rx; Base = db; Source = src; Reads = rs
+              InTX = intx; Writes = [] }
+
+        member inline private t.Stowage with get() = (t.Base :> Stowage)
+
+        member private t.Record (tv:TVar<'V>) (v:'V) : unit =
+            if isNull t.Reads then () else
+            lock (t.Reads) (fun () ->
+                let k = box tv
+                if not (t.Reads.ContainsKey k) then
+                    let reread (db:DB) = box (db.Read tv)
+                    t.Reads.Add(k, struct(box v, reread)))
+
+        member private t.Wrote (ks:obj list) : unit =
+            if List.isEmpty ks then () else
+            if t.InTX
+                then lock t (fun () -> t.Writes <- List.append ks (t.Writes))
+                else t.Reactor.Notify (t.Source) ks
+
+        member t.WriteMerge (tv:TVar<'V>) (v:'V) (merge:'V -> 'V option) : unit =
+            DB.writeMerge (t.Base) tv v merge
+            t.Wrote [box tv]
+
+        interface DB with
+            member t.Register k c = t.Base.Register k c
+            member t.Allocate v = t.Base.Allocate v
+            member t.Read tv =
+                let v = t.Base.Read tv
+                t.Record tv v
+                v
+            member t.Write tv v =
+                t.Base.Write tv v
+                t.Wrote [box tv]
+            member t.Flush () = t.Base.Flush ()
+            member t.Transact withTX =
+                let child = ref Unchecked.defaultof<TDB>
+                let withTX' tx =
+                    let c = new TDB(t.Reactor, tx, t.Source, t.Reads, true)
+                    child.Value <- c
+                    withTX (c :> DB)
+                let struct(r,ok) = t.Base.Transact withTX'
+                if ok then t.Wrote (child.Value.Writes)
+                struct(r,ok)
+        interface DB.MergeWriter with
+            member t.WriteMerge tv v merge = t.WriteMerge tv v merge
+        interface Stowage with
+            member t.Load h = t.Stowage.Load h
+            member t.Stow v = t.Stowage.Stow v
+            member t.Incref h = t.Stowage.Incref h
+            member t.Decref h = t.Stowage.Decref h
+        interface StowageBatch with
+            member t.LoadMany hs = Stowage.loadMany (t.Stowage) hs
+
+    /// A Reactor schedules agents over a DB.
+    and Reactor =
+        /// The underlying DB. Writes here are not observed.
+        val Base : DB
+        val mutable private root : TDB
+        val private watch : Dictionary<obj,HashSet<Agent>>
+        val private dirty : SortedSet<Agent>
+        val mutable private nextID : uint64
+        val mutable private bgtask : bool
+        val mutable private error : exn
+        new(db:DB) as rx =
+            { Base = db
+              root = Unchecked.defaultof<TDB>
+              watch = new Dictionary<obj,HashSet<Agent>>(HashIdentity.Reference)
+              dirty = new SortedSet<Agent>(byRank)
+              nextID = 0UL
+              bgtask = false
+              error = null
+            } then rx.root <- new TDB(rx, db, null, null, false)
+
+        /// The observed DB. Writes here, or in transactions on it,
+        /// dirty the agents that read the written variables.
+        member rx.DB with get() : DB = (rx.root :> DB)
+
+        /// Whether any agent is dirty or running.
+        member rx.Pending with get() : bool = lock rx (fun () -> rx.bgtask)
+
+        /// Install an agent. It runs once soon, then again whenever
+        /// a variable it read is written.
+        member rx.Install (run:DB -> unit) : Agent =
+            lock rx (fun () ->
+                rx.nextID <- (1UL + rx.nextID)
+                let a = new Agent(rx.nextID, run)
+                rx.MarkDirty a
+                a)
+
+        /// Remove an agent. It will not run again, though it might
+        /// be running concurrently.
+        member rx.Remove (a:Agent) : unit =
+            lock rx (fun () ->
+                a.removed <- true
+                if a.dirty then
+                    rx.dirty.Remove(a) |> ignore<bool>
+                    a.dirty <- false
+                rx.Unwatch a)
+
+        // mark agent dirty, start the scheduler if necessary (holding lock)
+        member private rx.MarkDirty (a:Agent) : unit =
+            if a.dirty || a.removed then () else
+            a.dirty <- true
+            rx.dirty.Add(a) |> ignore<bool>
+            if not rx.bgtask then
+                rx.bgtask <- true
+                Task.Run(fun () -> rx.BGRun()) |> ignore<Task>
+
+        member private rx.Unwatch (a:Agent) : unit =
+            if isNull a.reads then () else
+            for k in a.reads.Keys do
+                match rx.watch.TryGetValue k with
+                | true, s ->
+                    s.Remove(a) |> ignore<bool>
+                    if (0 = s.Count) then rx.watch.Remove(k) |> ignore<bool>
+                | _ -> ()
+
+        member private rx.Watch (a:Agent) : unit =
+            for k in a.reads.Keys do
+                match rx.watch.TryGetValue k with
+                | true, s -> s.Add(a) |> ignore<bool>
+                | _ ->
+                    let s = new HashSet<Agent>(HashIdentity.Reference)
+                    s.Add(a) |> ignore<bool>
+                    rx.watch.Add(k, s)
+
+        // Report committed writes. Dependents of the source agent are
+        // ranked above it. An agent is never dirtied by its own writes.
+        member internal rx.Notify (src:Agent) (ks:obj list) : unit =
+            lock rx (fun () ->
+                let touch (a:Agent) =
+                    if obj.ReferenceEquals(a, src) then () else
+                    let r = if isNull src then a.rank else max (a.rank) (1 + src.rank)
+                    if (r <> a.rank) then
+                        if a.dirty then
+                            rx.dirty.Remove(a) |> ignore<bool>
+                            a.dirty <- false
+                        a.rank <- r
+                    rx.MarkDirty a
+                for k in ks do
+                    match rx.watch.TryGetValue k with
+                    | true, s -> Array.iter touch (Array.ofSeq s)
+                    | _ -> ())
+
+        // whether every read of an agent still has its observed value
+        member private rx.Unchanged (rs:Dictionary<obj,Dep>) : bool =
+            rs.Values |> Seq.forall (fun (struct(v,reread)) -> same v (reread rx.Base))
+
+        member private rx.BGRun() : unit =
+            assert(not (Monitor.IsEntered(rx)))
+            let next () = lock rx (fun () ->
+                if (0 = rx.dirty.Count) then
+                    rx.bgtask <- false
+                    Monitor.PulseAll(rx)
+                    null
+                else
+                    let a = rx.dirty.Min
+                    rx.dirty.Remove(a) |> ignore<bool>
+                    a.dirty <- false
+                    a)
+            let mutable a = next ()
+            while not (isNull a) do
+                rx.Step a
+                a <- next ()
+
+        // Run an agent in a transaction on the base DB. Watches are
+        // updated before validating the reads, such that any write
+        // committed concurrently with the agent dirties it again.
+        member private rx.Step (a:Agent) : unit =
+            if not (isNull a.reads) && rx.Unchanged (a.reads)
+                then lock rx (fun () -> a.skips <- (1 + a.skips)) else
+            let rs = new Dictionary<obj,Dep>(HashIdentity.Reference)
+            let tx0 = ref Unchecked.defaultof<TDB>
+            let run tx =
+                let t = new TDB(rx, tx, a, rs, true)
+                tx0.Value <- t
+                a.Run (t :> DB)
+            let struct(ok,err) =
+                try let struct(_,ok) = rx.Base.Transact run
+                    struct(ok, null)
+                with e -> struct(true, e)
+            lock rx (fun () ->
+                a.runs <- (1 + a.runs)
+                a.error <- err
+                if not (isNull err) && isNull rx.error then rx.error <- err
+                if not a.removed then
+                    rx.Unwatch a
+                    a.reads <- rs
+                    rx.Watch a
+                    if not ok then rx.MarkDirty a)
+            if ok && isNull err then rx.Notify a (tx0.Value.Writes)
+            if not (rx.Unchanged rs) then lock rx (fun () -> rx.MarkDirty a)
+
+        /// Wait for every dirty agent to run. Raises the first error
+        /// from an agent since the last Sync, if any.
+        member rx.Sync() : unit =
+            lock rx (fun () ->
+                while rx.bgtask do
+                    Monitor.Wait(rx) |> ignore<bool>
+                if not (isNull rx.error) then
+                    let e = rx.error
+                    rx.error <- null
+                    raise (System.AggregateException(e)))
+
+    /// Install an agent on a Reactor.
+    let agent (rx:Reactor) (run:DB -> unit) : Agent = rx.Install run
+
+    /// A computed TVar, maintained by an agent.
+    ///
+    /// The variable initially holds `v0`. The agent computes the next
+    /// value from the DB and the prior value, which permits incremental
+    /// indexing against a remembered state. A result is written only if
+    /// `eq` reports it differs from the prior value.
+    let computeBy (eq:'V -> 'V -> bool) (rx:Reactor) (v0:'V) (fn:DB -> 'V -> 'V) : TVar<'V> =
+        let out = rx.Base.Allocate v0
+        // only this agent writes `out`, so read it without a dependency
+        let run (db:DB) =
+            let prior = rx.Base.Read out
+            let v = fn db prior
+            if not (eq prior v) then db.Write out v
+        agent rx run |> ignore<Agent>
+        out
+
+    /// A computed TVar. Results are compared by reference, or by value
+    /// for value types.
+    let compute (rx:Reactor) (v0:'V) (fn:DB -> 'V -> 'V) : TVar<'V> =
+        computeBy (fun a b -> same (box a) (box b)) rx v0 fn
+
@@ -43,52 +43,89 @@ module RscHash =
     // test whether an element is valid within a UTF8 or ASCII hash.
     let isHashByte (b : byte) : bool = alphabool.[int b] 
 
-    // encode forty bits from src to dst.
-    let inline private b32e40 (dst : byte[]) (src : byte[]) off =
-        let dst_off = (off * 8)
-        let src_off = (off * 5)
-        let inline r ix = src.[src_off + ix]
-        let inline w ix v = dst.[dst_off + ix] <- alphabyte.[int v]
-        // read forty bits of data
-        let i4 = r 4
-        let i3 = r 3
-        let i2 = r 2
-        let i1 = r 1
-        let i0 = r 0
-        // encode data into eight bytes
-        do w 7 (((i4 &&& 0x1Fuy)      ))
-        do w 6 (((i4 &&& 0xE0uy) >>> 5) |||
-                ((i3 &&& 0x03uy) <<< 3))
-        do w 5 (((i3 &&& 0x7Cuy) >>> 2))
-        do w 4 (((i3 &&& 0x80uy) >>> 7) |||
-                ((i2 &&& 0x0Fuy) <<< 1))
-        do w 3 (((i2 &&& 0xF0uy) >>> 4) |||
-                ((i1 &&& 0x01uy) <<< 4))
-        do w 2 (((i1 &&& 0x3Euy) >>> 1))
-        do w 1 (((i1 &&& 0xC0uy) >>> 6) |||
-                ((i0 &&& 0x07uy) <<< 2))
-        do w 0 (((i0 &&& 0xF8uy) >>> 3))
-
-    // perform a base32 encoding of the Blake2 hash.
+    // reverse lookup for the alphabet, 0xFF for non-hash bytes
+    let private alphadec : byte[] =
+        let arr = Array.create 256 0xFFuy
+        Array.iteri (fun ix b -> arr.[int b] <- byte ix) alphabyte
+        arr
+
+    // Encode forty bits at a time. We load five bytes into a word to
+    // extract eight 5-bit digits, rather than shuffling single bytes.
     let private b32enc (src : byte[]) : byte[] =
         assert ((40 = src.Length) && (64 = size))
         let dst = Array.zeroCreate size
-        do b32e40 dst src 7
-        do b32e40 dst src 6
-        do b32e40 dst src 5
-        do b32e40 dst src 4
-        do b32e40 dst src 3
-        do b32e40 dst src 2
-        do b32e40 dst src 1
-        do b32e40 dst src 0
+        for blk = 0 to 7 do
+            let s = (blk * 5)
+            let w = (uint64 src.[s    ] <<< 32) ||| (uint64 src.[s + 1] <<< 24) |||
+                    (uint64 src.[s + 2] <<< 16) ||| (uint64 src.[s + 3] <<<  8) |||
+                    (uint64 src.[s + 4])
+            let d = (blk * 8)
+            for ix = 0 to 7 do
+                dst.[d + ix] <- alphabyte.[int ((w >>> (35 - (5 * ix))) &&& 0x1FUL)]
         dst
 
+    // Decode forty bits at a time. Invalid bytes are accumulated in
+    // the high bits of `bad` so we test validity once per block.
+    let private b32dec (src : ByteString) : byte[] =
+        assert (size = src.Length)
+        let arr = src.UnsafeArray
+        let dst = Array.zeroCreate hashByteLen
+        for blk = 0 to 7 do
+            let s = src.Offset + (blk * 8)
+            let mutable w = 0UL
+            let mutable bad = 0uy
+            for ix = 0 to 7 do
+                let v = alphadec.[int arr.[s + ix]]
+                bad <- (bad ||| v)
+                w <- ((w <<< 5) ||| uint64 v)
+            if (0uy <> (bad &&& 0xE0uy))
+                then invalidArg "src" "not a valid RscHash"
+            let d = (blk * 5)
+            dst.[d    ] <- byte (w >>> 32)
+            dst.[d + 1] <- byte (w >>> 24)
+            dst.[d + 2] <- byte (w >>> 16)
+            dst.[d + 3] <- byte (w >>>  8)
+            dst.[d + 4] <- byte (w)
+        dst
+
+    /// Encode the 40 byte binary digest as an RscHash.
+    let encode (digest : byte[]) : RscHash =
+        if (hashByteLen <> digest.Length)
+            then invalidArg "digest" "expecting 40 bytes"
+        BS.unsafeCreateA (b32enc digest)
+
+    /// Decode an RscHash to its 40 byte binary digest.
+    let decode (h : RscHash) : byte[] =
+        if (size <> h.Length)
+            then invalidArg "h" "not a valid RscHash"
+        b32dec h
+
+    // Hashers are reused per thread. Constructing a HMACBlake2B has
+    // a significant cost compared to hashing a small binary.
+    let private hasher = 
+        new System.Threading.ThreadLocal<HMACBlake2B>(fun () -> 
+            new HMACBlake2B(hashBitLen))
+
     /// basic bytestring hash
     let hash (s : ByteString) : ByteString =
-        use alg = new HMACBlake2B(hashBitLen)
-        let bytes = alg.ComputeHash(s.UnsafeArray, s.Offset, s.Length)
+        let bytes = hasher.Value.ComputeHash(s.UnsafeArray, s.Offset, s.Length)
         BS.unsafeCreateA (b32enc bytes)
 
+    /// Hash many binaries, e.g. the nodes of a tree being compacted.
+    /// Equivalent to `Array.map hash`, but large batches are hashed
+    /// in parallel over a few threads.
+    let hashMany (ss : ByteString[]) : RscHash[] =
+        let hs = Array.zeroCreate (ss.Length)
+        let hashRange (lo:int) (hi:int) =
+            for ix = lo to (hi - 1) do
+                hs.[ix] <- hash (ss.[ix])
+        let batch = 64
+        if (ss.Length <= batch) then hashRange 0 (ss.Length) else
+            let parts = System.Collections.Concurrent.Partitioner.Create(0, ss.Length, batch)
+            System.Threading.Tasks.Parallel.ForEach(parts, fun (lo,hi) -> 
+                hashRange lo hi) |> ignore
+        hs
+
     /// Fold over RscHash dependencies represented within a value.
     ///
     /// Find substrings that look like hashes - appropriate size and
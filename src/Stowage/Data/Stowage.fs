@@ -60,11 +60,31 @@ type Stowage =
 /// Exception on Load failure.
 exception MissingRsc of Stowage * RscHash 
 
+/// Optional interface for Stowage that can load many resources at
+/// once, e.g. under a single read transaction. This mitigates latency
+/// for traversals of stowed data structures. See Stowage.loadMany.
+type StowageBatch =
+
+    /// Load many resources. Resources that cannot be located are
+    /// reported as None. Results are in the same order as requests.
+    abstract member LoadMany : RscHash[] -> ByteString option[]
+
 // TODO: Develop a useful set of Stowage combinators. (Low Priority.)
 //  layered, cached, mirrored, distributed hashtables...
 
 module Stowage =
 
+    /// Load many resources, reporting None for missing resources. This
+    /// uses StowageBatch if supported, otherwise loads one at a time.
+    let loadMany (db:Stowage) (hs:RscHash[]) : ByteString option[] =
+        match box db with
+        | :? StowageBatch as b -> b.LoadMany hs
+        | _ ->
+            let tryLoad h = 
+                try Some (db.Load h) 
+                with | MissingRsc _ -> None
+            Array.map tryLoad hs
+
     // when tracking deps, don't want to implicitly hold a huge array
     // of origin data in memory, so we'll trimBytes first.
     let private depcons lst rsc = (BS.trimBytes rsc) :: lst 
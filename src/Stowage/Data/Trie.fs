@@ -403,31 +403,80 @@ module Trie =
     // - efficient tree merges
 
     module Enc =
-        // encoding is trivial concatenation of key, value, and children.
+        // The original encoding is a trivial concatenation of key, value,
+        // and children. This is still readable. But we now write a denser
+        // encoding, which packs a node's options and short prefix lengths
+        // into a header byte:
+        //
+        //   0x80 (header) (prefix bytes) (value)? (children)?
+        //
+        // The header holds flags for value and children in low bits, and
+        // prefix length in the high six bits. At length 63 or more, the
+        // remaining length follows as a varnat. A varnat never begins with
+        // 0x80, so the tag distinguishes the two encodings.
+        let cNode = 0x80uy
+        let private fValue = 0x01uy
+        let private fChildren = 0x02uy
+        let private maxShortLen = 63
+
+        let private lenSize (len:int) : SizeEst =
+            if (len < maxShortLen) then 0UL else
+            EncVarNat.size (uint64 (len - maxShortLen))
+
         // to avoid dynamic construction of the IntMap codec I'm using
         // a recursive object constructor. Awkward, but safe in this case.
         type TreeCodec<'V> =
             val value    : Codec<'V>                  // value encoder
             val mutable children : Codec<IntMap<Tree<'V>>>    // for recursion
+            val mutable nodes : Codec<IntMap.Node<Tree<'V>>>  // non-empty children
             interface Codec<Tree<'V>> with
                 member c.Write t dst =
-                    EncBytes.write (t.prefix) dst
-                    EncOpt.write (c.value) (t.value) dst
-                    Codec.write (c.children) (t.children) dst
+                    let len = t.prefix.Length
+                    let flags = (if Option.isSome t.value then fValue else 0uy)
+                            ||| (if Option.isSome t.children then fChildren else 0uy)
+                    ByteStream.writeByte cNode dst
+                    ByteStream.writeByte ((byte (min len maxShortLen) <<< 2) ||| flags) dst
+                    if (len >= maxShortLen) then EncVarNat.write (uint64 (len - maxShortLen)) dst
+                    ByteStream.writeBytes (t.prefix) dst
+                    match t.value with
+                    | Some v -> Codec.write (c.value) v dst
+                    | None -> ()
+                    match t.children with
+                    | Some n -> Codec.write (c.nodes) n dst
+                    | None -> ()
                 member c.Read db src =
-                    let p = EncBytes.read src
-                    let v = EncOpt.read (c.value) db src
-                    let cs = Codec.read (c.children) db src
+                    if (cNode <> ByteStream.peekByte src) then
+                        let p = EncBytes.read src
+                        let v = EncOpt.read (c.value) db src
+                        let cs = Codec.read (c.children) db src
+                        { prefix = p; value = v; children = cs }
+                    else
+                    ByteStream.skip 1 src
+                    let hdr = ByteStream.readByte src
+                    let len = 
+                        let n = int (hdr >>> 2)
+                        if (n < maxShortLen) then n else
+                        let ext = EncVarNat.read src
+                        if (ext > uint64 (ByteStream.bytesRem src)) then raise ByteStream.ReadError
+                        (n + int ext)
+                    let p = ByteStream.readBytes len src
+                    let v = if (0uy = (hdr &&& fValue)) then None else 
+                                Some (Codec.read (c.value) db src)
+                    let cs = if (0uy = (hdr &&& fChildren)) then None else 
+                                Some (Codec.read (c.nodes) db src)
                     { prefix = p; value = v; children = cs }
                 member c.Compact db t =
-                    let szP = EncBytes.size (t.prefix)
+                    let len = t.prefix.Length
+                    let szP = 2UL + lenSize len + uint64 len // tag, header, prefix
+                    // option sizes include a byte we don't write
                     let struct(v',szV) = EncOpt.compact (c.value) db (t.value)
                     let struct(cs',szCS) = Codec.compactSz (c.children) db (t.children)
                     let t' = { prefix = (t.prefix); value = v'; children = cs' }
-                    struct(t', szP + szV + szCS)
+                    struct(t', szP + (szV - 1UL) + (szCS - 1UL))
             new(cv,thresh) 
-                as tc = { value = cv; children = Codec.invalid } then
-                tc.children <- IntMap.codec' thresh (tc :> Codec<Tree<'V>>)
+                as tc = { value = cv; children = Codec.invalid; nodes = Codec.invalid } then
+                tc.nodes <- IntMap.EncNode.codec' thresh (tc :> Codec<Tree<'V>>)
+                tc.children <- EncOpt.codec (tc.nodes)
 
     /// Codec with specified heuristic compaction threshold.
     let inline codec' (thresh:SizeEst) (cV:Codec<'V>) =
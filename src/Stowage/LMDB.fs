@@ -1,3 +1,4 @@
+#nowarn "9" // NativePtr for UnmanagedMemoryStream views
 namespace Stowage
 open System
 open System.IO
@@ -51,8 +52,45 @@ module LMDB =
           stow_count : uint64 // How many stowage resources. 
           stow_bytes : uint64 // Approx stowage data in bytes.
           rfct_bytes : uint64 // Stowage reference count overhead.
+          zero_count : uint64 // References with zero refct, awaiting GC.
         }
 
+    /// A read-only view of bytes in unmanaged or pinned memory.
+    ///
+    /// A view is valid only for the lease under which it's provided,
+    /// e.g. while a read transaction holds pages of the memory map.
+    /// Copy any bytes that must be retained after the lease ends.
+    [<Struct>]
+    type View =
+        val Ptr : nativeint
+        val Length : int
+        new(ptr,len) = { Ptr = ptr; Length = len }
+
+        /// Read a byte from the view.
+        member v.Item 
+            with get(ix:int) : byte =
+                if (uint32 ix >= uint32 v.Length) 
+                    then raise (System.IndexOutOfRangeException())
+                Marshal.ReadByte(v.Ptr, ix)
+
+        /// Copy a slice of the view into a new ByteString.
+        member v.Copy (off:int, len:int) : ByteString =
+            if (off < 0) || (len < 0) || (off > (v.Length - len))
+                then raise (System.ArgumentOutOfRangeException())
+            if (0 = len) then BS.empty else
+            let arr : byte[] = Array.zeroCreate len
+            Marshal.Copy(v.Ptr + nativeint off, arr, 0, len)
+            BS.unsafeCreateA arr
+
+        /// Copy the full view into a new ByteString.
+        member v.ToByteString () : ByteString = v.Copy(0, v.Length)
+
+        /// Access the view as a read-only stream. The stream is only
+        /// valid for the lease.
+        member v.Stream () : UnmanagedMemoryStream =
+            let p = NativeInterop.NativePtr.ofNativeInt<byte> (v.Ptr)
+            new UnmanagedMemoryStream(p, int64 v.Length)
+
     module private I =
         type WriteBatch = CritbitTree<Val>
         
@@ -76,34 +114,52 @@ module LMDB =
             assert(stowKeyLen = s.Length)
             ByteString.Hash64 s
 
-        // Our ephemeron table both locks the refct table and allows me
-        // to delay decrefs that might occur after concurrent writes so
-        // we don't prematurely GC any resources.
+        // Our ephemeron table tracks resources referenced from memory,
+        // and allows me to delay decrefs that might occur after concurrent
+        // writes so we don't prematurely GC any resources. The refct table
+        // is concurrent, so increfs and undelayed decrefs don't take the
+        // ephemeron lock.
+        //
+        // With a pipelined writer, a frame may be captured before GC of
+        // the prior frame completes. Each DelayDecrefs marks a frame, and
+        // PassDecrefs for the oldest frame only passes decrefs delayed
+        // before the next frame was captured.
         type Ephemerons =
-            val table : RCTable.Table
+            val table : RCTable.ConcurrentTable
             val mutable decrefs : ResizeArray<EphID>
+            val marks : Queue<int>
             val mutable delay : bool
             
             new() = 
-                { table = new RCTable.Table()
+                { table = new RCTable.ConcurrentTable()
                   decrefs = new ResizeArray<EphID>()
+                  marks = new Queue<int>()
                   delay = false
                 }
 
             member this.DelayDecrefs () = lock this (fun () -> 
+                this.marks.Enqueue(this.decrefs.Count)
                 this.delay <- true)
             member this.PassDecrefs () = lock this (fun () ->
-                this.decrefs.ForEach(fun k -> this.table.Decref k)
-                this.decrefs <- new ResizeArray<EphID>()
-                this.delay <- false)
-            member this.Incref (k:EphID) : unit = lock this (fun () -> 
-                this.table.Incref k)
-            member this.Decref (k:EphID) : unit = lock this (fun () ->
-                if this.delay 
-                    then this.decrefs.Add k
-                    else this.table.Decref k)
-            member this.Contains (k:EphID) : bool = lock this (fun () -> 
-                this.table.Contains k)
+                this.marks.Dequeue() |> ignore<int>
+                let n = if (0 = this.marks.Count) then this.decrefs.Count 
+                                                  else this.marks.Peek()
+                for ix = 0 to (n - 1) do
+                    this.table.Decref (this.decrefs.[ix])
+                this.decrefs.RemoveRange(0, n)
+                if (0 = this.marks.Count) then this.delay <- false else
+                let ms = this.marks.ToArray()
+                this.marks.Clear()
+                for m in ms do this.marks.Enqueue(m - n))
+            member this.Incref (k:EphID) : unit = this.table.Incref k
+            member this.Decref (k:EphID) : unit = 
+                // recheck delay under lock in case DelayDecrefs raced us
+                let delayed () = lock this (fun () ->
+                    if this.delay then this.decrefs.Add k
+                    this.delay)
+                if not (Volatile.Read(&this.delay) && delayed ()) 
+                    then this.table.Decref k
+            member this.Contains (k:EphID) : bool = this.table.Contains k
 
         type FileLock = FileStream
         let lockFile (name : string) : FileLock =
@@ -138,6 +194,21 @@ module LMDB =
         // overhead per item and shift sizes to avoid overflow.
         let inline sbSize (bytes:int) : int = (3 + (bytes >>> 6))
 
+        // A frame is a batch of writes captured from the write buffers.
+        // Frames are prepared in one thread - e.g. scanning values for
+        // resource references - while the prior frame is written. 
+        type Frame =
+            { write   : KVMap                       // root updates
+              stow    : StowBuff                    // new resources
+              sync    : TCS list                    // clients awaiting sync
+              halt    : bool                        // final frame
+              wdeps   : RscHash[]                   // refs from root updates
+              sdeps   : Map<StowKey,RscHash[]>      // refs from resources
+            }
+
+        // A resource planned for deletion, with its dependencies.
+        type Doomed = (struct(StowKey * RscHash[]))
+
         // Due to the entanglement with concurrency, GC, etc. I haven't 
         // found a convenient model to break this into small components.
         type Database =
@@ -157,10 +228,27 @@ module LMDB =
             val mutable stow     : StowBuff     // new stowage resources
             val mutable halt     : bool         // graceful shutdown
 
+            // captured work, held in memory while frame is prepared
+            val mutable preparing : bool        // frame is being prepared
+            val mutable prepwrite : KVMap       // preparing write batch
+            val mutable prepstow  : StowBuff    // preparing stowed data
+            val mutable prepared  : Frame option // ready for the writer
+
             // active work, held in memory until write completes
             val mutable writing  : KVMap        // flushing write batch
             val mutable stowing  : StowBuff     // flushing stowed data
 
+            // group commit window, in milliseconds
+            val mutable gcwindow : int
+
+            // incremental GC planned by the collector, applied by writer
+            val gcplan               : Queue<Doomed> // deletions to apply
+            val mutable gcuncommitted : int         // planned, not committed
+            val mutable gcwake       : bool         // collector should scan
+            val mutable gcwaiters    : TCS list     // awaiting a GC cycle
+            val mutable gcthread     : Thread       // the collector
+            val mutable gccursor     : ByteString   // next zero key to scan
+
             // buffer control options for stowage
             val mutable sbsize   : int          // data in stowage buffer
             val mutable sbthresh : int          // limit for stowage buffer
@@ -193,6 +281,17 @@ module LMDB =
                   writing  = CritbitTree.empty
                   stow     = Map.empty
                   stowing  = Map.empty
+                  preparing = false
+                  prepwrite = CritbitTree.empty
+                  prepstow  = Map.empty
+                  prepared  = None
+                  gcwindow  = 0
+                  gcplan    = new Queue<Doomed>()
+                  gcuncommitted = 0
+                  gcwake    = true
+                  gcwaiters = List.empty
+                  gcthread  = null
+                  gccursor  = BS.empty
                   sync     = List.empty
                   halt     = false
                   sbsize   = 0
@@ -212,24 +311,86 @@ module LMDB =
                 finally mdb_txn_commit tx
             finally rdlock.Release()
 
+        // resource from a read transaction, as a view of the memory map.
+        // Compares the stowKeyRem bytes in constant time.
+        let dbGetRscView (db : Database) (rtx : MDB_txn) (h : RscHash) : View option =
+            match mdb_getZC rtx (db.dbi_stow) (BS.take stowKeyLen h) with
+            | None -> None
+            | Some v ->
+                let len = int (v.size)
+                if (len < stowKeyRem) then None else
+                let rem : byte[] = Array.zeroCreate stowKeyRem
+                Marshal.Copy(v.data, rem, 0, stowKeyRem)
+                let remOK = ByteString.CTEq (BS.drop stowKeyLen h) (BS.unsafeCreateA rem)
+                if not remOK then None else
+                Some (new View(v.data + nativeint stowKeyRem, len - stowKeyRem))
+
         // locate resource in database, if it is available. This will search
         // recently buffered stowage before the LMDB layer. Uses constant time
         // to compare stowKeyRem bytes of RscHash to resist timing attacks.
         let tryLoadRsc (db : Database) (h : RscHash) : ByteString option =
             if (RscHash.size <> h.Length) 
                 then invalidArg "h" "invalid resource hash"
-            let struct(sb0,sb1) = lock db (fun () -> 
-                struct(db.stow, db.stowing))
+            let struct(sb0,sb1,sb2) = lock db (fun () -> 
+                struct(db.stow, db.prepstow, db.stowing))
             let inSB0 = tryFindRscSB h sb0
             if Option.isSome inSB0 then inSB0 else
             let inSB1 = tryFindRscSB h sb1
             if Option.isSome inSB1 then inSB1 else
-            let vOpt = withRTX db (fun tx -> 
-                mdb_get tx (db.dbi_stow) (BS.take stowKeyLen h))
-            match vOpt with
-            | Some rv when (ByteString.CTEq (BS.drop stowKeyLen h) (BS.take stowKeyRem rv)) ->
-                Some (BS.drop stowKeyRem rv)
-            | _ -> None
+            let inSB2 = tryFindRscSB h sb2
+            if Option.isSome inSB2 then inSB2 else
+            withRTX db (fun rtx -> 
+                match dbGetRscView db rtx h with
+                | Some view -> Some (view.ToByteString())
+                | None -> None)
+
+        // locate many resources, using one read transaction for those
+        // that aren't buffered. 
+        let tryLoadRscMany (db : Database) (hs : RscHash[]) : ByteString option[] =
+            if not (Array.forall (fun (h:RscHash) -> (RscHash.size = h.Length)) hs)
+                then invalidArg "hs" "invalid resource hash"
+            let struct(sb0,sb1,sb2) = lock db (fun () -> 
+                struct(db.stow, db.prepstow, db.stowing))
+            let inBuffer h =
+                match tryFindRscSB h sb0 with
+                | Some v -> Some v
+                | None ->
+                    match tryFindRscSB h sb1 with
+                    | Some v -> Some v
+                    | None -> tryFindRscSB h sb2
+            let result = Array.map inBuffer hs
+            if Array.forall Option.isSome result then result else
+            withRTX db (fun rtx ->
+                for ix = 0 to (hs.Length - 1) do
+                    if Option.isNone (result.[ix]) then
+                        match dbGetRscView db rtx (hs.[ix]) with
+                        | Some view -> result.[ix] <- Some (view.ToByteString())
+                        | None -> ()
+                result)
+
+        // view a resource without copying. For buffered resources the
+        // bytes are pinned, otherwise we read from the memory map under
+        // a read lock. The view is valid only while `reader` runs.
+        let withRscView (db : Database) (h : RscHash) (reader : View -> 'x) : 'x option =
+            if (RscHash.size <> h.Length) 
+                then invalidArg "h" "invalid resource hash"
+            let struct(sb0,sb1,sb2) = lock db (fun () -> 
+                struct(db.stow, db.prepstow, db.stowing))
+            let inBuffer = 
+                match tryFindRscSB h sb0 with
+                | Some v -> Some v
+                | None ->
+                    match tryFindRscSB h sb1 with
+                    | Some v -> Some v
+                    | None -> tryFindRscSB h sb2
+            match inBuffer with
+            | Some v -> 
+                BS.withPinnedBytes v (fun p -> Some (reader (new View(p, v.Length))))
+            | None ->
+                withRTX db (fun rtx -> 
+                    match dbGetRscView db rtx h with
+                    | Some view -> Some (reader view)
+                    | None -> None)
 
         // Add to stowage buffer. May cause background flush if there
         // is sufficient pending data.
@@ -247,6 +408,24 @@ module LMDB =
                     then Monitor.PulseAll(db))
             h
 
+        // Add many values to the stowage buffer. Values are hashed as
+        // a batch, then buffered under a single lock.
+        let stowRscMany (db : Database) (vs : ByteString[]) : RscHash[] =
+            if Array.exists (fun (v:ByteString) -> (v.Length > maxValLen)) vs
+                then invalidArg "vs" "oversized value"
+            let hs = RscHash.hashMany vs
+            for h in hs do 
+                db.ephtbl.Incref (skEphId (BS.take stowKeyLen h))
+            lock db (fun () ->
+                for ix = 0 to (vs.Length - 1) do
+                    let h = hs.[ix]
+                    let v = vs.[ix]
+                    db.stow <- Map.add (BS.take stowKeyLen h) (struct(h,v)) (db.stow)
+                    db.sbsize <- db.sbsize + (sbSize (v.Length))
+                if (db.sbsize > db.sbthresh)
+                    then Monitor.PulseAll(db))
+            hs
+
         // Change stowage threshold. May cause background flush if
         // threshold is reduced below current buffer size.
         let setStowageThreshold (db:Database) (nBytes:int) : unit =
@@ -255,20 +434,53 @@ module LMDB =
                 if (db.sbsize > db.sbthresh)
                     then Monitor.PulseAll(db))
 
+        // Change group commit window. 
+        let setGroupCommitWindow (db:Database) (ms:int) : unit =
+            if (ms < 0) then invalidArg "ms" "negative commit window"
+            lock db (fun () -> 
+                db.gcwindow <- ms
+                Monitor.PulseAll(db))
+
         let inline dbReadKey (db:Database) (rtx:MDB_txn) (k : Key) =
             mdb_get rtx (db.dbi_data) k
 
         // read a recent value for a key. If there was a write to the key
         // earlier in the smae thread, that value or a later one is read.
         let readKey (db : Database) (k : Key) : Val =
-            let struct(wb0,wb1) = lock db (fun () -> 
-                struct(db.write, db.writing))
+            let struct(wb0,wb1,wb2) = lock db (fun () -> 
+                struct(db.write, db.prepwrite, db.writing))
             match CritbitTree.tryFind k wb0 with
             | Some v -> v
             | None ->
                 match CritbitTree.tryFind k wb1 with
                 | Some v -> v
-                | None -> withRTX db (fun rtx -> dbReadKey db rtx k)
+                | None ->
+                    match CritbitTree.tryFind k wb2 with
+                    | Some v -> v
+                    | None -> withRTX db (fun rtx -> dbReadKey db rtx k)
+
+
+        // view the value for a key without copying. Like readKey, this
+        // observes recent writes. The view is valid only during `reader`.
+        let withKeyView (db : Database) (k : Key) (reader : View option -> 'x) : 'x =
+            let struct(wb0,wb1,wb2) = lock db (fun () -> 
+                struct(db.write, db.prepwrite, db.writing))
+            let inBuffer =
+                match CritbitTree.tryFind k wb0 with
+                | Some v -> Some v
+                | None ->
+                    match CritbitTree.tryFind k wb1 with
+                    | Some v -> Some v
+                    | None -> CritbitTree.tryFind k wb2
+            let pinned v = BS.withPinnedBytes v (fun p -> reader (Some (new View(p, v.Length))))
+            match inBuffer with
+            | Some (Some v) -> pinned v
+            | Some None -> reader None
+            | None ->
+                withRTX db (fun rtx ->
+                    match mdb_getZC rtx (db.dbi_data) k with
+                    | Some v -> reader (Some (new View(v.data, int v.size)))
+                    | None -> reader None)
 
 
         let inline leftBiasedUnion (a:CritbitTree<'x>) (b:CritbitTree<'x>) : CritbitTree<'x> =
@@ -367,13 +579,13 @@ module LMDB =
                   stow_count = uint64 (sStow.entries)
                   stow_bytes = stat_bytes sStow
                   rfct_bytes = (stat_bytes sZero) + (stat_bytes sRfct)
+                  zero_count = uint64 (sZero.entries)
                 })
 
-        // The GC task is sophisticated enough to have its own object.
+        // Reference counting within a write transaction.
         // 
         // Durable reference counts are held in the Database, and we must
-        // also delay GC based on ephemeral references (Ephemerons table)
-        // or incremental GC quotas (so we don't delay writers too much).
+        // also delay GC based on ephemeral references (Ephemerons table).
         // To avoid fine-grained updates, all reference counts should also
         // be computed in memory and serialized in one batch.
         //
@@ -382,42 +594,29 @@ module LMDB =
         // future batch, but not this one. Consequently, increfs should run
         // before anything else.
         //
-        // The current GC strategy is essentially breadth-first, but will
-        // delete recursively within the limits of quotas.
+        // Deletions are planned by the collector (see dbCollectLoop) from
+        // read snapshots, and applied by the writer within a budget. We
+        // don't cascade within a frame: dependencies that reach zero are
+        // recorded in dbi_zero, and the collector will find them later.
         type GC =
             val db  : Database
             val wtx : MDB_txn
             val mutable rfct  : Map<StowKey,RC> 
-            val queue : Queue<StowKey>    // pending GC targets
-            val mutable quota : int       // GC effort quota
             new(db,wtx) = 
               { db = db
                 wtx = wtx
                 rfct = Map.empty
-                queue = new Queue<StowKey>()
-                quota = GC.DefaultQuota
               }
 
-            // The amount of incremental GC is based on a flat quota,
+            // The number of deletions per frame is based on a flat quota,
             // plus a small quota per new resource so we can keep up
             // with a busy writer.
             static member DefaultQuota = 2000
             static member NewRscQuota = 2
 
-            // add a deletion task for a given StowKey. Constrained
-            // by quota and ephemeral resources. Deletion is delayed
-            // until the `RunToCompletion` loop.
-            member gc.AddDeleteTask (sk:StowKey) : unit = 
-                let blockGC = (0 = gc.quota)
-                           || (gc.db.ephtbl.Contains (skEphId sk)) 
-                if blockGC then () else
-                gc.quota <- (gc.quota - 1)
-                gc.queue.Enqueue sk
-
             member gc.SetRefct (sk:StowKey) (rc:RC) : unit =
                 assert(stowKeyLen = sk.Length)
                 gc.rfct <- Map.add sk rc (gc.rfct)
-                if (0UL = rc) then gc.AddDeleteTask sk
 
             member gc.GetRefct (sk:StowKey) : RC =
                 match Map.tryFind sk (gc.rfct) with
@@ -428,7 +627,6 @@ module LMDB =
                 // most new resources have a zero refct initially, but
                 // it's possible to reference a resource before stowing
                 // (leading to MissingRsc exceptions).
-                gc.quota <- (gc.quota + GC.NewRscQuota)
                 gc.SetRefct sk (gc.GetRefct sk)
 
             member gc.Incref (h:RscHash) : unit =
@@ -454,111 +652,279 @@ module LMDB =
                 | Some s -> RscHash.iterHashDeps (gc.Decref) s
                 | None -> ()
 
-            member gc.ScanPending() : unit =
-                // scan dbi_zero table for items we may delete.
-                let ks = mdb_keys_from (gc.wtx) (gc.db.dbi_zero) (BS.empty)
-                use e = ks.GetEnumerator()
-                while((0 < gc.quota) && (e.MoveNext())) do
-                    let sk = e.Current
-                    let tryGC = not (Map.containsKey sk (gc.rfct))
-                    if tryGC then gc.AddDeleteTask sk
-
-            member gc.Delete (sk:StowKey) : unit =
-                assert(0UL = (gc.GetRefct sk))
+            // Delete a planned resource if it remains garbage: no refs
+            // from this frame, no ephemeral refs, and not yet deleted.
+            // The stowed value may be absent, e.g. for a hash-like string
+            // that was conservatively referenced; we still drop its zero
+            // refct entry. Returns whether we deleted.
+            member gc.Delete (struct(sk,deps):Doomed) : bool =
+                let garbage = (0UL = gc.GetRefct sk)
+                           && not (gc.db.ephtbl.Contains (skEphId sk))
+                           && (mdb_contains (gc.wtx) (gc.db.dbi_zero) sk)
+                if not garbage then false else
                 gc.rfct <- Map.remove sk (gc.rfct)
-                mdb_get (gc.wtx) (gc.db.dbi_stow) sk
-                    |> Option.map (BS.drop stowKeyRem)
-                    |> gc.RemVal
                 dbDelRsc (gc.db) (gc.wtx) sk
-
-            member gc.RunToCompletion () : unit =
-                // perform GC until no new tasks are enqueued.
-                while(0 < gc.queue.Count) do
-                    gc.Delete (gc.queue.Dequeue())
+                Array.iter (gc.Decref) deps
+                true
 
             member gc.FlushRefcts () : unit = 
                 // write final reference counts to the database
                 Map.iter (dbSetRefct (gc.db) (gc.wtx)) (gc.rfct)
                 gc.rfct <- Map.empty
 
-            member gc.Perform () : unit =
-                gc.ScanPending()
-                gc.RunToCompletion()
-                gc.FlushRefcts()
-                if(0 = gc.quota) then signal (gc.db) // for incremental GC
+        let private hashDeps (v:ByteString) : RscHash[] =
+            let hs = new ResizeArray<RscHash>()
+            RscHash.iterHashDeps (fun h -> hs.Add(h)) v
+            hs.ToArray()
 
-        let dbWriteFrame (db:Database) : bool =
-            // prevent potential GC of concurrently rooted resources. 
-            db.ephtbl.DelayDecrefs()
-
-            // write buffers are held in Database until commit, but
-            // are immediately separated from new incoming writes
-            let struct(syncing,halting) = lock db (fun () ->
-                db.writing <- db.write
-                db.stowing <- db.stow
-                let syncing = db.sync
+        // Take up to `quota` planned deletions for a frame.
+        let private dbTakeDoomed (db:Database) (quota:int) : Doomed[] =
+            lock db (fun () ->
+                let n = min quota (db.gcplan.Count)
+                Array.init n (fun _ -> db.gcplan.Dequeue()))
+
+        // After commit: wake the collector, which may find new garbage.
+        // A frame that only applied deletions, yet deleted nothing, can't
+        // create garbage, so we don't wake the collector to re-plan. If
+        // planned deletions remain, request another frame.
+        let private dbCommittedDoomed (db:Database) (planned:int) (changed:bool) : unit =
+            let remaining = lock db (fun () ->
+                db.gcuncommitted <- (db.gcuncommitted - planned)
+                if changed then db.gcwake <- true
+                Monitor.PulseAll(db)
+                db.gcplan.Count)
+            if (remaining > 0) then signal db
+
+        // The collector plans deletions from read snapshots, in chunks
+        // so we don't hold a reader (which delays the writer) for long.
+        // A plan is limited by the writer's quota per frame.
+        let private collectChunk = 256
+
+        // Scan a chunk of keys from `from` and before `until` (if any).
+        // Returns the key after the last scanned, if there may be more.
+        let private dbScanChunk (db:Database) (from:StowKey) (until:StowKey option) (acc:ResizeArray<Doomed>) : StowKey option =
+            let inline before sk = 
+                match until with
+                | Some k -> (ByteString.Compare sk k < 0)
+                | None -> true
+            withRTX db (fun rtx ->
+                let ks = mdb_keys_from rtx (db.dbi_zero) from
+                use e = ks.GetEnumerator()
+                let mutable last = None
+                let mutable n = 0
+                while (n < collectChunk) && (e.MoveNext()) && (before e.Current) do
+                    let sk = e.Current
+                    last <- Some sk
+                    n <- (n + 1)
+                    if not (db.ephtbl.Contains (skEphId sk)) then
+                        match mdb_get rtx (db.dbi_stow) sk with
+                        | Some v -> acc.Add(struct(sk, hashDeps (BS.drop stowKeyRem v)))
+                        | None -> acc.Add(struct(sk, Array.empty))
+                if (n < collectChunk) then None else 
+                Option.map (fun sk -> BS.snoc sk 0uy) last)
+
+        // Scan from the collector's cursor, wrapping around at the end
+        // of the table, until the plan is full or we're back where we
+        // started. The next scan resumes where this one stopped, so we
+        // don't rescan from the start entries that we cannot collect yet
+        // (e.g. held by ephemeral references).
+        let private dbScanDoomed (db:Database) : Doomed[] =
+            let acc = new ResizeArray<Doomed>()
+            let start = db.gccursor
+            let rec loop from wrapped =
+                if (acc.Count >= GC.DefaultQuota) then from else
+                let until = if wrapped then Some start else None
+                match dbScanChunk db from until acc with
+                | Some sk -> loop sk wrapped
+                | None when wrapped || BS.isEmpty start -> start
+                | None -> loop (BS.empty) true
+            db.gccursor <- loop start false
+            acc.ToArray()
+
+        // Collector loop. Waits to be woken (after commits, or upon
+        // request), scans for garbage, then waits for the writer to
+        // commit the plan. Writer latency is bounded by its quota, and
+        // doesn't depend on how much garbage a commit releases.
+        let rec dbCollectLoop (db:Database) : unit =
+            let struct(halt,waiters) = lock db (fun () ->
+                while not (db.gcwake || db.halt) do
+                    Monitor.Wait(db) |> ignore<bool>
+                db.gcwake <- false
+                let ws = db.gcwaiters
+                db.gcwaiters <- List.empty
+                struct(db.halt, ws))
+            if halt then List.iter (fun (tcs:TCS) -> tcs.TrySetResult() |> ignore) waiters else
+            let doomed = dbScanDoomed db
+            if (doomed.Length > 0) then
+                lock db (fun () ->
+                    Array.iter (db.gcplan.Enqueue) doomed
+                    db.gcuncommitted <- (db.gcuncommitted + doomed.Length))
+                signal db
+                lock db (fun () ->
+                    while (db.gcuncommitted > 0) && not (db.halt) do
+                        Monitor.Wait(db) |> ignore<bool>)
+            List.iter (fun (tcs:TCS) -> tcs.SetResult()) waiters
+            dbCollectLoop db
+
+        // Request a GC cycle, i.e. scan and apply a plan.
+        let collect (db:Database) : System.Threading.Tasks.Task =
+            let tcs = new TCS()
+            lock db (fun () ->
+                db.gcwaiters <- (tcs :: db.gcwaiters)
+                db.gcwake <- true
+                Monitor.PulseAll(db))
+            tcs.Task :> System.Threading.Tasks.Task
+
+        let inline dbHasWork (db:Database) : bool =
+            let noWork = (List.isEmpty (db.sync))
+                      && (CritbitTree.isEmpty (db.write))
+                      && (db.sbsize < db.sbthresh)
+            not noWork
+
+        // Wait for work and a free slot, then capture the write buffers.
+        // If there is a group commit window, we delay a little so more
+        // concurrent writers may share a commit (and fsync). Assumes lock.
+        let private dbAwaitCapture (db:Database) : unit =
+            while (db.preparing || not (dbHasWork db)) do
+                Monitor.Wait(db) |> ignore<bool>
+            if (db.gcwindow > 0) then
+                let t = Diagnostics.Stopwatch.StartNew()
+                let inline remaining () = db.gcwindow - int t.ElapsedMilliseconds
+                while (not db.halt) && (db.sbsize < db.sbthresh) && (remaining() > 0) do
+                    Monitor.Wait(db, remaining()) |> ignore<bool>
+
+        // Capture and prepare a frame. The captured buffers remain
+        // visible to readers until the writer takes the frame. Frame
+        // preparation is mostly scanning for references to resources.
+        let dbPrepareFrame (db:Database) : bool =
+            let struct(write,stow,sync,halt) = lock db (fun () ->
+                dbAwaitCapture db
+                // prevent potential GC of concurrently rooted resources. 
+                db.ephtbl.DelayDecrefs()
+                let r = struct(db.write, db.stow, db.sync, db.halt)
+                db.preparing <- true
+                db.prepwrite <- db.write
+                db.prepstow <- db.stow
                 db.write <- CritbitTree.empty
                 db.stow <- Map.empty
                 db.sync <- List.empty
                 db.sbsize <- 0
-                struct(syncing,db.halt))
+                r)
+            let wdeps = 
+                CritbitTree.toSeq write 
+                    |> Seq.collect (fun (_,v) -> 
+                        match v with
+                        | Some s -> hashDeps s
+                        | None -> Array.empty)
+                    |> Array.ofSeq
+            let sdeps = Map.map (fun _ (struct(_,v)) -> hashDeps v) stow
+            let f = { write = write; stow = stow; sync = sync; halt = halt
+                      wdeps = wdeps; sdeps = sdeps }
+            lock db (fun () ->
+                db.prepared <- Some f
+                Monitor.PulseAll(db))
+            halt
 
+        // Take the prepared frame into the writing slot.
+        let private dbTakeFrame (db:Database) : Frame =
+            lock db (fun () ->
+                while Option.isNone (db.prepared) do
+                    Monitor.Wait(db) |> ignore<bool>
+                let f = Option.get (db.prepared)
+                db.writing <- f.write
+                db.stowing <- f.stow
+                db.prepwrite <- CritbitTree.empty
+                db.prepstow <- Map.empty
+                db.prepared <- None
+                db.preparing <- false
+                Monitor.PulseAll(db)
+                f)
+
+        // Writer metrics, shared by every database in the process.
+        let private frameTimer =
+            Metrics.timer "stowage_lmdb_write_frame_seconds" "Write frames, from taking a frame until it is durable."
+        let private commitTimer =
+            Metrics.timer "stowage_lmdb_commit_seconds" "Commit and fsync of a write frame."
+        let private gcTimer =
+            Metrics.timer "stowage_lmdb_frame_gc_seconds" "Reference counting and deletions within a write frame."
+        let private frameKeys = Metrics.counter "stowage_lmdb_frame_keys_total" "Key-value roots written."
+        let private frameRscs = Metrics.counter "stowage_lmdb_frame_resources_total" "New resources written."
+        let private frameBytes = Metrics.counter "stowage_lmdb_frame_bytes_total" "Bytes of keys, values and new resources written."
+        let private gcDeleted = Metrics.counter "stowage_lmdb_gc_deleted_total" "Resources deleted by GC."
+
+        let dbWriteFrame (db:Database) : bool =
+            let f = dbTakeFrame db
+            let t0 = Diagnostics.Stopwatch.GetTimestamp()
             let wtx = mdb_readwrite_txn_begin (db.mdb_env)
 
             // Write our new roots. Remember old roots for GC purposes.
-            let overwriting = CritbitTree.map (fun k _ -> dbReadKey db wtx k) (db.writing)
-            CritbitTree.iter (dbWriteKeyVal db wtx) (db.writing)
+            let overwriting = CritbitTree.map (fun k _ -> dbReadKey db wtx k) (f.write)
+            CritbitTree.iter (dbWriteKeyVal db wtx) (f.write)
 
             // For stowage, filter known resources. Write the remainder.
             let isNewRsc sk _ = not (mdb_contains wtx (db.dbi_stow) sk) 
-            db.stowing <- Map.filter isNewRsc (db.stowing)
-            Map.iter (fun _ (struct(h,v)) -> dbAddRsc db wtx h v) (db.stowing)
+            let stowing = Map.filter isNewRsc (f.stow)
+            Map.iter (fun _ (struct(h,v)) -> dbAddRsc db wtx h v) stowing
 
-            // update reference counts and perform GC.
+            // update reference counts, then apply planned deletions.
+            let tGC = Diagnostics.Stopwatch.GetTimestamp()
             let gc = new GC(db,wtx)
-            CritbitTree.iter (fun _ v -> gc.AddVal v) (db.writing)
-            Map.iter (fun _ (struct(_,v)) -> gc.AddVal (Some v)) (db.stowing)
+            Array.iter (gc.Incref) (f.wdeps)
+            Map.iter (fun sk _ -> Array.iter (gc.Incref) (Map.find sk (f.sdeps))) stowing
             CritbitTree.iter (fun _ v -> gc.RemVal v) (overwriting)
-            Map.iter (fun sk _ -> gc.NewRsc sk) (db.stowing)
-            gc.Perform()
+            Map.iter (fun sk _ -> gc.NewRsc sk) stowing
+            let quota = GC.DefaultQuota + (GC.NewRscQuota * Map.count stowing)
+            let doomed = dbTakeDoomed db quota
+            let deleted = doomed |> Array.sumBy (fun d -> if gc.Delete d then 1 else 0)
+            gc.FlushRefcts()
             db.ephtbl.PassDecrefs() // allow decrefs after GC
+            gcTimer.Since tGC
 
             // write and flush the transaction
+            let tCommit = Diagnostics.Stopwatch.GetTimestamp()
             mdb_txn_commit wtx
             let oldReaders = lock db (fun () ->
                 let oldReadLock = db.rdlock
                 db.rdlock <- new ReadLock()
                 oldReadLock)
             mdb_env_sync (db.mdb_env) // flush to disk
+            commitTimer.Since tCommit
+            let changed = (deleted > 0) || not (CritbitTree.isEmpty (f.write)) 
+                       || not (Map.isEmpty stowing)
+            dbCommittedDoomed db (doomed.Length) changed
+            frameTimer.Since t0
+            let kvBytes = CritbitTree.fold (fun n k v -> 
+                            n + int64 (BS.length k) + (match v with | Some s -> int64 (BS.length s) | None -> 0L)) 0L (f.write)
+            let rscBytes = Map.fold (fun n _ (struct(_,v)) -> n + int64 (BS.length v)) 0L stowing
+            frameKeys.Add (int64 (CritbitTree.size (f.write)))
+            frameRscs.Add (int64 (Map.count stowing))
+            frameBytes.Add (kvBytes + rscBytes)
+            gcDeleted.Add (int64 deleted)
             let reportSync (tcs:TCS) = tcs.SetResult()
-            List.iter reportSync syncing
+            List.iter reportSync (f.sync)
             oldReaders.Wait() // wait on readers of old frame
             lock db (fun () -> // clear old read buffers
                 db.writing <- CritbitTree.empty
                 db.stowing <- Map.empty)
-            halting 
+            f.halt
 
-        let inline dbHasWork (db:Database) : bool =
-            let noWork = (List.isEmpty (db.sync))
-                      && (CritbitTree.isEmpty (db.write))
-                      && (db.sbsize < db.sbthresh)
-            not noWork
-
-        let inline dbAwaitWork (db:Database) : unit =
-            lock db (fun () ->
-                if not (dbHasWork db)
-                    then Monitor.Wait(db) |> ignore<bool>)
+        // The writer is pipelined: one thread prepares the next frame
+        // while another thread writes and commits the current frame.
+        let rec dbPrepareLoop (db:Database) : unit =
+            let halting = dbPrepareFrame db
+            if halting then () else dbPrepareLoop db
 
         let rec dbWriterLoop (db:Database) : unit = 
-            dbAwaitWork db
             let halting = dbWriteFrame db
             if halting then () else dbWriterLoop db
 
 
         let openDB (path:string) (maxSizeMB:int) : Database =
             let db = new Database(path,maxSizeMB)
-            signal db // perform initial GC
+            (new Thread(fun () -> dbPrepareLoop db)).Start()
             (new Thread(fun () -> dbWriterLoop db)).Start()
+            db.gcthread <- new Thread(fun () -> dbCollectLoop db)
+            db.gcthread.Start() // performs initial GC
             db
 
         // close will perform one final write loop then halt.
@@ -570,6 +936,8 @@ module LMDB =
                 db.sync <- (tcs :: db.sync)
                 Monitor.PulseAll(db))
             tcs.Task.Wait()
+            lock db (fun () -> Monitor.PulseAll(db))
+            db.gcthread.Join()
             db.Close()
             System.GC.SuppressFinalize(db)
 
@@ -599,6 +967,32 @@ module LMDB =
                 let sk = BS.take (I.stowKeyLen) h
                 this.db.ephtbl.Decref (I.skEphId sk)
 
+        interface StowageBatch with
+            member this.LoadMany hs = I.tryLoadRscMany (this.db) hs
+
+        /// Stow many values, as a batch. Equivalent to stowing each
+        /// value, but hashes the batch in parallel and buffers it under
+        /// one lock. Useful when compacting many small nodes.
+        member this.StowMany (vs:ByteString[]) : RscHash[] = 
+            I.stowRscMany (this.db) vs
+
+        /// Zero-copy access to a resource.
+        ///
+        /// The reader observes the resource bytes directly from the LMDB
+        /// memory map (or pinned, if the resource is still buffered). The
+        /// view is valid only while the reader runs; it holds the read
+        /// lock, which delays reuse of pages by the writer. Readers should
+        /// be brief, and must copy any bytes they retain. This can avoid
+        /// a large allocation and copy for lookups into big resources.
+        member this.LoadView (h:RscHash) (reader:View -> 'X) : 'X =
+            match I.withRscView (this.db) h reader with
+            | Some x -> x
+            | None -> raise (MissingRsc (this :> Stowage, h))
+
+        /// Zero-copy access to the value for a key. See LoadView.
+        member this.ReadView (k:Key) (reader:View option -> 'X) : 'X =
+            I.withKeyView (this.db) k reader
+
         interface DB.Storage with
             member this.Mangle k = mangle k
             member this.Read k = I.readKey (this.db) k
@@ -620,15 +1014,42 @@ module LMDB =
         member this.SetStowageBuffer (bytes:int) : unit =
             I.setStowageThreshold (this.db) bytes
 
+        /// Configure Group Commit Window (in milliseconds).
+        ///
+        /// When a write arrives while the writer is idle, we wait up to
+        /// this long for more writes before capturing a batch, so that
+        /// concurrent writers share a single commit and fsync. This adds
+        /// latency to every sync, but may greatly improve throughput with
+        /// many writers. The default is zero, i.e. commit immediately.
+        /// Writes that arrive while a commit is in progress are batched
+        /// regardless.
+        member this.SetGroupCommitWindow (ms:int) : unit =
+            I.setGroupCommitWindow (this.db) ms
+
         /// Force GC pass of the storage layer.
         /// 
-        /// This is not a full GC, it only waits for one write step which
-        /// may free up a couple thousand items. To determine progress, you
-        /// may need to use Stats().
+        /// This is not a full GC, it only waits for one collector cycle
+        /// which may free up a couple thousand items. To determine progress,
+        /// you may need to use Stats(). 
+        ///
+        /// GC normally runs in the background: a collector thread scans for
+        /// garbage against read snapshots, and the writer applies a limited
+        /// number of deletions per frame.
         member this.GC() : unit = 
             DB.flushStorage (this :> DB.Storage)
+            (I.collect (this.db)).Wait()
 
         /// Basic Database Size Statistics.
         member this.Stats() : Stats = 
             I.readStats (this.db)
 
+        /// Report Stats() in the Metrics registry, labeled by table. The
+        /// metrics are per process, so register only the primary Storage.
+        member this.RegisterMetrics() : unit =
+            let tables (fn:Stats -> (string * uint64) list) () =
+                fn (this.Stats()) |> List.map (fun (t,n) -> (t, float n))
+            Metrics.family "stowage_lmdb_entries" "Entries per table." "gauge" "table" 
+                (tables (fun s -> [("roots", s.root_count); ("stow", s.stow_count); ("zero", s.zero_count)]))
+            Metrics.family "stowage_lmdb_bytes" "Approximate bytes per table, from page counts." "gauge" "table"
+                (tables (fun s -> [("roots", s.root_bytes); ("stow", s.stow_bytes); ("rfct", s.rfct_bytes)]))
+
@@ -4,6 +4,7 @@ namespace Stowage
 open System
 open System.Security
 open System.Runtime.InteropServices
+open System.Threading
 
 /// Reference Tracking
 ///
@@ -201,3 +202,174 @@ module internal RCTable =
             loop ((1n + ixDel) &&& mask)
 
 
+
+    // A concurrent variant of the table, for refcounts that are updated
+    // from many threads (finalizers, VRef construction). The table is
+    // split into stripes by the high bits of the ID. Each stripe is an
+    // open-addressed table of packed 64-bit entries like the above, but
+    // in managed memory so a thread racing a resize still reads a valid
+    // (if stale) array.
+    //
+    // The common case, an increment or decrement of an existing entry
+    // where the result remains within 1..rcMax, is a lock-free CAS on
+    // the entry. Insert, delete, digit overflow and resize take the
+    // stripe's lock. Deletes leave a tombstone rather than shifting
+    // entries, so the lock-free path never observes a moving entry.
+    // Resize replaces every entry of the old array by a `Moved` marker,
+    // which directs lock-free operations to the slow path.
+    [<AllowNullLiteral>]
+    type private Stripe =
+        val mutable Data : int64[]
+        val mutable Fill : int          // live entries and tombstones
+        val mutable Live : int          // live entries
+        val mutable Next : Table        // next RC digit or null
+        new(sz:int) =
+            { Data = Array.zeroCreate (1 <<< sz)
+              Fill = 0
+              Live = 0
+              Next = null
+            }
+
+    type ConcurrentTable =
+        val private Stripes : Stripe[]
+        val private Shift : int
+
+        static member private Tombstone : int64 = int64 (1UL <<< Elem.rcBits)
+        static member private Moved : int64 = int64 (2UL <<< Elem.rcBits)
+        static member private Digit : uint16 = (Elem.rcMax - 7us)
+
+        /// Construct a table with 2^stripeBits stripes.
+        new(stripeBits:int) =
+            if ((stripeBits < 0) || (stripeBits > 16))
+                then invalidArg "stripeBits" "expecting 0..16"
+            { Stripes = Array.init (1 <<< stripeBits) (fun _ -> new Stripe(8))
+              Shift = (Elem.idBits - stripeBits)
+            }
+        new() = new ConcurrentTable(6)
+
+        member inline private tbl.StripeOf (id:uint64) : Stripe =
+            tbl.Stripes.[int (id >>> tbl.Shift)]
+
+        // find returns struct(index * entry) for the ID's entry, or the
+        // empty slot where probing stopped (entry 0). Seeing `Moved`
+        // returns the marker, to be handled by the caller.
+        static member private Find (data:int64[]) (id:uint64) : struct(int * int64) =
+            let mask = (data.Length - 1)
+            let rec loop ix =
+                let v = Volatile.Read(&data.[ix])
+                if (0L = v) || (ConcurrentTable.Moved = v) then struct(ix,v) else
+                let e = Elem(uint64 v)
+                if ((0us <> e.rc) && (e.id = id)) then struct(ix,v) else
+                loop ((1 + ix) &&& mask)
+            loop ((int id) &&& mask)
+
+        /// Test whether ID is present within table.
+        member tbl.Contains (idFull:uint64) : bool =
+            let id = (idFull &&& Elem.idMask)
+            let s = tbl.StripeOf id
+            let struct(_,v) = ConcurrentTable.Find (s.Data) id
+            if (ConcurrentTable.Moved <> v) then (0L <> v) else
+            lock s (fun () ->
+                let struct(_,v) = ConcurrentTable.Find (s.Data) id
+                (0L <> v))
+
+        /// Add ID to the table, or incref existing ID
+        member tbl.Incref (idFull:uint64) : unit =
+            let id = (idFull &&& Elem.idMask)
+            let s = tbl.StripeOf id
+            let rec fast () =
+                let data = s.Data
+                let struct(ix,v) = ConcurrentTable.Find data id
+                if (0L = v) || (ConcurrentTable.Moved = v) then false else
+                let e = Elem(uint64 v)
+                if (Elem.rcMax = e.rc) then false else
+                let v' = int64 (Elem(id, e.rc + 1us).v)
+                if (v = Interlocked.CompareExchange(&data.[ix], v', v)) then true else
+                fast ()
+            if not (fast ()) then lock s (fun () -> ConcurrentTable.SlowIncref s id)
+
+        member tbl.Decref (idFull:uint64) : unit =
+            let id = (idFull &&& Elem.idMask)
+            let s = tbl.StripeOf id
+            let rec fast () =
+                let data = s.Data
+                let struct(ix,v) = ConcurrentTable.Find data id
+                if (0L = v) || (ConcurrentTable.Moved = v) then false else
+                let e = Elem(uint64 v)
+                if (1us = e.rc) then false else
+                let v' = int64 (Elem(id, e.rc - 1us).v)
+                if (v = Interlocked.CompareExchange(&data.[ix], v', v)) then true else
+                fast ()
+            if not (fast ()) then lock s (fun () -> ConcurrentTable.SlowDecref s id)
+
+        // Under the stripe lock, only lock-free increments and decrements
+        // may race us. So we only CAS entries that are already present.
+        static member private SlowIncref (s:Stripe) (id:uint64) : unit =
+            ConcurrentTable.Reserve s
+            let data = s.Data
+            let struct(ix,v) = ConcurrentTable.Find data id
+            if (0L = v) then
+                // reuse a tombstone from the probe sequence if possible
+                let mask = (data.Length - 1)
+                let rec slot ix' =
+                    if (ix' = ix) || (ConcurrentTable.Tombstone = data.[ix']) then ix' else
+                    slot ((1 + ix') &&& mask)
+                let ixNew = slot ((int id) &&& mask)
+                if (ixNew = ix) then s.Fill <- (s.Fill + 1)
+                Volatile.Write(&data.[ixNew], int64 (Elem(id, 1us).v))
+                s.Live <- (s.Live + 1)
+            else
+                let e = Elem(uint64 v)
+                if (Elem.rcMax = e.rc) then
+                    let v' = int64 (Elem(id, (Elem.rcMax - ConcurrentTable.Digit) + 1us).v)
+                    if (v = Interlocked.CompareExchange(&data.[ix], v', v)) then
+                        if (null = s.Next) then s.Next <- new Table()
+                        s.Next.Incref id
+                    else ConcurrentTable.SlowIncref s id
+                else
+                    let v' = int64 (Elem(id, e.rc + 1us).v)
+                    if (v <> Interlocked.CompareExchange(&data.[ix], v', v))
+                        then ConcurrentTable.SlowIncref s id
+
+        static member private SlowDecref (s:Stripe) (id:uint64) : unit =
+            let data = s.Data
+            let struct(ix,v) = ConcurrentTable.Find data id
+            if (0L = v) then invalidOp "refct already zero!" else
+            let e = Elem(uint64 v)
+            if (1us = e.rc) then
+                let borrow = (null <> s.Next) && (s.Next.Contains id)
+                let v' = if borrow then int64 (Elem(id, ConcurrentTable.Digit).v)
+                                   else ConcurrentTable.Tombstone
+                if (v <> Interlocked.CompareExchange(&data.[ix], v', v))
+                    then ConcurrentTable.SlowDecref s id
+                else if borrow then s.Next.Decref id
+                else s.Live <- (s.Live - 1)
+            else
+                let v' = int64 (Elem(id, e.rc - 1us).v)
+                if (v <> Interlocked.CompareExchange(&data.[ix], v', v))
+                    then ConcurrentTable.SlowDecref s id
+
+        // At most 2/3 fill, counting tombstones. We rebuild at the same
+        // size if most of the fill is tombstones, otherwise grow.
+        static member private Reserve (s:Stripe) : unit =
+            let len = s.Data.Length
+            if ((3 * s.Fill) < (2 * len)) then () else
+            let len' = if ((3 * s.Live) < len) then len else (2 * len)
+            if (len' > (1 <<< 30))
+                then raise (System.OutOfMemoryException())
+            let old_data = s.Data
+            let new_data : int64[] = Array.zeroCreate len'
+            let mask = (len' - 1)
+            let rec place ix v =
+                if (0L = new_data.[ix]) then new_data.[ix] <- v else
+                place ((1 + ix) &&& mask) v
+            let mutable live = 0
+            for ix = 0 to (len - 1) do
+                // freeze the entry; lock-free updates may race us
+                let v = Interlocked.Exchange(&old_data.[ix], ConcurrentTable.Moved)
+                if (0us <> (Elem(uint64 v)).rc) then
+                    place (int ((Elem(uint64 v)).id) &&& mask) v
+                    live <- (live + 1)
+            s.Fill <- live
+            s.Live <- live
+            Volatile.Write(&s.Data, new_data)
@@ -37,6 +37,20 @@ let ``hash test`` () =
     Assert.Equal<string>(BS.toString h2, h2s)
     Assert.Equal<string>(BS.toString h3, h3s)
 
+[<Fact>]
+let ``batch hash and base32`` () =
+    let rng = new System.Random(14)
+    let bins = Array.init 1000 (fun i -> 
+        BS.unsafeCreateA (Array.init (rng.Next(200)) (fun _ -> byte (rng.Next(256)))))
+    let hs = RscHash.hashMany bins
+    Assert.Equal<RscHash[]>(Array.map RscHash.hash bins, hs)
+    for h in hs do
+        let d = RscHash.decode h
+        Assert.Equal(40, d.Length)
+        Assert.Equal<ByteString>(h, RscHash.encode d)
+    let bad = BS.append (BS.take 63 (hs.[0])) (BS.fromString "a")
+    Assert.Throws<ArgumentException>(fun () -> RscHash.decode bad |> ignore) |> ignore
+
 [<Fact>]
 let ``intmap hbi`` () =
     let inline hbi n = int (IntMap.Critbit.highBitIndex n)
@@ -285,6 +299,95 @@ let ``efficient trie diff`` () =
     
 
 
+type TestCached(cleared:int ref) =
+    member val Hold = Array.zeroCreate<byte> 100
+    interface Cached with
+        member __.Usage with get() = 0
+        member __.Clear() = System.Threading.Interlocked.Increment(cleared) |> ignore
+
+[<Fact>]
+let ``sharded cache manager`` () =
+    let cm = new Cache.Manager(4, 50, 100000UL, 8)
+    let cleared = ref 0
+    let held = Array.init 8 (fun _ -> new System.Collections.Generic.List<TestCached>())
+    let worker ix () =
+        for i = 1 to 10000 do
+            let c = new TestCached(cleared)
+            held.[ix].Add(c) // prevent GC, so each item is cleared
+            cm.Receive (c :> Cached) 100UL
+    let threads = Array.init 8 (fun ix -> new Thread(worker ix))
+    Array.iter (fun (t:Thread) -> t.Start()) threads
+    Array.iter (fun (t:Thread) -> t.Join()) threads
+    // scrubbing is in the background; wait for it to catch up
+    let sw = System.Diagnostics.Stopwatch.StartNew()
+    while (!cleared < 70000) && (sw.ElapsedMilliseconds < 10000L) do
+        Thread.Sleep(10)
+    printfn "cache items cleared: %d" (!cleared)
+    Assert.True(!cleared >= 70000)
+    Assert.True(!cleared <= 80000)
+
+[<Fact>]
+let ``cache manager buffered items`` () =
+    // fewer items than a thread buffers are still scrubbed over quota
+    let cm = new Cache.Manager(4, 50, 1000UL, 1)
+    let cleared = ref 0
+    let held = Array.init 10 (fun _ -> new TestCached(cleared))
+    Array.iter (fun c -> cm.Receive (c :> Cached) 100UL) held
+    let sw = System.Diagnostics.Stopwatch.StartNew()
+    while (!cleared = 0) && (sw.ElapsedMilliseconds < 10000L) do
+        Thread.Sleep(10)
+    Assert.True(!cleared > 0)
+    // items buffered by an exited thread are released from its size
+    let cm' = new Cache.Manager(4, 50, System.UInt64.MaxValue, 1)
+    let t = new Thread(fun () -> 
+        for i = 1 to 5 do cm'.Receive (new TestCached(cleared) :> Cached) 100UL)
+    t.Start()
+    t.Join()
+    Assert.True((cm'.Stats()).size > 0UL)
+    let sw' = System.Diagnostics.Stopwatch.StartNew()
+    while ((cm'.Stats()).size > 0UL) && (sw'.ElapsedMilliseconds < 10000L) do
+        System.GC.Collect()
+        System.GC.WaitForPendingFinalizers()
+        Thread.Sleep(10)
+    Assert.Equal(0UL, (cm'.Stats()).size)
+    System.GC.KeepAlive(held)
+
+type TestCostly(cost:int64, cleared:int ref) =
+    interface Cached with
+        member __.Usage with get() = 0
+        member __.Clear() = System.Threading.Interlocked.Increment(cleared) |> ignore
+    interface Costly with
+        member __.Cost with get() = cost
+
+[<Fact>]
+let ``cost-aware cache eviction`` () =
+    let cm = new Cache.Manager(4, 50, System.UInt64.MaxValue, 1)
+    let cheapCleared = ref 0
+    let costlyCleared = ref 0
+    let held = new System.Collections.Generic.List<obj>()
+    for i = 1 to 5000 do
+        let cheap = new TestCostly(1L, cheapCleared)
+        let costly = new TestCostly(10000L, costlyCleared)
+        held.Add(cheap); held.Add(costly)
+        cm.Receive (cheap :> Cached) 100UL
+        cm.Receive (costly :> Cached) 100UL
+    cm.Resize 1000000UL // enough for about half the items
+    let sw = System.Diagnostics.Stopwatch.StartNew()
+    while ((cm.Stats()).size > 1000000UL) && (sw.ElapsedMilliseconds < 10000L) do
+        Thread.Sleep(10)
+    let stats = cm.Stats()
+    printfn "cache cleared cheap %d, costly %d; stats %A" (!cheapCleared) (!costlyCleared) stats
+    Assert.True(!cheapCleared > (4 * !costlyCleared))
+    Assert.Equal(uint64 (!cheapCleared + !costlyCleared), stats.evictions)
+    // hit and miss counters, via MCache
+    let mc = new MCache.C<int,int>(cm, System.Collections.Generic.EqualityComparer<int>.Default)
+    MCache.add 1 1 10UL mc
+    Assert.Equal(Some 1, MCache.tryFind 1 mc)
+    Assert.Equal(None, MCache.tryFind 2 mc)
+    let stats' = cm.Stats()
+    Assert.Equal(stats.hits + 1UL, stats'.hits)
+    Assert.Equal(stats.misses + 1UL, stats'.misses)
+
 // a fixture is needed to load the database
 type TestDB =
     val s : LMDB.Storage
@@ -369,6 +472,32 @@ type DBTests =
         t.FullGC()
         Assert.Equal<ByteString option>(None, t.TryLoad ra)
 
+    [<Fact>]
+    member t.``GC of conservatively referenced hashes`` () =
+        // a value with a hash-like string that was never stowed
+        let path = "testDB-gc-fake"
+        clearTestDir path
+        use s = new LMDB.Storage(path, 100)
+        let st = s :> DB.Storage
+        let k = st.Mangle (BS.fromString "fake")
+        let fake = BS.toString (RscHash.hash (BS.fromString "never stowed"))
+        st.WriteBatch (CritbitTree.ofList [(k, Some (BS.fromString ("ref " + fake)))]) ()
+        Assert.Equal(0UL, (s.Stats()).zero_count)
+        st.WriteBatch (CritbitTree.ofList [(k, Some (BS.fromString "plain"))]) ()
+        s.GC()
+        s.GC()
+        Assert.Equal(0UL, (s.Stats()).zero_count)
+        // the collector goes idle, rather than writing empty frames
+        let frames = Metrics.timer "stowage_lmdb_write_frame_seconds" ""
+        let sw = System.Diagnostics.Stopwatch.StartNew()
+        let rec idle () =
+            let n0 = frames.Count
+            Thread.Sleep(200)
+            if (n0 = frames.Count) then true
+            elif (sw.ElapsedMilliseconds > 5000L) then false
+            else idle ()
+        Assert.True(idle ())
+
     member t.ToKey (s:string) : DB.Key = 
         t.Storage.Mangle (BS.fromString s)
     member t.ToVal (s:string) : DB.Val =
@@ -424,6 +553,162 @@ type DBTests =
         Assert.False(hasRsc c_val)
 
 
+    [<Fact>]
+    member t.``group commit of concurrent writers`` () =
+        let nThreads = 8
+        let nWrites = 50
+        let key i j = t.ToKey (sprintf "group-commit-%d-%d" i j)
+        let rsc i j = BS.fromString (sprintf "group commit resource %d %d" i j)
+        let writer i () =
+            for j = 1 to nWrites do
+                let r = t.Stowage.Stow (rsc i j)
+                let sync = t.Storage.WriteBatch (CritbitTree.singleton (key i j) (Some r))
+                t.Stowage.Decref r
+                sync ()
+        t.s.SetGroupCommitWindow 5
+        let sw = System.Diagnostics.Stopwatch.StartNew()
+        let threads = Array.init nThreads (fun i -> new Thread(writer i))
+        Array.iter (fun (th:Thread) -> th.Start()) threads
+        Array.iter (fun (th:Thread) -> th.Join()) threads
+        sw.Stop()
+        t.s.SetGroupCommitWindow 0
+        let usecPerSync = (sw.Elapsed.TotalMilliseconds * 1000.0)
+                            / (float (nThreads * nWrites))
+        printfn "usec per concurrent sync write: %A" usecPerSync
+        t.FullGC()
+        for i = 0 to (nThreads - 1) do
+            for j = 1 to nWrites do
+                Assert.Equal<DB.Val>(Some (RscHash.hash (rsc i j)), t.Storage.Read (key i j))
+                Assert.True(t.HasRsc (rsc i j))
+        // cleanup
+        let clear = seq { for i = 0 to (nThreads - 1) do
+                            for j = 1 to nWrites do 
+                                yield (key i j, None) }
+        t.Storage.WriteBatch (CritbitTree.ofSeq clear) ()
+        t.FullGC()
+        Assert.False(t.HasRsc (rsc 0 1))
+
+    [<Fact>]
+    member t.``stow many`` () =
+        let vs = Array.init 500 (fun i -> BS.fromString (sprintf "stow many %d" i))
+        let hs = t.s.StowMany vs
+        Assert.Equal<RscHash[]>(Array.map RscHash.hash vs, hs)
+        Assert.Equal<ByteString>(vs.[7], t.Stowage.Load (hs.[7]))
+        t.Flush()
+        Assert.Equal<ByteString[]>(vs, Array.map (t.Stowage.Load) hs)
+        Array.iter (t.Stowage.Decref) hs
+        t.FullGC()
+        Assert.False(Array.exists (t.HasRsc) vs)
+
+    [<Fact>]
+    member t.``archive export and import`` () =
+        // a small DAG: shared leaves, two nodes, and a root
+        let stow (s:string) = t.Stowage.Stow (BS.fromString s)
+        let leaves = Array.init 100 (fun i -> stow (sprintf "archive leaf %d" i))
+        let hstr (hs:RscHash[]) = hs |> Array.map BS.toString |> String.concat " "
+        let n1 = stow ("node1 " + hstr leaves.[0..59])
+        let n2 = stow ("node2 " + hstr leaves.[40..99])
+        let fake = BS.toString (RscHash.hash (BS.fromString "not stowed"))
+        let root = BS.fromString (sprintf "root %s %s %s" (hstr [|n1; n2|]) (BS.toString leaves.[7]) fake)
+        let mem = new MemoryStream()
+        let ex = Archive.write t.Stowage [("test", root)] mem
+        Assert.Equal(102L, ex.resources)
+        Assert.Equal(1L, ex.missing)
+
+        let path = "testDB-archive"
+        clearTestDir path
+        use s2 = new LMDB.Storage(path, 100)
+        let db2 = DB.fromStorage (s2 :> DB.Storage)
+        let tv = db2.Register (BS.fromString "root") (EncBytesRaw.codec)
+        let bind roots =
+            Assert.Equal<string list>(["test"], List.map fst roots)
+            db2.Write tv (Some (snd (List.head roots)))
+        let im = Archive.read db2 1000 bind (new MemoryStream(mem.ToArray()))
+        Assert.Equal(102L, im.resources)
+        Assert.Equal(ex.bytes, im.bytes)
+        // imported resources are rooted only by the root variable
+        System.GC.Collect()
+        s2.GC()
+        let load h = (s2 :> Stowage).Load h
+        Assert.Equal<ByteString>(BS.fromString "archive leaf 99", load leaves.[99])
+        Assert.Equal<ByteString>(t.Stowage.Load n2, load n2)
+
+        // resources are verified against their hashes
+        let bad = mem.ToArray()
+        let ix = System.Text.Encoding.ASCII.GetString(bad).IndexOf("archive leaf 50")
+        bad.[ix] <- byte 'A'
+        Assert.Throws<Archive.CorruptArchive>(fun () ->
+            Archive.read db2 1000 ignore (new MemoryStream(bad)) |> ignore) |> ignore
+        // resources imported before the failure are not held
+        let pathBad = "testDB-archive-bad"
+        clearTestDir pathBad
+        use s3 = new LMDB.Storage(pathBad, 100)
+        let db3 = DB.fromStorage (s3 :> DB.Storage)
+        Assert.Throws<Archive.CorruptArchive>(fun () ->
+            Archive.read db3 (1 <<< 20) ignore (new MemoryStream(bad)) |> ignore) |> ignore
+        db3.Flush()
+        System.GC.Collect()
+        s3.GC()
+        Assert.Throws<MissingRsc>(fun () -> (s3 :> Stowage).Load leaves.[0] |> ignore) |> ignore
+        Array.iter (t.Stowage.Decref) (Array.append leaves [| n1; n2 |])
+
+    [<Fact>]
+    member t.``runtime metrics`` () =
+        let c = Metrics.counter "test_metrics_total" "A test counter."
+        let tm = Metrics.timer "test_metrics_seconds" "A test timer."
+        Assert.True(obj.ReferenceEquals(c, Metrics.counter "test_metrics_total" "again"))
+        Assert.Throws<System.ArgumentException>(fun () ->
+            Metrics.timer "test_metrics_total" "wrong type" |> ignore) |> ignore
+        c.Add 41L
+        c.Incr ()
+        tm.Slow <- System.TimeSpan.Zero
+        tm.Time (fun () -> System.Threading.Thread.Sleep(2))
+        Assert.Equal(1L, tm.Count)
+        Assert.True(tm.MaxSeconds >= 0.001)
+        Assert.True(Metrics.slowSpans () |> List.exists (fun s -> (s.name = "test_metrics_seconds")))
+
+        // write frames are reported, counted across databases
+        let frames = Metrics.timer "stowage_lmdb_write_frame_seconds" ""
+        let n0 = frames.Count
+        t.Stowage.Stow (BS.fromString "metrics test resource") |> t.Stowage.Decref
+        t.s.RegisterMetrics()
+        t.Flush()
+        Assert.True(frames.Count > n0)
+
+        let lines = (Metrics.report ()).Split('\n')
+        let has (l:string) = Array.contains l lines
+        Assert.True(has "# TYPE test_metrics_total counter")
+        Assert.True(has "test_metrics_total 42")
+        Assert.True(has "test_metrics_seconds_count 1")
+        Assert.True(has "test_metrics_seconds_bucket{le=\"+Inf\"} 1")
+        Assert.True(has "# TYPE test_metrics_max_seconds gauge")
+        Assert.False(lines |> Array.exists (fun l -> l.StartsWith("test_metrics_seconds_max")))
+        Assert.True(lines |> Array.exists (fun l -> l.StartsWith("stowage_lmdb_entries{table=\"stow\"} ")))
+        Assert.True(lines |> Array.exists (fun l -> l.StartsWith("stowage_lmdb_write_frame_seconds_count ")))
+
+    [<Fact>]
+    member t.``zero-copy views`` () =
+        let v = BS.fromString "testing zero-copy resource views"
+        let r = t.Stowage.Stow v
+        let viewCopy (view:LMDB.View) = view.ToByteString()
+        Assert.Equal<ByteString>(v, t.s.LoadView r viewCopy) // buffered
+        t.Flush()
+        Assert.Equal<ByteString>(v, t.s.LoadView r viewCopy) // memory map
+        Assert.Equal(byte 'z', t.s.LoadView r (fun view -> view.[8]))
+        Assert.Equal<ByteString>(BS.fromString "views", t.s.LoadView r (fun view -> view.Copy(27,5)))
+        let missing = RscHash.hash (BS.fromString "no such resource")
+        Assert.Throws<MissingRsc>(fun () -> t.s.LoadView missing viewCopy |> ignore) |> ignore
+        // keys
+        let k = t.ToKey "zero-copy-key"
+        let readView () = t.s.ReadView k (Option.map viewCopy)
+        let sync = t.Storage.WriteBatch (CritbitTree.singleton k (Some r))
+        Assert.Equal<ByteString option>(Some r, readView ())
+        sync ()
+        Assert.Equal<ByteString option>(Some r, readView ())
+        t.Storage.WriteBatch (CritbitTree.singleton k None) ()
+        Assert.Equal<ByteString option>(None, readView ())
+        t.Stowage.Decref r
+
     [<Fact>]
     member t.``cannot decref below zero!``() =
         let rsc = BS.fromString "testing: cannot decref below zero!"
@@ -436,6 +721,67 @@ type DBTests =
         Assert.Throws<InvalidOperationException>(fun () -> 
             t.Storage.Decref ref)
 
+    [<Fact>]
+    member t.``concurrent incref and decref`` () =
+        // many threads churn refcounts on shared resources, past the
+        // 6-bit digit and through table resizes
+        let nThreads = 8
+        let rscs = Array.init 2000 (fun i -> BS.fromString (sprintf "concurrent refct %d" i))
+        let refs = Array.map (t.Stowage.Stow) rscs
+        t.Flush()
+        let churn i () =
+            for k = 1 to 5 do
+                for j = 0 to (refs.Length - 1) do
+                    if (0 = ((i + j) % 3)) then
+                        for _ = 1 to 100 do t.Storage.Incref (refs.[j])
+                        for _ = 1 to 100 do t.Storage.Decref (refs.[j])
+                    else 
+                        t.Storage.Incref (refs.[j])
+                        t.Storage.Decref (refs.[j])
+        let threads = Array.init nThreads (fun i -> new Thread(churn i))
+        Array.iter (fun (th:Thread) -> th.Start()) threads
+        Array.iter (fun (th:Thread) -> th.Join()) threads
+        // every resource still has its implicit ref from Stow
+        t.FullGC()
+        Assert.True(Array.forall (t.HasRsc) rscs)
+        Array.iteri (fun j r -> if (0 = (j % 2)) then t.Stowage.Decref r) refs
+        t.FullGC()
+        Array.iteri (fun j rsc -> Assert.Equal((1 = (j % 2)), t.HasRsc rsc)) rscs
+        Array.iteri (fun j r -> if (1 = (j % 2)) then t.Stowage.Decref r) refs
+        t.FullGC()
+        Assert.False(Array.exists (t.HasRsc) rscs)
+
+    [<Fact>]
+    member t.``incremental GC of a long chain`` () =
+        // a chain of resources, each referencing the prior, so GC must
+        // cascade across many collector cycles. We hold the middle link.
+        let n = 6000
+        let link (h:RscHash) (i:int) = BS.concat [h; BS.fromString (sprintf " link %d" i)]
+        let chain = Array.zeroCreate n
+        chain.[0] <- t.Stowage.Stow (BS.fromString "link 0")
+        for i = 1 to (n - 1) do
+            chain.[i] <- t.Stowage.Stow (link (chain.[i-1]) i)
+            t.Stowage.Decref (chain.[i-1])
+        t.Flush()
+        let mid = chain.[n / 2]
+        t.Stowage.Incref mid
+        t.Stowage.Decref (chain.[n - 1])
+        // the writer remains responsive while garbage is collected
+        let sw = System.Diagnostics.Stopwatch()
+        let mutable maxMs = 0.0
+        for i = 1 to 20 do
+            sw.Restart()
+            let kvs = CritbitTree.ofList [t.KVP ("chain-gc", sprintf "write %d" i)]
+            (t.Storage.WriteBatch kvs)()
+            maxMs <- max maxMs (sw.Elapsed.TotalMilliseconds)
+        printfn "max write latency during chain GC: %A ms" maxMs
+        t.FullGC()
+        Assert.True(Array.forall (t.TryLoad >> Option.isSome) (chain.[.. n/2]))
+        Assert.True(Array.forall (t.TryLoad >> Option.isNone) (chain.[n/2 + 1 ..]))
+        t.Stowage.Decref mid
+        t.FullGC()
+        Assert.True(Array.forall (t.TryLoad >> Option.isNone) chain)
+
     [<Fact>]
     member t.``fast enough for practical work`` () =
         t.FullGC()
@@ -582,6 +928,105 @@ type DBTests =
         Assert.Equal<string option>(Some "a1", t.DB.Read a)
         Assert.Equal<string option>(None, t.DB.Read b)
 
+    [<Fact>]
+    member t.``merged tx commits`` () =
+        // a counter incremented by concurrent transactions
+        let a = t.DB.Allocate 0
+        let incr (tx:DB) = 
+            DB.writeMerge tx a (1 + tx.Read a) (fun n -> Some (n + 1))
+        let struct(_,tx2_commit) = t.DB.Transact(fun tx ->
+            incr tx
+            let struct(_,tx1_commit) = t.DB.Transact (fun tx -> incr tx)
+            Assert.True(tx1_commit))
+        Assert.True(tx2_commit)
+        Assert.Equal(2, t.DB.Read a)
+
+        // conflicts are reported by merge, or by plain reads
+        let b = t.DB.Allocate "b"
+        let struct(_,tx3_commit) = t.DB.Transact(fun tx ->
+            DB.writeMerge tx a (1 + tx.Read a) (fun _ -> None)
+            incr t.DB)
+        Assert.False(tx3_commit)
+        let struct(_,tx4_commit) = t.DB.Transact(fun tx ->
+            incr tx
+            ignore (tx.Read b)
+            t.DB.Write b "b1")
+        Assert.False(tx4_commit)
+        Assert.Equal(3, t.DB.Read a)
+
+        // hierarchical transactions preserve merge functions
+        let struct(_,tx5_commit) = t.DB.Transact(fun tx ->
+            let struct(_,ok) = tx.Transact incr
+            Assert.True(ok)
+            incr t.DB)
+        Assert.True(tx5_commit)
+        Assert.Equal(5, t.DB.Read a)
+
+        // many threads incrementing concurrently without failure
+        let n = 8
+        let k = 200
+        let work () = 
+            for _ in 1 .. k do
+                let struct(_,ok) = t.DB.Transact incr
+                Assert.True(ok)
+        let ts = Array.init n (fun _ -> System.Threading.Tasks.Task.Run(work))
+        System.Threading.Tasks.Task.WaitAll(ts)
+        Assert.Equal(5 + n * k, t.DB.Read a)
+
+    [<Fact>]
+    member t.``reactive computed variables`` () =
+        let rx = new Reactive.Reactor(t.DB)
+        let db = rx.DB
+        let a = db.Allocate 1
+        let b = db.Allocate 10
+        let c = db.Allocate "c"
+        let sumRuns = ref 0
+        let sum = Reactive.compute rx 0 (fun tx _ ->
+            sumRuns.Value <- sumRuns.Value + 1
+            tx.Read a + tx.Read b)
+        let parity = Reactive.compute rx false (fun tx _ -> (0 = (tx.Read sum % 2)))
+        let msg = Reactive.compute rx "" (fun tx _ ->
+            sprintf "%s %d %b" (tx.Read c) (tx.Read sum) (tx.Read parity))
+        rx.Sync()
+        Assert.Equal<string>("c 11 false", db.Read msg)
+
+        // a burst of writes is batched, and runs in topological order
+        let struct(_,ok) = db.Transact(fun tx ->
+            tx.Write a 2
+            tx.Write b 20)
+        Assert.True(ok)
+        rx.Sync()
+        Assert.Equal<string>("c 22 true", db.Read msg)
+        Assert.True(sumRuns.Value <= 2)
+
+        // rewriting an unchanged value skips the computation
+        let runs = sumRuns.Value
+        db.Write a 2
+        rx.Sync()
+        Assert.Equal(runs, sumRuns.Value)
+
+        // unchanged results don't propagate
+        db.Write a 4
+        db.Write c "d"
+        rx.Sync()
+        Assert.Equal<string>("d 24 true", db.Read msg)
+
+        // writes to the underlying DB are not observed
+        t.DB.Write c "e"
+        rx.Sync()
+        Assert.Equal<string>("d 24 true", db.Read msg)
+
+        // errors are reported by Sync, and the agent remains watching
+        let boom = Reactive.agent rx (fun tx ->
+            if (tx.Read a > 10) then invalidOp "too big")
+        db.Write a 11
+        Assert.Throws<AggregateException>(fun () -> rx.Sync()) |> ignore
+        Assert.False(isNull boom.Error)
+        db.Write a 5
+        rx.Sync()
+        Assert.True(isNull boom.Error)
+        Assert.Equal<string>("e 25 false", db.Read msg)
+
     [<Fact>]
     member t.``vref basics`` () =
         let cv = EncStringRaw.codec
@@ -602,6 +1047,54 @@ type DBTests =
         Assert.True(CVRef.isRemote b)
 
 
+    [<Fact>]
+    member t.``batch loads and prefetch`` () =
+        let rscs = Array.init 100 (fun i -> BS.fromString (sprintf "batch load %d" i))
+        let refs = Array.map (t.Stowage.Stow) rscs
+        let missing = RscHash.hash (BS.fromString "batch load missing")
+        let req = Array.append (Array.sub refs 0 50) [| missing |]
+        Assert.Equal<ByteString option[]>(Array.append (Array.map Some (Array.sub rscs 0 50)) [| None |],
+            Stowage.loadMany (t.DB :> Stowage) req) // buffered
+        t.Flush()
+        Assert.Equal<ByteString option[]>(Array.map Some rscs, Stowage.loadMany (t.Stowage) refs)
+        Array.iter (t.Stowage.Decref) refs
+
+        // prefetching traversal of a cold IntMap
+        let cm = IntMap.codec' 2000UL (EncVarNat.codec)
+        let m = Seq.fold (fun m k -> IntMap.add k (k * k) m) IntMap.empty (seq { 0UL .. 3UL .. 60000UL })
+        let mc = Codec.compact cm (t.DB) m
+        Assert.True(IntMap.hasRemote mc)
+        let cold = Codec.readBytes cm (t.DB) (Codec.writeBytes cm mc)
+        Assert.Equal<(uint64 * uint64) list>(IntMap.toList m, List.ofSeq (IntMap.toSeqAhead 8 cold))
+
+    [<Fact>]
+    member t.``dense node encodings`` () =
+        let bytes (xs:int list) = BS.ofList (List.map byte xs)
+        let cm = IntMap.codec (EncVarNat.codec)
+        let m = IntMap.empty |> IntMap.add 0UL 5UL |> IntMap.add 1UL 7UL
+        let mNew = bytes [1; 0xC0; int 'L'; 0; 5; int 'L'; 0; 7]
+        let mOld = bytes [1; int 'N'; 0; 0; int '`'; int 'L'; 0; 5; int 'L'; 0; 7]
+        Assert.Equal<ByteString>(mNew, Codec.writeBytes cm m)
+        Assert.Equal<(uint64 * uint64) list>(IntMap.toList m, 
+            IntMap.toList (Codec.readBytes cm (t.Stowage) mOld))
+        let ct = Trie.codec (EncBytes.codec)
+        let tr = Trie.singleton (BS.fromString "ab") (BS.fromString "x")
+        let tNew = bytes [0x80; (2 <<< 2) ||| 1; int 'a'; int 'b'; 1; int 'x']
+        let tOld = bytes [2; int 'a'; int 'b'; 1; 1; int 'x'; 0]
+        Assert.Equal<ByteString>(tNew, Codec.writeBytes ct tr)
+        Assert.Equal<(ByteString * ByteString) list>(Trie.toList tr, 
+            Trie.toList (Codec.readBytes ct (t.Stowage) tOld))
+        // long prefixes, and exact size estimates
+        let rng = new System.Random(19)
+        let key _ = BS.unsafeCreateA (Array.init (rng.Next(200)) (fun _ -> byte (97 + rng.Next(3))))
+        let big = Seq.init 2000 (fun i -> (key i, BS.fromString (string i))) |> Trie.ofSeq
+        let ct' = Trie.codec' (System.UInt64.MaxValue) (EncBytes.codec)
+        let struct(big',sz) = Codec.compactSz ct' (t.Stowage) big
+        let bigBytes = Codec.writeBytes ct' big'
+        Assert.Equal(int sz, bigBytes.Length)
+        Assert.Equal<(ByteString * ByteString) list>(Trie.toList big, 
+            Trie.toList (Codec.readBytes ct' (t.Stowage) bigBytes))
+
     [<Fact>]
     member t.``intmap serialization`` () =
         let mutable m = IntMap.empty
@@ -641,6 +1134,27 @@ type DBTests =
         Assert.Equal(2000, Seq.length (IntMap.toSeq m))
         Assert.Equal<(uint64 * int) seq>(IntMap.toSeq m, IntMap.toSeq m')
 
+    [<Fact>]
+    member t.``parallel compaction is deterministic`` () =
+        let rng = new System.Random(15)
+        let keys = Array.init 20000 (fun _ -> BS.fromString (string (rng.Next())))
+        let tc = LSMTrie.codec' 800UL (EncVarInt32.codec)
+        let lsm = Array.fold (fun m k -> LSMTrie.add k (BS.length k) m) LSMTrie.empty keys
+        let seqBytes = Codec.writeBytes tc (Codec.compact tc (t.Stowage) lsm)
+        let parBytes = Codec.writeBytes tc (Codec.compactPar tc (t.Stowage) lsm)
+        Assert.Equal<ByteString>(seqBytes, parBytes)
+        let cm = IntMap.codec' 400UL (EncVarInt32.codec)
+        let m = Array.fold (fun m k -> IntMap.add (uint64 (ByteString.Hash64 k)) 1 m) IntMap.empty keys
+        let struct(mSeq,szSeq) = Codec.compactSz cm (t.Stowage) m
+        let struct(mPar,szPar) = Codec.compactSzPar cm (t.Stowage) m
+        Assert.Equal(szSeq, szPar)
+        Assert.Equal<ByteString>(Codec.writeBytes cm mSeq, Codec.writeBytes cm mPar)
+        // incremental updates on the compacted tree
+        let upd = Seq.fold (fun m ix -> LSMTrie.add (keys.[ix]) 0 m) 
+                           (Codec.compact tc (t.Stowage) lsm) (seq { 0 .. 37 .. 19999 })
+        Assert.Equal<ByteString>(Codec.writeBytes tc (Codec.compact tc (t.Stowage) upd),
+                                 Codec.writeBytes tc (Codec.compactPar tc (t.Stowage) upd))
+
     [<Fact>] 
     member tf.``LSM Trie single compaction performance`` () =
 
@@ -686,6 +1200,69 @@ type DBTests =
         Assert.True(usec_per_write < 30.0)
         Assert.True(usec_per_read < 8.0)
 
+    [<Fact>]
+    member tf.``LSM Trie policy and write stats`` () =
+        // digits are sparse bytes, so absent keys fall between children
+        let toKey (i:int) = 
+            BS.fromString (String.map (fun c -> char (48 + 2 * (int c - 48))) (string i))
+        let absent (i:int) = BS.snoc (toKey i) (byte '1')
+        let rootAbsent (i:int) = BS.cons (byte (49 + 2 * (i % 5))) (toKey i)
+        let rng = new System.Random(16)
+        let keys = Array.init 20000 (fun _ -> rng.Next(1000000))
+        let run (policy:LSMTrie.Policy) =
+            let stats = new LSMTrie.WriteStats()
+            let tc = LSMTrie.codecWith policy stats (EncVarInt32.codec)
+            let step t (ix:int) =
+                let k = keys.[ix]
+                stats.RecordUpdate (uint64 (BS.length (toKey k) + 4))
+                let t' = LSMTrie.add (toKey k) k t
+                if (0 <> (ix % 500)) then t' else Codec.compact tc (tf.Stowage) t'
+            let t = Array.fold step LSMTrie.empty [| 0 .. (keys.Length - 1) |]
+                        |> Codec.compact tc (tf.Stowage)
+            struct(tc, stats, t)
+        let struct(tcL,statsL,tL) = run (LSMTrie.Policy.leveled 800UL)
+        let struct(_,statsT,tT) = run (LSMTrie.Policy.tiered 800UL 4 2)
+        Assert.True(statsL.TotalFlushed > 0L)
+        Assert.True(statsT.TotalFlushed > 0L)
+        for t in [tL; tT] do
+            Assert.True(Array.forall (fun k -> (Some k) = LSMTrie.tryFind (toKey k) t) keys)
+            Assert.True(Array.forall (fun k -> Option.isNone (LSMTrie.tryFind (absent k) t)) keys)
+
+        // round trip, with the summary covering remote children
+        let bytes = Codec.writeBytes tcL tL
+        let tR = Codec.readBytes tcL (tf.Stowage) bytes
+        Assert.Equal(32, tR.summary.Length)
+        Assert.Equal<(ByteString * int) seq>(LSMTrie.toSeq tL, LSMTrie.toSeq tR)
+
+        // the summary is consulted: an absent child is found without
+        // loading remote nodes, and lookups agree without the summary
+        let loads = ref 0
+        let counting =
+            { new Stowage with
+                member __.Stow v = tf.Stowage.Stow v
+                member __.Load h = loads.Value <- loads.Value + 1; tf.Stowage.Load h
+                member __.Incref h = tf.Stowage.Incref h
+                member __.Decref h = tf.Stowage.Decref h }
+        let lookups (t:LSMTrie<int>) =
+            loads.Value <- 0
+            let found = keys |> Array.map (fun k -> LSMTrie.tryFind (rootAbsent k) t)
+            struct(found, loads.Value)
+        let tS = Codec.readBytes tcL counting bytes
+        let struct(withSummary, loadsS) = lookups tS
+        let tU = { Codec.readBytes tcL counting bytes with summary = BS.empty }
+        let struct(without, loadsU) = lookups tU
+        Assert.Equal(0, loadsS)
+        Assert.True(loadsU > 0)
+        Assert.True((withSummary = without))
+        Assert.True(Array.forall Option.isNone without)
+
+        // nodes without a summary, as written before summaries, still parse
+        let bytesU = Codec.writeBytes tcL tU
+        Assert.NotEqual(0x80uy, bytesU.[0])
+        let tU' = Codec.readBytes tcL (tf.Stowage) bytesU
+        Assert.True(BS.isEmpty tU'.summary)
+        Assert.Equal<(ByteString * int) seq>(LSMTrie.toSeq tL, LSMTrie.toSeq tU')
+
     [<Fact>]
     member tf.``LSM Trie mixed operations`` () =
         // Testing an LSM tree properly requires compaction. The final
@@ -26,6 +26,7 @@ open Data.ByteString
 // Concurrent updates can be hindered by a centralized data structure. 
 // This could be mitigated via transactional update model, such that we
 // can detect merge-conflicts and allow most non-conflicting updates.
+// (See TX.commit, which merges concurrent commits on the root Dict.)
 //
 // A reverse-lookup index can be maintained in real-time, but the others
 // cannot be due to cascading update issues. We should manage the indices
@@ -45,6 +46,7 @@ module DB =
 
     type Symbol = Dict.Symbol   /// Bytes, minus LF or SP
     type Def = Dict.Def         /// Bytes minus LF, with finalizers
+    type Prefix = Dict.Prefix   /// Symbol prefix
 
     /// Our simplified transaction model! Upon commit, we'll compare
     /// a read-set against values in the database. If everything is
@@ -53,23 +55,75 @@ module DB =
     /// Reads and writes may be entire dictionaries, which allows for
     /// prefix-level updates or read dependencies. But in the normal
     /// use case, our write-set or read-set should be a simple set of
-    /// symbols with local definitions.
+    /// symbols with local definitions. Symbols read as undefined are
+    /// recorded separately, as are prefixes read as a whole.
     type TX = 
         { reads   : Dict
+          absent  : Symbol list           // symbols read as undefined
+          prefixes: (Prefix * Dict) list  // extracted at prefix
           writes  : Dict      
           durable : bool
         }
 
     module TX =
-        let empty = { reads = Dict.empty; writes = Dict.empty; durable = false }
+        let empty = 
+            { reads = Dict.empty; absent = []; prefixes = []
+              writes = Dict.empty; durable = false }
         let inline addRead' (k:Symbol) (d:Def) (tx:TX) : TX =
             { tx with reads = Dict.add k d (tx.reads) }
         let inline addRead (k:Symbol) (s:ByteString) (tx:TX) : TX =
             addRead' k (Def(s)) tx // ignore Stowage GC issues
+        let inline addAbsent (k:Symbol) (tx:TX) : TX =
+            { tx with absent = (k :: tx.absent) }
         let inline addWrite (k:Symbol) (d:Def) (tx:TX) : TX = 
             { tx with writes = Dict.add k d (tx.writes) }
         let inline markDurable tx = { tx with durable = true }
 
+        /// Read a symbol from a root, recording the read whether or
+        /// not the symbol is defined.
+        let read (k:Symbol) (root:Dict) (tx:TX) : struct(Def option * TX) =
+            match Dict.tryFind k root with
+            | Some d -> struct(Some d, addRead' k d tx)
+            | None -> struct(None, addAbsent k tx)
+
+        /// Read every symbol with a given prefix from a root. The
+        /// transaction then conflicts with any change under the prefix.
+        let readPrefix (p:Prefix) (root:Dict) (tx:TX) : struct(Dict * TX) =
+            let d = Dict.extractPrefix p root
+            struct(d, { tx with prefixes = ((p,d) :: tx.prefixes) })
+
+        /// Validate a transaction's reads against a root dictionary.
+        /// Reads are validated per symbol or prefix, so a transaction
+        /// remains valid when concurrent updates touch only others.
+        let valid (root:Dict) (tx:TX) : bool =
+            let okRead (k,d) = (Some d = Dict.tryFind k root)
+            let okAbsent k = not (Dict.contains k root)
+            let okPrefix (p,d) = Seq.isEmpty (Dict.diff d (Dict.extractPrefix p root))
+            List.forall okAbsent (tx.absent)
+                && Seq.forall okRead (Dict.toSeq (tx.reads))
+                && List.forall okPrefix (tx.prefixes)
+
+        /// Apply a transaction's writes to a root if it's valid.
+        let apply (root:Dict) (tx:TX) : Dict option =
+            if not (valid root tx) then None else
+            Some (Dict.flushUpdates root (tx.writes))
+
+        /// Commit a transaction to a root dictionary variable.
+        ///
+        /// The root is the only shared variable. When other commits on
+        /// the root race with ours, we revalidate against the new root
+        /// and merge our writes, rather than fail or retry. This fails
+        /// only if our read-set was invalidated.
+        let commit (db:Stowage.DB) (root:TVar<Dict>) (tx:TX) : bool =
+            let struct(ok,committed) = db.Transact (fun tdb ->
+                match apply (tdb.Read root) tx with
+                | None -> false
+                | Some r ->
+                    Stowage.DB.writeMerge tdb root r (fun cur -> apply cur tx)
+                    if tx.durable then tdb.Flush()
+                    true)
+            ok && committed
+
 
     /// Database abstract interface.
     ///
@@ -0,0 +1,97 @@
+namespace Wikilon
+open System.Threading
+open System.Collections.Generic
+open Awelon
+open Stowage
+open Data.ByteString
+
+// Server push for dictionary updates.
+//
+// Rather than have clients poll, a client subscribes to a channel and
+// receives an event for each word whose definition changed, with its
+// new version hash. The client refetches only the words it cares for,
+// and ETags make unchanged pages cheap. Events are computed by diffing
+// successive versions of the dictionary, so intermediate versions may
+// be skipped if the dictionary is updated quickly.
+module Push =
+
+    /// An update: a word and its new version, or None if deleted.
+    type Event =
+        { seq     : uint64
+          word    : Dict.Symbol
+          version : RscHash option
+        }
+
+    /// A message to a subscriber. Reset indicates the subscriber was
+    /// dropped after falling too far behind, and should resynchronize.
+    type Msg =
+        | Update of Event
+        | Reset
+
+    /// A subscriber to a Hub, with a queue of messages.
+    type Sub =
+        val private queue : Queue<Msg>
+        val private signal : SemaphoreSlim
+        new() = { queue = new Queue<Msg>(); signal = new SemaphoreSlim(0) }
+
+        member internal s.Count with get() = lock (s.queue) (fun () -> s.queue.Count)
+        member internal s.Post (m:Msg) : unit =
+            lock (s.queue) (fun () -> s.queue.Enqueue(m))
+            s.signal.Release() |> ignore<int>
+
+        /// Wait for the next message.
+        member s.Receive() : Async<Msg> =
+            async {
+                do! Async.AwaitTask (s.signal.WaitAsync())
+                return lock (s.queue) (fun () -> s.queue.Dequeue())
+            }
+
+    /// A publish-subscribe channel for dictionary events.
+    type Hub =
+        val MaxQueue : int
+        val mutable private subs : Sub list
+        val mutable private seq : uint64
+        new(maxQueue) = { MaxQueue = maxQueue; subs = []; seq = 0UL }
+        new() = new Hub(10000)
+
+        /// Number of events published.
+        member h.Seq with get() : uint64 = lock h (fun () -> h.seq)
+
+        member h.Subscribe() : Sub =
+            let s = new Sub()
+            lock h (fun () -> h.subs <- s :: h.subs)
+            s
+
+        member h.Unsubscribe (s:Sub) : unit =
+            lock h (fun () -> h.subs <- List.filter (fun x -> not (obj.ReferenceEquals(x,s))) h.subs)
+
+        /// Publish events to every subscriber. Subscribers whose queues
+        /// exceed MaxQueue are sent Reset and dropped.
+        member h.Publish (us:seq<struct(Dict.Symbol * RscHash option)>) : unit =
+            lock h (fun () ->
+                for struct(w,v) in us do
+                    h.seq <- (1UL + h.seq)
+                    let e = Update { seq = h.seq; word = w; version = v }
+                    for s in h.subs do s.Post e
+                let slow (s:Sub) = (s.Count > h.MaxQueue)
+                for s in List.filter slow h.subs do s.Post Reset
+                h.subs <- List.filter (slow >> not) h.subs)
+
+    /// Publish changes to an index variable, as maintained by a Reactor
+    /// agent. Events are diffs of the version index between successive
+    /// indices. This covers words whose definitions changed, per
+    /// Dict.diff, and also their transitive clients, whose pages and
+    /// ETags depend on the new versions.
+    let agent (rx:Reactive.Reactor) (hub:Hub) (ixv:TVar<DictIndex.Index>) : Reactive.Agent =
+        let prior = ref DictIndex.empty
+        Reactive.agent rx (fun db ->
+            let ix = db.Read ixv
+            let us =
+                LSMTrie.diff (prior.Value.vers) (ix.vers)
+                    |> Seq.map (fun (w,vd) ->
+                        match vd with
+                        | InL _ -> struct(w, None)
+                        | InR h | InB (_,h) -> struct(w, Some h))
+                    |> Array.ofSeq
+            prior.Value <- ix
+            hub.Publish us)
@@ -1,7 +1,9 @@
 namespace Wikilon
+open Awelon
 open Stowage
 open Data.ByteString
 open Suave
+open Suave.Operators
 
 // The main goal right now is to get something useful running ASAP.
 
@@ -13,10 +15,125 @@ module WS =
           // might add logging, etc.
         }
 
+    /// Web service state. The dictionary root is durable. Indices are
+    /// maintained by Reactor agents, so writes to the root must go via
+    /// `rx.DB` to be observed. Rendered pages are cached in memory by
+    /// version hash, and dictionary events are pushed via the hub.
+    type Service =
+        { rx    : Reactive.Reactor
+          root  : TVar<Dict option>
+          index : TVar<DictIndex.Index>
+          pages : MCache.C<RscHash, byte[]>
+          hub   : Push.Hub
+        }
+
+    let rootKey = BS.fromString "dict"
+
+    let mkService (p:Params) : Service =
+        let rx = new Reactive.Reactor(p.db)
+        let root = p.db.Register rootKey (Dict.node_codec)
+        let dict = Reactive.compute rx Dict.empty (fun db _ -> defaultArg (db.Read root) Dict.empty)
+        let index = DictIndex.agent rx (DictIndex.compact (p.db :> Stowage)) dict
+        let hub = new Push.Hub()
+        Push.agent rx hub index |> ignore<Reactive.Agent>
+        Metrics.counterFn "wikilon_push_events_total" "Dictionary events published." (fun () -> float hub.Seq)
+        { rx = rx; root = root; index = index; pages = new MCache.C<RscHash, byte[]>(); hub = hub }
+
+    // A strong ETag for a page determined by a version hash.
+    let inline private etag (h:RscHash) : string = "\"" + BS.toString h + "\""
+
+    // Entity tags from If-None-Match headers.
+    let private ifNoneMatch (req:HttpRequest) : string list =
+        let cmp = System.StringComparison.OrdinalIgnoreCase
+        req.headers
+            |> List.filter (fun (k,_) -> System.String.Equals(k, "If-None-Match", cmp))
+            |> List.collect (fun (_,v) -> v.Split(',') |> Array.map (fun s -> s.Trim()) |> List.ofArray)
 
+    // Render a page, or fetch it from cache. The page is a function of
+    // the version, so it never needs invalidation.
+    let private cachedPage (svc:Service) (h:RscHash) (render:unit -> byte[]) : byte[] =
+        match MCache.tryFind h (svc.pages) with
+        | Some page -> page
+        | None ->
+            let page = render ()
+            MCache.tryAdd h page (uint64 (64 + page.Length)) (svc.pages)
+
+    /// Serve a versioned page with a strong ETag, or 304 Not Modified
+    /// if the client's cached copy has the same tag.
+    let versioned (svc:Service) (h:RscHash) (render:unit -> byte[]) : WebPart =
+        request (fun req ->
+            let tag = etag h
+            let hdrs = Writers.setHeader "ETag" tag >=> Writers.setHeader "Cache-Control" "no-cache"
+            let tags = ifNoneMatch req
+            if List.exists (fun t -> (t = tag) || (t = "*")) tags
+                then hdrs >=> Redirection.NOT_MODIFIED
+                else hdrs >=> Successful.ok (cachedPage svc h render))
+
+    // Definition of a word as plain text, from the indexed dictionary,
+    // so the content is consistent with the version hash.
+    let private wordPage (svc:Service) : WebPart =
+        request (fun req ->
+            let path = System.Uri.UnescapeDataString(req.url.AbsolutePath)
+            let w = BS.fromString (path.Substring("/dict/".Length))
+            let ix = svc.rx.DB.Read (svc.index)
+            match DictIndex.version w ix, Dict.tryFind w (ix.dict) with
+            | Some h, Some def ->
+                let render () = BS.toArray (def.Data)
+                Writers.setMimeType "text/plain; charset=utf-8" >=> versioned svc h render
+            | _ -> RequestErrors.NOT_FOUND "undefined word")
+
+    // Server-sent events for dictionary updates. Each event is typed
+    // `update` or `delete`, with data `word version`. A `reset` event
+    // is sent if the client fell behind, and ends the stream.
+    let private events (svc:Service) (out:Sockets.Connection) : Sockets.SocketOp<unit> =
+        let send (m:EventSource.Message) = EventSource.send out m
+        let msgOf (e:Push.Event) =
+            let id = string (e.seq)
+            match e.version with
+            | Some h -> { EventSource.mkMessage id (BS.toString e.word + " " + BS.toString h) with ``type`` = Some "update" }
+            | None -> { EventSource.mkMessage id (BS.toString e.word) with ``type`` = Some "delete" }
+        let sub = svc.hub.Subscribe()
+        let rec loop () =
+            async {
+                let! m = sub.Receive()
+                match m with
+                | Push.Reset -> return! send { EventSource.mkMessage "" "" with ``type`` = Some "reset" }
+                | Push.Update e ->
+                    let! r = send (msgOf e)
+                    match r with
+                    | Choice1Of2 () -> return! loop ()
+                    | Choice2Of2 err -> return Choice2Of2 err
+            }
+        async {
+            try return! loop ()
+            finally svc.hub.Unsubscribe sub
+        }
 
+    // Administrative pages require HTTP basic auth as user `admin`, with
+    // the password from Params. Without a password, they're forbidden.
+    let private adminOnly (p:Params) (part:WebPart) : WebPart =
+        match p.admin with
+        | None -> RequestErrors.FORBIDDEN "no admin account"
+        | Some pw ->
+            // compare passwords in constant time, against timing attacks
+            let valid (user:string, pass:string) = 
+                let okPass = ByteString.CTEq (BS.fromString pass) pw
+                okPass && (user = "admin")
+            Authentication.authenticateBasic valid part
 
-    let mkApp (p:Params) = 
-        Successful.OK ("Hello World")
+    let private textPage (render:unit -> string) : WebPart =
+        Writers.setHeader "Cache-Control" "no-store"
+            >=> Writers.setMimeType "text/plain; version=0.0.4; charset=utf-8"
+            >=> request (fun _ -> Successful.OK (render ()))
 
+    let mkApp (p:Params) : WebPart =
+        let svc = mkService p
+        choose
+            [ Filters.GET >=> Filters.path "/" >=> Successful.OK ("Hello World")
+              Filters.GET >=> Filters.pathStarts "/dict/" >=> wordPage svc
+              Filters.GET >=> Filters.path "/events" >=> EventSource.handShake (events svc)
+              // metrics in the Prometheus text format, and recent slow spans
+              Filters.GET >=> Filters.path "/admin/metrics" >=> adminOnly p (textPage Metrics.report)
+              Filters.GET >=> Filters.path "/admin/trace" >=> adminOnly p (textPage Metrics.traceReport)
+            ]
 